@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include "rarsjs/core.h"
+#include "rarsjs/program.h"
 
 __AFL_FUZZ_INIT();
 
@@ -12,6 +13,6 @@ int main(void)
         int len = __AFL_FUZZ_TESTCASE_LEN;
         src = realloc(src, len);
         memcpy(src, buf, len);
-        assemble(src, len, false);
+        assemble(&g_program_default, src, len, false);
     }
 }
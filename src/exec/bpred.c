@@ -0,0 +1,128 @@
+#include "rarsjs/bpred.h"
+
+#include "rarsjs/program.h"
+
+// All predictors index one flat table of saturating counters; BTFN doesn't
+// use it. Unconditional direct jumps are assumed to always be predicted
+
+#define BPRED_MAX_TABLE_BITS 20
+
+export BpredConfig g_bpred_config = {
+    .kind = BPRED_2BIT,
+    .table_bits = 10,
+    .history_bits = 10,
+    .ras_size = 8,
+};
+
+// Starts with cold tables and the current config. Call after the program
+// has been assembled or loaded, as the counters are sized after its text.
+// Returns an error message, or NULL on success
+export const char *bpred_enable(Program *p) {
+    const BpredConfig *config = &g_bpred_config;
+    if (config->kind > BPRED_GSHARE) return "unknown branch predictor";
+    if (config->table_bits > BPRED_MAX_TABLE_BITS) {
+        return "branch predictor table is too large";
+    }
+    if (config->history_bits > 32) return "global history is too long";
+
+    bpred_disable(p);
+    Bpred *b = &p->bpred;
+    b->config = *config;
+
+    size_t counters = (size_t)1 << config->table_bits;
+    b->counters = malloc(counters);
+    RARSJS_CHECK_OOM(b->counters);
+    // 2-bit counters start weakly not taken, 1-bit ones not taken
+    memset(b->counters, config->kind == BPRED_2BIT ? 1 : 0, counters);
+
+    if (config->ras_size) {
+        b->ras = malloc(config->ras_size * sizeof(u32));
+        RARSJS_CHECK_OOM(b->ras);
+    }
+
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
+        if (sec->base == TEXT_BASE) b->by_pc_len = sec->contents.len / 4;
+    }
+    // one more entry for the branches outside the text section
+    size_t by_pc = (b->by_pc_len + 1) * sizeof(BpredStats);
+    b->by_pc = malloc(by_pc);
+    RARSJS_CHECK_OOM(b->by_pc);
+    memset(b->by_pc, 0, by_pc);
+
+    b->enabled = true;
+    return NULL;
+}
+
+export void bpred_disable(Program *p) {
+    Bpred *b = &p->bpred;
+    free(b->counters);
+    free(b->ras);
+    free(b->by_pc);
+    *b = (Bpred){0};
+}
+
+static void count(BpredStats *st, BpredStats *pc, bool mispredict) {
+    st->branches++;
+    pc->branches++;
+    st->mispredicts += mispredict;
+    pc->mispredicts += mispredict;
+}
+
+void bpred_predict_branch(Bpred *b, u32 pc, bool backward, bool taken) {
+    u32 mask = (1u << b->config.table_bits) - 1;
+    u32 idx = pc >> 2;
+    if (b->config.kind == BPRED_GSHARE) idx ^= b->history;
+    u8 *ctr = &b->counters[idx & mask];
+
+    bool predicted;
+    switch (b->config.kind) {
+        case BPRED_BTFN:
+            predicted = backward;
+            break;
+        case BPRED_1BIT:
+            predicted = *ctr;
+            *ctr = taken;
+            break;
+        default:
+            predicted = *ctr >= 2;
+            if (taken && *ctr < 3) (*ctr)++;
+            else if (!taken && *ctr > 0) (*ctr)--;
+            break;
+    }
+
+    if (b->config.history_bits) {
+        u32 hist_mask = b->config.history_bits >= 32
+                            ? ~0u
+                            : (1u << b->config.history_bits) - 1;
+        b->history = ((b->history << 1) | taken) & hist_mask;
+    }
+
+    u32 pc_idx = (pc - TEXT_BASE) / 4;
+    if (pc_idx > b->by_pc_len) pc_idx = b->by_pc_len;
+    count(&b->branches, &b->by_pc[pc_idx], predicted != taken);
+}
+
+void bpred_predict_call(Bpred *b, u32 ret_addr) {
+    u32 size = b->config.ras_size;
+    if (!size) return;
+
+    b->ras[b->ras_top] = ret_addr;
+    b->ras_top = (b->ras_top + 1) % size;
+    if (b->ras_len < size) b->ras_len++;
+}
+
+// Without a return address stack, returns are never predicted
+void bpred_predict_ret(Bpred *b, u32 target) {
+    u32 size = b->config.ras_size;
+    bool hit = false;
+
+    if (size && b->ras_len) {
+        b->ras_top = (b->ras_top + size - 1) % size;
+        b->ras_len--;
+        hit = b->ras[b->ras_top] == target;
+    }
+
+    b->returns.branches++;
+    b->returns.mispredicts += !hit;
+}
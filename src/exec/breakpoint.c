@@ -0,0 +1,111 @@
+#include "rarsjs/breakpoint.h"
+
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// Sizes the bitmap after the text section, returns false if there is none
+static bool breakpoint_alloc(Program *p) {
+    Breakpoints *b = &p->breakpoints;
+    if (b->bits) return true;
+
+    // programs loaded from an ELF file don't set the text section
+    Section *text = emulator_get_section(p, TEXT_BASE);
+    if (!text || text->contents.len < 4) return false;
+
+    b->len = text->contents.len / 4;
+    b->bits = calloc((b->len + 7) / 8, 1);
+    RARSJS_CHECK_OOM(b->bits);
+    return true;
+}
+
+// Sets or clears the breakpoint at pc, returns false if pc isn't an
+// instruction of the text section
+export bool breakpoint_set(Program *p, u32 pc, bool on) {
+    Breakpoints *b = &p->breakpoints;
+    u32 off = pc - TEXT_BASE;
+    if ((off & 3) || !breakpoint_alloc(p) || off / 4 >= b->len) {
+        return false;
+    }
+
+    u8 *byte = &b->bits[off / 32];
+    u8 bit = 1 << (off / 4 % 8);
+    if (on && !(*byte & bit)) b->count++;
+    if (!on && (*byte & bit)) b->count--;
+    *byte = on ? *byte | bit : *byte & ~bit;
+    return true;
+}
+
+// Instructions are emitted in source order, so a line is usually a single
+// run of instructions (several for a pseudoinstruction). Only the first
+// instruction of each run is indexed, so that a breakpoint on a line stops
+// there once
+static void breakpoint_index_lines(Program *p) {
+    Breakpoints *b = &p->breakpoints;
+    u32 len = RARSJS_ARRAY_LEN(&p->as.text_by_linenum);
+    u32 *lines = p->as.text_by_linenum.buf;
+
+    u32 max = 0;
+    for (u32 i = 0; i < len; i++) {
+        if (lines[i] > max) max = lines[i];
+    }
+
+    b->lines = max + 1;
+    b->line_start = calloc(max + 2, sizeof(u32));
+    RARSJS_CHECK_OOM(b->line_start);
+
+    u32 runs = 0;
+    for (u32 i = 0; i < len; i++) {
+        if (i && lines[i] == lines[i - 1]) continue;
+        b->line_start[lines[i] + 1]++;
+        runs++;
+    }
+    for (u32 l = 0; l <= max; l++) {
+        b->line_start[l + 1] += b->line_start[l];
+    }
+
+    u32 *next = malloc((max + 1) * sizeof(u32));
+    RARSJS_CHECK_OOM(next);
+    memcpy(next, b->line_start, (max + 1) * sizeof(u32));
+    b->line_pcs = malloc((runs ? runs : 1) * sizeof(u32));
+    RARSJS_CHECK_OOM(b->line_pcs);
+    for (u32 i = 0; i < len; i++) {
+        if (i && lines[i] == lines[i - 1]) continue;
+        b->line_pcs[next[lines[i]]++] = i;
+    }
+    free(next);
+}
+
+// Sets or clears the breakpoints of a source line, returns how many
+// instructions it covers
+export u32 breakpoint_set_line(Program *p, u32 line, bool on) {
+    Breakpoints *b = &p->breakpoints;
+    if (!b->line_start) breakpoint_index_lines(p);
+    if (line == 0 || line >= b->lines) return 0;
+
+    u32 set = 0;
+    for (u32 i = b->line_start[line];
+         i < b->line_start[line + 1]; i++) {
+        set += breakpoint_set(p, TEXT_BASE + b->line_pcs[i] * 4, on);
+    }
+    return set;
+}
+
+export void breakpoint_clear_all(Program *p) {
+    Breakpoints *b = &p->breakpoints;
+    if (b->bits) {
+        memset(b->bits, 0, (b->len + 7) / 8);
+    }
+    b->count = 0;
+}
+
+// Forgets the breakpoints along with the program they were set on
+void breakpoint_reset(Program *p) {
+    Breakpoints *b = &p->breakpoints;
+    free(b->bits);
+    free(b->line_start);
+    free(b->line_pcs);
+    *b = (Breakpoints){0};
+}
+
+// Whether the last run stopped on a breakpoint, for the web UI
+export bool breakpoint_hit(Program *p) { return p->breakpoints.hit; }
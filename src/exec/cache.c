@@ -0,0 +1,195 @@
+#include "rarsjs/cache.h"
+
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// Only tags and state are simulated, the data itself always comes from the
+// sections, so the caches never change what a program computes
+
+export CacheConfig g_icache_config = {
+    .size = 4096,
+    .line = 32,
+    .ways = 2,
+    .policy = CACHE_LRU,
+};
+
+export CacheConfig g_dcache_config = {
+    .size = 4096,
+    .line = 32,
+    .ways = 4,
+    .policy = CACHE_LRU,
+    .write_back = true,
+    .write_allocate = true,
+};
+
+static bool is_pow2(u32 x) { return x && !(x & (x - 1)); }
+
+static bool bit_get(const u64 *set, u32 i) { return (set[i / 64] >> (i % 64)) & 1; }
+
+static void bit_put(u64 *set, u32 i, bool val) {
+    if (val) set[i / 64] |= 1ull << (i % 64);
+    else set[i / 64] &= ~(1ull << (i % 64));
+}
+
+// Returns an error message, or NULL if config is usable
+const char *cache_config_check(const CacheConfig *config) {
+    if (!is_pow2(config->size) || !is_pow2(config->line) ||
+        !is_pow2(config->ways)) {
+        return "cache size, line size and ways must be powers of two";
+    }
+    if (config->line < 4) return "cache lines must be at least 4 bytes";
+    if (config->size < config->line * config->ways) {
+        return "cache is smaller than one set";
+    }
+    if (config->policy > CACHE_RANDOM) return "unknown replacement policy";
+    return NULL;
+}
+
+static void *alloc_zeroed(size_t size) {
+    void *ret = malloc(size);
+    RARSJS_CHECK_OOM(ret);
+    memset(ret, 0, size);
+    return ret;
+}
+
+static void cache_init(Cache *c, const CacheConfig *config, u32 sections,
+                       u32 text_len) {
+    *c = (Cache){.config = *config, .rng = 0x2545F491};
+    c->sets = config->size / config->line / config->ways;
+    c->line_shift = __builtin_ctz(config->line);
+
+    u32 lines = c->sets * config->ways;
+    c->tags = alloc_zeroed(lines * sizeof(u32));
+    c->valid = alloc_zeroed((lines + 63) / 64 * sizeof(u64));
+    c->dirty = alloc_zeroed((lines + 63) / 64 * sizeof(u64));
+    c->stamp = alloc_zeroed(lines * sizeof(u64));
+
+    c->by_section = alloc_zeroed((sections + 1) * sizeof(CacheStats));
+    c->by_pc_len = text_len / 4;
+    c->by_pc = alloc_zeroed((c->by_pc_len + 1) * sizeof(CacheStats));
+}
+
+static void cache_free(Cache *c) {
+    free(c->tags);
+    free(c->valid);
+    free(c->dirty);
+    free(c->stamp);
+    free(c->by_section);
+    free(c->by_pc);
+    *c = (Cache){0};
+}
+
+// Starts both caches cold, with the current configs. Call after the program
+// has been assembled or loaded, as the counters are sized after its sections.
+// Returns an error message, or NULL on success
+export const char *cache_enable(Program *p) {
+    const char *err = cache_config_check(&g_icache_config);
+    if (!err) err = cache_config_check(&g_dcache_config);
+    if (err) return err;
+
+    cache_disable(p);
+    u32 sections = RARSJS_ARRAY_LEN(&p->as.sections);
+    u32 text_len = 0;
+    for (size_t i = 0; i < sections; i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
+        if (sec->base == TEXT_BASE) text_len = sec->contents.len;
+    }
+
+    Caches *c = &p->cache;
+    cache_init(&c->icache, &g_icache_config, sections, text_len);
+    cache_init(&c->dcache, &g_dcache_config, sections, text_len);
+    c->enabled = true;
+    return NULL;
+}
+
+export void cache_disable(Program *p) {
+    p->cache.enabled = false;
+    cache_free(&p->cache.icache);
+    cache_free(&p->cache.dcache);
+}
+
+static u32 cache_victim(Cache *c, u32 base) {
+    u32 ways = c->config.ways;
+    for (u32 w = 0; w < ways; w++) {
+        if (!bit_get(c->valid, base + w)) return base + w;
+    }
+
+    if (c->config.policy == CACHE_RANDOM) {
+        // xorshift32, so that runs are reproducible
+        c->rng ^= c->rng << 13;
+        c->rng ^= c->rng >> 17;
+        c->rng ^= c->rng << 5;
+        return base + (c->rng & (ways - 1));
+    }
+
+    u32 victim = base;
+    for (u32 w = 1; w < ways; w++) {
+        if (c->stamp[base + w] < c->stamp[victim]) victim = base + w;
+    }
+    return victim;
+}
+
+// Every event is counted globally, for the section and for the instruction
+#define COUNT(field) (c->stats.field++, sec->field++, pcs->field++)
+
+static void cache_access_line(Cache *c, u32 line, bool write, CacheStats *sec,
+                              CacheStats *pcs) {
+    u32 base = (line & (c->sets - 1)) * c->config.ways;
+    c->clock++;
+    COUNT(accesses);
+
+    for (u32 i = base; i < base + c->config.ways; i++) {
+        if (!bit_get(c->valid, i) || c->tags[i] != line) continue;
+
+        if (c->config.policy == CACHE_LRU) c->stamp[i] = c->clock;
+        if (write && c->config.write_back) bit_put(c->dirty, i, true);
+        else if (write) COUNT(mem_writes);
+        return;
+    }
+
+    COUNT(misses);
+    if (write && !c->config.write_allocate) {
+        COUNT(mem_writes);
+        return;
+    }
+
+    u32 i = cache_victim(c, base);
+    if (bit_get(c->valid, i)) {
+        COUNT(evictions);
+        if (bit_get(c->dirty, i)) COUNT(mem_writes);
+    }
+
+    // the whole line number is kept as the tag, which is simpler than
+    // dropping the set bits and costs nothing here
+    c->tags[i] = line;
+    c->stamp[i] = c->clock;
+    bit_put(c->valid, i, true);
+    bit_put(c->dirty, i, write && c->config.write_back);
+    if (write && !c->config.write_back) COUNT(mem_writes);
+}
+
+#undef COUNT
+
+// Simulates an access by the instruction at pc to the memory of sections.
+// Devices aren't cached
+void cache_access(Cache *c, const RARSJS_ARRAY(SectionPtr) *sections,
+                  u32 addr, u32 len, bool write, u32 pc) {
+    size_t sec_idx = 0;
+    for (; sec_idx < RARSJS_ARRAY_LEN(sections); sec_idx++) {
+        Section *s = *RARSJS_ARRAY_GET(sections, sec_idx);
+        if (addr >= s->base && addr < s->limit) break;
+    }
+    if (sec_idx == RARSJS_ARRAY_LEN(sections)) return;
+    if ((*RARSJS_ARRAY_GET(sections, sec_idx))->base == MMIO_BASE) return;
+
+    // instructions outside the text section (like the kernel's) share the
+    // last entry
+    u32 pc_idx = (pc - TEXT_BASE) / 4;
+    if (pc_idx > c->by_pc_len) pc_idx = c->by_pc_len;
+
+    u32 last = (addr + len - 1) >> c->line_shift;
+    for (u32 line = addr >> c->line_shift; line <= last; line++) {
+        cache_access_line(c, line, write, &c->by_section[sec_idx],
+                          &c->by_pc[pc_idx]);
+    }
+}
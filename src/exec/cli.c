@@ -7,13 +7,29 @@
 
 #include "ezld/include/ezld/linker.h"
 #include "ezld/include/ezld/runtime.h"
+#include "rarsjs/bpred.h"
+#include "rarsjs/cache.h"
 #include "rarsjs/callsan.h"
 #include "rarsjs/core.h"
+#include "rarsjs/dev.h"
 #include "rarsjs/elf.h"
 #include "rarsjs/emulate.h"
+#include "rarsjs/globals.h"
+#include "rarsjs/grade.h"
+#include "rarsjs/profile.h"
+#include "rarsjs/program.h"
+#include "rarsjs/smp.h"
+#include "rarsjs/timing.h"
+#include "rarsjs/trace.h"
 #include "rarsjs/util.h"
 #include "vendor/commander.h"
 
+// Instructions run between checks for runtime errors in emulate_safe
+#define EMULATE_BATCH 65536
+
+// Maximum number of rows in each table of the --profile report
+#define PROFILE_REPORT_ROWS 20
+
 // Type of command handler functions (c_*)
 typedef void (*cmd_func_t)(void);
 
@@ -39,6 +55,21 @@ static int g_cmd_args_len;
 // Flags
 // Set by variout opt_* like --sanitize, --fuzz
 static bool g_flg_callsan = false;
+static bool g_flg_profile = false;
+static bool g_flg_timing = false;
+static bool g_flg_cache = false;
+static bool g_flg_bpred = false;
+// Folded stacks output of --profile-calls, NULL if not given
+static char *g_profile_calls_out = NULL;
+// Output of --trace, NULL if not given
+static char *g_trace_out = NULL;
+// --trace-last, 0 to keep the whole trace
+static u32 g_trace_last = 0;
+static FILE *g_trace_file = NULL;
+// Cases of --grade, NULL if not given
+static char *g_grade_cases = NULL;
+static bool g_flg_grade_json = false;
+static GradeConfig g_grade_config = {.max_ms = 10000};
 
 // The file text, used as backing storage by all global strings
 // this simplifies lifetime management significantly
@@ -60,107 +91,105 @@ static void update_argument(const char *arg) {
 
 // UTILITY FUNCTIONS
 
-static void emulate_safe(void) {
-    while (!g_exited) {
-        emulate();
-
-        switch (g_runtime_error_type) {
-            case ERROR_NONE:
-                break;
-
-            case ERROR_FETCH:
-                fprintf(stderr,
-                        "emulator: fetch error at pc=0x%08x on addr=0x%08x\n",
-                        g_pc, g_runtime_error_params[0]);
-                return;
-
-            case ERROR_LOAD:
-                fprintf(stderr,
-                        "emulator: load error at pc=0x%08x on addr=0x%08x\n",
-                        g_pc, g_runtime_error_params[0]);
-                return;
-
-            case ERROR_STORE:
-                fprintf(stderr,
-                        "emulator: store error at pc=0x%08x on addr=0x%08x\n",
-                        g_pc, g_runtime_error_params[0]);
-                return;
-
-            case ERROR_UNHANDLED_INSN:
-                fprintf(stderr,
-                        "emulator: unhandled instruction at pc=0x%08x\n", g_pc);
-                goto err;
-
-            case ERROR_CALLSAN_CANTREAD:
-                fprintf(stderr,
-                        "callsan: attempt to read from uninitialized register "
-                        "%s at pc=0x%08x. Check the calling convention!\n",
-                        REGISTER_NAMES[g_runtime_error_params[0]], g_pc);
-                goto err;
-
-            case ERROR_CALLSAN_NOT_SAVED:
-                fprintf(stderr,
-                        "callsan: attempt to write callee-saved register %s at "
-                        "pc=0x%08x without saving it first. Check the calling "
-                        "convention!\n",
-                        REGISTER_NAMES[g_runtime_error_params[0]], g_pc);
-                goto err;
-
-            case ERROR_CALLSAN_RA_MISMATCH:
-                fprintf(
-                    stderr,
-                    "callsan: attempt to return from non-leaf function without "
-                    "restoring ra register at pc=0x%08x. Check the calling "
+// Prints the runtime error of m, returns whether it is worth a sanitizer
+// report
+static bool report_runtime_error(Machine *m) {
+    if (g_smp.len > 1) fprintf(stderr, "hart %u: ", m->hartid);
+
+    switch (m->runtime_error_type) {
+        case ERROR_FETCH:
+            fprintf(stderr,
+                    "emulator: fetch error at pc=0x%08x on addr=0x%08x\n",
+                    m->pc, m->runtime_error_params[0]);
+            return false;
+
+        case ERROR_LOAD:
+            fprintf(stderr,
+                    "emulator: load error at pc=0x%08x on addr=0x%08x\n",
+                    m->pc, m->runtime_error_params[0]);
+            return false;
+
+        case ERROR_STORE:
+            fprintf(stderr,
+                    "emulator: store error at pc=0x%08x on addr=0x%08x\n",
+                    m->pc, m->runtime_error_params[0]);
+            return false;
+
+        case ERROR_UNHANDLED_INSN:
+            fprintf(stderr,
+                    "emulator: unhandled instruction at pc=0x%08x\n", m->pc);
+            return true;
+
+        case ERROR_CALLSAN_CANTREAD:
+            fprintf(stderr,
+                    "callsan: attempt to read from uninitialized register "
+                    "%s at pc=0x%08x. Check the calling convention!\n",
+                    REGISTER_NAMES[m->runtime_error_params[0]], m->pc);
+            return true;
+
+        case ERROR_CALLSAN_NOT_SAVED:
+            fprintf(stderr,
+                    "callsan: attempt to write callee-saved register %s at "
+                    "pc=0x%08x without saving it first. Check the calling "
                     "convention!\n",
-                    g_pc);
-                goto err;
-
-            case ERROR_CALLSAN_SP_MISMATCH:
-                fprintf(
-                    stderr,
-                    "callsan: attempt to return from function with wrong stack "
-                    "pointer value at pc=0x%08x\n",
-                    g_pc);
-                goto err;
-
-            case ERROR_CALLSAN_RET_EMPTY:
-                fprintf(
-                    stderr,
-                    "callsan: attempt to return without a call at pc=0x%08x\n",
-                    g_pc);
-                goto err;
-
-            case ERROR_CALLSAN_LOAD_STACK:
-                fprintf(stderr,
-                        "callsan: attempt to read at pc=0x%08x from stack "
-                        "address 0x%08x, which hasn't been written to in the "
-                        "current function\n",
-                        g_pc, g_runtime_error_params[0]);
-                goto err;
-
-            default:
-                fprintf(stderr, "emulator: unhandled error at pc=0x%08x\n",
-                        g_pc);
-
-                return;
-        }
-    }
-
-    return;
-
-err:
-    if (!g_flg_callsan) {
-        return;
+                    REGISTER_NAMES[m->runtime_error_params[0]], m->pc);
+            return true;
+
+        case ERROR_CALLSAN_RA_MISMATCH:
+            fprintf(
+                stderr,
+                "callsan: attempt to return from non-leaf function without "
+                "restoring ra register at pc=0x%08x. Check the calling "
+                "convention!\n",
+                m->pc);
+            return true;
+
+        case ERROR_CALLSAN_SP_MISMATCH:
+            fprintf(
+                stderr,
+                "callsan: attempt to return from function with wrong stack "
+                "pointer value at pc=0x%08x\n",
+                m->pc);
+            return true;
+
+        case ERROR_CALLSAN_RET_EMPTY:
+            fprintf(
+                stderr,
+                "callsan: attempt to return without a call at pc=0x%08x\n",
+                m->pc);
+            return true;
+
+        case ERROR_CALLSAN_LOAD_STACK:
+            fprintf(stderr,
+                    "callsan: attempt to read at pc=0x%08x from stack "
+                    "address 0x%08x, which hasn't been written to in the "
+                    "current function\n",
+                    m->pc, m->runtime_error_params[0]);
+            return true;
+
+        case ERROR_INPUT:
+            fprintf(stderr,
+                    "emulator: read int at pc=0x%08x found no number in the "
+                    "input\n",
+                    m->pc);
+            return false;
+
+        default:
+            fprintf(stderr, "emulator: unhandled error at pc=0x%08x\n",
+                    m->pc);
+            return false;
     }
+}
 
+static void print_sanitizer_report(Machine *m) {
     puts("");
     puts("===================== RARSJS SANITIZER ERROR");
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_shadow_stack); i++) {
-        ShadowStackEnt *ent = RARSJS_ARRAY_GET(&g_shadow_stack, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&m->shadow_stack); i++) {
+        ShadowStackEnt *ent = RARSJS_ARRAY_GET(&m->shadow_stack, i);
         fprintf(stderr, "\t#%zu pc=0x%08x sp=0x%08x ", i, ent->pc, ent->sp);
         LabelData *label;
         u32 off;
-        if (pc_to_label_r(ent->pc, &label, &off)) {
+        if (pc_to_label_r(&g_program_default, ent->pc, &label, &off)) {
             // TODO: size_t can be > INT_MAX though I think no-one will ever
             // write a string longer than 2.1B chars
             fprintf(stderr, "(at %.*s+0x%x", (int)label->len, label->txt, off);
@@ -182,12 +211,398 @@ err:
             if (i + j < 10) {
                 fprintf(stderr, " ");
             }
-            fprintf(stderr, "0x%08x    ", g_regs[i + j]);
+            fprintf(stderr, "0x%08x    ", m->regs[i + j]);
         }
         puts("");
     }
 }
 
+static void emulate_safe(void) {
+    console_input_set_file(&g_program_default, stdin);
+
+    Machine *fault = NULL;
+    if (g_smp.len > 1) {
+        fault = smp_run(&g_program_default);
+    } else {
+        while (!g_exited && g_runtime_error_type == ERROR_NONE) {
+            emulate_n(&g_machine, EMULATE_BATCH);
+        }
+        if (g_runtime_error_type != ERROR_NONE) fault = &g_machine;
+    }
+
+    if (fault && report_runtime_error(fault) && g_flg_callsan) {
+        print_sanitizer_report(fault);
+    }
+}
+
+static int profile_entry_cmp(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static void print_profile(void) {
+    u64 total = profile_total(&g_program_default);
+    if (!total) return;
+
+    fprintf(stderr, "\n===================== RARSJS PROFILE\n");
+    fprintf(stderr, "%llu instructions executed in .text\n\n",
+            (unsigned long long)total);
+
+    RARSJS_ARRAY(ProfileEntry) labels =
+        profile_by_label(&g_program_default);
+    qsort(labels.buf, labels.len, sizeof(ProfileEntry), profile_entry_cmp);
+    fprintf(stderr, "%-24s %14s %7s\n", "label", "instructions", "%");
+    for (size_t i = 0;
+         i < RARSJS_ARRAY_LEN(&labels) && i < PROFILE_REPORT_ROWS; i++) {
+        ProfileEntry *ent = RARSJS_ARRAY_GET(&labels, i);
+        LabelData *label = RARSJS_ARRAY_GET(&g_labels, ent->key);
+        fprintf(stderr, "%-24.*s %14llu %6.2f%%\n", (int)label->len,
+                label->txt, (unsigned long long)ent->count,
+                100.0 * ent->count / total);
+    }
+    RARSJS_ARRAY_FREE(&labels);
+
+    // there are no line numbers for programs loaded from an ELF file
+    RARSJS_ARRAY(ProfileEntry) lines = profile_by_line(&g_program_default);
+    if (!RARSJS_ARRAY_IS_EMPTY(&lines)) {
+        qsort(lines.buf, lines.len, sizeof(ProfileEntry), profile_entry_cmp);
+        fprintf(stderr, "\n%-24s %14s %7s\n", "line", "instructions", "%");
+    }
+    for (size_t i = 0;
+         i < RARSJS_ARRAY_LEN(&lines) && i < PROFILE_REPORT_ROWS; i++) {
+        ProfileEntry *ent = RARSJS_ARRAY_GET(&lines, i);
+        fprintf(stderr, "%-24u %14llu %6.2f%%\n", ent->key,
+                (unsigned long long)ent->count, 100.0 * ent->count / total);
+    }
+    RARSJS_ARRAY_FREE(&lines);
+}
+
+// Name of the function at pc for profiler output, in a static buffer
+static const char *func_name(u32 pc) {
+    static char buf[128];
+    LabelData *label;
+    u32 off;
+    if (!pc_to_label_r(&g_program_default, pc, &label, &off)) {
+        snprintf(buf, sizeof(buf), "0x%08x", pc);
+    } else if (off) {
+        snprintf(buf, sizeof(buf), "%.*s+0x%x", (int)label->len, label->txt,
+                 off);
+    } else {
+        snprintf(buf, sizeof(buf), "%.*s", (int)label->len, label->txt);
+    }
+    return buf;
+}
+
+static int profile_func_cmp(const void *a, const void *b) {
+    const ProfileFunc *x = a, *y = b;
+    if (x->inclusive != y->inclusive) return x->inclusive < y->inclusive ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+// Writes one "caller;callee;... instructions" line per call stack, the
+// format used by flamegraph.pl and most flame graph viewers
+static void write_folded_stacks(FILE *out) {
+    RARSJS_ARRAY(u32) path = RARSJS_ARRAY_NEW(u32);
+
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_profile_nodes); i++) {
+        ProfileNode *node = RARSJS_ARRAY_GET(&g_profile_nodes, i);
+        if (!node->self) continue;
+
+        path.len = 0;
+        for (u32 n = i; n; n = RARSJS_ARRAY_GET(&g_profile_nodes, n)->parent) {
+            *RARSJS_ARRAY_PUSH(&path) = n;
+        }
+        *RARSJS_ARRAY_PUSH(&path) = 0;
+
+        for (size_t j = RARSJS_ARRAY_LEN(&path); j-- > 0;) {
+            ProfileNode *n =
+                RARSJS_ARRAY_GET(&g_profile_nodes, *RARSJS_ARRAY_GET(&path, j));
+            ProfileFunc *f = RARSJS_ARRAY_GET(&g_profile_funcs, n->func);
+            fprintf(out, "%s%c", func_name(f->pc), j ? ';' : ' ');
+        }
+        fprintf(out, "%llu\n", (unsigned long long)node->self);
+    }
+
+    RARSJS_ARRAY_FREE(&path);
+}
+
+static void print_call_profile(void) {
+    profile_calls_finish(&g_program_default);
+
+    FILE *out = fopen(g_profile_calls_out, "w");
+    if (out) {
+        write_folded_stacks(out);
+        fclose(out);
+    } else {
+        fprintf(stderr, "profiler: could not open output file\n");
+    }
+
+    // the nodes refer to functions by index, so this must come last
+    qsort(g_profile_funcs.buf, g_profile_funcs.len, sizeof(ProfileFunc),
+          profile_func_cmp);
+    fprintf(stderr, "\n===================== RARSJS CALL PROFILE\n");
+    fprintf(stderr, "%-24s %10s %14s %14s %9s\n", "function", "calls",
+            "inclusive", "exclusive", "max depth");
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_profile_funcs) &&
+                       i < PROFILE_REPORT_ROWS;
+         i++) {
+        ProfileFunc *f = RARSJS_ARRAY_GET(&g_profile_funcs, i);
+        fprintf(stderr, "%-24s %10llu %14llu %14llu %9u\n", func_name(f->pc),
+                (unsigned long long)f->calls, (unsigned long long)f->inclusive,
+                (unsigned long long)f->exclusive, f->max_depth);
+    }
+}
+
+static void print_timing(void) {
+    u64 cycles = g_timing.cycles, insns = g_timing.instructions;
+    if (!insns) return;
+
+    fprintf(stderr, "\n===================== RARSJS TIMING\n");
+    fprintf(stderr, "%-24s %14llu\n", "instructions",
+            (unsigned long long)insns);
+    fprintf(stderr, "%-24s %14llu\n", "cycles", (unsigned long long)cycles);
+    fprintf(stderr, "%-24s %14.3f\n", "CPI", (double)cycles / insns);
+    fprintf(stderr, "%-24s %14llu\n", "load-use stalls",
+            (unsigned long long)g_timing.load_use_stalls);
+    fprintf(stderr, "%-24s %14llu\n", "branch/jump flushes",
+            (unsigned long long)g_timing.branch_stalls);
+    fprintf(stderr, "%-24s %14llu\n", "multi-cycle stalls",
+            (unsigned long long)g_timing.unit_stalls);
+}
+
+// Adds count to the line of the instruction at index idx of the text
+// section, expecting them in order like profile_by_line
+static void add_to_line(RARSJS_ARRAY(ProfileEntry) * lines, u32 idx,
+                        u64 count) {
+    if (!count || idx >= RARSJS_ARRAY_LEN(&g_text_by_linenum)) return;
+
+    u32 line = *RARSJS_ARRAY_GET(&g_text_by_linenum, idx);
+    size_t n = RARSJS_ARRAY_LEN(lines);
+    if (n && RARSJS_ARRAY_GET(lines, n - 1)->key == line) {
+        RARSJS_ARRAY_GET(lines, n - 1)->count += count;
+    } else {
+        *RARSJS_ARRAY_PUSH(lines) = (ProfileEntry){line, count};
+    }
+}
+
+// Prints the lines with the highest counts and frees them
+static void print_top_lines(RARSJS_ARRAY(ProfileEntry) * lines,
+                            const char *what) {
+    if (!RARSJS_ARRAY_IS_EMPTY(lines)) {
+        qsort(lines->buf, lines->len, sizeof(ProfileEntry), profile_entry_cmp);
+        fprintf(stderr, "\n%-24s %12s\n", "line", what);
+    }
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(lines) && i < PROFILE_REPORT_ROWS;
+         i++) {
+        ProfileEntry *ent = RARSJS_ARRAY_GET(lines, i);
+        fprintf(stderr, "%-24u %12llu\n", ent->key,
+                (unsigned long long)ent->count);
+    }
+    RARSJS_ARRAY_FREE(lines);
+}
+
+static bool start_cache(void) {
+    const char *err = cache_enable(&g_program_default);
+    if (err) fprintf(stderr, "cache: %s\n", err);
+    return !err;
+}
+
+static void print_cache_stats(const char *name, const CacheStats *st) {
+    fprintf(stderr, "%-24s %12llu %12llu %7.2f%% %12llu %12llu\n", name,
+            (unsigned long long)st->accesses, (unsigned long long)st->misses,
+            st->accesses ? 100.0 * st->misses / st->accesses : 0.0,
+            (unsigned long long)st->evictions,
+            (unsigned long long)st->mem_writes);
+}
+
+static void print_cache_report(const char *title, const Cache *c) {
+    const CacheConfig *cfg = &c->config;
+    static const char *const POLICIES[] = {"LRU", "FIFO", "random"};
+    fprintf(stderr, "\n%s: %u bytes, %u byte lines, %u ways, %s", title,
+            cfg->size, cfg->line, cfg->ways, POLICIES[cfg->policy]);
+    if (c == &g_dcache) {
+        fprintf(stderr, ", write-%s, %swrite-allocate",
+                cfg->write_back ? "back" : "through",
+                cfg->write_allocate ? "" : "no-");
+    }
+    fprintf(stderr, "\n%-24s %12s %12s %8s %12s %12s\n", "section", "accesses",
+            "misses", "miss", "evictions", "mem writes");
+
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
+        if (!c->by_section[i].accesses) continue;
+        print_cache_stats((*RARSJS_ARRAY_GET(&g_sections, i))->name,
+                          &c->by_section[i]);
+    }
+    print_cache_stats("total", &c->stats);
+
+    RARSJS_ARRAY(ProfileEntry) lines = RARSJS_ARRAY_NEW(ProfileEntry);
+    for (u32 i = 0; i < c->by_pc_len; i++) {
+        add_to_line(&lines, i, c->by_pc[i].misses);
+    }
+
+    print_top_lines(&lines, "misses");
+}
+
+static void print_cache(void) {
+    fprintf(stderr, "\n===================== RARSJS CACHES\n");
+    print_cache_report("L1I", &g_icache);
+    print_cache_report("L1D", &g_dcache);
+}
+
+static bool start_bpred(void) {
+    const char *err = bpred_enable(&g_program_default);
+    if (err) fprintf(stderr, "branch predictor: %s\n", err);
+    return !err;
+}
+
+static bool start_trace(void) {
+    g_trace_file = fopen(g_trace_out, "wb");
+    if (!g_trace_file) {
+        fprintf(stderr, "trace: could not open output file\n");
+        return false;
+    }
+
+    trace_start(&g_program_default, g_trace_file, g_trace_last);
+    return true;
+}
+
+static void finish_trace(void) {
+    if (!trace_finish(&g_program_default)) {
+        fprintf(stderr, "trace: could not write output file\n");
+    }
+    fclose(g_trace_file);
+    g_trace_file = NULL;
+}
+
+// The models and recorders follow a single hart, so they are left out of
+// multi-hart runs
+static bool start_smp(void) {
+    if (g_flg_profile || g_profile_calls_out || g_flg_timing || g_flg_cache ||
+        g_flg_bpred || g_trace_out || g_grade_cases) {
+        fprintf(stderr,
+                "smp: --harts can't be combined with profiling, timing, "
+                "caches, branch prediction, tracing or grading\n");
+        return false;
+    }
+
+    const char *err = smp_enable(&g_program_default);
+    if (err) fprintf(stderr, "smp: %s\n", err);
+    return !err;
+}
+
+// Runs the loaded program on every --grade case instead of stdin. The cases
+// run on copies of the program without the models, so those are refused
+static void grade(void) {
+    if (g_flg_profile || g_profile_calls_out || g_flg_timing || g_flg_cache ||
+        g_flg_bpred || g_trace_out) {
+        fprintf(stderr,
+                "grade: --grade can't be combined with profiling, timing, "
+                "caches, branch prediction or tracing\n");
+        return;
+    }
+
+    RARSJS_ARRAY(GradeCase) cases = RARSJS_ARRAY_NEW(GradeCase);
+    char *error = NULL;
+    if (!grade_load_cases(g_grade_cases, &cases, &error)) {
+        fprintf(stderr, "grade: %s\n", error);
+        grade_free_cases(&cases);
+        return;
+    }
+
+    GradeResult *results = malloc(cases.len * sizeof(GradeResult));
+    RARSJS_CHECK_OOM(results);
+    grade_run(&g_program_default, cases.buf, cases.len, &g_grade_config,
+              results);
+    grade_report(stdout, cases.buf, results, cases.len, g_flg_grade_json);
+
+    free(results);
+    grade_free_cases(&cases);
+}
+
+static void print_bpred_stats(const char *name, const BpredStats *st) {
+    fprintf(stderr, "%-24s %12llu %12llu %7.2f%%\n", name,
+            (unsigned long long)st->branches,
+            (unsigned long long)st->mispredicts,
+            st->branches ? 100.0 * st->mispredicts / st->branches : 0.0);
+}
+
+static void print_bpred(void) {
+    static const char *const KINDS[] = {"static BTFN", "1-bit bimodal",
+                                        "2-bit bimodal", "gshare"};
+    const BpredConfig *cfg = &g_bpred.config;
+
+    fprintf(stderr, "\n===================== RARSJS BRANCH PREDICTOR\n");
+    fprintf(stderr, "%s", KINDS[cfg->kind]);
+    if (cfg->kind != BPRED_BTFN) fprintf(stderr, ", %u counters", 1u << cfg->table_bits);
+    if (cfg->kind == BPRED_GSHARE) fprintf(stderr, ", %u history bits", cfg->history_bits);
+    fprintf(stderr, ", %u entry return address stack\n", cfg->ras_size);
+
+    fprintf(stderr, "%-24s %12s %12s %8s\n", "", "executed", "mispredicts",
+            "rate");
+    print_bpred_stats("conditional branches", &g_bpred.branches);
+    print_bpred_stats("returns", &g_bpred.returns);
+
+    // the branches that mispredict the most, with their location
+    RARSJS_ARRAY(ProfileEntry) pcs = RARSJS_ARRAY_NEW(ProfileEntry);
+    RARSJS_ARRAY(ProfileEntry) lines = RARSJS_ARRAY_NEW(ProfileEntry);
+    for (u32 i = 0; i < g_bpred.by_pc_len; i++) {
+        if (!g_bpred.by_pc[i].branches) continue;
+        *RARSJS_ARRAY_PUSH(&pcs) =
+            (ProfileEntry){i, g_bpred.by_pc[i].mispredicts};
+        add_to_line(&lines, i, g_bpred.by_pc[i].mispredicts);
+    }
+
+    qsort(pcs.buf, pcs.len, sizeof(ProfileEntry), profile_entry_cmp);
+    if (!RARSJS_ARRAY_IS_EMPTY(&pcs)) {
+        fprintf(stderr, "\n%-10s %-24s %6s %12s %12s %8s\n", "pc", "at",
+                "line", "executed", "mispredicts", "rate");
+    }
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&pcs) && i < PROFILE_REPORT_ROWS;
+         i++) {
+        u32 idx = RARSJS_ARRAY_GET(&pcs, i)->key;
+        u32 pc = TEXT_BASE + idx * 4;
+        BpredStats *st = &g_bpred.by_pc[idx];
+        fprintf(stderr, "0x%08x %-24s ", pc, func_name(pc));
+        if (idx < RARSJS_ARRAY_LEN(&g_text_by_linenum)) {
+            fprintf(stderr, "%6u ", *RARSJS_ARRAY_GET(&g_text_by_linenum, idx));
+        } else {
+            fprintf(stderr, "%6s ", "-");
+        }
+        fprintf(stderr, "%12llu %12llu %7.2f%%\n",
+                (unsigned long long)st->branches,
+                (unsigned long long)st->mispredicts,
+                100.0 * st->mispredicts / st->branches);
+    }
+    RARSJS_ARRAY_FREE(&pcs);
+
+    print_top_lines(&lines, "mispredicts");
+}
+
+// Runs the loaded program, or grades it, with the models the flags ask for,
+// then prints their reports
+static void run_with_models(void) {
+    if (g_smp_config.harts > 1 && !start_smp()) return;
+    if (g_grade_cases) {
+        grade();
+        return;
+    }
+
+    if (g_flg_profile) profile_enable(&g_program_default);
+    if (g_profile_calls_out) profile_calls_enable(&g_program_default);
+    if (g_flg_timing) timing_enable(&g_program_default);
+    if (g_flg_cache && !start_cache()) return;
+    if (g_flg_bpred && !start_bpred()) return;
+    if (g_trace_out && !start_trace()) return;
+    emulate_safe();
+    if (g_trace_out) finish_trace();
+    if (g_flg_profile) print_profile();
+    if (g_profile_calls_out) print_call_profile();
+    if (g_flg_timing) print_timing();
+    if (g_flg_cache) print_cache();
+    if (g_flg_bpred) print_bpred();
+}
+
 static void assemble_from_file(const char *src_path, bool allow_externs) {
     FILE *f = fopen(src_path, "r");
 
@@ -205,7 +620,7 @@ static void assemble_from_file(const char *src_path, bool allow_externs) {
     fread(g_txt, s, 1, f);
     fclose(f);
 
-    assemble(g_txt, s, allow_externs);
+    assemble(&g_program_default, g_txt, s, allow_externs);
 
     if (g_error) {
         fprintf(stderr, "assembler: line %u %s\n", g_error_line, g_error);
@@ -224,7 +639,7 @@ static void c_build(void) {
     size_t elf_sz = 0;
     char *error = NULL;
 
-    if (!elf_emit_exec(&elf_contents, &elf_sz, &error)) {
+    if (!elf_emit_exec(&g_program_default, &elf_contents, &elf_sz, &error)) {
         fprintf(stderr, "linker: %s\n", error);
         goto exit;
     }
@@ -266,9 +681,10 @@ static void c_run(void) {
 
     fread(elf_contents, sz, 1, elf);
 
-    RARSJS_CHECK_CALL(elf_load(elf_contents, sz, &error), exit);
+    RARSJS_CHECK_CALL(elf_load(&g_program_default, elf_contents, sz, &error),
+                      exit);
 
-    emulate_safe();
+    run_with_models();
 
 exit:
     if (error) fprintf(stderr, "loader: %s\n", error);
@@ -278,17 +694,30 @@ exit:
 
 static void c_emulate(void) {
     assemble_from_file(g_next_arg, false);
-    if (g_error) goto exit;
-
-    emulate_safe();
+    if (!g_error) run_with_models();
 
-exit:
     if (g_txt) {
         free(g_txt);
         g_txt = NULL;
     }
 }
 
+static void c_decode_trace(void) {
+    FILE *in = fopen(g_next_arg, "rb");
+    char *error = NULL;
+
+    if (!in) {
+        error = "could not open input file";
+        goto exit;
+    }
+
+    trace_decode(in, stdout, &error);
+
+exit:
+    if (error) fprintf(stderr, "trace: %s\n", error);
+    if (in) fclose(in);
+}
+
 static void c_readelf(void) {
     FILE *elf = fopen(g_next_arg, "rb");
     char *error = NULL;
@@ -383,7 +812,7 @@ static void c_assemble(void) {
     size_t elf_sz = 0;
     char *error = NULL;
 
-    if (!elf_emit_obj(&elf_contents, &elf_sz, &error)) {
+    if (!elf_emit_obj(&g_program_default, &elf_contents, &elf_sz, &error)) {
         fprintf(stderr, "assembler: %s\n", error);
         goto exit;
     }
@@ -546,6 +975,11 @@ static void opt_readelf(command_t *self) {
     g_command = c_readelf;
 }
 
+static void opt_decode_trace(command_t *self) {
+    update_argument(self->arg);
+    g_command = c_decode_trace;
+}
+
 static void opt_o(command_t *self) {
     g_obj_out = malloc(strlen(self->arg) + 1);
     RARSJS_CHECK_OOM(g_obj_out);
@@ -571,11 +1005,226 @@ static void opt_ascii(command_t *self) {
 
 static void opt_sanitize(command_t *self) {
     g_flg_callsan = true;
-    callsan_init();
+    callsan_init(&g_machine);
+}
+
+static void opt_profile(command_t *self) { g_flg_profile = true; }
+
+static void opt_timing(command_t *self) { g_flg_timing = true; }
+
+// Calls fn for each key=value in a comma separated list, exiting with usage
+// as the error message if the list is malformed or fn rejects an entry
+static void parse_options_list(const char *list, const char *usage,
+                               bool (*fn)(const char *key, const char *val)) {
+    char *copy = strdup(list);
+    RARSJS_CHECK_OOM(copy);
+
+    char *save;
+    for (char *ent = strtok_r(copy, ",", &save); ent;
+         ent = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(ent, '=');
+        if (val) *val++ = 0;
+
+        if (!val || !*val || !fn(ent, val)) {
+            fprintf(stderr, "invalid option list '%s', expected e.g. %s\n",
+                    list, usage);
+            exit(-1);
+        }
+    }
+
+    free(copy);
+}
+
+// Parses a number with an optional k suffix
+static bool parse_size64(const char *val, u64 *out) {
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (end == val || *val == '-') return false;
+    if (*end == 'k' || *end == 'K') {
+        if (n > UINT64_MAX / 1024) return false;
+        n *= 1024, end++;
+    }
+    *out = n;
+    return !*end;
+}
+
+static bool parse_size(const char *val, u32 *out) {
+    u64 n;
+    if (!parse_size64(val, &n) || n > UINT32_MAX) return false;
+    *out = n;
+    return true;
+}
+
+static bool set_latency(const char *key, const char *val) {
+    if (!strcmp(key, "mul")) return parse_size(val, &g_timing_config.mul);
+    if (!strcmp(key, "div")) return parse_size(val, &g_timing_config.div);
+    if (!strcmp(key, "load")) return parse_size(val, &g_timing_config.load);
+    if (!strcmp(key, "branch")) return parse_size(val, &g_timing_config.branch);
+    if (!strcmp(key, "csr")) return parse_size(val, &g_timing_config.csr);
+    return false;
+}
+
+static void opt_latencies(command_t *self) {
+    g_flg_timing = true;
+    parse_options_list(self->arg, "mul=3,div=20,load=1,branch=2,csr=3",
+                       set_latency);
+}
+
+static bool set_cache_option(CacheConfig *config, const char *key,
+                             const char *val) {
+    if (!strcmp(key, "size")) return parse_size(val, &config->size);
+    if (!strcmp(key, "line")) return parse_size(val, &config->line);
+    if (!strcmp(key, "ways")) return parse_size(val, &config->ways);
+
+    if (!strcmp(key, "policy")) {
+        if (!strcmp(val, "lru")) config->policy = CACHE_LRU;
+        else if (!strcmp(val, "fifo")) config->policy = CACHE_FIFO;
+        else if (!strcmp(val, "random")) config->policy = CACHE_RANDOM;
+        else return false;
+        return true;
+    }
+
+    if (!strcmp(key, "write")) {
+        if (strcmp(val, "back") && strcmp(val, "through")) return false;
+        config->write_back = !strcmp(val, "back");
+        return true;
+    }
+
+    if (!strcmp(key, "allocate")) {
+        if (strcmp(val, "yes") && strcmp(val, "no")) return false;
+        config->write_allocate = !strcmp(val, "yes");
+        return true;
+    }
+
+    return false;
 }
 
+static bool set_icache_option(const char *key, const char *val) {
+    return set_cache_option(&g_icache_config, key, val);
+}
+
+static bool set_dcache_option(const char *key, const char *val) {
+    return set_cache_option(&g_dcache_config, key, val);
+}
+
+#define CACHE_USAGE \
+    "size=4k,line=32,ways=4,policy=lru|fifo|random,write=back|through," \
+    "allocate=yes|no"
+
+static void opt_cache(command_t *self) { g_flg_cache = true; }
+
+static void opt_icache(command_t *self) {
+    g_flg_cache = true;
+    parse_options_list(self->arg, CACHE_USAGE, set_icache_option);
+}
+
+static void opt_dcache(command_t *self) {
+    g_flg_cache = true;
+    parse_options_list(self->arg, CACHE_USAGE, set_dcache_option);
+}
+
+static bool set_bpred_option(const char *key, const char *val) {
+    if (!strcmp(key, "bits")) return parse_size(val, &g_bpred_config.table_bits);
+    if (!strcmp(key, "history")) {
+        return parse_size(val, &g_bpred_config.history_bits);
+    }
+    if (!strcmp(key, "ras")) return parse_size(val, &g_bpred_config.ras_size);
+
+    if (!strcmp(key, "type")) {
+        if (!strcmp(val, "btfn")) g_bpred_config.kind = BPRED_BTFN;
+        else if (!strcmp(val, "1bit")) g_bpred_config.kind = BPRED_1BIT;
+        else if (!strcmp(val, "2bit")) g_bpred_config.kind = BPRED_2BIT;
+        else if (!strcmp(val, "gshare")) g_bpred_config.kind = BPRED_GSHARE;
+        else return false;
+        return true;
+    }
+
+    return false;
+}
+
+static void opt_bpred(command_t *self) {
+    g_flg_bpred = true;
+    if (self->arg) {
+        parse_options_list(self->arg,
+                           "type=btfn|1bit|2bit|gshare,bits=10,history=10,ras=8",
+                           set_bpred_option);
+    }
+}
+
+static void opt_profile_calls(command_t *self) {
+    g_profile_calls_out = strdup(self->arg);
+    RARSJS_CHECK_OOM(g_profile_calls_out);
+}
+
+static void opt_trace(command_t *self) {
+    g_trace_out = strdup(self->arg);
+    RARSJS_CHECK_OOM(g_trace_out);
+}
+
+static void opt_trace_last(command_t *self) {
+    if (!parse_size(self->arg, &g_trace_last) || !g_trace_last) {
+        fprintf(stderr, "invalid instruction count '%s'\n", self->arg);
+        exit(-1);
+    }
+}
+
+static void opt_grade(command_t *self) {
+    g_grade_cases = strdup(self->arg);
+    RARSJS_CHECK_OOM(g_grade_cases);
+}
+
+static void opt_jobs(command_t *self) {
+    if (!parse_size(self->arg, &g_grade_config.jobs) || !g_grade_config.jobs) {
+        fprintf(stderr, "invalid number of jobs '%s'\n", self->arg);
+        exit(-1);
+    }
+}
+
+static bool set_grade_limit(const char *key, const char *val) {
+    if (!strcmp(key, "ms")) return parse_size(val, &g_grade_config.max_ms);
+    if (!strcmp(key, "insns")) {
+        return parse_size64(val, &g_grade_config.max_instructions);
+    }
+    return false;
+}
+
+static void opt_grade_limits(command_t *self) {
+    parse_options_list(self->arg, "insns=1000k,ms=10000", set_grade_limit);
+}
+
+static void opt_grade_json(command_t *self) { g_flg_grade_json = true; }
+
+static void opt_harts(command_t *self) {
+    if (!parse_size(self->arg, &g_smp_config.harts) || !g_smp_config.harts ||
+        g_smp_config.harts > SMP_MAX_HARTS) {
+        fprintf(stderr, "invalid number of harts '%s', expected 1 to %u\n",
+                self->arg, SMP_MAX_HARTS);
+        exit(-1);
+    }
+}
+
+static bool set_smp_option(const char *key, const char *val) {
+    if (!strcmp(key, "quantum")) return parse_size(val, &g_smp_config.quantum);
+
+    if (!strcmp(key, "mode")) {
+        if (!strcmp(val, "lockstep")) g_smp_config.mode = SMP_LOCKSTEP;
+        else if (!strcmp(val, "free")) g_smp_config.mode = SMP_FREE;
+        else return false;
+        return true;
+    }
+
+    return false;
+}
+
+static void opt_smp(command_t *self) {
+    parse_options_list(self->arg, "mode=lockstep|free,quantum=1000",
+                       set_smp_option);
+}
+
+static void free_default_runtime(void) { free_runtime(&g_program_default); }
+
 int main(int argc, char **argv) {
-    atexit(free_runtime);
+    atexit(free_default_runtime);
     g_argc = argc;
     g_argv = argv;
 
@@ -607,6 +1256,68 @@ int main(int argc, char **argv) {
                    opt_o);
     command_option(&cmd, "-s", "--sanitize",
                    "enable rarsjs sanitizers (callsan)", opt_sanitize);
+    command_option(&cmd, "-p", "--profile",
+                   "count executed instructions and report the hottest labels "
+                   "and lines",
+                   opt_profile);
+    command_option(&cmd, "-g", "--profile-calls <file>",
+                   "count calls and instructions per function and write the "
+                   "call stacks to file in folded format (for flame graphs)",
+                   opt_profile_calls);
+    command_option(&cmd, "-t", "--timing",
+                   "estimate cycles and CPI on a 5-stage pipeline", opt_timing);
+    command_option(&cmd, "-L", "--latencies <spec>",
+                   "set the --timing latencies in cycles, like "
+                   "mul=3,div=20,load=1,branch=2,csr=3",
+                   opt_latencies);
+    command_option(&cmd, "-k", "--cache",
+                   "simulate L1 instruction and data caches and report "
+                   "misses per section and line",
+                   opt_cache);
+    command_option(&cmd, NULL, "--icache <spec>",
+                   "configure the --cache L1I, like " CACHE_USAGE, opt_icache);
+    command_option(&cmd, NULL, "--dcache <spec>",
+                   "configure the --cache L1D, like " CACHE_USAGE, opt_dcache);
+    command_option(&cmd, "-B", "--branch-predictor [spec]",
+                   "simulate a branch predictor and report mispredictions, "
+                   "optionally configured like type=gshare,bits=10,"
+                   "history=10,ras=8",
+                   opt_bpred);
+    command_option(&cmd, "-T", "--trace <file>",
+                   "record the pc, register and memory writes of every "
+                   "executed instruction to file in a compact binary format",
+                   opt_trace);
+    command_option(&cmd, NULL, "--trace-last <n>",
+                   "only keep the last n instructions in the --trace, to see "
+                   "what led to a crash",
+                   opt_trace_last);
+    command_option(&cmd, "-d", "--decode-trace <file>",
+                   "print a --trace file as text", opt_decode_trace);
+    command_option(&cmd, "-G", "--grade <cases>",
+                   "run the program on every case of a directory (NAME.in, "
+                   "NAME.out) or manifest ('input expected' lines) and "
+                   "report which produce the expected output",
+                   opt_grade);
+    command_option(&cmd, "-j", "--jobs <n>",
+                   "number of --grade cases run in parallel (default: one "
+                   "per CPU)",
+                   opt_jobs);
+    command_option(&cmd, NULL, "--grade-limits <spec>",
+                   "limit each --grade case, like insns=1000k,ms=10000 (0 "
+                   "for no limit, default ms=10000)",
+                   opt_grade_limits);
+    command_option(&cmd, NULL, "--grade-json",
+                   "print the --grade summary as JSON instead of TSV",
+                   opt_grade_json);
+    command_option(&cmd, "-H", "--harts <n>",
+                   "run the program on n harts sharing memory, told apart by "
+                   "the mhartid CSR",
+                   opt_harts);
+    command_option(&cmd, NULL, "--smp <spec>",
+                   "schedule --harts like mode=lockstep|free,quantum=1000, "
+                   "lockstep (the default) being deterministic and free "
+                   "running a host thread per hart",
+                   opt_smp);
     command_parse(&cmd, argc, argv);
     g_cmd_args = (const char **)cmd.argv;
     g_cmd_args_len = cmd.argc;
@@ -622,6 +1333,9 @@ int main(int argc, char **argv) {
     if (g_out_changed) {
         free((void *)g_obj_out);
     }
+    free(g_profile_calls_out);
+    free(g_trace_out);
+    free(g_grade_cases);
     command_free(&cmd);
     return EXIT_SUCCESS;
 }
@@ -4,31 +4,10 @@
 
 #include "rarsjs/callsan.h"
 #include "rarsjs/dev.h"
+#include "rarsjs/dirty.h"
 #include "rarsjs/elf.h"
 #include "rarsjs/emulate.h"
-
-export Section *g_text, *g_data, *g_stack, *g_kernel_text, *g_kernel_data,
-    *g_mmio;
-
-RARSJS_ARRAY(SectionPtr) g_sections = RARSJS_ARRAY_NEW(SectionPtr);
-RARSJS_ARRAY(Extern) g_externs = RARSJS_ARRAY_NEW(Extern);
-RARSJS_ARRAY(LabelData) g_labels = RARSJS_ARRAY_NEW(LabelData);
-RARSJS_ARRAY(Global) g_globals = RARSJS_ARRAY_NEW(Global);
-export RARSJS_ARRAY(u32) g_text_by_linenum;
-
-static RARSJS_ARRAY(DeferredInsn)
-    g_deferred_insn = RARSJS_ARRAY_NEW(DeferredInsn);
-
-static Section *g_section;
-
-export bool g_in_fixup;
-export u32 g_error_line;
-export const char *g_error;
-
-export u32 g_runtime_error_params[2];
-export Error g_runtime_error_type;
-
-static bool g_allow_externs;
+#include "rarsjs/program.h"
 
 // NOTE: this may seem like it can be static, but it's used elsewhere (like in
 // cli.c)
@@ -43,7 +22,9 @@ const char *const CSR_NAMES[] = {
     [0x144] = "sip",      [0x300] = "mstatus", [0x302] = "medeleg",
     [0x303] = "mideleg",  [0x304] = "mie",     [0x305] = "mtvec",
     [0x340] = "mscratch", [0x341] = "mepc",    [0x342] = "mcause",
-    [0x344] = "mip"};
+    [0x344] = "mip",      [0xC00] = "cycle",   [0xC01] = "time",
+    [0xC02] = "instret",  [0xC80] = "cycleh",  [0xC81] = "timeh",
+    [0xC82] = "instreth", [0xF14] = "mhartid"};
 
 // clang-format off
 u32 DS1S2(u32 d, u32 s1, u32 s2) { return (d << 7) | (s1 << 15) | (s2 << 20); }
@@ -106,6 +87,8 @@ u32 LUI(u32 rd, u32 off) { return 0b0110111 | (rd << 7) | (off << 12); }
 u32 AUIPC(u32 rd, u32 off) { return 0b0010111 | (rd << 7) | (off << 12); }
 u32 JAL(u32 rd, u32 off) { return 0b1101111 | (rd << 7) | (((off >> 12) & 255) << 12) | (((off >> 11) & 1) << 20) | (((off >> 1) & 1023) << 21) | ((off >> 20) << 31); }
 u32 JALR(u32 rd, u32 rs1, u32 off) { return 0b1100111 | (rd << 7) | (rs1 << 15) | (off << 20); }
+u32 Amo(u32 rd, u32 rs1, u32 rs2, u32 funct5) { return 0b0101111 | (0b010 << 12) | DS1S2(rd, rs1, rs2) | (funct5 << 27); }
+u32 FENCE(u32 pred, u32 succ) { return 0b0001111 | (succ << 20) | (pred << 24); }
 // clang-format on
 
 bool whitespace(char c) {
@@ -381,11 +364,7 @@ int parse_reg(Parser *p) {
     return -1;
 }
 
-int parse_csr(Parser *p) {
-    const char *str;
-    size_t len;
-    parse_ident(p, &str, &len);
-
+int csr_by_name(const char *str, size_t len) {
     for (int i = 0; i < sizeof(CSR_NAMES)/sizeof(CSR_NAMES[0]); i++) {
         if (CSR_NAMES[i] && str_eq_case(str, len, CSR_NAMES[i])) return i;
     }
@@ -393,135 +372,153 @@ int parse_csr(Parser *p) {
     return -1;
 }
 
-void asm_emit_byte(u8 byte, int linenum) {
-    if (!g_in_fixup) {
-        *RARSJS_ARRAY_PUSH(&g_section->contents) = byte;
+int parse_csr(Parser *p) {
+    const char *str;
+    size_t len;
+    parse_ident(p, &str, &len);
+    return csr_by_name(str, len);
+}
+
+void asm_emit_byte(Parser *p, u8 byte) {
+    Assembler *as = &p->prog->as;
+    if (!as->in_fixup) {
+        *RARSJS_ARRAY_PUSH(&as->section->contents) = byte;
     } else {
-        *RARSJS_ARRAY_INSERT(&g_section->contents, g_section->emit_idx) = byte;
+        *RARSJS_ARRAY_INSERT(&as->section->contents, as->section->emit_idx) =
+            byte;
     }
-    g_section->emit_idx++;
+    as->section->emit_idx++;
 }
 
-void asm_emit(u32 inst, int linenum) {
-    if (g_section == g_text) {
-        *RARSJS_ARRAY_PUSH(&g_text_by_linenum) = linenum;
+void asm_emit(Parser *p, u32 inst) {
+    Assembler *as = &p->prog->as;
+    if (as->section == as->text) {
+        *RARSJS_ARRAY_PUSH(&as->text_by_linenum) = p->startline;
     }
 
-    asm_emit_byte(inst >> 0, linenum);
-    asm_emit_byte(inst >> 8, linenum);
-    asm_emit_byte(inst >> 16, linenum);
-    asm_emit_byte(inst >> 24, linenum);
+    asm_emit_byte(p, inst >> 0);
+    asm_emit_byte(p, inst >> 8);
+    asm_emit_byte(p, inst >> 16);
+    asm_emit_byte(p, inst >> 24);
 }
 
-static Extern *get_extern(const char *sym, size_t sym_len) {
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_externs); i++) {
-        if (RARSJS_ARRAY_GET(&g_externs, i)->len == sym_len &&
-            0 ==
-                memcmp(sym, RARSJS_ARRAY_GET(&g_externs, i)->symbol, sym_len)) {
-            return RARSJS_ARRAY_GET(&g_externs, i);
+static Extern *get_extern(Assembler *as, const char *sym, size_t sym_len) {
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->externs); i++) {
+        if (RARSJS_ARRAY_GET(&as->externs, i)->len == sym_len &&
+            0 == memcmp(sym, RARSJS_ARRAY_GET(&as->externs, i)->symbol,
+                        sym_len)) {
+            return RARSJS_ARRAY_GET(&as->externs, i);
         }
     }
 
-    Extern *e = RARSJS_ARRAY_PUSH(&g_externs);
+    Extern *e = RARSJS_ARRAY_PUSH(&as->externs);
     e->symbol = sym;
     e->len = sym_len;
     return e;
 }
 
-const char *reloc_branch(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_branch(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_BRANCH;
     return NULL;
 }
 
-const char *reloc_jal(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_jal(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_JAL;
     return NULL;
 }
 
-const char *reloc_hi20(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_hi20(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
 
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_HI20;
     return NULL;
 }
 
-const char *reloc_lo12i(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_lo12i(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
 
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_LO12_I;
     return NULL;
 }
 
-const char *reloc_lo12s(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_lo12s(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
 
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_LO12_S;
     return NULL;
 }
 
-const char *reloc_hi20lo12i(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_hi20lo12i(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
 
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_HI20;
 
-    r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+    r = RARSJS_ARRAY_PUSH(&as->section->relocations);
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx + 4;
+    r->offset = as->section->emit_idx + 4;
     r->type = R_RISCV_LO12_I;
     return NULL;
 }
 
-const char *reloc_hi20lo12s(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_hi20lo12s(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
 
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_HI20;
 
-    r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+    r = RARSJS_ARRAY_PUSH(&as->section->relocations);
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx + 4;
+    r->offset = as->section->emit_idx + 4;
     r->type = R_RISCV_LO12_S;
     return NULL;
 }
 
-const char *reloc_abs32(const char *sym, size_t sym_len) {
-    Extern *e = get_extern(sym, sym_len);
-    Relocation *r = RARSJS_ARRAY_PUSH(&g_section->relocations);
+const char *reloc_abs32(Parser *p, const char *sym, size_t sym_len) {
+    Assembler *as = &p->prog->as;
+    Extern *e = get_extern(as, sym, sym_len);
+    Relocation *r = RARSJS_ARRAY_PUSH(&as->section->relocations);
 
     r->symbol = e;
     r->addend = 0;
-    r->offset = g_section->emit_idx;
+    r->offset = as->section->emit_idx;
     r->type = R_RISCV_32;
     return NULL;
 }
@@ -562,7 +559,7 @@ const char *handle_alu_reg(Parser *p, const char *opcode, size_t opcode_len) {
     else if (str_eq_case(opcode, opcode_len, "rem")) inst = REM(d, s1, s2);
     else if (str_eq_case(opcode, opcode_len, "remu")) inst = REMU(d, s1, s2);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
     return NULL;
 }
 
@@ -597,7 +594,7 @@ const char *handle_alu_imm(Parser *p, const char *opcode, size_t opcode_len) {
     else if (str_eq_case(opcode, opcode_len, "srli")) inst = SRLI(d, s1, simm);
     else if (str_eq_case(opcode, opcode_len, "srai")) inst = SRAI(d, s1, simm);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
 
     return NULL;
 }
@@ -632,13 +629,14 @@ const char *handle_ldst(Parser *p, const char *opcode, size_t opcode_len) {
     else if (str_eq_case(opcode, opcode_len, "sh")) inst = SH(reg, mem, simm);
     else if (str_eq_case(opcode, opcode_len, "sw")) inst = SW(reg, mem, simm);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
     return NULL;
 }
 
 const char *label(Parser *p, Parser *orig, DeferredInsnCb *cb,
                   const char *opcode, size_t opcode_len, u32 *out_addr,
                   bool *later, DeferredInsnReloc *reloc) {
+    Assembler *as = &p->prog->as;
     *later = false;
     const char *target;
     size_t target_len;
@@ -646,27 +644,30 @@ const char *label(Parser *p, Parser *orig, DeferredInsnCb *cb,
     parse_ident(p, &target, &target_len);
     if (target_len == 0) return "No label";
 
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_labels); i++) {
-        if (str_eq_2(RARSJS_ARRAY_GET(&g_labels, i)->txt,
-                     RARSJS_ARRAY_GET(&g_labels, i)->len, target, target_len)) {
-            *out_addr = RARSJS_ARRAY_GET(&g_labels, i)->addr;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+        if (str_eq_2(RARSJS_ARRAY_GET(&as->labels, i)->txt,
+                     RARSJS_ARRAY_GET(&as->labels, i)->len, target,
+                     target_len)) {
+            *out_addr = RARSJS_ARRAY_GET(&as->labels, i)->addr;
             return NULL;
         }
     }
 
-    if (g_in_fixup && (!reloc || !g_allow_externs)) return "Label not found";
-    if (g_in_fixup) {
+    if (as->in_fixup && (!reloc || !as->allow_externs)) {
+        return "Label not found";
+    }
+    if (as->in_fixup) {
         *out_addr = 0;
-        return reloc(target, target_len);
+        return reloc(p, target, target_len);
     }
-    DeferredInsn *insn = RARSJS_ARRAY_PUSH(&g_deferred_insn);
-    insn->emit_idx = g_section->emit_idx;
+    DeferredInsn *insn = RARSJS_ARRAY_PUSH(&as->deferred_insn);
+    insn->emit_idx = as->section->emit_idx;
     insn->p = *orig;
     insn->cb = cb;
     insn->reloc = reloc;
     insn->opcode = opcode;
     insn->opcode_len = opcode_len;
-    insn->section = g_section;
+    insn->section = as->section;
     *later = true;
     return NULL;
 }
@@ -692,10 +693,11 @@ const char *handle_branch(Parser *p, const char *opcode, size_t opcode_len) {
                             &later, reloc_branch);
     if (err) return err;
     if (later) {
-        asm_emit(0, p->startline);
+        asm_emit(p, 0);
         return NULL;
     }
-    i32 simm = addr - (g_section->emit_idx + g_section->base);
+    Section *sec = p->prog->as.section;
+    i32 simm = addr - (sec->emit_idx + sec->base);
 
     u32 inst = 0;
     if (str_eq_case(opcode, opcode_len, "beq")) inst = BEQ(s1, s2, simm);
@@ -708,7 +710,7 @@ const char *handle_branch(Parser *p, const char *opcode, size_t opcode_len) {
     else if (str_eq_case(opcode, opcode_len, "ble")) inst = BGE(s2, s1, simm);
     else if (str_eq_case(opcode, opcode_len, "bgtu")) inst = BLTU(s2, s1, simm);
     else if (str_eq_case(opcode, opcode_len, "bleu")) inst = BGEU(s2, s1, simm);
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
     return NULL;
 }
 
@@ -729,10 +731,11 @@ const char *handle_branch_zero(Parser *p, const char *opcode,
                             &addr, &later, reloc_branch);
     if (err) return err;
     if (later) {
-        asm_emit(0, p->startline);
+        asm_emit(p, 0);
         return NULL;
     }
-    i32 simm = addr - (g_section->emit_idx + g_section->base);
+    Section *sec = p->prog->as.section;
+    i32 simm = addr - (sec->emit_idx + sec->base);
 
     u32 inst = 0;
     if (str_eq_case(opcode, opcode_len, "beqz")) inst = BEQ(s, 0, simm);
@@ -742,7 +745,7 @@ const char *handle_branch_zero(Parser *p, const char *opcode,
     else if (str_eq_case(opcode, opcode_len, "bltz")) inst = BLT(s, 0, simm);
     else if (str_eq_case(opcode, opcode_len, "bgtz")) inst = BLT(0, s, simm);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
     return NULL;
 }
 
@@ -768,7 +771,7 @@ const char *handle_alu_pseudo(Parser *p, const char *opcode,
     else if (str_eq_case(opcode, opcode_len, "sltz")) inst = SLT(d, s, 0);
     else if (str_eq_case(opcode, opcode_len, "sgtz")) inst = SLT(d, 0, s);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
     return NULL;
 }
 
@@ -799,11 +802,12 @@ const char *handle_jump(Parser *p, const char *opcode, size_t opcode_len) {
                 reloc_jal);
     if (err) return err;
     if (later) {
-        asm_emit(0, p->startline);
+        asm_emit(p, 0);
         return NULL;
     }
-    i32 simm = addr - (g_section->emit_idx + g_section->base);
-    asm_emit(JAL(d, simm), p->startline);
+    Section *sec = p->prog->as.section;
+    i32 simm = addr - (sec->emit_idx + sec->base);
+    asm_emit(p, JAL(d, simm));
     return NULL;
 }
 
@@ -819,7 +823,7 @@ const char *handle_jump_reg(Parser *p, const char *opcode, size_t opcode_len) {
         if ((d = parse_reg(p)) == -1) return "Invalid register";
         skip_whitespace(p);
         if (!consume_if(p, ',')) {
-            asm_emit(JALR(1, d, 0), p->startline);
+            asm_emit(p, JALR(1, d, 0));
             return NULL;
         }
         skip_whitespace(p);
@@ -844,17 +848,17 @@ const char *handle_jump_reg(Parser *p, const char *opcode, size_t opcode_len) {
             if (!parse_numeric(p, &simm)) return "Invalid imm";
         }
         if (simm >= -2048 && simm <= 2047)
-            asm_emit(JALR(d, s, simm), p->startline);
+            asm_emit(p, JALR(d, s, simm));
         else return "Immediate out of range";
     } else if (str_eq_case(opcode, opcode_len, "jr")) {
         if ((s = parse_reg(p)) == -1) return "Invalid rs";
-        asm_emit(JALR(0, s, 0), p->startline);
+        asm_emit(p, JALR(0, s, 0));
     }
     return NULL;
 }
 
 const char *handle_ret(Parser *p, const char *opcode, size_t opcode_len) {
-    asm_emit(JALR(0, 1, 0), p->startline);
+    asm_emit(p, JALR(0, 1, 0));
     return NULL;
 }
 
@@ -875,7 +879,7 @@ const char *handle_upper(Parser *p, const char *opcode, size_t opcode_len) {
     if (str_eq_case(opcode, opcode_len, "lui")) inst = LUI(d, simm);
     else if (str_eq_case(opcode, opcode_len, "auipc")) inst = AUIPC(d, simm);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
     return NULL;
 }
 
@@ -891,13 +895,13 @@ const char *handle_li(Parser *p, const char *opcode, size_t opcode_len) {
     if (!parse_numeric(p, &simm)) return "Invalid imm";
 
     if (simm >= -2048 && simm <= 2047) {
-        asm_emit(ADDI(d, 0, simm), p->startline);
+        asm_emit(p, ADDI(d, 0, simm));
     } else {
         u32 lo = simm & 0xFFF;
         if (lo >= 0x800) lo -= 0x1000;
         u32 hi = (u32)(simm - lo) >> 12;
-        asm_emit(LUI(d, hi), p->startline);
-        asm_emit(ADDI(d, d, lo), p->startline);
+        asm_emit(p, LUI(d, hi));
+        asm_emit(p, ADDI(d, d, lo));
     }
     return NULL;
 }
@@ -917,28 +921,29 @@ const char *handle_la(Parser *p, const char *opcode, size_t opcode_len) {
     const char *err = label(p, &orig, handle_la, opcode, opcode_len, &addr,
                             &later, reloc_hi20lo12i);
     if (later) {
-        asm_emit(0, p->startline);
-        asm_emit(0, p->startline);
+        asm_emit(p, 0);
+        asm_emit(p, 0);
         return NULL;
     }
     if (err) return err;
-    i32 simm = addr - (g_section->emit_idx + g_section->base);
+    Section *sec = p->prog->as.section;
+    i32 simm = addr - (sec->emit_idx + sec->base);
 
     u32 lo = simm & 0xFFF;
     if (lo >= 0x800) lo -= 0x1000;
     u32 hi = (u32)(simm - lo) >> 12;
-    asm_emit(AUIPC(d, hi), p->startline);
-    asm_emit(ADDI(d, d, lo), p->startline);
+    asm_emit(p, AUIPC(d, hi));
+    asm_emit(p, ADDI(d, d, lo));
     return NULL;
 }
 
 const char *handle_ecall(Parser *p, const char *opcode, size_t opcode_len) {
-    asm_emit(0x73, p->startline);
+    asm_emit(p, 0x73);
     return NULL;
 }
 
 const char *handle_sret(Parser *p, const char *opcode, size_t opcode_len) {
-    asm_emit(0x10200073, p->startline);
+    asm_emit(p, 0x10200073);
     return NULL;
 }
 
@@ -965,7 +970,19 @@ const char *handle_csr(Parser *p, const char *opcode, size_t opcode_len) {
     else if (str_eq_case(opcode, opcode_len, "csrrs")) inst = CSRRS(d, s, csr);
     else if (str_eq_case(opcode, opcode_len, "csrrc")) inst = CSRRC(d, s, csr);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
+    return NULL;
+}
+
+// rdcycle, rdinstret... are csrrs rd, <name without rd>, zero
+const char *handle_rdcounter(Parser *p, const char *opcode,
+                             size_t opcode_len) {
+    int d;
+
+    skip_whitespace(p);
+    if ((d = parse_reg(p)) == -1) return "Invalid rd";
+
+    asm_emit(p, CSRRS(d, 0, csr_by_name(opcode + 2, opcode_len - 2)));
     return NULL;
 }
 
@@ -995,7 +1012,89 @@ const char *handle_csr_imm(Parser *p, const char *opcode, size_t opcode_len) {
     else if (str_eq_case(opcode, opcode_len, "csrrci"))
         inst = CSRRCI(d, zimm, csr);
 
-    asm_emit(inst, p->startline);
+    asm_emit(p, inst);
+    return NULL;
+}
+
+// lr.w rd, (rs1), and the others rd, rs2, (rs1), with an optional 0 offset
+const char *handle_amo(Parser *p, const char *opcode, size_t opcode_len) {
+    int d, s1, s2 = 0;
+    i32 simm;
+
+    u32 funct5 = 0;
+    if (str_eq_case(opcode, opcode_len, "lr.w")) funct5 = 0b00010;
+    else if (str_eq_case(opcode, opcode_len, "sc.w")) funct5 = 0b00011;
+    else if (str_eq_case(opcode, opcode_len, "amoswap.w")) funct5 = 0b00001;
+    else if (str_eq_case(opcode, opcode_len, "amoadd.w")) funct5 = 0b00000;
+    else if (str_eq_case(opcode, opcode_len, "amoxor.w")) funct5 = 0b00100;
+    else if (str_eq_case(opcode, opcode_len, "amoand.w")) funct5 = 0b01100;
+    else if (str_eq_case(opcode, opcode_len, "amoor.w")) funct5 = 0b01000;
+    else if (str_eq_case(opcode, opcode_len, "amomin.w")) funct5 = 0b10000;
+    else if (str_eq_case(opcode, opcode_len, "amomax.w")) funct5 = 0b10100;
+    else if (str_eq_case(opcode, opcode_len, "amominu.w")) funct5 = 0b11000;
+    else if (str_eq_case(opcode, opcode_len, "amomaxu.w")) funct5 = 0b11100;
+
+    skip_whitespace(p);
+    if ((d = parse_reg(p)) == -1) return "Invalid rd";
+    skip_whitespace(p);
+    if (!consume_if(p, ',')) return "Expected ,";
+
+    if (funct5 != 0b00010) {
+        skip_whitespace(p);
+        if ((s2 = parse_reg(p)) == -1) return "Invalid rs2";
+        skip_whitespace(p);
+        if (!consume_if(p, ',')) return "Expected ,";
+    }
+
+    skip_whitespace(p);
+    if (parse_numeric(p, &simm) && simm != 0) return "Offset must be 0";
+    skip_whitespace(p);
+    if (!consume_if(p, '(')) return "Expected (";
+    skip_whitespace(p);
+    if ((s1 = parse_reg(p)) == -1) return "Invalid rs1";
+    skip_whitespace(p);
+    if (!consume_if(p, ')')) return "Expected )";
+
+    asm_emit(p, Amo(d, s1, s2, funct5));
+    return NULL;
+}
+
+// The i, o, r and w of a fence's predecessor or successor set
+static int parse_fence_set(Parser *p) {
+    const char *set;
+    size_t set_len;
+    parse_ident(p, &set, &set_len);
+
+    int bits = 0;
+    for (size_t i = 0; i < set_len; i++) {
+        char c = my_tolower(set[i]);
+        if (c == 'w') bits |= 0b0001;
+        else if (c == 'r') bits |= 0b0010;
+        else if (c == 'o') bits |= 0b0100;
+        else if (c == 'i') bits |= 0b1000;
+        else return -1;
+    }
+    return set_len ? bits : -1;
+}
+
+// fence alone orders everything, like fence iorw, iorw
+const char *handle_fence(Parser *p, const char *opcode, size_t opcode_len) {
+    if (str_eq_case(opcode, opcode_len, "fence.i")) {
+        asm_emit(p, 0x100F);
+        return NULL;
+    }
+
+    int pred = 0b1111, succ = 0b1111;
+    skip_trailing(p);
+    if (p->pos < p->size && ident(p->input[p->pos])) {
+        if ((pred = parse_fence_set(p)) == -1) return "Invalid predecessor set";
+        skip_whitespace(p);
+        if (!consume_if(p, ',')) return "Expected ,";
+        skip_whitespace(p);
+        if ((succ = parse_fence_set(p)) == -1) return "Invalid successor set";
+    }
+
+    asm_emit(p, FENCE(pred, succ));
     return NULL;
 }
 
@@ -1027,15 +1126,22 @@ OpcodeHandling opcode_types[] = {
     {handle_ecall, {"ecall"}},
     {handle_csr, {"csrrw", "csrrs", "csrrc"}},
     {handle_csr_imm, {"csrrwi", "csrrsi", "csrrci"}},
+    {handle_rdcounter,
+     {"rdcycle", "rdcycleh", "rdtime", "rdtimeh", "rdinstret", "rdinstreth"}},
     {handle_sret, {"sret"}},
+    {handle_amo,
+     {"lr.w", "sc.w", "amoswap.w", "amoadd.w", "amoxor.w", "amoand.w",
+      "amoor.w", "amomin.w", "amomax.w", "amominu.w", "amomaxu.w"}},
+    {handle_fence, {"fence", "fence.i"}},
 };
 
 // defining _start but not making it global is a VERY common mistake
 // another mistake i've seen is putting _start in .data by accident
-const char *resolve_start(u32 *start_pc) {
+const char *resolve_start(Program *prog, u32 *start_pc) {
     Section *section;
-    if (!resolve_symbol("_start", strlen("_start"), true, start_pc, &section)) {
-        if (resolve_symbol("_start", strlen("_start"), false, start_pc,
+    if (!resolve_symbol(prog, "_start", strlen("_start"), true, start_pc,
+                        &section)) {
+        if (resolve_symbol(prog, "_start", strlen("_start"), false, start_pc,
                            &section)) {
             return "_start defined, but without .globl";
         }
@@ -1044,45 +1150,45 @@ const char *resolve_start(u32 *start_pc) {
         *start_pc = TEXT_BASE;
         return NULL;
     }
-    if (section != g_text) {
+    if (section != prog->as.text) {
         return "_start not in .text section";
     }
     return NULL;
 }
 
-const char *resolve_kernel_start(u32 *start_pc) {
+const char *resolve_kernel_start(Program *prog, u32 *start_pc) {
     Section *section;
-    if (!resolve_symbol("_kernel_start", strlen("_kernel_start"), true,
+    if (!resolve_symbol(prog, "_kernel_start", strlen("_kernel_start"), true,
                         start_pc, &section)) {
-        if (resolve_symbol("_kernel_start", strlen("_kernel_start"), false,
-                           start_pc, &section)) {
+        if (resolve_symbol(prog, "_kernel_start", strlen("_kernel_start"),
+                           false, start_pc, &section)) {
             return "_kernel_start defined, but without .globl";
         }
 
         return "_kernel_start symbol not found";
     }
 
-    if (section != g_kernel_text) {
+    if (section != prog->as.kernel_text) {
         return "_kernel_start not in .kernel_text section";
     }
 
     return NULL;
 }
-const char *resolve_entry(u32 *start_pc) {
-    if (resolve_kernel_start(start_pc) == NULL) {
-        emulator_enter_kernel();
+const char *resolve_entry(Program *prog, u32 *start_pc) {
+    if (resolve_kernel_start(prog, start_pc) == NULL) {
+        emulator_enter_kernel(&prog->machine);
         return NULL;
     }
 
-    return resolve_start(start_pc);
+    return resolve_start(prog, start_pc);
 }
 
-static void prepare_default_syms(void) {
-#define MMIO_LABEL(name, addrr)                                      \
-    *RARSJS_ARRAY_PUSH(&g_labels) = (LabelData){.txt = (name),       \
-                                                .len = strlen(name), \
-                                                .addr = (addrr),     \
-                                                .section = g_mmio}
+static void prepare_default_syms(Assembler *as) {
+#define MMIO_LABEL(name, addrr)                                        \
+    *RARSJS_ARRAY_PUSH(&as->labels) = (LabelData){.txt = (name),       \
+                                                  .len = strlen(name), \
+                                                  .addr = (addrr),     \
+                                                  .section = as->mmio}
 
     MMIO_LABEL("_MMIO_BASE", MMIO_BASE);
     MMIO_LABEL("_MMIO_END", MMIO_END);
@@ -1095,6 +1201,7 @@ static void prepare_default_syms(void) {
     MMIO_LABEL("_DMA0_LEN", DMA0_LEN);
     MMIO_LABEL("_DMA0_TRANS_SIZE", DMA0_TRANS_SIZE);
     MMIO_LABEL("_DMA0_CNTL", DMA0_CNTL);
+    MMIO_LABEL("_DMA0_STATUS", DMA0_STATUS);
     MMIO_LABEL("_DMA0_END", DMA0_END);
 
     MMIO_LABEL("_DMA1_BASE", DMA1_BASE);
@@ -1105,6 +1212,7 @@ static void prepare_default_syms(void) {
     MMIO_LABEL("_DMA1_LEN", DMA1_LEN);
     MMIO_LABEL("_DMA1_TRANS_SIZE", DMA1_TRANS_SIZE);
     MMIO_LABEL("_DMA1_CNTL", DMA1_CNTL);
+    MMIO_LABEL("_DMA1_STATUS", DMA1_STATUS);
     MMIO_LABEL("_DMA1_END", DMA1_END);
 
     MMIO_LABEL("_DMA2_BASE", DMA2_BASE);
@@ -1115,6 +1223,7 @@ static void prepare_default_syms(void) {
     MMIO_LABEL("_DMA2_LEN", DMA2_LEN);
     MMIO_LABEL("_DMA2_TRANS_SIZE", DMA2_TRANS_SIZE);
     MMIO_LABEL("_DMA2_CNTL", DMA2_CNTL);
+    MMIO_LABEL("_DMA2_STATUS", DMA2_STATUS);
     MMIO_LABEL("_DMA2_END", DMA2_END);
 
     MMIO_LABEL("_DMA3_BASE", DMA3_BASE);
@@ -1125,6 +1234,7 @@ static void prepare_default_syms(void) {
     MMIO_LABEL("_DMA3_LEN", DMA3_LEN);
     MMIO_LABEL("_DMA3_TRANS_SIZE", DMA3_TRANS_SIZE);
     MMIO_LABEL("_DMA3_CNTL", DMA3_CNTL);
+    MMIO_LABEL("_DMA3_STATUS", DMA3_STATUS);
     MMIO_LABEL("_DMA3_END", DMA3_END);
 
     MMIO_LABEL("_POWER0_BASE", POWER0_BASE);
@@ -1141,84 +1251,88 @@ static void prepare_default_syms(void) {
 
     MMIO_LABEL("_RIC0_BASE", RIC0_BASE);
     MMIO_LABEL("_RIC0_DEVADDR", RIC0_DEVADDR);
+    MMIO_LABEL("_RIC0_IPI", RIC0_IPI);
     MMIO_LABEL("_RIC0_END", RIC0_END);
 
 #undef MMIO_LABEL
 }
 
-export void assemble(const char *txt, size_t s, bool allow_externs) {
-    g_allow_externs = allow_externs;
-    g_in_fixup = false;
-
-    callsan_init();
-    emulator_init();
-
-    g_text = malloc(sizeof(*g_text));
-    RARSJS_CHECK_OOM(g_text);
-    g_data = malloc(sizeof(*g_data));
-    RARSJS_CHECK_OOM(g_data);
-    g_kernel_data = malloc(sizeof(*g_kernel_data));
-    RARSJS_CHECK_OOM(g_kernel_data);
-    g_kernel_text = malloc(sizeof(*g_kernel_text));
-    RARSJS_CHECK_OOM(g_kernel_text);
-
-    *g_text = (Section){.name = ".text",
-                        .base = TEXT_BASE,
-                        .limit = TEXT_END,
-                        .contents = RARSJS_ARRAY_NEW(u8),
-                        .emit_idx = 0,
-                        .align = 4,
-                        .relocations = RARSJS_ARRAY_NEW(Relocation),
-                        .read = true,
-                        .write = false,
-                        .execute = true,
-                        .super = false,
-                        .physical = true};
-
-    *g_data = (Section){.name = ".data",
-                        .base = DATA_BASE,
-                        .limit = DATA_END,
-                        .contents = RARSJS_ARRAY_NEW(u8),
-                        .emit_idx = 0,
-                        .align = 1,
-                        .relocations = RARSJS_ARRAY_NEW(Relocation),
-                        .read = true,
-                        .write = true,
-                        .execute = false,
-                        .super = false,
-                        .physical = true};
-
-    *g_kernel_data = (Section){.name = ".kernel_data",
-                               .base = KERNEL_DATA_BASE,
-                               .limit = KERNEL_DATA_END,
-                               .contents = RARSJS_ARRAY_NEW(u8),
-                               .emit_idx = 0,
-                               .align = 1,
-                               .relocations = RARSJS_ARRAY_NEW(Relocation),
-                               .read = true,
-                               .write = true,
-                               .execute = false,
-                               .super = true,
-                               .physical = false};
-
-    *g_kernel_text = (Section){.name = ".kernel_text",
-                               .base = KERNEL_TEXT_BASE,
-                               .limit = KERNEL_TEXT_END,
-                               .contents = RARSJS_ARRAY_NEW(u8),
-                               .emit_idx = 0,
-                               .align = 1,
-                               .relocations = RARSJS_ARRAY_NEW(Relocation),
-                               .read = true,
-                               .write = false,
-                               .execute = true,
-                               .super = true,
-                               .physical = false};
-
-    prepare_runtime_sections();
-    prepare_default_syms();
-    g_section = g_text;
+export void assemble(Program *prog, const char *txt, size_t s,
+                     bool allow_externs) {
+    Assembler *as = &prog->as;
+    as->allow_externs = allow_externs;
+    as->in_fixup = false;
+
+    callsan_init(&prog->machine);
+    emulator_init(prog);
+
+    as->text = malloc(sizeof(*as->text));
+    RARSJS_CHECK_OOM(as->text);
+    as->data = malloc(sizeof(*as->data));
+    RARSJS_CHECK_OOM(as->data);
+    as->kernel_data = malloc(sizeof(*as->kernel_data));
+    RARSJS_CHECK_OOM(as->kernel_data);
+    as->kernel_text = malloc(sizeof(*as->kernel_text));
+    RARSJS_CHECK_OOM(as->kernel_text);
+
+    *as->text = (Section){.name = ".text",
+                          .base = TEXT_BASE,
+                          .limit = TEXT_END,
+                          .contents = RARSJS_ARRAY_NEW(u8),
+                          .emit_idx = 0,
+                          .align = 4,
+                          .relocations = RARSJS_ARRAY_NEW(Relocation),
+                          .read = true,
+                          .write = false,
+                          .execute = true,
+                          .super = false,
+                          .physical = true};
+
+    *as->data = (Section){.name = ".data",
+                          .base = DATA_BASE,
+                          .limit = DATA_END,
+                          .contents = RARSJS_ARRAY_NEW(u8),
+                          .emit_idx = 0,
+                          .align = 1,
+                          .relocations = RARSJS_ARRAY_NEW(Relocation),
+                          .read = true,
+                          .write = true,
+                          .execute = false,
+                          .super = false,
+                          .physical = true};
+
+    *as->kernel_data = (Section){.name = ".kernel_data",
+                                 .base = KERNEL_DATA_BASE,
+                                 .limit = KERNEL_DATA_END,
+                                 .contents = RARSJS_ARRAY_NEW(u8),
+                                 .emit_idx = 0,
+                                 .align = 1,
+                                 .relocations = RARSJS_ARRAY_NEW(Relocation),
+                                 .read = true,
+                                 .write = true,
+                                 .execute = false,
+                                 .super = true,
+                                 .physical = false};
+
+    *as->kernel_text = (Section){.name = ".kernel_text",
+                                 .base = KERNEL_TEXT_BASE,
+                                 .limit = KERNEL_TEXT_END,
+                                 .contents = RARSJS_ARRAY_NEW(u8),
+                                 .emit_idx = 0,
+                                 .align = 1,
+                                 .relocations = RARSJS_ARRAY_NEW(Relocation),
+                                 .read = true,
+                                 .write = false,
+                                 .execute = true,
+                                 .super = true,
+                                 .physical = false};
+
+    prepare_runtime_sections(prog);
+    prepare_default_syms(as);
+    as->section = as->text;
 
     Parser parser = {0};
+    parser.prog = prog;
     parser.input = txt;
     parser.size = s;
     parser.pos = 0;
@@ -1247,29 +1361,30 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
                 parse_ident(p, &secname, &secname_len);
                 SectionPtr sec = NULL;
                 // scan already-existing section names
-                for (size_t i = 0; !sec && i < g_sections.len; i++)
-                    if (str_eq(secname, secname_len, g_sections.buf[i]->name))
-                        sec = g_sections.buf[i];
+                for (size_t i = 0; !sec && i < as->sections.len; i++)
+                    if (str_eq(secname, secname_len,
+                               as->sections.buf[i]->name))
+                        sec = as->sections.buf[i];
                 if (!sec) {
                     err = "Section not found";
                     break;
                 }
-                g_section = sec;
+                as->section = sec;
                 continue;
             }
 
             if (str_eq_case(directive, directive_len, "data")) {
-                g_section = g_data;
+                as->section = as->data;
                 continue;
             } else if (str_eq_case(directive, directive_len, "text")) {
-                g_section = g_text;
+                as->section = as->text;
                 continue;
             } else if (str_eq_case(directive, directive_len, "globl")) {
                 skip_whitespace(p);
                 const char *ident;
                 size_t ident_len;
                 parse_ident(p, &ident, &ident_len);
-                *RARSJS_ARRAY_PUSH(&g_globals) =
+                *RARSJS_ARRAY_PUSH(&as->globals) =
                     (Global){.str = ident, .len = ident_len};
                 continue;
             } else if (str_eq_case(directive, directive_len, "byte")) {
@@ -1287,7 +1402,7 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
                             err = "Out of bounds byte";
                             break;
                         }
-                        asm_emit_byte(value, p->startline);
+                        asm_emit_byte(p, value);
                     } else break;
                     first = false;
                 }
@@ -1307,8 +1422,8 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
                             err = "Out of bounds half";
                             break;
                         }
-                        asm_emit_byte(value, p->startline);
-                        asm_emit_byte(value >> 8, p->startline);
+                        asm_emit_byte(p, value);
+                        asm_emit_byte(p, value >> 8);
                     } else break;
                     first = false;
                 }
@@ -1324,7 +1439,7 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
                             err = "Invalid word";
                             break;
                         }
-                        asm_emit(value, p->startline);
+                        asm_emit(p, value);
                     } else break;
                     first = false;
                 }
@@ -1342,7 +1457,7 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
                             break;
                         }
                         for (size_t i = 0; i < out_len; i++)
-                            asm_emit_byte(out[i], p->startline);
+                            asm_emit_byte(p, out[i]);
                         free(out);
                     } else break;
                     first = false;
@@ -1363,8 +1478,8 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
                             break;
                         }
                         for (size_t i = 0; i < out_len; i++)
-                            asm_emit_byte(out[i], p->startline);
-                        asm_emit_byte(0, p->startline);
+                            asm_emit_byte(p, out[i]);
+                        asm_emit_byte(p, 0);
                         free(out);
                     } else break;
                     first = false;
@@ -1387,19 +1502,20 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
         skip_trailing(p);
 
         if (consume_if(p, ':')) {
-            for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_labels); i++) {
-                if (str_eq_2(RARSJS_ARRAY_GET(&g_labels, i)->txt,
-                             RARSJS_ARRAY_GET(&g_labels, i)->len, ident,
+            for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+                if (str_eq_2(RARSJS_ARRAY_GET(&as->labels, i)->txt,
+                             RARSJS_ARRAY_GET(&as->labels, i)->len, ident,
                              ident_len)) {
                     err = "Multiple definitions for the same label";
                     break;
                 }
             }
-            u32 addr = g_section->emit_idx + g_section->base;
-            *RARSJS_ARRAY_PUSH(&g_labels) = (LabelData){.txt = ident,
-                                                        .len = ident_len,
-                                                        .addr = addr,
-                                                        .section = g_section};
+            u32 addr = as->section->emit_idx + as->section->base;
+            *RARSJS_ARRAY_PUSH(&as->labels) =
+                (LabelData){.txt = ident,
+                            .len = ident_len,
+                            .addr = addr,
+                            .section = as->section};
             continue;
         }
 
@@ -1433,11 +1549,11 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
     }
 
     if (!err) {
-        g_in_fixup = true;
-        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_deferred_insn); i++) {
-            struct DeferredInsn *insn = RARSJS_ARRAY_GET(&g_deferred_insn, i);
-            g_section = insn->section;
-            g_section->emit_idx = insn->emit_idx;
+        as->in_fixup = true;
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->deferred_insn); i++) {
+            DeferredInsn *insn = RARSJS_ARRAY_GET(&as->deferred_insn, i);
+            as->section = insn->section;
+            as->section->emit_idx = insn->emit_idx;
             p = &insn->p;
             err = insn->cb(&insn->p, insn->opcode, insn->opcode_len);
             if (err) break;
@@ -1445,38 +1561,87 @@ export void assemble(const char *txt, size_t s, bool allow_externs) {
     }
 
     if (err) {
-        g_error = err;
-        g_error_line = p->startline;
+        as->error = err;
+        as->error_line = p->startline;
         return;
     }
 
-    err = resolve_entry(&g_pc);
+    label_index_build(prog);
+    err = resolve_entry(prog, &prog->machine.pc);
     if (err) {
-        g_error = err;
-        g_error_line = 1;
+        as->error = err;
+        as->error_line = 1;
     }
 }
 
-bool pc_to_label_r(u32 pc, LabelData **ret, u32 *off) {
-    LabelData *closest = NULL;
+static int label_index_cmp(const void *a, const void *b) {
+    u64 ka = *(const u64 *)a, kb = *(const u64 *)b;
+    return ka < kb ? -1 : ka > kb;
+}
 
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_labels); i++) {
-        if (RARSJS_ARRAY_GET(&g_labels, i)->addr <= pc &&
-            (!closest ||
-             RARSJS_ARRAY_GET(&g_labels, i)->addr > closest->addr)) {
-            closest = RARSJS_ARRAY_GET(&g_labels, i);
-        }
+// Called once the labels are all known; lookups build it otherwise
+void label_index_build(Program *prog) {
+    Assembler *as = &prog->as;
+    LabelIndex *idx = &as->label_index;
+    label_index_free(prog);
+
+    // sorted as address << 32 | index, so that the labels at the same address
+    // keep their order
+    u64 *keys = malloc(RARSJS_ARRAY_LEN(&as->labels) * sizeof(u64) + 1);
+    RARSJS_CHECK_OOM(keys);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+        LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
+        if (l->section && l->section == as->mmio) continue;
+        keys[idx->len++] = (u64)l->addr << 32 | i;
     }
+    qsort(keys, idx->len, sizeof(u64), label_index_cmp);
 
-    if (closest) {
-        *ret = closest;
-        *off = pc - closest->addr;
-        return true;
-    }
+    idx->order = malloc(idx->len * sizeof(u32) + 1);
+    RARSJS_CHECK_OOM(idx->order);
+    for (size_t i = 0; i < idx->len; i++) idx->order[i] = (u32)keys[i];
+    free(keys);
+    idx->built = true;
+}
+
+void label_index_free(Program *prog) {
+    LabelIndex *idx = &prog->as.label_index;
+    free(idx->order);
+    idx->order = NULL;
+    idx->len = 0;
+    idx->built = false;
+}
 
+// Finds the closest label at or before pc in the section of pc
+bool pc_to_label_r(Program *prog, u32 pc, LabelData **ret, u32 *off) {
+    const Assembler *as = &prog->as;
+    const LabelIndex *idx = &as->label_index;
+    if (!idx->built) label_index_build(prog);
     *ret = NULL;
     *off = 0;
-    return false;
+
+    // first entry past pc
+    size_t lo = 0, hi = idx->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        u32 addr = RARSJS_ARRAY_GET(&as->labels, idx->order[mid])->addr;
+        if (addr <= pc) lo = mid + 1;
+        else hi = mid;
+    }
+    if (!lo) return false;
+
+    // the first of the labels at that address
+    LabelData *closest = RARSJS_ARRAY_GET(&as->labels, idx->order[--lo]);
+    while (lo && RARSJS_ARRAY_GET(&as->labels, idx->order[lo - 1])->addr ==
+                     closest->addr) {
+        closest = RARSJS_ARRAY_GET(&as->labels, idx->order[--lo]);
+    }
+
+    Section *sec = emulator_get_section(prog, pc);
+    if (!sec || closest->addr < sec->base) return false;
+
+    *ret = closest;
+    *off = pc - closest->addr;
+    return true;
 }
 
 // Ugly because i"m calling it from JS"
@@ -1484,9 +1649,9 @@ bool pc_to_label_r(u32 pc, LabelData **ret, u32 *off) {
 const char *g_pc_to_label_txt;
 size_t g_pc_to_label_len;
 u32 g_pc_to_label_off;
-void pc_to_label(u32 pc) {
+void pc_to_label(Program *prog, u32 pc) {
     LabelData *l;
-    if (pc_to_label_r(pc, &l, &g_pc_to_label_off)) {
+    if (pc_to_label_r(prog, pc, &l, &g_pc_to_label_off)) {
         g_pc_to_label_txt = l->txt;
         g_pc_to_label_len = l->len;
         return;
@@ -1495,20 +1660,21 @@ void pc_to_label(u32 pc) {
     g_pc_to_label_len = 0;
 }
 
-bool resolve_symbol(const char *sym, size_t sym_len, bool global, u32 *addr,
-                    Section **sec) {
+bool resolve_symbol(Program *prog, const char *sym, size_t sym_len, bool global,
+                    u32 *addr, Section **sec) {
+    Assembler *as = &prog->as;
     LabelData *ret = NULL;
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_labels); i++) {
-        LabelData *l = RARSJS_ARRAY_GET(&g_labels, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+        LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
         if (str_eq_2(sym, sym_len, l->txt, l->len)) {
             ret = l;
             break;
         }
     }
     if (ret && global) {
-        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_globals); i++)
-            if (str_eq_2(sym, sym_len, RARSJS_ARRAY_GET(&g_globals, i)->str,
-                         RARSJS_ARRAY_GET(&g_globals, i)->len)) {
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->globals); i++)
+            if (str_eq_2(sym, sym_len, RARSJS_ARRAY_GET(&as->globals, i)->str,
+                         RARSJS_ARRAY_GET(&as->globals, i)->len)) {
                 *addr = ret->addr;
                 if (sec) {
                     *sec = ret->section;
@@ -1527,69 +1693,78 @@ bool resolve_symbol(const char *sym, size_t sym_len, bool global, u32 *addr,
     return false;
 }
 
-void prepare_aux_sections() {
-    g_stack = malloc(sizeof(Section));
-    RARSJS_CHECK_OOM(g_stack);
-    *g_stack = (Section){.name = "RARSJS_STACK",
-                         .base = STACK_TOP - STACK_LEN,
-                         .limit = STACK_TOP,
-                         .contents = RARSJS_ARRAY_PREPARE(u8, STACK_LEN),
-                         .emit_idx = 0,
-                         .align = 1,
-                         .relocations = {.buf = NULL, .len = 0, .cap = 0},
-                         .read = true,
-                         .write = true,
-                         .execute = false,
-                         .physical = false};
-
-    g_stack->contents.buf = malloc(g_stack->contents.len);
+void prepare_aux_sections(Program *prog) {
+    Assembler *as = &prog->as;
+    as->stack = malloc(sizeof(Section));
+    RARSJS_CHECK_OOM(as->stack);
+    *as->stack = (Section){.name = "RARSJS_STACK",
+                           .base = STACK_TOP - STACK_LEN,
+                           .limit = STACK_TOP,
+                           .contents = RARSJS_ARRAY_PREPARE(u8, STACK_LEN),
+                           .emit_idx = 0,
+                           .align = 1,
+                           .relocations = {.buf = NULL, .len = 0, .cap = 0},
+                           .read = true,
+                           .write = true,
+                           .execute = false,
+                           .physical = false};
+
+    as->stack->contents.buf = malloc(as->stack->contents.len);
     // fill all the memory with random uninitialized values
-    memset(g_stack->contents.buf, 0xAB, g_stack->contents.len);
-
-    g_regs[2] = STACK_TOP;  // FIXME: now i am diverging from RARS, which
-                            // does STACK_TOP - 4
-
-    g_mmio = malloc(sizeof(*g_mmio));
-    RARSJS_CHECK_OOM(g_mmio);
-    *g_mmio = (Section){.name = ".mmio",
-                        .base = MMIO_BASE,
-                        .limit = MMIO_END,
-                        .contents = RARSJS_ARRAY_NEW(u8),
-                        .emit_idx = 0,
-                        .align = 1,
-                        .relocations = RARSJS_ARRAY_NEW(Relocation),
-                        .read = true,
-                        .write = true,
-                        .execute = false,
-                        .super = true,
-                        .physical = false};
-
-    *RARSJS_ARRAY_PUSH(&g_sections) = g_stack;
-    *RARSJS_ARRAY_PUSH(&g_sections) = g_mmio;
-}
-
-void prepare_runtime_sections() {
+    memset(as->stack->contents.buf, 0xAB, as->stack->contents.len);
+
+    // FIXME: now i am diverging from RARS, which does STACK_TOP - 4
+    prog->machine.regs[2] = STACK_TOP;
+
+    as->mmio = malloc(sizeof(*as->mmio));
+    RARSJS_CHECK_OOM(as->mmio);
+    *as->mmio = (Section){.name = ".mmio",
+                          .base = MMIO_BASE,
+                          .limit = MMIO_END,
+                          .contents = RARSJS_ARRAY_NEW(u8),
+                          .emit_idx = 0,
+                          .align = 1,
+                          .relocations = RARSJS_ARRAY_NEW(Relocation),
+                          .read = true,
+                          .write = true,
+                          .execute = false,
+                          .super = true,
+                          .physical = false};
+
+    *RARSJS_ARRAY_PUSH(&as->sections) = as->stack;
+    *RARSJS_ARRAY_PUSH(&as->sections) = as->mmio;
+}
+
+void prepare_runtime_sections(Program *prog) {
+    Assembler *as = &prog->as;
     // TODO: dynamically growing stacks?
 
-    *RARSJS_ARRAY_PUSH(&g_sections) = g_text;
-    *RARSJS_ARRAY_PUSH(&g_sections) = g_data;
-    *RARSJS_ARRAY_PUSH(&g_sections) = g_kernel_text;
-    *RARSJS_ARRAY_PUSH(&g_sections) = g_kernel_data;
+    *RARSJS_ARRAY_PUSH(&as->sections) = as->text;
+    *RARSJS_ARRAY_PUSH(&as->sections) = as->data;
+    *RARSJS_ARRAY_PUSH(&as->sections) = as->kernel_text;
+    *RARSJS_ARRAY_PUSH(&as->sections) = as->kernel_data;
 }
 
-void free_runtime() {
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+void free_runtime(Program *prog) {
+    Assembler *as = &prog->as;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         RARSJS_ARRAY_FREE(&s->relocations);
         RARSJS_ARRAY_FREE(&s->contents);
+        free(s->snapshot.baseline);
+        dirty_free(s);
         free(s);
     }
 
-    RARSJS_ARRAY_FREE(&g_sections);
-    RARSJS_ARRAY_FREE(&g_text_by_linenum);
-    RARSJS_ARRAY_FREE(&g_labels);
-    RARSJS_ARRAY_FREE(&g_deferred_insn);
-    RARSJS_ARRAY_FREE(&g_globals);
-    RARSJS_ARRAY_FREE(&g_externs);
-    RARSJS_ARRAY_FREE(&g_shadow_stack);
+    RARSJS_ARRAY_FREE(&as->sections);
+    // an ELF file loaded next doesn't set them all
+    as->text = as->data = as->stack = NULL;
+    as->kernel_text = as->kernel_data = as->mmio = NULL;
+    RARSJS_ARRAY_FREE(&as->text_by_linenum);
+    RARSJS_ARRAY_FREE(&as->labels);
+    label_index_free(prog);
+    RARSJS_ARRAY_FREE(&as->deferred_insn);
+    RARSJS_ARRAY_FREE(&as->globals);
+    RARSJS_ARRAY_FREE(&as->externs);
+    RARSJS_ARRAY_FREE(&prog->machine.shadow_stack);
 }
@@ -1,27 +1,15 @@
 #include "rarsjs/dev.h"
 
 #include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+#include "rarsjs/smp.h"
 
 #define MMIO_OP_READ 0
 #define MMIO_OP_WRITE 1
 
-typedef bool (*DeviceHandler)(u32 devaddr, u8 *buf, u32 op_size, u32 off,
-                              int op);
-
-typedef struct {
-    DeviceHandler handler;
-    u8 buffer[MMIO_DEVICE_RSV];
-} Device;
-
-typedef struct {
-    u32 dst_addr;
-    u32 src_addr;
-    u32 dst_inc;
-    u32 src_inc;
-    u32 len;
-    u32 trans_size;
-    u32 cntl;
-} PACKED DMAControllerRegisters;
+// m is the machine doing the access, or the one ticking the devices
+typedef bool (*DeviceHandler)(Machine *m, u32 devaddr, u8 *buf, u32 op_size,
+                              u32 off, int op);
 
 typedef struct {
     char in;
@@ -33,43 +21,274 @@ typedef struct {
 
 typedef struct {
     u32 devaddr;
+    u32 ipi;
 } PACKED RICRegisters;
 
-static Device g_mmio_devices[];
+static const DeviceHandler g_mmio_handlers[MMIO_NUM_DEVICES];
+
+#ifndef __wasm__
+// Hands guest output to sink instead of writing it to stdout, NULL to undo
+void console_output_set_sink(Program *p, ConsoleSink sink) {
+    p->console.out_sink = sink;
+}
+#endif
+
+void console_flush(Program *p) {
+    Console *con = &p->console;
+    if (0 == con->out_len) {
+        return;
+    }
+
+#ifdef __wasm__
+    flush_output(con->out_buf, con->out_len);
+#else
+    if (con->out_sink) {
+        con->out_sink(con->out_buf, con->out_len);
+    } else {
+        fwrite(con->out_buf, 1, con->out_len, stdout);
+    }
+#endif
+    con->out_len = 0;
+}
+
+// Used while replaying instructions whose output the host already has
+void console_set_muted(Program *p, bool muted) { p->console.out_muted = muted; }
+
+void console_putchar(Program *p, u8 c) {
+    Console *con = &p->console;
+    con->out_total++;
+    if (con->out_muted) {
+        return;
+    }
+
+    con->out_buf[con->out_len++] = c;
+    if ('\n' == c || CONSOLE_OUT_BUF_LEN == con->out_len) {
+        console_flush(p);
+    }
+}
 
-static void ric_send_interrupt(u32 devaddr) {
-    RICRegisters *ric = (void *)g_mmio_devices[6].buffer;
+// The RIC is wired to hart 0
+static void ric_send_interrupt(Program *p, u32 devaddr) {
+    RICRegisters *ric = (void *)p->dev.buffers[6];
     ric->devaddr = devaddr;
-    emulator_interrupt_set_pending(CAUSE_SUPERVISOR_EXTERNAL & ~CAUSE_INTERRUPT);
+    emulator_interrupt_set_pending(
+        &p->machine, CAUSE_SUPERVISOR_EXTERNAL & ~CAUSE_INTERRUPT);
 }
 
-static bool dma_handler(u32 devaddr, u8 *buf, u32 op_size, u32 off, int op) {
-    if (MMIO_OP_READ == op) {
+#define CONSOLE_IN_MIN_CAP 4096
+
+#ifndef __wasm__
+#define CONSOLE_IN_CHUNK 4096
+
+void console_input_set_file(Program *p, FILE *file) {
+    p->console.in_file = file;
+}
+#endif
+
+static ConsoleRegisters *console_regs(Program *p) {
+    return (void *)p->dev.buffers[5];
+}
+
+// Mirrors the queue length into IN_SIZE and raises the batch interrupt once
+// at least batch_size bytes are available
+static void console_input_sync(Program *p) {
+    Console *con = &p->console;
+    ConsoleRegisters *console = console_regs(p);
+    size_t avail = con->in.len - con->in_pos;
+    console->in_size = avail > UINT32_MAX ? UINT32_MAX : avail;
+
+    u32 batch = console->batch_size ? console->batch_size : 1;
+    if (avail < batch) {
+        con->in_signalled = false;
+        return;
+    }
+
+    if ((CONSOLE_CNTL_INTERRUPT & console->cntl) && !con->in_signalled) {
+        con->in_signalled = true;
+        ric_send_interrupt(p, CONSOLE0_BASE);
+    }
+}
+
+// Appends len uninitialized bytes to the input queue and returns them for the
+// host to fill. The guest does not run until the host returns, so the bytes
+// are already counted in IN_SIZE
+// Input that was already read is kept, so that restoring a snapshot can
+// rewind the read position
+export u8 *console_input_reserve(Program *p, u32 len) {
+    RARSJS_ARRAY(u8) *in = &p->console.in;
+    if (in->len + len > in->cap) {
+        size_t cap = in->cap ? in->cap : CONSOLE_IN_MIN_CAP;
+        while (cap < in->len + len) cap *= 2;
+
+        u8 *buf = malloc(cap);
+        RARSJS_CHECK_OOM(buf);
+        if (in->buf) {
+            memcpy(buf, in->buf, in->len);
+            free(in->buf);
+        }
+        in->buf = buf;
+        in->cap = cap;
+    }
+
+    u8 *dst = in->buf + in->len;
+    in->len += len;
+    console_input_sync(p);
+    return dst;
+}
+
+void console_input_push(Program *p, const u8 *buf, u32 len) {
+    memcpy(console_input_reserve(p, len), buf, len);
+}
+
+// Reads the next line (or chunk) of host input into the queue
+// A line at a time, so that interactive use from a terminal still works
+static void console_input_refill(Program *p) {
+#ifndef __wasm__
+    FILE *file = p->console.in_file;
+    if (!file) {
+        return;
+    }
+
+    // the guest is probably waiting on a prompt it just printed
+    console_flush(p);
+
+    u8 line[CONSOLE_IN_CHUNK];
+    u32 len = 0;
+    int c;
+    while (len < CONSOLE_IN_CHUNK && EOF != (c = getc(file))) {
+        line[len++] = c;
+        if ('\n' == c) break;
+    }
+
+    if (len) {
+        memcpy(console_input_reserve(p, len), line, len);
+    }
+#endif
+}
+
+// Returns false only at the end of the input
+static bool console_input_available(Program *p) {
+    Console *con = &p->console;
+    if (con->in_pos == con->in.len) {
+        console_input_refill(p);
+    }
+
+    return con->in_pos < con->in.len;
+}
+
+int console_peekchar(Program *p) {
+    if (!console_input_available(p)) {
+        return -1;
+    }
+
+    return p->console.in.buf[p->console.in_pos];
+}
+
+int console_getchar(Program *p) {
+    if (!console_input_available(p)) {
+        return -1;
+    }
+
+    u8 c = p->console.in.buf[p->console.in_pos++];
+    console_input_sync(p);
+    return c;
+}
+
+// Called between instruction batches: a guest that waits for the batch
+// interrupt never reads the console, so the host has to fetch input for it
+void console_input_poll(Program *p) {
+    ConsoleRegisters *console = console_regs(p);
+    u32 batch = console->batch_size ? console->batch_size : 1;
+    if ((CONSOLE_CNTL_INTERRUPT & console->cntl) && console->in_size < batch) {
+        console_input_refill(p);
+    }
+}
+
+// Guest addresses touched by a strided transfer of count elements, as an
+// inclusive-exclusive range. Increments are two's complement, so a negative
+// increment walks backwards from the start address
+static bool dma_span(u32 start, u32 inc, u32 count, u32 trans_size, u32 *lo,
+                     u32 *span) {
+    i64 first = start;
+    i64 last = first + (i64)(i32)inc * (i64)(count - 1);
+    if (last < first) {
+        i64 tmp = first;
+        first = last;
+        last = tmp;
+    }
+    last += trans_size;
+    if (first < 0 || last > (i64)UINT32_MAX + 1) return false;
+    *lo = first;
+    *span = last - first;
+    return true;
+}
+
+// Fast path: resolve both ranges once and copy host memory directly
+// Returns false if either range is not plain memory inside a single section
+// (e.g. it crosses sections or targets MMIO), in which case the caller falls
+// back to element-wise LOAD/STORE
+static bool dma_transfer_bulk(Machine *m, DMAControllerRegisters *dma,
+                              u32 count) {
+    u32 src_lo, src_span, dst_lo, dst_span;
+    if (!dma_span(dma->src_addr, dma->src_inc, count, dma->trans_size, &src_lo,
+                  &src_span) ||
+        !dma_span(dma->dst_addr, dma->dst_inc, count, dma->trans_size, &dst_lo,
+                  &dst_span)) {
+        return false;
+    }
+
+    u8 *src = emulator_resolve_range(m, src_lo, src_span, false);
+    u8 *dst = emulator_resolve_range(m, dst_lo, dst_span, true);
+    if (!src || !dst) {
+        return false;
+    }
+
+    if (dma->src_inc == dma->trans_size && dma->dst_inc == dma->trans_size) {
+        // the ranges can overlap (e.g. shifting a buffer in place)
+        memmove(dst, src, (size_t)count * dma->trans_size);
         return true;
     }
 
-    DMAControllerRegisters *dma = (void *)buf;
+    u8 *src_el = src + (dma->src_addr - src_lo);
+    u8 *dst_el = dst + (dma->dst_addr - dst_lo);
+    for (u32 i = 0; i < count; i++) {
+        u32 data;
+        rarsjs_buf_read(src_el, dma->trans_size, &data);
+        rarsjs_buf_write(dst_el, dma->trans_size, data);
+        src_el += (i32)dma->src_inc;
+        dst_el += (i32)dma->dst_inc;
+    }
 
-    if (!(DMA_CNTL_DO & dma->cntl)) {
+    return true;
+}
+
+static bool dma_transfer(Machine *m, DMAControllerRegisters *dma) {
+    if (dma->trans_size != 1 && dma->trans_size != 2 && dma->trans_size != 4) {
+        return false;
+    }
+
+    if (0 == dma->len) {
         return true;
     }
 
-    dma->cntl &= ~DMA_CNTL_DO;
+    u32 count = (dma->len + dma->trans_size - 1) / dma->trans_size;
+    if (dma_transfer_bulk(m, dma, count)) {
+        return true;
+    }
 
-    for (u32 dst_off = 0, src_off = 0, i = 0; i < dma->len;
-         dst_off += dma->dst_inc, src_off += dma->src_inc,
-             i += dma->trans_size) {
+    for (u32 dst_off = 0, src_off = 0, i = 0; i < count;
+         dst_off += dma->dst_inc, src_off += dma->src_inc, i++) {
         u32 dst_addr = dma->dst_addr + dst_off;
         u32 src_addr = dma->src_addr + src_off;
 
         bool load_err;
-        u32 data = LOAD(src_addr, dma->trans_size, &load_err);
+        u32 data = LOAD(m, src_addr, dma->trans_size, &load_err);
         if (load_err) {
             return false;
         }
 
         bool store_err;
-        STORE(dst_addr, data, dma->trans_size, &store_err);
+        STORE(m, dst_addr, data, dma->trans_size, &store_err);
         if (store_err) {
             return false;
         }
@@ -78,7 +297,84 @@ static bool dma_handler(u32 devaddr, u8 *buf, u32 op_size, u32 off, int op) {
     return true;
 }
 
-static bool power_handler(u32 devaddr, u8 *buf, u32 op_size, u32 off, int op) {
+static void dma_complete(Program *p, u32 devaddr, DMAControllerRegisters *dma,
+                         DMAControllerRegisters *live, bool ok) {
+    live->status &= ~DMA_STATUS_BUSY;
+    live->status |= ok ? DMA_STATUS_DONE : DMA_STATUS_ERROR;
+
+    if (DMA_CNTL_INTERRUPT & dma->cntl) {
+        ric_send_interrupt(p, devaddr);
+    }
+}
+
+static bool dma_handler(Machine *m, u32 devaddr, u8 *buf, u32 op_size,
+                        u32 off, int op) {
+    if (MMIO_OP_READ == op) {
+        return true;
+    }
+
+    DMAControllerRegisters *dma = (void *)buf;
+
+    if (!(DMA_CNTL_DO & dma->cntl)) {
+        return true;
+    }
+
+    dma->cntl &= ~DMA_CNTL_DO;
+
+    Devices *dev = &m->prog->dev;
+    DMATransfer *t = &dev->dma_transfers[(devaddr - DMA0_BASE) / MMIO_DEVICE_RSV];
+    if (t->active) {
+        // only one transfer per controller can be in flight
+        dma->status |= DMA_STATUS_ERROR;
+        return true;
+    }
+
+    dma->status &= ~(DMA_STATUS_DONE | DMA_STATUS_ERROR);
+
+    if (DMA_CNTL_ASYNC & dma->cntl) {
+        t->regs = *dma;
+        t->devaddr = devaddr;
+        t->privilege = m->privilege;
+        t->ticks_left = DMA_SETUP_LATENCY + dma->len / DMA_BYTES_PER_TICK;
+        t->active = true;
+        dma->status |= DMA_STATUS_BUSY;
+        dev->pending++;
+        return true;
+    }
+
+    bool ok = dma_transfer(m, dma);
+    dma_complete(m->prog, devaddr, dma, dma, ok);
+    return ok;
+}
+
+// Advances in-flight asynchronous transfers by one instruction
+// Completed transfers copy their data, update the status register and,
+// if requested, raise an interrupt through the RIC
+void dev_tick(Machine *m) {
+    Devices *dev = &m->prog->dev;
+    for (u32 i = 0; i < DMA_NUM; i++) {
+        DMATransfer *t = &dev->dma_transfers[i];
+        if (!t->active || --t->ticks_left) {
+            continue;
+        }
+
+        t->active = false;
+        dev->pending--;
+
+        // the copy is checked against the privilege the transfer started
+        // with, not the one the hart has now
+        int privilege = m->privilege;
+        m->privilege = t->privilege;
+        bool ok = dma_transfer(m, &t->regs);
+        m->privilege = privilege;
+
+        DMAControllerRegisters *live = (void *)dev->buffers[i];
+        dma_complete(m->prog, t->devaddr, &t->regs, live, ok);
+    }
+}
+
+static bool power_handler(Machine *m, u32 devaddr, u8 *buf, u32 op_size,
+                          u32 off, int op) {
     if (MMIO_OP_READ == op) {
         return true;
     }
@@ -86,88 +382,137 @@ static bool power_handler(u32 devaddr, u8 *buf, u32 op_size, u32 off, int op) {
     u8 cntl = *buf;
 
     if (POWER_CNTL_SHUTDOWN & cntl) {
-        emu_exit();
+        emulator_exit(m);
     }
 
     // TODO: handle restart
     return true;
 }
 
-static bool console_handler(u32 devaddr, u8 *buf, u32 op_size, u32 off,
-                            int op) {
+static bool console_handler(Machine *m, u32 devaddr, u8 *buf, u32 op_size,
+                            u32 off, int op) {
     ConsoleRegisters *console = (void *)buf;
 
     if (op == MMIO_OP_READ) {
         if (off == offsetof(ConsoleRegisters, in)) {
-            // how?
+            int c = console_getchar(m->prog);
+            if (c < 0 && (CONSOLE_CNTL_IN_BLOCK & console->cntl)) {
+                // a blocking read past the end of the input would never return
+                return false;
+            }
+            console->in = c < 0 ? 0 : c;
+        } else if (off == offsetof(ConsoleRegisters, in_size)) {
+            console_input_available(m->prog);
         }
     } else if (op == MMIO_OP_WRITE) {
         if (off == offsetof(ConsoleRegisters, out)) {
-            putchar(console->out);
-        }
-    }
-
-    // TODO: this should not be here, this shouild be run when reading input
-    // from the user
-    if (console->cntl & CONSOLE_CNTL_INTERRUPT) {
-        console->in_size++;
-        if (console->in_size >= console->batch_size) {
-            console->in_size = 0;
-            ric_send_interrupt(devaddr);
+            console_putchar(m->prog, console->out);
         }
     }
 
+    // also catches enabling the interrupt (or shrinking the batch) while
+    // enough input is already queued
+    console_input_sync(m->prog);
     return true;
 }
 
-static bool ric_handler(u32 devaddr, u8 *buf, u32 op_size, u32 off, int op) {
-    return op == MMIO_OP_READ;
+// Writing a hart id to ipi raises a software interrupt on that hart, which
+// acknowledges it by clearing SSIP in sip
+static bool ric_handler(Machine *m, u32 devaddr, u8 *buf, u32 op_size,
+                        u32 off, int op) {
+    if (op == MMIO_OP_READ) return true;
+    if (off != offsetof(RICRegisters, ipi)) return false;
+
+    Machine *target = smp_hart(&m->prog->smp, ((RICRegisters *)buf)->ipi);
+    if (!target) return false;
+    emulator_interrupt_set_pending(
+        target, CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
+    return true;
 }
 
-static Device g_mmio_devices[] = {
-    [0] = {dma_handler, {0}},      // DMA 0
-    [1] = {dma_handler, {0}},      // DMA 1
-    [2] = {dma_handler, {0}},      // DMA 2
-    [3] = {dma_handler, {0}},      // DMA 3,
-    [4] = {power_handler, {0}},    // POWER 0
-    [5] = {console_handler, {0}},  // CONSOLE 0
-    [6] = {ric_handler, {0}},      // RIC 0
+static const DeviceHandler g_mmio_handlers[MMIO_NUM_DEVICES] = {
+    [0] = dma_handler,      // DMA 0
+    [1] = dma_handler,      // DMA 1
+    [2] = dma_handler,      // DMA 2
+    [3] = dma_handler,      // DMA 3,
+    [4] = power_handler,    // POWER 0
+    [5] = console_handler,  // CONSOLE 0
+    [6] = ric_handler,      // RIC 0
 };
 
-bool mmio_read(u32 mmio_addr, int size, u32 *ret) {
+bool mmio_read(Machine *m, u32 mmio_addr, int size, u32 *ret) {
     u32 dev_num = mmio_addr / MMIO_DEVICE_RSV;
     u32 dev_addr = MMIO_BASE + dev_num * MMIO_DEVICE_RSV;
 
-    if (dev_num > sizeof(g_mmio_devices) / sizeof(Device)) {
+    if (dev_num >= MMIO_NUM_DEVICES) {
         return false;
     }
 
-    Device *dev = &g_mmio_devices[dev_num];
-    u8 *buf = dev->buffer;
+    u8 *buf = m->prog->dev.buffers[dev_num];
     u32 off = mmio_addr - (dev_num * MMIO_DEVICE_RSV);
-    bool ok = dev->handler(dev_addr, buf, size, off, MMIO_OP_READ);
+    bool ok = g_mmio_handlers[dev_num](m, dev_addr, buf, size, off,
+                                       MMIO_OP_READ);
 
     if (!ok) {
         *ret = 0;
         return false;
     }
 
-    return rarsjs_buf_read(buf, size, ret);
+    return rarsjs_buf_read(buf + off, size, ret);
 }
 
-bool mmio_write(u32 mmio_addr, int size, u32 value) {
+bool mmio_write(Machine *m, u32 mmio_addr, int size, u32 value) {
     u32 dev_num = mmio_addr / MMIO_DEVICE_RSV;
     u32 dev_addr = MMIO_BASE + dev_num * MMIO_DEVICE_RSV;
 
-    if (dev_num > sizeof(g_mmio_devices) / sizeof(Device)) {
+    if (dev_num >= MMIO_NUM_DEVICES) {
         return false;
     }
-    Device *dev = &g_mmio_devices[dev_num];
-    u8 *buf = dev->buffer;
+    u8 *buf = m->prog->dev.buffers[dev_num];
     u32 off = mmio_addr - (dev_num * MMIO_DEVICE_RSV);
     if (!rarsjs_buf_write(buf + off, size, value)) {
         return false;
     }
 
-    return dev->handler(dev_addr, buf, size, off, MMIO_OP_WRITE);
+    return g_mmio_handlers[dev_num](m, dev_addr, buf, size, off,
+                                    MMIO_OP_WRITE);
+}
+
+void dev_reset(Program *p) {
+    memset(&p->dev, 0, sizeof(p->dev));
+
+    Console *con = &p->console;
+    con->out_len = 0;
+    con->out_total = 0;
+    con->out_muted = false;
+
+    RARSJS_ARRAY_FREE(&con->in);
+    con->in_pos = 0;
+    con->in_signalled = false;
+}
+
+// Device state as saved by dev_save, for snapshots
+typedef struct {
+    Devices dev;
+    u64 console_out_total;
+    size_t console_in_pos;
+    bool console_in_signalled;
+} DevState;
+
+size_t dev_state_size(void) { return sizeof(DevState); }
+
+void dev_save(Program *p, void *out) {
+    DevState *state = out;
+    state->dev = p->dev;
+    state->console_out_total = p->console.out_total;
+    state->console_in_pos = p->console.in_pos;
+    state->console_in_signalled = p->console.in_signalled;
+}
+
+void dev_load(Program *p, const void *in) {
+    const DevState *state = in;
+    p->dev = state->dev;
+    p->console.out_total = state->console_out_total;
+    p->console.in_pos = state->console_in_pos;
+    p->console.in_signalled = state->console_in_signalled;
 }
@@ -0,0 +1,129 @@
+#include "rarsjs/dirty.h"
+
+#include "rarsjs/program.h"
+#include "rarsjs/smp.h"
+
+// Bits are only ever set by harts, possibly on several threads at once, and
+// cleared by their consumer while no hart runs
+
+static u32 dirty_words(const Section *sec) {
+    u32 pages = (sec->contents.len + DIRTY_PAGE_SIZE - 1) >> DIRTY_PAGE_SHIFT;
+    return (pages + 63) / 64;
+}
+
+// The bits are allocated by the first write to the section, after which its
+// contents don't change size
+static u64 *dirty_alloc(Dirty *d, Section *sec, DirtyConsumer c) {
+    smp_lock(d->smp);
+    u64 *bits = sec->dirty_pages[c];
+    if (!bits) {
+        bits = calloc(dirty_words(sec), sizeof(u64));
+        RARSJS_CHECK_OOM(bits);
+        __atomic_store_n(&sec->dirty_pages[c], bits, __ATOMIC_RELEASE);
+    }
+    smp_unlock(d->smp);
+    return bits;
+}
+
+void dirty_mark_range(Dirty *d, Section *sec, u32 off, u32 len) {
+    if (!len || !sec->contents.len) return;
+
+    u32 last = (off + len - 1) >> DIRTY_PAGE_SHIFT;
+    for (int c = 0; c < DIRTY_CONSUMERS; c++) {
+        u64 *bits = __atomic_load_n(&sec->dirty_pages[c], __ATOMIC_ACQUIRE);
+        if (!bits) {
+            if (!(d->lazy >> c & 1)) continue;
+            bits = dirty_alloc(d, sec, c);
+        }
+
+        for (u32 page = off >> DIRTY_PAGE_SHIFT; page <= last; page++) {
+            u64 bit = 1ull << (page % 64);
+            if (__atomic_fetch_or(&bits[page / 64], bit, __ATOMIC_RELAXED) &
+                bit) {
+                continue;
+            }
+            __atomic_fetch_add(&d->generation, 1, __ATOMIC_RELAXED);
+            if (c == DIRTY_SNAPSHOT) {
+                smp_lock(d->smp);
+                *RARSJS_ARRAY_PUSH(&d->snapshot_pages) = (DirtyPage){sec, page};
+                smp_unlock(d->smp);
+            }
+        }
+    }
+}
+
+// Starts tracking sec for c, with all of its pages clean
+void dirty_watch(Dirty *d, Section *sec, DirtyConsumer c) {
+    u64 *bits = dirty_alloc(d, sec, c);
+    memset(bits, 0, dirty_words(sec) * sizeof(u64));
+}
+
+bool dirty_is_set(const Section *sec, DirtyConsumer c, u32 page) {
+    if (!sec->dirty_pages[c] || page >= dirty_words(sec) * 64) return false;
+    return sec->dirty_pages[c][page / 64] >> (page % 64) & 1;
+}
+
+static void dirty_unset(Section *sec, DirtyConsumer c, u32 page) {
+    sec->dirty_pages[c][page / 64] &= ~(1ull << (page % 64));
+}
+
+void dirty_clear(Program *p, DirtyConsumer c) {
+    if (c == DIRTY_SNAPSHOT) {
+        RARSJS_ARRAY(DirtyPage) *pages = &p->dirty.snapshot_pages;
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(pages); i++) {
+            DirtyPage *page = RARSJS_ARRAY_GET(pages, i);
+            dirty_unset(page->sec, c, page->page);
+        }
+        pages->len = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
+        if (sec->dirty_pages[c]) {
+            memset(sec->dirty_pages[c], 0, dirty_words(sec) * sizeof(u64));
+        }
+    }
+}
+
+// Whether any page of [addr, addr + len) was written since the last call,
+// clearing the memory view's bits for those pages only. The view's bits are
+// kept from the first call on, which therefore answers true
+export bool dirty_window_take(Program *p, u32 addr, u32 len) {
+    Dirty *d = &p->dirty;
+    if (!(d->lazy >> DIRTY_VIEW & 1)) {
+        d->lazy |= 1u << DIRTY_VIEW;
+        return true;
+    }
+
+    bool dirty = false;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
+        if (!sec->dirty_pages[DIRTY_VIEW]) continue;
+
+        // overlap of [addr, addr + len) with the section
+        u64 start = addr > sec->base ? addr : sec->base;
+        u64 end = (u64)addr + len;
+        u64 sec_end = (u64)sec->base + sec->contents.len;
+        if (sec_end < end) end = sec_end;
+        if (start >= end) continue;
+
+        u32 last = (end - 1 - sec->base) >> DIRTY_PAGE_SHIFT;
+        for (u32 page = (start - sec->base) >> DIRTY_PAGE_SHIFT; page <= last;
+             page++) {
+            if (dirty_is_set(sec, DIRTY_VIEW, page)) {
+                dirty_unset(sec, DIRTY_VIEW, page);
+                dirty = true;
+            }
+        }
+    }
+    return dirty;
+}
+
+// For sections that are freed or change size
+void dirty_free(Section *sec) {
+    for (int c = 0; c < DIRTY_CONSUMERS; c++) {
+        free(sec->dirty_pages[c]);
+        sec->dirty_pages[c] = NULL;
+    }
+}
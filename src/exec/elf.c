@@ -8,6 +8,7 @@
 
 #include "rarsjs/core.h"
 #include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
 #include "rarsjs/util.h"
 
 // TODO: if the host machine and RISC-V have mismatched byte orders (i.e., the
@@ -18,9 +19,12 @@
 
 #define UNKNOWN_PROP "Unknown"
 
-#define STRTAB_ISTR 1   // Index of .strtab in strtab
-#define STRTAB_ISYM 9   // Index of .symtab in strtab
-#define STRTAB_ISEC 17  // Start of section names in strtab
+#define STRTAB_ISTR 1    // Index of .strtab in strtab
+#define STRTAB_ISYM 9    // Index of .symtab in strtab
+#define STRTAB_ILIN 17   // Index of .rarsjs.lines in strtab
+#define STRTAB_ISEC 31   // Start of section names in strtab
+
+#define LINES_NAME ".rarsjs.lines"
 
 static inline void copy_n(void *dst, const void *src, size_t src_sz,
                           size_t *off) {
@@ -266,17 +270,18 @@ fail:
 // This functions also assumes that the names of relocation sections follow
 // those of the relative section withing the string table. E.g., .rela.text
 // comes immediately after .text NOTE: This function changes elf.shidx in each
-// physical section in g_sections with len > 0
-static bool make_core(u8 **out, size_t *out_sz, size_t *name_off,
-                      size_t *phdrs_start, size_t *shdrs_start, size_t *phnum,
-                      size_t *shnum, size_t *reloc_idx, size_t *reloc_num,
-                      size_t file_off, size_t rsv_shdrs, size_t symtab_idx,
-                      bool use_phdrs, bool use_shdrs, char **error) {
+// physical section with len > 0
+static bool make_core(Assembler *as, u8 **out, size_t *out_sz,
+                      size_t *name_off, size_t *phdrs_start,
+                      size_t *shdrs_start, size_t *phnum, size_t *shnum,
+                      size_t *reloc_idx, size_t *reloc_num, size_t file_off,
+                      size_t rsv_shdrs, size_t symtab_idx, bool use_phdrs,
+                      bool use_shdrs, char **error) {
     size_t segments_count = 0;
     size_t segments_sz = 0;
     size_t reloc_shdrs_num = 0;
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         if (s->physical && 0 != s->contents.len) {
             segments_count++;
             segments_sz += s->contents.len;
@@ -345,8 +350,8 @@ static bool make_core(u8 **out, size_t *out_sz, size_t *name_off,
 
     // Write program headers, segments, and section headers
     // RELOCATION HEADERS EXCLUDED
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         if (!s->physical || 0 == s->contents.len) {
             continue;
         }
@@ -427,18 +432,27 @@ fail:
     return false;
 }
 
+// Labels that go in the symbol table of an executable. MMIO registers are
+// named by every program, so they are left out
+static inline bool label_exported(const Assembler *as, LabelData *l) {
+    return !l->section || l->section != as->mmio;
+}
+
 // This function makes an ELF string table
 // The string table always starts with:
-// \0.strtab\0.symtab\0
-// Thus, the indices for .startab and .symtab are 1 and 9 respectively
-// Section names start at index 17
-// Then come, in this order, externs and globals (if included)
-static bool make_strtab(char **out, size_t *out_sz, bool inc_externs,
-                        bool inc_globs, char **error) {
-    size_t base_len = strlen(".strtab") + 1 + strlen(".symtab") + 1;
+// \0.strtab\0.symtab\0.rarsjs.lines\0
+// Thus, the indices for .startab, .symtab and .rarsjs.lines are 1, 9 and 17
+// Section names start at index 31
+// Then come, in this order, externs, globals and labels (if included)
+// labels_off, if given, gets the index of the first label
+static bool make_strtab(Assembler *as, char **out, size_t *out_sz,
+                        bool inc_externs, bool inc_globs, bool inc_labels,
+                        size_t *labels_off, char **error) {
+    size_t base_len = strlen(".strtab") + 1 + strlen(".symtab") + 1 +
+                      strlen(LINES_NAME) + 1;
     size_t strtab_sz = 1 + base_len;
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         if (s->physical && 0 != s->contents.len) {
             strtab_sz += strlen(s->name) + 1;
 
@@ -448,17 +462,23 @@ static bool make_strtab(char **out, size_t *out_sz, bool inc_externs,
         }
     }
     if (inc_externs) {
-        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_externs); i++) {
-            Extern *e = RARSJS_ARRAY_GET(&g_externs, i);
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->externs); i++) {
+            Extern *e = RARSJS_ARRAY_GET(&as->externs, i);
             strtab_sz += e->len + 1;
         }
     }
     if (inc_globs) {
-        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_globals); i++) {
-            Global *g = RARSJS_ARRAY_GET(&g_globals, i);
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->globals); i++) {
+            Global *g = RARSJS_ARRAY_GET(&as->globals, i);
             strtab_sz += g->len + 1;
         }
     }
+    if (inc_labels) {
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+            LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
+            if (label_exported(as, l)) strtab_sz += l->len + 1;
+        }
+    }
 
     char *strtab = malloc(strtab_sz);
     RARSJS_CHECK_OOM(strtab);
@@ -468,8 +488,9 @@ static bool make_strtab(char **out, size_t *out_sz, bool inc_externs,
 
     copy_s(strtab, ".strtab", &strtab_off);
     copy_s(strtab, ".symtab", &strtab_off);
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+    copy_s(strtab, LINES_NAME, &strtab_off);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         if (s->physical && 0 != s->contents.len) {
             copy_s(strtab, s->name, &strtab_off);
 
@@ -482,21 +503,33 @@ static bool make_strtab(char **out, size_t *out_sz, bool inc_externs,
     }
 
     if (inc_externs) {
-        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_externs); i++) {
-            Extern *e = RARSJS_ARRAY_GET(&g_externs, i);
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->externs); i++) {
+            Extern *e = RARSJS_ARRAY_GET(&as->externs, i);
             copy_n(strtab, e->symbol, e->len, &strtab_off);
             strtab[strtab_off++] = '\0';
         }
     }
 
     if (inc_globs) {
-        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_globals); i++) {
-            Global *g = RARSJS_ARRAY_GET(&g_globals, i);
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->globals); i++) {
+            Global *g = RARSJS_ARRAY_GET(&as->globals, i);
             copy_n(strtab, g->str, g->len, &strtab_off);
             strtab[strtab_off++] = '\0';
         }
     }
 
+    if (labels_off) {
+        *labels_off = strtab_off;
+    }
+    if (inc_labels) {
+        for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+            LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
+            if (!label_exported(as, l)) continue;
+            copy_n(strtab, l->txt, l->len, &strtab_off);
+            strtab[strtab_off++] = '\0';
+        }
+    }
+
     *out = strtab;
     *out_sz = strtab_sz;
     return true;
@@ -506,11 +539,12 @@ fail:
     return false;
 }
 
-static bool make_symtab(u8 **out, size_t *out_sz, size_t *ent_num,
-                        size_t name_off, char **error) {
+static bool make_symtab(Program *prog, u8 **out, size_t *out_sz,
+                        size_t *ent_num, size_t name_off, char **error) {
+    Assembler *as = &prog->as;
     size_t symtab_sz =
         sizeof(ElfSymtabEntry) *
-        (1 + RARSJS_ARRAY_LEN(&g_externs) + RARSJS_ARRAY_LEN(&g_globals));
+        (1 + RARSJS_ARRAY_LEN(&as->externs) + RARSJS_ARRAY_LEN(&as->globals));
     ElfSymtabEntry *symtab = malloc(symtab_sz);
     RARSJS_CHECK_OOM(symtab);
 
@@ -520,8 +554,8 @@ static bool make_symtab(u8 **out, size_t *out_sz, size_t *ent_num,
 
     size_t symtab_i = 1;
 
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_externs); i++, symtab_i++) {
-        Extern *e = RARSJS_ARRAY_GET(&g_externs, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->externs); i++, symtab_i++) {
+        Extern *e = RARSJS_ARRAY_GET(&as->externs, i);
         ElfSymtabEntry *sym = &symtab[symtab_i];
         e->elf.stidx = symtab_i;
         sym->name_off = name_off;
@@ -533,8 +567,8 @@ static bool make_symtab(u8 **out, size_t *out_sz, size_t *ent_num,
         name_off += e->len + 1;
     }
 
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_globals); i++, symtab_i++) {
-        Global *g = RARSJS_ARRAY_GET(&g_globals, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->globals); i++, symtab_i++) {
+        Global *g = RARSJS_ARRAY_GET(&as->globals, i);
         ElfSymtabEntry *sym = &symtab[symtab_i];
         g->elf.stidx = symtab_i;
         sym->name_off = name_off;
@@ -544,7 +578,7 @@ static bool make_symtab(u8 **out, size_t *out_sz, size_t *ent_num,
         u32 addr = 0;
         Section *sec = NULL;
 
-        if (!resolve_symbol(g->str, g->len, true, &addr, &sec)) {
+        if (!resolve_symbol(prog, g->str, g->len, true, &addr, &sec)) {
             *error = "symbol is declared global but never defined";
             goto fail;
         }
@@ -566,12 +600,116 @@ fail:
     return false;
 }
 
-static bool make_rela(u8 **out, size_t *out_sz, size_t file_off,
-                      ElfSectionHeader *shdrs, size_t reloc_idx,
-                      ElfSymtabEntry *symtab, char **error) {
+static int global_cmp(const void *a, const void *b) {
+    const Global *ga = a, *gb = b;
+    int c = memcmp(ga->str, gb->str, ga->len < gb->len ? ga->len : gb->len);
+    if (c) return c;
+    return ga->len < gb->len ? -1 : ga->len > gb->len;
+}
+
+// Which labels are global, indexed like the labels. The globals are sorted by
+// name once, so that each label takes a binary search
+static bool *mark_globals(const Assembler *as) {
+    size_t n = RARSJS_ARRAY_LEN(&as->globals);
+    Global *sorted = malloc(n * sizeof(Global) + 1);
+    RARSJS_CHECK_OOM(sorted);
+    if (n) memcpy(sorted, as->globals.buf, n * sizeof(Global));
+    qsort(sorted, n, sizeof(Global), global_cmp);
+
+    bool *global = calloc(RARSJS_ARRAY_LEN(&as->labels) + 1, sizeof(bool));
+    RARSJS_CHECK_OOM(global);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+        LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
+        Global key = {.str = l->txt, .len = l->len};
+        global[i] = bsearch(&key, sorted, n, sizeof(Global), global_cmp);
+    }
+    free(sorted);
+    return global;
+}
+
+// Symbol table of an executable, with every label at its final address
+// Local symbols must come first, first_global gets the index of the first
+// global one. Names are expected in the strtab from name_off, in label order
+static void make_label_symtab(Assembler *as, u8 **out, size_t *out_sz,
+                              size_t *first_global, size_t name_off) {
+    bool *is_global = mark_globals(as);
+    size_t locals = 0, count = 0;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+        LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
+        if (!label_exported(as, l)) continue;
+        count++;
+        locals += !is_global[i];
+    }
+
+    size_t symtab_sz = sizeof(ElfSymtabEntry) * (1 + count);
+    ElfSymtabEntry *symtab = calloc(1 + count, sizeof(ElfSymtabEntry));
+    RARSJS_CHECK_OOM(symtab);
+    symtab[0].shent_idx = SHN_UNDEF;
+
+    size_t local_i = 1, global_i = 1 + locals;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->labels); i++) {
+        LabelData *l = RARSJS_ARRAY_GET(&as->labels, i);
+        if (!label_exported(as, l)) continue;
+
+        bool global = is_global[i];
+        ElfSymtabEntry *sym = &symtab[global ? global_i++ : local_i++];
+        sym->name_off = name_off;
+        sym->value = l->addr;
+        sym->info = ELF32_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+
+        // make_core only gives an index to sections it emits
+        Section *sec = l->section;
+        bool emitted = sec && sec->physical && 0 != sec->contents.len;
+        sym->shent_idx = emitted ? sec->elf.shidx : SHN_ABS;
+        name_off += l->len + 1;
+    }
+    free(is_global);
+
+    *out = (u8 *)symtab;
+    *out_sz = symtab_sz;
+    *first_global = 1 + locals;
+}
+
+// Line table for the instructions of .text, so that a loaded program can be
+// mapped back to its source. Layout:
+// - u32 address of the first instruction
+// - u32 number of instructions
+// - for each instruction, its line minus that of the one before (the first
+//   one is relative to 0), zigzag encoded as a ULEB128
+// Lines mostly go up by one, so an instruction usually takes a single byte
+static void make_lines(const Assembler *as, u8 **out, size_t *out_sz) {
+    u32 count = RARSJS_ARRAY_LEN(&as->text_by_linenum);
+    u8 *lines = malloc(8 + (size_t)count * 5);
+    RARSJS_CHECK_OOM(lines);
+
+    u32 base = TEXT_BASE;
+    size_t off = 0;
+    copy_n(lines, &base, sizeof(base), &off);
+    copy_n(lines, &count, sizeof(count), &off);
+
+    u32 prev = 0;
+    for (u32 i = 0; i < count; i++) {
+        u32 line = *RARSJS_ARRAY_GET(&as->text_by_linenum, i);
+        i32 delta = (i32)(line - prev);
+        u32 zz = ((u32)delta << 1) ^ (u32)(delta >> 31);
+        prev = line;
+        do {
+            u8 byte = zz & 0x7F;
+            zz >>= 7;
+            lines[off++] = byte | (zz ? 0x80 : 0);
+        } while (zz);
+    }
+
+    *out = lines;
+    *out_sz = off;
+}
+
+static bool make_rela(Assembler *as, u8 **out, size_t *out_sz,
+                      size_t file_off, ElfSectionHeader *shdrs,
+                      size_t reloc_idx, ElfSymtabEntry *symtab, char **error) {
     size_t rela_count = 0;
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         rela_count += s->relocations.len;
     }
 
@@ -580,13 +718,13 @@ static bool make_rela(u8 **out, size_t *out_sz, size_t file_off,
 
     // NOTE: this works because it assumes that section headers have been palced
     // by the make_core function. The make_core function places section headers
-    // in the order they appear in the g_sections array if they contain data.
+    // in the order they appear in the as->sections array if they contain data.
     // The same applies to .rela sections that appear in section headers
     // starting at index reloc_idx and are placed in the same order (excluding
     // sections that do not require relocations)
     size_t rel_i = 0;
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *s = *RARSJS_ARRAY_GET(&g_sections, i);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        Section *s = *RARSJS_ARRAY_GET(&as->sections, i);
         if (!s->physical || 0 == s->contents.len || 0 == s->relocations.len) {
             continue;
         }
@@ -616,11 +754,18 @@ fail:
     return false;
 }
 
-bool elf_emit_exec(void **out, size_t *len, char **error) {
+bool elf_emit_exec(Program *prog, void **out, size_t *len, char **error) {
+    Assembler *as = &prog->as;
     char *strtab = NULL;
     u8 *core = NULL;
+    u8 *symtab = NULL;
+    u8 *lines = NULL;
     u8 *elf_contents = NULL;
     size_t strtab_sz = 0;
+    size_t labels_off = 0;
+    size_t symtab_sz = 0;
+    size_t first_global = 0;
+    size_t lines_sz = 0;
     size_t core_sz = 0;
     size_t name_off = STRTAB_ISEC;
     size_t phdrs_start = 0;
@@ -629,17 +774,21 @@ bool elf_emit_exec(void **out, size_t *len, char **error) {
     size_t shnum = 0;
 
     u32 entrypoint;
-    if (!resolve_symbol("_start", strlen("_start"), true, &entrypoint, NULL)) {
+    if (!resolve_symbol(prog, "_start", strlen("_start"), true, &entrypoint,
+                        NULL)) {
         *error = "unresolved reference to `_start`";
         return false;
     }
 
-    RARSJS_CHECK_CALL(make_strtab(&strtab, &strtab_sz, true, true, error),
+    RARSJS_CHECK_CALL(make_strtab(as, &strtab, &strtab_sz, true, true, true,
+                                  &labels_off, error),
                       fail);
-    RARSJS_CHECK_CALL(make_core(&core, &core_sz, &name_off, &phdrs_start,
+    RARSJS_CHECK_CALL(make_core(as, &core, &core_sz, &name_off, &phdrs_start,
                                 &shdrs_start, &phnum, &shnum, NULL, NULL,
-                                sizeof(ElfHeader), 1, 0, true, true, error),
+                                sizeof(ElfHeader), 3, 0, true, true, error),
                       fail);
+    make_label_symtab(as, &symtab, &symtab_sz, &first_global, labels_off);
+    make_lines(as, &lines, &lines_sz);
 
     ElfHeader e_hdr = {
         .magic = {0x7F, 'E', 'L', 'F'},  // ELF magic
@@ -674,33 +823,63 @@ bool elf_emit_exec(void **out, size_t *len, char **error) {
                                   .align = 1,
                                   .link = 0,
                                   .ent_sz = 0};
+    shdrs[2] =
+        (ElfSectionHeader){.name_off = STRTAB_ISYM,
+                           .type = SHT_SYMTAB,
+                           .flags = 0,
+                           .info = first_global,
+                           .off = sizeof(ElfHeader) + core_sz + strtab_sz,
+                           .virt_addr = 0,
+                           .mem_sz = symtab_sz,
+                           .align = 1,
+                           .link = 1,
+                           .ent_sz = sizeof(ElfSymtabEntry)};
+    shdrs[3] = (ElfSectionHeader){
+        .name_off = STRTAB_ILIN,
+        .type = SHT_PROGBITS,
+        .flags = 0,
+        .off = sizeof(ElfHeader) + core_sz + strtab_sz + symtab_sz,
+        .virt_addr = 0,
+        .mem_sz = lines_sz,
+        .align = 1,
+        .link = 0,
+        .ent_sz = 0};
 
-    elf_contents = malloc(sizeof(ElfHeader) + core_sz + strtab_sz);
+    elf_contents =
+        malloc(sizeof(ElfHeader) + core_sz + strtab_sz + symtab_sz + lines_sz);
     RARSJS_CHECK_OOM(elf_contents);
     size_t elf_off = 0;
 
     copy_n(elf_contents, &e_hdr, sizeof(e_hdr), &elf_off);
     copy_n(elf_contents, core, core_sz, &elf_off);
     copy_n(elf_contents, strtab, strtab_sz, &elf_off);
+    copy_n(elf_contents, symtab, symtab_sz, &elf_off);
+    copy_n(elf_contents, lines, lines_sz, &elf_off);
     *out = elf_contents;
     *len = elf_off;
 
     free(core);
     free(strtab);
+    free(symtab);
+    free(lines);
     return true;
 
 fail:
     free(strtab);
     free(core);
+    free(symtab);
+    free(lines);
     free(elf_contents);
     return false;
 }
 
-bool elf_emit_obj(void **out, size_t *len, char **error) {
+bool elf_emit_obj(Program *prog, void **out, size_t *len, char **error) {
+    Assembler *as = &prog->as;
     char *strtab = NULL;
     u8 *core = NULL;
     u8 *symtab = NULL;
     u8 *relas = NULL;
+    u8 *lines = NULL;
     u8 *elf_contents = NULL;
 
     size_t strtab_sz = 0;
@@ -715,21 +894,24 @@ bool elf_emit_obj(void **out, size_t *len, char **error) {
     size_t symtab_sz = 0;
     size_t symtab_entnum = 0;
     size_t relas_sz = 0;
+    size_t lines_sz = 0;
 
-    RARSJS_CHECK_CALL(make_strtab(&strtab, &strtab_sz, true, true, error),
-                      fail);
     RARSJS_CHECK_CALL(
-        make_core(&core, &core_sz, &name_off, &phdrs_start, &shdrs_start,
-                  &phnum, &shnum, &reloc_idx, &reloc_num, sizeof(ElfHeader), 2,
-                  2, false, true, error),
+        make_strtab(as, &strtab, &strtab_sz, true, true, false, NULL, error),
         fail);
     RARSJS_CHECK_CALL(
-        make_symtab(&symtab, &symtab_sz, &symtab_entnum, name_off, error),
+        make_core(as, &core, &core_sz, &name_off, &phdrs_start, &shdrs_start,
+                  &phnum, &shnum, &reloc_idx, &reloc_num, sizeof(ElfHeader), 3,
+                  2, false, true, error),
         fail);
+    RARSJS_CHECK_CALL(make_symtab(prog, &symtab, &symtab_sz, &symtab_entnum,
+                                  name_off, error),
+                      fail);
+    make_lines(as, &lines, &lines_sz);
 
     ElfSectionHeader *shdrs = (ElfSectionHeader *)(core + shdrs_start);
     RARSJS_CHECK_CALL(
-        make_rela(&relas, &relas_sz,
+        make_rela(as, &relas, &relas_sz,
                   sizeof(ElfHeader) + core_sz + strtab_sz + symtab_sz, shdrs,
                   reloc_idx, (ElfSymtabEntry *)symtab, error),
         fail);
@@ -775,9 +957,19 @@ bool elf_emit_obj(void **out, size_t *len, char **error) {
                            .align = 1,
                            .link = 1,
                            .ent_sz = sizeof(ElfSymtabEntry)};
-
-    elf_contents =
-        malloc(sizeof(ElfHeader) + core_sz + strtab_sz + symtab_sz + relas_sz);
+    shdrs[3] = (ElfSectionHeader){
+        .name_off = STRTAB_ILIN,
+        .type = SHT_PROGBITS,
+        .flags = 0,
+        .off = sizeof(ElfHeader) + core_sz + strtab_sz + symtab_sz + relas_sz,
+        .virt_addr = 0,
+        .mem_sz = lines_sz,
+        .align = 1,
+        .link = 0,
+        .ent_sz = 0};
+
+    elf_contents = malloc(sizeof(ElfHeader) + core_sz + strtab_sz + symtab_sz +
+                          relas_sz + lines_sz);
     RARSJS_CHECK_OOM(elf_contents);
     size_t elf_off = 0;
 
@@ -786,6 +978,7 @@ bool elf_emit_obj(void **out, size_t *len, char **error) {
     copy_n(elf_contents, strtab, strtab_sz, &elf_off);
     copy_n(elf_contents, symtab, symtab_sz, &elf_off);
     copy_n(elf_contents, relas, relas_sz, &elf_off);
+    copy_n(elf_contents, lines, lines_sz, &elf_off);
 
     *out = elf_contents;
     *len = elf_off;
@@ -794,6 +987,7 @@ bool elf_emit_obj(void **out, size_t *len, char **error) {
     free(strtab);
     free(symtab);
     free(relas);
+    free(lines);
     return true;
 
 fail:
@@ -802,10 +996,88 @@ fail:
     free(symtab);
     free(elf_contents);
     free(relas);
+    free(lines);
     return false;
 }
 
-bool elf_load(u8 *elf_contents, size_t elf_len, char **error) {
+static inline bool in_file(ElfSectionHeader *shdr, size_t elf_len) {
+    return shdr->off <= elf_len && shdr->mem_sz <= elf_len - shdr->off;
+}
+
+// Turns the symbols defined in a .symtab into labels, pointing into the
+// string table of the file
+static bool load_symtab(Program *prog, u8 *elf_contents, size_t elf_len,
+                        ElfSectionHeader *shdrs, u32 shnum,
+                        ElfSectionHeader *symtab, char **error) {
+    if (symtab->link >= shnum || !in_file(symtab, elf_len) ||
+        !in_file(&shdrs[symtab->link], elf_len)) {
+        *error = "symbol table out of range";
+        return false;
+    }
+
+    ElfSectionHeader *str_shdr = &shdrs[symtab->link];
+    char *str = (char *)(elf_contents + str_shdr->off);
+    ElfSymtabEntry *syms = (ElfSymtabEntry *)(elf_contents + symtab->off);
+    size_t count = symtab->mem_sz / sizeof(ElfSymtabEntry);
+
+    for (size_t i = 1; i < count; i++) {
+        ElfSymtabEntry *sym = &syms[i];
+        u8 type = ELF32_ST_TYPE(sym->info);
+        if (SHN_UNDEF == sym->shent_idx || STT_SECTION == type ||
+            STT_FILE == type || 0 == sym->name_off) {
+            continue;
+        }
+
+        if (sym->name_off >= str_shdr->mem_sz) {
+            *error = "symbol name offset out of range";
+            return false;
+        }
+
+        const char *name = str + sym->name_off;
+        *RARSJS_ARRAY_PUSH(&prog->as.labels) = (LabelData){
+            .txt = name,
+            .len = strnlen(name, str_shdr->mem_sz - sym->name_off),
+            .addr = sym->value,
+            .section = emulator_get_section(prog, sym->value)};
+    }
+
+    return true;
+}
+
+// Reads the line table made by make_lines
+static bool load_lines(Assembler *as, u8 *elf_contents, size_t elf_len,
+                       ElfSectionHeader *shdr, char **error) {
+    u32 base, count;
+    if (!in_file(shdr, elf_len) || shdr->mem_sz < 8) goto corrupt;
+
+    u8 *lines = elf_contents + shdr->off;
+    memcpy(&base, lines, sizeof(base));
+    memcpy(&count, lines + 4, sizeof(count));
+    // everything indexes lines from the start of .text
+    if (TEXT_BASE != base) return true;
+
+    size_t off = 8;
+    u32 line = 0;
+    for (u32 i = 0; i < count; i++) {
+        u32 zz = 0;
+        for (u32 shift = 0;; shift += 7) {
+            if (off >= shdr->mem_sz || shift > 28) goto corrupt;
+            u8 byte = lines[off++];
+            zz |= (u32)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        line += (zz >> 1) ^ -(zz & 1);
+        *RARSJS_ARRAY_PUSH(&as->text_by_linenum) = line;
+    }
+    return true;
+
+corrupt:
+    *error = "corrupt line table";
+    return false;
+}
+
+bool elf_load(Program *prog, u8 *elf_contents, size_t elf_len, char **error) {
+    Assembler *as = &prog->as;
     if (!elf_contents) {
         *error = "null buffer";
         return false;
@@ -881,17 +1153,46 @@ bool elf_load(u8 *elf_contents, size_t elf_len, char **error) {
             s->execute = true;
         }
 
-        *RARSJS_ARRAY_PUSH(&g_sections) = s;
+        *RARSJS_ARRAY_PUSH(&as->sections) = s;
     }
 
-    emulator_init();
-    g_pc = e_header->entry;
+    emulator_init(prog);
+    prog->machine.pc = e_header->entry;
+
+    // Debug information, when there is some. Labels and lines point into
+    // elf_contents, like the names of the sections. The program runs the same
+    // without them, so a malformed table is reported and left out
+    RARSJS_ARRAY_FREE(&as->labels);
+    RARSJS_ARRAY_FREE(&as->text_by_linenum);
+    for (u32 i = 0; i < e_header->shent_num; i++) {
+        ElfSectionHeader *s_hdr = &shdrs[i];
+        char *debug_error = NULL;
+        if (SHT_SYMTAB == s_hdr->type) {
+            if (!load_symtab(prog, elf_contents, elf_len, shdrs,
+                             e_header->shent_num, s_hdr, &debug_error)) {
+                fprintf(stderr, "loader: ignoring the symbols: %s\n",
+                        debug_error);
+                RARSJS_ARRAY_FREE(&as->labels);
+            }
+        } else if (SHT_PROGBITS == s_hdr->type &&
+                   !(SHF_ALLOC & s_hdr->flags) &&
+                   s_hdr->name_off < str_tab_len &&
+                   0 == strncmp(str_tab + s_hdr->name_off, LINES_NAME,
+                                str_tab_len - s_hdr->name_off)) {
+            if (!load_lines(as, elf_contents, elf_len, s_hdr, &debug_error)) {
+                fprintf(stderr, "loader: ignoring the line table: %s\n",
+                        debug_error);
+                RARSJS_ARRAY_FREE(&as->text_by_linenum);
+            }
+        }
+    }
+    label_index_build(prog);
     return true;
 
 fail:
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        free(*RARSJS_ARRAY_GET(&g_sections, i));
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        free(*RARSJS_ARRAY_GET(&as->sections, i));
     }
-    RARSJS_ARRAY_FREE(&g_sections);
+    RARSJS_ARRAY_FREE(&as->sections);
     return false;
 }
@@ -1,24 +1,19 @@
 #include "rarsjs/emulate.h"
 
+#include "rarsjs/bpred.h"
+#include "rarsjs/breakpoint.h"
+#include "rarsjs/cache.h"
 #include "rarsjs/callsan.h"
 #include "rarsjs/core.h"
 #include "rarsjs/dev.h"
-
-export u32 g_regs[32];
-export u32 g_csr[4096];
-export u32 g_pc;
-
-export u32 g_mem_written_len;
-export u32 g_mem_written_addr;
-export u32 g_reg_written;
-
-export bool g_exited;
-export int g_exit_code;
-
-extern u32 g_runtime_error_params[2];
-extern Error g_runtime_error_type;
-
-static int g_privilege_level = PRIV_USER;
+#include "rarsjs/dirty.h"
+#include "rarsjs/profile.h"
+#include "rarsjs/program.h"
+#include "rarsjs/smp.h"
+#include "rarsjs/snapshot.h"
+#include "rarsjs/timetravel.h"
+#include "rarsjs/timing.h"
+#include "rarsjs/trace.h"
 
 // end is inclusive, like in Verilog
 static inline u32 extr(u32 val, u32 end, u32 start) {
@@ -67,9 +62,9 @@ static inline u32 remu32(u32 a, u32 b) {
     }
 }
 
-Section *emulator_get_section(u32 addr) {
-    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
-        Section *sec = *RARSJS_ARRAY_GET(&g_sections, i);
+Section *emulator_get_section(Program *p, u32 addr) {
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
         if (addr >= sec->base && addr < sec->limit) {
             return sec;
         }
@@ -78,8 +73,8 @@ Section *emulator_get_section(u32 addr) {
     return NULL;
 }
 
-u8 *emulator_get_addr(u32 addr, int size, Section **out_sec) {
-    Section *addr_sec = emulator_get_section(addr);
+u8 *emulator_get_addr(Program *p, u32 addr, int size, Section **out_sec) {
+    Section *addr_sec = emulator_get_section(p, addr);
 
     if (out_sec) {
         *out_sec = addr_sec;
@@ -99,19 +94,39 @@ u8 *emulator_get_addr(u32 addr, int size, Section **out_sec) {
     return NULL;
 }
 
-u32 LOAD(u32 addr, int size, bool *err) {
+// Resolves a whole guest range to host memory, with the same permission checks
+// as LOAD/STORE, so that bulk users (like DMA) only pay for them once
+// MMIO is never resolved, since device registers have side effects
+u8 *emulator_resolve_range(Machine *m, u32 addr, u32 len, bool write) {
+    if (addr + len < addr) return NULL;
+
+    Section *sec = emulator_get_section(m->prog, addr);
+    if (!sec || sec->base == MMIO_BASE) return NULL;
+    if (addr + len > sec->contents.len + sec->base) return NULL;
+    if (write ? !sec->write : !sec->read) return NULL;
+    if (sec->super && m->privilege == PRIV_USER) return NULL;
+
+    if (write) {
+        dirty_mark(&m->prog->dirty, sec, addr, len);
+    }
+    return sec->contents.buf + (addr - sec->base);
+}
+
+u32 LOAD(Machine *m, u32 addr, int size, bool *err) {
     Section *mem_sec;
-    u8 *mem = emulator_get_addr(addr, size, &mem_sec);
+    u8 *mem = emulator_get_addr(m->prog, addr, size, &mem_sec);
 
     if (!mem_sec || !mem_sec->read ||
-        (mem_sec->super && g_privilege_level == PRIV_USER)) {
+        (mem_sec->super && m->privilege == PRIV_USER)) {
         *err = true;
         return 0;
     }
 
     if (mem_sec->base == MMIO_BASE) {
         u32 ret;
-        *err = !mmio_read(addr - MMIO_BASE, size, &ret);
+        smp_lock(&m->prog->smp);
+        *err = !mmio_read(m, addr - MMIO_BASE, size, &ret);
+        smp_unlock(&m->prog->smp);
         return ret;
     } else if (!mem) {
         *err = true;
@@ -134,27 +149,30 @@ u32 LOAD(u32 addr, int size, bool *err) {
     return ret;
 }
 
-void STORE(u32 addr, u32 val, int size, bool *err) {
-    g_mem_written_len = size;
-    g_mem_written_addr = addr;
+void STORE(Machine *m, u32 addr, u32 val, int size, bool *err) {
+    m->mem_written_len = size;
+    m->mem_written_addr = addr;
 
     Section *mem_sec;
-    u8 *mem = emulator_get_addr(addr, size, &mem_sec);
+    u8 *mem = emulator_get_addr(m->prog, addr, size, &mem_sec);
 
     if (!mem_sec || !mem_sec->write ||
-        (mem_sec->super && g_privilege_level == PRIV_USER)) {
+        (mem_sec->super && m->privilege == PRIV_USER)) {
         *err = true;
         return;
     }
 
     if (mem_sec->base == MMIO_BASE) {
-        *err = !mmio_write(addr - MMIO_BASE, size, val);
+        smp_lock(&m->prog->smp);
+        *err = !mmio_write(m, addr - MMIO_BASE, size, val);
+        smp_unlock(&m->prog->smp);
         return;
     } else if (!mem) {
         *err = true;
         return;
     }
 
+    dirty_mark(&m->prog->dirty, mem_sec, addr, size);
     if (size == 1) {
         mem[0] = val;
     } else if (size == 2) {
@@ -169,75 +187,148 @@ void STORE(u32 addr, u32 val, int size, bool *err) {
     *err = false;
 }
 
-void do_syscall() {
+// Parses a decimal integer from the console like RARS does, skipping leading
+// whitespace and consuming the rest of the line if it is blank. Returns false
+// if there are no digits, as at the end of the input
+static bool read_int(Program *p, u32 *out) {
+    int c;
+    while ((c = console_peekchar(p)) == ' ' || c == '\t' || c == '\r' ||
+           c == '\n') {
+        console_getchar(p);
+    }
+
+    bool neg = c == '-';
+    if (c == '-' || c == '+') console_getchar(p);
+
+    u32 val = 0;
+    bool digits = false;
+    while ((c = console_peekchar(p)) >= '0' && c <= '9') {
+        val = val * 10 + (c - '0');
+        console_getchar(p);
+        digits = true;
+    }
+    if (!digits) return false;
+
+    while ((c = console_peekchar(p)) == ' ' || c == '\t' || c == '\r') {
+        console_getchar(p);
+    }
+    if (c == '\n') console_getchar(p);
+
+    *out = neg ? -val : val;
+    return true;
+}
+
+static void do_syscall_locked(Machine *m) {
+    Program *p = m->prog;
     u32 scause = CAUSE_U_ECALL;
-    if (g_privilege_level == PRIV_SUPERVISOR) {
+    if (m->privilege == PRIV_SUPERVISOR) {
         scause = CAUSE_S_ECALL;
     }
 
-    if (!RARSJS_ARRAY_IS_EMPTY(&g_kernel_text->contents)) {
-        emulator_deliver_interrupt(CAUSE_U_ECALL);
+    // programs loaded from an ELF file don't set the kernel text
+    Section *kernel_text = p->as.kernel_text;
+    if (kernel_text && !RARSJS_ARRAY_IS_EMPTY(&kernel_text->contents)) {
+        emulator_deliver_interrupt(m, CAUSE_U_ECALL);
         return;
     }
 
-    g_reg_written = 0;
+    m->reg_written = 0;
 
-    u32 param = g_regs[10];
-    if (g_regs[17] == 1) {
+    u32 param = m->regs[10];
+    if (m->regs[17] == 1) {
         // print int
         char buffer[12];
         int i = 0;
         if ((i32)param < 0) {
-            putchar('-');
+            console_putchar(p, '-');
             param = -param;
         }
         do {
             buffer[i++] = (param % 10) + '0';
             param /= 10;
         } while (param > 0);
-        while (i--) putchar(buffer[i]);
-    } else if (g_regs[17] == 4) {
+        while (i--) console_putchar(p, buffer[i]);
+    } else if (m->regs[17] == 4) {
         // print string
         u32 i = 0;
         while (1) {
             bool err = false;
-            u8 ch = LOAD(param + i, 1, &err);
+            u8 ch = LOAD(m, param + i, 1, &err);
             if (err) return;  // TODO: return an error?
             if (ch == 0) break;
             i++;
-            putchar(ch);
+            console_putchar(p, ch);
+        }
+    } else if (m->regs[17] == 5) {
+        // read int
+        if (!read_int(p, &m->regs[10])) {
+            m->runtime_error_type = ERROR_INPUT;
+            return;
+        }
+        m->reg_written = 10;
+        callsan_store(m, 10);
+    } else if (m->regs[17] == 8) {
+        // read string, at most a1-1 characters up to and including a newline
+        u32 max = m->regs[11];
+        u32 i = 0;
+        bool err = false;
+        while (i + 1 < max) {
+            int c = console_getchar(p);
+            if (c < 0) break;
+            STORE(m, param + i, c, 1, &err);
+            if (err) break;
+            i++;
+            if (c == '\n') break;
+        }
+        if (max > 0 && !err) STORE(m, param + i, 0, 1, &err);
+        if (err) {
+            m->runtime_error_params[0] = param + i;
+            m->runtime_error_type = ERROR_STORE;
+            return;
         }
-    } else if (g_regs[17] == 11) {
+    } else if (m->regs[17] == 11) {
         // print char
-        putchar(param);
-    } else if (g_regs[17] == 34) {
+        console_putchar(p, param);
+    } else if (m->regs[17] == 12) {
+        // read char, -1 at the end of the input
+        m->regs[10] = console_getchar(p);
+        m->reg_written = 10;
+        callsan_store(m, 10);
+    } else if (m->regs[17] == 34) {
         // print int hex
-        putchar('0');
-        putchar('x');
+        console_putchar(p, '0');
+        console_putchar(p, 'x');
         for (int i = 32 - 4; i >= 0; i -= 4)
-            putchar("0123456789abcdef"[(param >> i) & 15]);
-    } else if (g_regs[17] == 35) {
+            console_putchar(p, "0123456789abcdef"[(param >> i) & 15]);
+    } else if (m->regs[17] == 35) {
         // print int binary
-        putchar('0');
-        putchar('b');
+        console_putchar(p, '0');
+        console_putchar(p, 'b');
         for (int i = 31; i >= 0; i--) {
-            putchar(((param >> i) & 1) ? '1' : '0');
+            console_putchar(p, ((param >> i) & 1) ? '1' : '0');
         }
-    } else if (g_regs[17] == 93 || g_regs[17] == 7 || g_regs[17] == 10) {
-        emu_exit();
+    } else if (m->regs[17] == 93 || m->regs[17] == 7 || m->regs[17] == 10) {
+        emulator_exit(m);
     }
 
-    g_pc += 4;
+    m->pc += 4;
 }
 
-void do_sret() {
+// The console is shared by all harts
+static void do_syscall(Machine *m) {
+    smp_lock(&m->prog->smp);
+    do_syscall_locked(m);
+    smp_unlock(&m->prog->smp);
+}
+
+static void do_sret(Machine *m) {
     // SRET is only legal in supervisor
-    if (g_privilege_level != PRIV_SUPERVISOR) {
-        g_runtime_error_params[0] = g_pc;
-        g_runtime_error_type = ERROR_UNHANDLED_INSN;
+    if (m->privilege != PRIV_SUPERVISOR) {
+        m->runtime_error_params[0] = m->pc;
+        m->runtime_error_type = ERROR_UNHANDLED_INSN;
         return;
     }
-    u32 status = g_csr[CSR_MSTATUS];
+    u32 status = m->csr[CSR_MSTATUS];
     bool old_spp = status & STATUS_SPP;
     bool old_spie = status & STATUS_SPIE;
     // SIE = SPIE
@@ -246,9 +337,10 @@ void do_sret() {
     status |= STATUS_SPIE;
     // SPP = 0
     status &= ~STATUS_SPP;
-    g_csr[CSR_MSTATUS] = status;
-    g_privilege_level = old_spp;
-    g_pc = g_csr[CSR_SEPC];
+    m->csr[CSR_MSTATUS] = status;
+    m->privilege = old_spp;
+    m->pc = m->csr[CSR_SEPC];
+    emulator_interrupt_recheck(m);
 }
 
 
@@ -258,47 +350,243 @@ void do_sret() {
 #define SSTATUS_MASK (STATUS_SIE|STATUS_SPIE|STATUS_SPP|STATUS_FS_MASK)
 #define SUPERVISOR_INT_MASK ((1<<1)|(1<<5)|(1<<9))
 
-u32 rdcsr(u32 csr) {
+// The counters are derived from the retirement count when read, rather than
+// being updated by every instruction
+static u64 read_counter(Machine *m, u32 csr) {
+    // the instruction reading it hasn't retired yet
+    u64 instret = m->instret - 1;
+    if (csr == _CSR_INSTRET) return instret;
+    // cycle and time both tick at the core clock, which runs an instruction
+    // per cycle unless the timing model says otherwise
+    Timing *t = &m->prog->timing;
+    return t->enabled ? t->cycles : instret;
+}
+
+static u32 rdcsr(Machine *m, u32 csr) {
+    if (csr == CSR_MHARTID) return m->hartid;
+    if ((csr & ~0x80) >= _CSR_CYCLE && (csr & ~0x80) <= _CSR_INSTRET) {
+        u64 val = read_counter(m, csr & ~0x80);
+        return csr & 0x80 ? val >> 32 : val;
+    }
+
     u32 mask = -1u;
     if (csr == _CSR_SSTATUS) csr = CSR_MSTATUS, mask = SSTATUS_MASK;
     else if (csr == _CSR_SIE) csr = CSR_MIE, mask = SUPERVISOR_INT_MASK;
     else if (csr == _CSR_SIP) csr = CSR_MIP, mask = SUPERVISOR_INT_MASK;
-    return g_csr[csr] & mask;
+    return m->csr[csr] & mask;
 }
 
-void wrcsr(u32 csr, u32 val) {
-    // for SIP, only SSIP (software interrupts) is writable
-    // since it is the way to EOI a software interrupt
-    // whereas the other ones are EOI'd by the respective devices
+static void wrcsr(Machine *m, u32 csr, u32 val) {
     u32 mask = -1u;
     if (csr == _CSR_SSTATUS) csr = CSR_MSTATUS, mask = SSTATUS_MASK;
     else if (csr == _CSR_SIE) csr = CSR_MIE, mask = SUPERVISOR_INT_MASK;
+    // for SIP, only SSIP (software interrupts) is writable
+    // since it is the way to EOI a software interrupt
+    // whereas the other ones are EOI'd by the respective devices
     else if (csr == _CSR_SIP) csr = CSR_MIP, mask = 1u << (CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
-    g_csr[csr] = (g_csr[csr] & ~mask) | (val & mask);
+
+    // other harts raise interrupts concurrently (see
+    // emulator_interrupt_set_pending), so the pending bits are updated
+    // atomically
+    u32 old = __atomic_load_n(&m->csr[csr], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&m->csr[csr], &old,
+                                        (old & ~mask) | (val & mask), true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    if (csr == CSR_MSTATUS || csr == CSR_MIE || csr == CSR_MIP) {
+        emulator_interrupt_recheck(m);
+    }
 }
 
-void emulate() {
-    g_runtime_error_type = ERROR_NONE;
-    g_mem_written_len = 0;
-    g_reg_written = 0;
-    g_regs[0] = 0;
-    bool err;
+// Takes the highest priority pending interrupt, if interrupts are enabled
+// The flag is cleared before looking, so that an interrupt raised meanwhile
+// by another hart leaves it set
+static void emulator_check_interrupts(Machine *m) {
+    __atomic_store_n(&m->irq_maybe_pending, false, __ATOMIC_SEQ_CST);
+    if (!(m->csr[CSR_MSTATUS] & STATUS_SIE)) return;
+
+    u32 pending = __atomic_load_n(&m->csr[CSR_MIP], __ATOMIC_SEQ_CST) &
+                  m->csr[CSR_MIE];
+    if (pending != 0) {
+        int intno = __builtin_ctz(pending);
+        emulator_deliver_interrupt(m, CAUSE_INTERRUPT | intno);
+    }
+}
 
-    if (g_csr[CSR_MSTATUS] & STATUS_SIE) {
-        u32 pending = g_csr[CSR_MIP] & g_csr[CSR_MIE];
-        if (pending != 0) {
-            int intno = __builtin_ctz(pending);
-            emulator_deliver_interrupt(CAUSE_INTERRUPT | intno);
-        }
+// The bodies of JALR, the branches and the loads, taking the operands
+// already read
+
+static inline void exec_jalr(Machine *m, u32 rd, u32 rs1, u32 S1, i32 imm) {
+    callsan_store(m, rd);
+    m->regs[rd] = m->pc + 4;
+    // this has to be checked before updating pc so that the highlighted pc
+    // is correct
+    if (rd == 0 && rs1 == 1) {  // jr ra/ret
+        if (!callsan_ret(m)) return;
+        profile_ret(&m->prog->profile, m->instret);
+        bpred_ret(&m->prog->bpred, (S1 + imm) & ~1);
     }
+    m->pc = (S1 + imm) & ~1;
+    if (rd == 1) {
+        callsan_call(m);
+        profile_call(&m->prog->profile, m->pc, m->instret);
+        bpred_call(&m->prog->bpred, m->regs[rd]);
+    }
+    m->reg_written = rd;
+}
+
+static inline void exec_branch(Machine *m, u32 funct3, u32 S1, u32 S2,
+                               i32 imm) {
+    bool T = false;
+    if ((funct3 >> 1) == 0) T = S1 == S2;
+    else if ((funct3 >> 1) == 2) T = (i32)S1 < (i32)S2;
+    else if ((funct3 >> 1) == 3) T = S1 < S2;
+    else {
+        m->runtime_error_params[0] = m->pc;
+        m->runtime_error_type = ERROR_UNHANDLED_INSN;
+        return;
+    }
+    if (funct3 & 1) T = !T;
+    bpred_branch(&m->prog->bpred, m->pc, imm, T);
+    m->pc += T ? imm : 4;
+}
 
-    u32 inst = LOAD(g_pc, 4, &err);
+static inline void exec_load(Machine *m, u32 funct3, u32 rd, u32 addr) {
+    bool err;
+    u32 val;
+    if (funct3 == 0b000) val = sext(LOAD(m, addr, 1, &err), 8);
+    else if (funct3 == 0b001) val = sext(LOAD(m, addr, 2, &err), 16);
+    else if (funct3 == 0b010) val = LOAD(m, addr, 4, &err);
+    else if (funct3 == 0b100) val = LOAD(m, addr, 1, &err);
+    else if (funct3 == 0b101) val = LOAD(m, addr, 2, &err);
+    else {
+        m->runtime_error_type = ERROR_UNHANDLED_INSN;
+        return;
+    }
+    m->regs[rd] = val;
     if (err) {
-        g_runtime_error_params[0] = g_pc;
-        g_runtime_error_type = ERROR_FETCH;
+        m->runtime_error_params[0] = addr;
+        m->runtime_error_type = ERROR_LOAD;
+        return;
+    }
+    if (!callsan_check_load(m, addr, 1 << (funct3 & 0b11))) {
+        m->runtime_error_params[0] = addr;
+        m->runtime_error_type = ERROR_CALLSAN_LOAD_STACK;
         return;
     }
+    cache_data(&m->prog->cache, &m->prog->as.sections, addr,
+               1 << (funct3 & 0b11), false, m->pc);
+
+    m->pc += 4;
+    m->reg_written = rd;
+    callsan_store(m, rd);
+}
+
+// LR.W, SC.W and the AMOs, all of them sequentially consistent, which makes
+// their aq and rl bits moot. The word is accessed in place, which is why it
+// has to be aligned (hosts are little-endian, like the guest)
+static void exec_amo(Machine *m, u32 funct5, u32 rd, u32 rs2, u32 addr,
+                     u32 src) {
+    bool lr = funct5 == 0b00010, sc = funct5 == 0b00011;
+    u32 *word = NULL;
+    if (addr % 4 == 0) word = (u32 *)emulator_resolve_range(m, addr, 4, !lr);
+    if (!word) {
+        m->runtime_error_params[0] = addr;
+        m->runtime_error_type = lr ? ERROR_LOAD : ERROR_STORE;
+        return;
+    }
+    if (!sc && !callsan_check_load(m, addr, 4)) {
+        m->runtime_error_params[0] = addr;
+        m->runtime_error_type = ERROR_CALLSAN_LOAD_STACK;
+        return;
+    }
+
+    u32 old, new;
+    if (lr) {
+        old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+        m->reserved = true;
+        m->reserved_addr = addr;
+        m->reserved_val = old;
+    } else if (sc) {
+        u32 expected = m->reserved_val;
+        old = !(m->reserved && m->reserved_addr == addr &&
+                __atomic_compare_exchange_n(word, &expected, src, false,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST));
+        m->reserved = false;
+    } else {
+        old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            bool less = (i32)old < (i32)src, lessu = old < src;
+            if (funct5 == 0b00001) new = src;                // SWAP
+            else if (funct5 == 0b00000) new = old + src;     // ADD
+            else if (funct5 == 0b00100) new = old ^ src;     // XOR
+            else if (funct5 == 0b01100) new = old & src;     // AND
+            else if (funct5 == 0b01000) new = old | src;     // OR
+            else if (funct5 == 0b10000) new = less ? old : src;   // MIN
+            else if (funct5 == 0b10100) new = less ? src : old;   // MAX
+            else if (funct5 == 0b11000) new = lessu ? old : src;  // MINU
+            else if (funct5 == 0b11100) new = lessu ? src : old;  // MAXU
+            else {
+                m->runtime_error_params[0] = m->pc;
+                m->runtime_error_type = ERROR_UNHANDLED_INSN;
+                return;
+            }
+        } while (!__atomic_compare_exchange_n(word, &old, new, true,
+                                              __ATOMIC_SEQ_CST,
+                                              __ATOMIC_RELAXED));
+    }
 
+    if (!lr && !(sc && old)) {
+        m->mem_written_len = 4;
+        m->mem_written_addr = addr;
+        callsan_report_store(m, addr, 4, rs2);
+    }
+    cache_data(&m->prog->cache, &m->prog->as.sections, addr, 4, !lr, m->pc);
+
+    m->regs[rd] = old;
+    m->pc += 4;
+    m->reg_written = rd;
+    callsan_store(m, rd);
+}
+
+// Everything before executing an instruction: counting it, clocking the
+// devices, taking interrupts and fetching it. Returns false on a fetch fault
+static inline bool emulate_fetch(Machine *m, u32 *inst) {
+    Program *p = m->prog;
+    m->instret++;
+    m->runtime_error_type = ERROR_NONE;
+    m->mem_written_len = 0;
+    m->reg_written = 0;
+    m->regs[0] = 0;
+    bool err;
+
+    // devices are clocked by hart 0
+    if (p->dev.pending && m->hartid == 0) {
+        smp_lock(&p->smp);
+        dev_tick(m);
+        smp_unlock(&p->smp);
+    }
+
+    if (__atomic_load_n(&m->irq_maybe_pending, __ATOMIC_RELAXED)) {
+        emulator_check_interrupts(m);
+    }
+
+    *inst = LOAD(m, m->pc, 4, &err);
+    if (err) {
+        m->runtime_error_params[0] = m->pc;
+        m->runtime_error_type = ERROR_FETCH;
+        return false;
+    }
+    timing_fetch(&p->timing, m->pc, *inst);
+    cache_fetch(&p->cache, &p->as.sections, m->pc);
+    trace_fetch(&p->trace, m->pc);
+    return true;
+}
+
+static void execute(Machine *m, u32 inst) {
+    bool err;
     u32 rd = extr(inst, 11, 7);
     u32 rs1 = extr(inst, 19, 15);
     u32 rs2 = extr(inst, 24, 20);
@@ -315,129 +603,111 @@ void emulate() {
     i32 itype = sext(extr(inst, 31, 20), 12);
     i32 utype = extr(inst, 31, 12) << 12;
 
-    u32 S1 = g_regs[rs1];
-    u32 S2 = g_regs[rs2];
-    u32 *D = &g_regs[rd];
+    u32 S1 = m->regs[rs1];
+    u32 S2 = m->regs[rs2];
+    u32 *D = &m->regs[rd];
 
     u32 opcode = extr(inst, 6, 0);
 
     // LUI
     if (opcode == 0b0110111) {
         *D = utype;
-        g_pc += 4;
-        g_reg_written = rd;
-        callsan_store(rd);
+        m->pc += 4;
+        m->reg_written = rd;
+        callsan_store(m, rd);
         return;
     }
 
     // AUIPC
     if (opcode == 0b0010111) {
-        *D = g_pc + utype;
-        g_pc += 4;
-        g_reg_written = rd;
-        callsan_store(rd);
+        *D = m->pc + utype;
+        m->pc += 4;
+        m->reg_written = rd;
+        callsan_store(m, rd);
         return;
     }
 
     // JAL
     if (opcode == 0b1101111) {
-        *D = g_pc + 4;
-        g_pc += jtype;
-        g_reg_written = rd;
-        callsan_store(rd);
-        if (rd == 1) callsan_call();
+        *D = m->pc + 4;
+        m->pc += jtype;
+        m->reg_written = rd;
+        callsan_store(m, rd);
+        if (rd == 1) {
+            callsan_call(m);
+            profile_call(&m->prog->profile, m->pc, m->instret);
+            bpred_call(&m->prog->bpred, *D);
+        }
         return;
     }
 
     // JALR
     if (opcode == 0b1100111) {
-        if (!callsan_can_load(rs1)) return;
-        callsan_store(rd);
-        *D = g_pc + 4;
-        // this has to be checked before updating pc so that the highlighted pc
-        // is correct
-        if (rd == 0 && rs1 == 1) {  // jr ra/ret
-            if (!callsan_ret()) return;
-        }
-        g_pc = (S1 + itype) & ~1;
-        if (rd == 1) callsan_call();
-        g_reg_written = rd;
+        if (!callsan_can_load(m, rs1)) return;
+        exec_jalr(m, rd, rs1, S1, itype);
         return;
     }
 
     // BEQ/BNE/BLT/BGE/BLTU/BGEU
     if (opcode == 0b1100011) {
-        if (!callsan_can_load(rs1)) return;
-        if (!callsan_can_load(rs2)) return;
-        bool T = false;
-        if ((funct3 >> 1) == 0) T = S1 == S2;
-        else if ((funct3 >> 1) == 2) T = (i32)S1 < (i32)S2;
-        else if ((funct3 >> 1) == 3) T = S1 < S2;
-        else {
-            g_runtime_error_params[0] = g_pc;
-            g_runtime_error_type = ERROR_UNHANDLED_INSN;
-            return;
-        }
-        if (funct3 & 1) T = !T;
-        g_pc += T ? btype : 4;
+        if (!callsan_can_load(m, rs1)) return;
+        if (!callsan_can_load(m, rs2)) return;
+        exec_branch(m, funct3, S1, S2, btype);
         return;
     }
 
     // LB/LH/LW/LBU/LHU
     if (opcode == 0b0000011) {
-        if (!callsan_can_load(rs1)) return;
-
-        if (funct3 == 0b000) *D = sext(LOAD(S1 + itype, 1, &err), 8);
-        else if (funct3 == 0b001) *D = sext(LOAD(S1 + itype, 2, &err), 16);
-        else if (funct3 == 0b010) *D = LOAD(S1 + itype, 4, &err);
-        else if (funct3 == 0b100) *D = LOAD(S1 + itype, 1, &err);
-        else if (funct3 == 0b101) *D = LOAD(S1 + itype, 2, &err);
-        else {
-            g_runtime_error_type = ERROR_UNHANDLED_INSN;
-            return;
-        }
-        if (err) {
-            g_runtime_error_params[0] = S1 + itype;
-            g_runtime_error_type = ERROR_LOAD;
-            return;
-        }
-        if (!callsan_check_load(S1 + itype, 1 << (funct3 & 0b11))) {
-            g_runtime_error_params[0] = S1 + itype;
-            g_runtime_error_type = ERROR_CALLSAN_LOAD_STACK;
-            return;
-        }
-
-        g_pc += 4;
-        g_reg_written = rd;
-        callsan_store(rd);
+        if (!callsan_can_load(m, rs1)) return;
+        exec_load(m, funct3, rd, S1 + itype);
         return;
     }
 
     // SB/SH/SW
     if (opcode == 0b0100011) {
-        if (!callsan_can_load(rs1)) return;
-        if (!callsan_can_load(rs2)) return;
-        if (funct3 == 0b000) STORE(S1 + stype, S2, 1, &err);
-        else if (funct3 == 0b001) STORE(S1 + stype, S2, 2, &err);
-        else if (funct3 == 0b010) STORE(S1 + stype, S2, 4, &err);
+        if (!callsan_can_load(m, rs1)) return;
+        if (!callsan_can_load(m, rs2)) return;
+        if (funct3 == 0b000) STORE(m, S1 + stype, S2, 1, &err);
+        else if (funct3 == 0b001) STORE(m, S1 + stype, S2, 2, &err);
+        else if (funct3 == 0b010) STORE(m, S1 + stype, S2, 4, &err);
         else {
-            g_runtime_error_params[0] = g_pc;
-            g_runtime_error_type = ERROR_UNHANDLED_INSN;
+            m->runtime_error_params[0] = m->pc;
+            m->runtime_error_type = ERROR_UNHANDLED_INSN;
             return;
         }
         if (err) {
-            g_runtime_error_params[0] = S1 + stype;
-            g_runtime_error_type = ERROR_STORE;
+            m->runtime_error_params[0] = S1 + stype;
+            m->runtime_error_type = ERROR_STORE;
             return;
         }
-        callsan_report_store(S1 + stype, 1 << funct3, rs2);
-        g_pc += 4;
+        callsan_report_store(m, S1 + stype, 1 << funct3, rs2);
+        cache_data(&m->prog->cache, &m->prog->as.sections, S1 + stype,
+                   1 << funct3, true, m->pc);
+        m->pc += 4;
+        return;
+    }
+
+    // LR.W/SC.W/AMO*.W
+    if (opcode == 0b0101111) {
+        if (funct3 != 0b010) goto end;
+        if (!callsan_can_load(m, rs1)) return;
+        if (!callsan_can_load(m, rs2)) return;
+        exec_amo(m, funct7 >> 2, rd, rs2, S1, S2);
+        return;
+    }
+
+    // FENCE/FENCE.I, code is never modified, so only harts on their own
+    // threads need the host to order their accesses
+    if (opcode == 0b0001111) {
+        if (funct3 > 0b001) goto end;
+        if (m->prog->smp.threaded) __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        m->pc += 4;
         return;
     }
 
     // non-Load I-type
     if (opcode == 0b0010011) {
-        if (!callsan_can_load(rs1)) return;
+        if (!callsan_can_load(m, rs1)) return;
         u32 shamt = itype & 31;
         if (funct3 == 0b000) *D = S1 + itype;                       // ADDI
         else if (funct3 == 0b010) *D = (i32)S1 < itype;             // SLTI
@@ -450,20 +720,20 @@ void emulate() {
         else if (funct3 == 0b101 && funct7 == 32)
             *D = (i32)S1 >> shamt;  // SRAI
         else {
-            g_runtime_error_params[0] = g_pc;
-            g_runtime_error_type = ERROR_UNHANDLED_INSN;
+            m->runtime_error_params[0] = m->pc;
+            m->runtime_error_type = ERROR_UNHANDLED_INSN;
             return;
         }
-        g_pc += 4;
-        g_reg_written = rd;
-        callsan_store(rd);
+        m->pc += 4;
+        m->reg_written = rd;
+        callsan_store(m, rd);
         return;
     }
 
     // R-type
     if (opcode == 0b0110011) {
-        if (!callsan_can_load(rs1)) return;
-        if (!callsan_can_load(rs2)) return;
+        if (!callsan_can_load(m, rs1)) return;
+        if (!callsan_can_load(m, rs2)) return;
         u32 shamt = S2 & 31;
         if (funct3 == 0b000 && funct7 == 0) *D = S1 + S2;                 // ADD
         else if (funct3 == 0b000 && funct7 == 32) *D = S1 - S2;           // SUB
@@ -487,108 +757,227 @@ void emulate() {
         else if (funct3 == 0b110 && funct7 == 1) *D = rem32(S1, S2);   // REM
         else if (funct3 == 0b111 && funct7 == 1) *D = remu32(S1, S2);  // REMU
         else {
-            g_runtime_error_params[0] = g_pc;
-            g_runtime_error_type = ERROR_UNHANDLED_INSN;
+            m->runtime_error_params[0] = m->pc;
+            m->runtime_error_type = ERROR_UNHANDLED_INSN;
             return;
         }
-        g_pc += 4;
-        g_reg_written = rd;
-        callsan_store(rd);
+        m->pc += 4;
+        m->reg_written = rd;
+        callsan_store(m, rd);
         return;
     }
     // SYSTEM instructions
     if (opcode == 0x73) {
         if (funct3 == 0b000) {
             if (itype == 0x102) {  // SRET
-                do_sret();
+                do_sret(m);
             } else {  // ECALL
-                do_syscall();
+                do_syscall(m);
             }
             return;
-        } else if (funct3 == 0b001) {  // CSRRW
-            u32 old = rdcsr(itype);
-            if (rs1 != 0) wrcsr(itype, g_regs[rs1]);
-            g_regs[rd] = old;
+        }
+
+        // bits 9:8 of the CSR number are the lowest privilege that can
+        // access it, except for mhartid, since there is no machine mode to
+        // hand the hart id down
+        u32 csr = extr(inst, 31, 20);
+        if ((int)((csr >> 8) & 0b11) > m->privilege && csr != CSR_MHARTID) {
+            m->runtime_error_params[0] = m->pc;
+            m->runtime_error_type = ERROR_PROTECTION;
+            return;
+        }
+
+        // CSRs 0xC00-0xFFF are read-only, so writing them is illegal
+        if ((csr >> 10) == 3 && rs1 != 0) goto end;
+
+        if (funct3 == 0b001) {  // CSRRW
+            u32 old = rdcsr(m, csr);
+            if (rs1 != 0) wrcsr(m, csr, m->regs[rs1]);
+            m->regs[rd] = old;
         } else if (funct3 == 0b010) {  // CSRRS
-            u32 old = rdcsr(itype);
-            if (rs1 != 0) wrcsr(itype, old | g_regs[rs1]);
-            g_regs[rd] = old;
+            u32 old = rdcsr(m, csr);
+            if (rs1 != 0) wrcsr(m, csr, old | m->regs[rs1]);
+            m->regs[rd] = old;
         } else if (funct3 == 0b011) {  // CSRRC
-            u32 old = rdcsr(itype);
-            if (rs1 != 0) wrcsr(itype, old & ~g_regs[rs1]);
-            g_regs[rd] = old;
+            u32 old = rdcsr(m, csr);
+            if (rs1 != 0) wrcsr(m, csr, old & ~m->regs[rs1]);
+            m->regs[rd] = old;
         } else if (funct3 == 0b101) {  // CSRRWI
-            g_regs[rd] = g_csr[itype];
-            if (rs1 != 0) wrcsr(itype, rs1);        // used as imm
+            m->regs[rd] = rdcsr(m, csr);
+            if (rs1 != 0) wrcsr(m, csr, rs1);        // used as imm
         } else if (funct3 == 0b110) {  // CSRRSI
-            u32 old = rdcsr(itype);
-            if (rs1 != 0) wrcsr(itype, old | rs1);
-            g_regs[rd] = old;
+            u32 old = rdcsr(m, csr);
+            if (rs1 != 0) wrcsr(m, csr, old | rs1);
+            m->regs[rd] = old;
         } else if (funct3 == 0b111) {  // CSRRCI
-            u32 old = rdcsr(itype);
-            if (rs1 != 0) wrcsr(itype, old & ~rs1);
-            g_regs[rd] = old;
+            u32 old = rdcsr(m, csr);
+            if (rs1 != 0) wrcsr(m, csr, old & ~rs1);
+            m->regs[rd] = old;
         } else {
             goto end;
         }
-        callsan_store(rd);
-
-        // TODO: CSR instructions themselves are not privileged, s/m CSRs are,
-        // so this is wrong, but close enough
-        if (g_privilege_level == PRIV_USER) {
-            g_runtime_error_params[0] = g_pc;
-            g_runtime_error_type = ERROR_PROTECTION;
-        }
+        callsan_store(m, rd);
 
-        g_pc += 4;
-        g_reg_written = rd;
+        m->pc += 4;
+        m->reg_written = rd;
         return;
     }
 
     // if i reached here, it's an unhandled instruction
 end:
-    g_runtime_error_params[0] = g_pc;
-    g_runtime_error_type = ERROR_UNHANDLED_INSN;
+    m->runtime_error_params[0] = m->pc;
+    m->runtime_error_type = ERROR_UNHANDLED_INSN;
     return;
 }
 
+void emulate(Machine *m) {
+    u32 inst;
+    if (emulate_fetch(m, &inst)) execute(m, inst);
+}
+
+// Runs up to n instructions, stopping early on exit, on a runtime error,
+// before an instruction with a breakpoint (but the first one, so that a run
+// can resume from a breakpoint, unless resume says that this batch goes on
+// with a run cut into several) or once fewer than depth calls are active
+// The call depth is the length of the shadow stack, which the emulator keeps
+// whether the sanitizer reports are wanted or not
+// Buffered console output is flushed once at the end of the batch
+// Every instruction goes through the hooks of the optional models (profiler,
+// timing, caches, branch predictor, trace, breakpoints, dirty pages, devices).
+// They are inline and test a flag or a pointer before anything else, so the
+// ones that are off cost a single check each
+// All of that state is reached through m's Program, never through the
+// current one, so that programs can run at once on different threads
+// Returns the number of instructions executed, including a faulting one
+static inline u32 emulate_until(Machine *m, u32 n, u32 depth, bool resume) {
+    Program *p = m->prog;
+    console_input_poll(p);
+    p->breakpoints.hit = false;
+
+    u32 i = 0;
+    while (i < n && !m->exited) {
+        bool check = i || resume;
+        if (check && RARSJS_ARRAY_LEN(&m->shadow_stack) < depth) break;
+        if (check && breakpoint_at(&p->breakpoints, m->pc)) {
+            p->breakpoints.hit = true;
+            break;
+        }
+        if (m->instret >= p->timetravel.next) timetravel_checkpoint(p);
+        profile_count(&p->profile, m->pc);
+        emulate(m);
+        i++;
+        trace_retire(&p->trace, m);
+        if (m->runtime_error_type != ERROR_NONE) break;
+        timing_account(&p->timing, m->pc);
+    }
+
+    console_flush(p);
+    return i;
+}
+
+u32 emulate_n(Machine *m, u32 n) { return emulate_until(m, n, 0, false); }
+
+// Runs the current instruction and, if it is a call, the whole call, in up
+// to n instructions
+u32 emulate_step_over(Machine *m, u32 n) {
+    return emulate_until(m, n, RARSJS_ARRAY_LEN(&m->shadow_stack) + 1, false);
+}
+
+// Runs until the current function returns, in up to n instructions
+u32 emulate_step_out(Machine *m, u32 n) {
+    return emulate_until(m, n, RARSJS_ARRAY_LEN(&m->shadow_stack), false);
+}
+
+// Goes on with a run that was split into batches of up to n instructions,
+// down to the depth its first batch started from (0 for a plain run)
+u32 emulate_resume(Machine *m, u32 n, u32 depth) {
+    return emulate_until(m, n, depth, true);
+}
+
+void emulator_exit(Machine *m) {
+    m->exited = true;
+    console_flush(m->prog);
+#ifdef __wasm__
+    emu_exit();
+#endif
+}
+
 // wrapper for the webui
-u32 emu_load(u32 addr, int size) {
+u32 emu_load(Program *p, u32 addr, int size) {
     bool err;
-    u32 val = LOAD(addr, size, &err);
+    u32 val = LOAD(&p->machine, addr, size, &err);
     if (err) return 0;
     return val;
 }
 
-void emulator_enter_kernel() {
-    g_privilege_level = PRIV_SUPERVISOR;
+// Copies len bytes of guest memory from addr to out in one go, for the webui
+// Bit i of valid (LSB first) tells whether byte i could be loaded by the
+// default machine; the others, and MMIO, which is never read since that has
+// side effects, come out as 0
+void emu_read_window(Program *p, u32 addr, u32 len, u8 *out, u8 *valid) {
+    memset(out, 0, len);
+    memset(valid, 0, (len + 7) / 8);
+
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
+        if (sec->base == MMIO_BASE || !sec->read) continue;
+        if (sec->super && p->machine.privilege == PRIV_USER) continue;
+
+        // overlap of [addr, addr + len) with the loaded part of the section
+        u64 start = addr > sec->base ? addr : sec->base;
+        u64 end = (u64)addr + len;
+        u64 sec_end = (u64)sec->base + sec->contents.len;
+        if (sec_end < end) end = sec_end;
+        if (start >= end) continue;
+
+        memcpy(out + (start - addr), sec->contents.buf + (start - sec->base),
+               end - start);
+        for (u64 b = start - addr; b < end - addr; b++) {
+            valid[b / 8] |= 1 << (b % 8);
+        }
+    }
 }
 
-void emulator_leave_kernel() {
-    g_privilege_level = PRIV_USER;
+void emulator_enter_kernel(Machine *m) {
+    m->privilege = PRIV_SUPERVISOR;
 }
 
-void emulator_interrupt_set_pending(u32 intno) {
-    g_csr[CSR_MIP] |= 1u << intno;
+void emulator_leave_kernel(Machine *m) {
+    m->privilege = PRIV_USER;
 }
 
-void emulator_interrupt_clear_pending(u32 intno) {
-    g_csr[CSR_MIP] &= ~(1u << intno);
+// Can target a hart running on another thread
+void emulator_interrupt_set_pending(Machine *m, u32 intno) {
+    __atomic_fetch_or(&m->csr[CSR_MIP], 1u << intno, __ATOMIC_SEQ_CST);
+    emulator_interrupt_recheck(m);
 }
 
-void emulator_deliver_interrupt(u32 cause) {
+// Fewer pending interrupts can't make one taken, so the flag is left for the
+// next instruction to clear
+void emulator_interrupt_clear_pending(Machine *m, u32 intno) {
+    __atomic_fetch_and(&m->csr[CSR_MIP], ~(1u << intno), __ATOMIC_RELAXED);
+}
+
+// Makes the next instruction look for pending interrupts. Called after
+// changing SIE, MIP or MIE in a way that may let one be taken
+// Only the hart itself clears the flag, so a stale false is never stored
+void emulator_interrupt_recheck(Machine *m) {
+    __atomic_store_n(&m->irq_maybe_pending, true, __ATOMIC_SEQ_CST);
+}
+
+void emulator_deliver_interrupt(Machine *m, u32 cause) {
     bool is_interrupt = cause & CAUSE_INTERRUPT;
     u32 off = cause & ~CAUSE_INTERRUPT;
     assert(off < 32);
 
-    int prev_privilege = g_privilege_level;
+    int prev_privilege = m->privilege;
     
-    g_csr[CSR_SEPC] = g_pc;
-    g_csr[CSR_SCAUSE] = cause;
+    m->csr[CSR_SEPC] = m->pc;
+    m->csr[CSR_SCAUSE] = cause;
 
-    u32 status = g_csr[CSR_MSTATUS];
+    u32 status = m->csr[CSR_MSTATUS];
     bool was_enabled = status & STATUS_SIE;
-    g_privilege_level = PRIV_SUPERVISOR;
+    m->privilege = PRIV_SUPERVISOR;
 
     // STATUS.xIE = 0 
     status &= ~STATUS_SIE;
@@ -597,34 +986,57 @@ void emulator_deliver_interrupt(u32 cause) {
     // STATUS.xPP = prev_privilege
     // NOTE: SPP is 1 bit long
     status = (status & ~STATUS_SPP) | ((prev_privilege != PRIV_USER) ? STATUS_SPP : 0);
-    g_csr[CSR_MSTATUS] = status;
+    m->csr[CSR_MSTATUS] = status;
 
-    u32 tvec_base = g_csr[CSR_STVEC] & ~0x3u;
-    u32 tvec_mode = g_csr[CSR_STVEC] & 0x3u;
-    if (tvec_mode == 1 && is_interrupt) g_pc = tvec_base + (off << 2);
-    else g_pc = tvec_base;
+    u32 tvec_base = m->csr[CSR_STVEC] & ~0x3u;
+    u32 tvec_mode = m->csr[CSR_STVEC] & 0x3u;
+    if (tvec_mode == 1 && is_interrupt) m->pc = tvec_base + (off << 2);
+    else m->pc = tvec_base;
 }
 
-void emulator_init(void) {
-    g_exited = false;
-    g_exit_code = 0;
-
-    memset(g_regs, 0, sizeof(g_regs));
-    g_pc = TEXT_BASE;
-    g_mem_written_len = 0;
-    g_mem_written_addr = 0;
-    g_reg_written = 0;
-    g_error_line = 0;
-    g_error = NULL;
-
-    memset(g_runtime_error_params, 0, sizeof(g_runtime_error_params));
-    g_runtime_error_type = 0;
-
-    prepare_aux_sections();
+// Puts the hart in its reset state, with the pc at the start of the text
+// The callsan state is reset separately, by callsan_init
+void machine_init(Machine *m) {
+    m->exited = false;
+    m->exit_code = 0;
+    m->instret = 0;
+    m->privilege = PRIV_USER;
+    m->hartid = 0;
+    m->stack_top = STACK_TOP;
+    m->reserved = false;
+
+    memset(m->regs, 0, sizeof(m->regs));
+    m->pc = TEXT_BASE;
+    m->mem_written_len = 0;
+    m->mem_written_addr = 0;
+    m->reg_written = 0;
+
+    memset(m->runtime_error_params, 0, sizeof(m->runtime_error_params));
+    m->runtime_error_type = 0;
+
+    memset(m->csr, 0, sizeof(m->csr));
+    m->csr[CSR_MSTATUS] |= STATUS_SIE;
+    m->csr[CSR_MIE] |= 1u << (CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
+    m->csr[CSR_MIE] |= 1u << (CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
+    m->csr[CSR_MIE] |= 1u << (CAUSE_SUPERVISOR_EXTERNAL & ~CAUSE_INTERRUPT);
+    emulator_interrupt_recheck(m);
+}
 
-    memset(g_csr, 0, sizeof(g_csr));
-    g_csr[CSR_MSTATUS] |= STATUS_SIE;
-    g_csr[CSR_MIE] |= 1u << (CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
-    g_csr[CSR_MIE] |= 1u << (CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
-    g_csr[CSR_MIE] |= 1u << (CAUSE_SUPERVISOR_EXTERNAL & ~CAUSE_INTERRUPT);
+// Resets the machine of p along with everything it shares
+void emulator_init(Program *p) {
+    smp_disable(p);
+    breakpoint_reset(p);
+    machine_init(&p->machine);
+    p->as.error_line = 0;
+    p->as.error = NULL;
+
+    prepare_aux_sections(p);
+    dev_reset(p);
+    timetravel_disable(p);
+    snapshot_reset(p);
+    profile_disable(p);
+    profile_calls_disable(p);
+    timing_disable(p);
+    cache_disable(p);
+    bpred_disable(p);
 }
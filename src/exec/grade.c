@@ -0,0 +1,377 @@
+#include "rarsjs/grade.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rarsjs/dev.h"
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+#include "rarsjs/snapshot.h"
+
+// The program is assembled or loaded once. Cases are spread over worker
+// threads, each running its own copy of the program, and every case starts
+// from a snapshot of that copy taken before the first one. Guest output is
+// compared with the expected one as it is flushed, so a wrong answer stops
+// the case right away
+
+#define GRADE_BATCH 65536
+
+static const char *const GRADE_STATUS_NAMES[] = {
+    "pass", "wrong", "error", "limit", "timeout", "crash",
+};
+
+// Expected output of the case running on this thread, and how much of it was
+// matched
+static _Thread_local u8 *g_expected;
+static _Thread_local size_t g_expected_len;
+static _Thread_local u64 g_output_len;
+static _Thread_local bool g_mismatch;
+
+static void grade_sink(const u8 *buf, u32 len) {
+    for (u32 i = 0; i < len && !g_mismatch; i++) {
+        if (g_output_len >= g_expected_len ||
+            buf[i] != g_expected[g_output_len]) {
+            g_mismatch = true;
+            break;
+        }
+        g_output_len++;
+    }
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    rewind(file);
+
+    char *buf = malloc(*len + 1);
+    RARSJS_CHECK_OOM(buf);
+    if (fread(buf, 1, *len, file) != *len) {
+        free(buf);
+        buf = NULL;
+    } else {
+        buf[*len] = 0;
+    }
+
+    fclose(file);
+    return buf;
+}
+
+// name relative to dir, unless it is absolute
+static char *join_path(const char *dir, const char *name, const char *ext) {
+    size_t len = strlen(dir) + strlen(name) + strlen(ext) + 2;
+    char *path = malloc(len);
+    RARSJS_CHECK_OOM(path);
+    if (*dir && *name != '/') snprintf(path, len, "%s/%s%s", dir, name, ext);
+    else snprintf(path, len, "%s%s", name, ext);
+    return path;
+}
+
+static int case_cmp(const void *a, const void *b) {
+    return strcmp(((const GradeCase *)a)->name, ((const GradeCase *)b)->name);
+}
+
+// Every NAME.out in dir is a case, with NAME.in as its input if it exists
+static bool load_dir(const char *path, RARSJS_ARRAY(GradeCase) *out,
+                     char **error) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        *error = "could not open cases directory";
+        return false;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        size_t len = strlen(ent->d_name);
+        if (len <= 4 || strcmp(ent->d_name + len - 4, ".out")) continue;
+
+        GradeCase *c = RARSJS_ARRAY_PUSH(out);
+        c->name = strndup(ent->d_name, len - 4);
+        RARSJS_CHECK_OOM(c->name);
+        c->expected = join_path(path, c->name, ".out");
+        c->input = join_path(path, c->name, ".in");
+        if (access(c->input, R_OK)) {
+            free(c->input);
+            c->input = NULL;
+        }
+    }
+
+    closedir(dir);
+    qsort(out->buf, out->len, sizeof(GradeCase), case_cmp);
+    return true;
+}
+
+// Each line of a manifest is "input expected", with - for no input and
+// relative paths relative to the manifest. Empty lines and # comments are
+// skipped, and every file named must be readable
+static bool load_manifest(const char *path, RARSJS_ARRAY(GradeCase) *out,
+                          char **error) {
+    size_t len;
+    char *txt = read_file(path, &len);
+    if (!txt) {
+        *error = "could not read cases manifest";
+        return false;
+    }
+
+    char *dir = strdup(path);
+    RARSJS_CHECK_OOM(dir);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = 0;
+    else *dir = 0;
+
+    bool ok = true;
+    char *save;
+    for (char *line = strtok_r(txt, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        char *save_line;
+        char *input = strtok_r(line, " \t\r", &save_line);
+        if (!input || *input == '#') continue;
+
+        char *expected = strtok_r(NULL, " \t\r", &save_line);
+        if (!expected || strtok_r(NULL, " \t\r", &save_line)) {
+            *error = "manifest lines must be 'input expected'";
+            ok = false;
+            break;
+        }
+
+        GradeCase *c = RARSJS_ARRAY_PUSH(out);
+        c->name = strdup(expected);
+        RARSJS_CHECK_OOM(c->name);
+        c->expected = join_path(dir, expected, "");
+        c->input = strcmp(input, "-") ? join_path(dir, input, "") : NULL;
+        if (access(c->expected, R_OK)) {
+            *error = "could not read the expected output of a case";
+            ok = false;
+            break;
+        }
+        if (c->input && access(c->input, R_OK)) {
+            *error = "could not read the input of a case";
+            ok = false;
+            break;
+        }
+    }
+
+    free(dir);
+    free(txt);
+    return ok;
+}
+
+// Reads the cases from a directory or a manifest file
+bool grade_load_cases(const char *path, RARSJS_ARRAY(GradeCase) *out,
+                      char **error) {
+    struct stat st;
+    if (stat(path, &st)) {
+        *error = "could not find cases";
+        return false;
+    }
+
+    bool ok = S_ISDIR(st.st_mode) ? load_dir(path, out, error)
+                                  : load_manifest(path, out, error);
+    if (ok && RARSJS_ARRAY_IS_EMPTY(out)) {
+        *error = "no cases found";
+        ok = false;
+    }
+    return ok;
+}
+
+void grade_free_cases(RARSJS_ARRAY(GradeCase) *cases) {
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(cases); i++) {
+        GradeCase *c = RARSJS_ARRAY_GET(cases, i);
+        free(c->name);
+        free(c->input);
+        free(c->expected);
+    }
+    RARSJS_ARRAY_FREE(cases);
+}
+
+static u64 now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void grade_case(Program *p, const GradeCase *c, const Snapshot *start,
+                       const GradeConfig *config, GradeResult *res) {
+    Machine *m = &p->machine;
+    *res = (GradeResult){.status = GRADE_PASS};
+
+    g_expected = (u8 *)read_file(c->expected, &g_expected_len);
+    if (!g_expected) {
+        res->status = GRADE_CRASH;
+        return;
+    }
+    g_output_len = 0;
+    g_mismatch = false;
+
+    // the input queue isn't part of snapshots, so it is dropped by hand
+    dev_reset(p);
+    snapshot_restore(p, start);
+    FILE *in = c->input ? fopen(c->input, "rb") : NULL;
+    console_input_set_file(p, in);
+    console_output_set_sink(p, grade_sink);
+
+    u64 begin = now_ms();
+    u64 instret = m->instret;
+    while (!m->exited && !g_mismatch) {
+        u32 batch = GRADE_BATCH;
+        if (config->max_instructions) {
+            u64 left = config->max_instructions - (m->instret - instret);
+            if (!left) {
+                res->status = GRADE_LIMIT;
+                break;
+            }
+            if (left < batch) batch = left;
+        }
+
+        emulate_n(m, batch);
+        if (m->runtime_error_type != ERROR_NONE) {
+            res->status = GRADE_ERROR;
+            res->error = m->runtime_error_type;
+            break;
+        }
+        if (config->max_ms && now_ms() - begin > config->max_ms) {
+            res->status = GRADE_TIMEOUT;
+            break;
+        }
+    }
+
+    bool wrong = g_mismatch || g_output_len != g_expected_len;
+    if (res->status == GRADE_PASS && wrong) res->status = GRADE_WRONG;
+    res->mismatch_at = g_output_len;
+    res->exit_code = m->exit_code;
+    res->instructions = m->instret - instret;
+    res->ms = now_ms() - begin;
+
+    console_output_set_sink(p, NULL);
+    console_input_set_file(p, NULL);
+    if (in) fclose(in);
+    free(g_expected);
+    g_expected = NULL;
+}
+
+typedef struct {
+    const GradeCase *cases;
+    size_t len;
+    const GradeConfig *config;
+    GradeResult *results;
+    const Program *prog;
+    u32 next;  // next case to run
+} GradeJobs;
+
+// Takes cases until there are none left, running them on a copy of the
+// program of its own
+static void *grade_worker(void *arg) {
+    GradeJobs *jobs = arg;
+    Program *own = malloc(sizeof(Program));
+    RARSJS_CHECK_OOM(own);
+    program_init(own);
+    program_copy(own, jobs->prog);
+
+    Snapshot *start = snapshot_create(own);
+    u32 i;
+    while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) <
+           jobs->len) {
+        grade_case(own, &jobs->cases[i], start, jobs->config,
+                   &jobs->results[i]);
+    }
+    snapshot_free(start);
+
+    program_free(own);
+    free(own);
+    return NULL;
+}
+
+// Runs every case from the current state of p, which is left untouched
+void grade_run(const Program *p, const GradeCase *cases, size_t len,
+               const GradeConfig *config, GradeResult *results) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 jobs = config->jobs ? config->jobs : cpus > 0 ? cpus : 1;
+    if (jobs > len) jobs = len;
+
+    for (size_t i = 0; i < len; i++) {
+        results[i] = (GradeResult){.status = GRADE_CRASH};
+    }
+    GradeJobs shared = {cases, len, config, results, p, 0};
+
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    RARSJS_CHECK_OOM(threads);
+    u32 started = 0;
+    for (u32 w = 0; w < jobs; w++) {
+        if (pthread_create(&threads[started], NULL, grade_worker, &shared)) {
+            break;
+        }
+        started++;
+    }
+
+    // if no thread could be started, this one does all the work
+    if (!started) grade_worker(&shared);
+    for (u32 w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    free(threads);
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// One line per case as TSV, or a single JSON object
+void grade_report(FILE *out, const GradeCase *cases,
+                  const GradeResult *results, size_t len, bool json) {
+    size_t passed = 0;
+    for (size_t i = 0; i < len; i++) passed += results[i].status == GRADE_PASS;
+
+    if (!json) {
+        fprintf(out, "case\tstatus\texit\tinstructions\tms\tdetail\n");
+    } else {
+        fprintf(out, "{\"passed\": %zu, \"total\": %zu, \"cases\": [", passed,
+                len);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        const GradeResult *res = &results[i];
+        const char *status = GRADE_STATUS_NAMES[res->status];
+        if (!json) {
+            fprintf(out, "%s\t%s\t%d\t%llu\t%llu\t", cases[i].name, status,
+                    res->exit_code, (unsigned long long)res->instructions,
+                    (unsigned long long)res->ms);
+            if (res->status == GRADE_WRONG) {
+                fprintf(out, "output differs at byte %llu",
+                        (unsigned long long)res->mismatch_at);
+            } else if (res->status == GRADE_ERROR) {
+                fprintf(out, "runtime error %u", res->error);
+            }
+            fputc('\n', out);
+            continue;
+        }
+
+        fprintf(out, "%s\n  {\"case\": ", i ? "," : "");
+        json_string(out, cases[i].name);
+        fprintf(out,
+                ", \"status\": \"%s\", \"exit\": %d, \"instructions\": %llu, "
+                "\"ms\": %llu",
+                status, res->exit_code, (unsigned long long)res->instructions,
+                (unsigned long long)res->ms);
+        if (res->status == GRADE_WRONG) {
+            fprintf(out, ", \"mismatch_at\": %llu",
+                    (unsigned long long)res->mismatch_at);
+        } else if (res->status == GRADE_ERROR) {
+            fprintf(out, ", \"error\": %u", res->error);
+        }
+        fputc('}', out);
+    }
+
+    if (json) fprintf(out, "\n]}\n");
+}
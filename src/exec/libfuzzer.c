@@ -1,8 +1,9 @@
 #include "rarsjs/core.h"
+#include "rarsjs/program.h"
 
 int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
-    assemble((const char*)Data, Size, false);
-    free_runtime();
+    assemble(&g_program_default, (const char*)Data, Size, false);
+    free_runtime(&g_program_default);
     return 0;
 }
 
@@ -0,0 +1,195 @@
+#include "rarsjs/profile.h"
+
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// Starts counting from zero; call after the program has been assembled or
+// loaded, since the counters are sized after its text section
+export void profile_enable(Program *prog) {
+    profile_disable(prog);
+
+    // programs loaded from an ELF file don't set the text section
+    Section *text = NULL;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&prog->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&prog->as.sections, i);
+        if (sec->base == TEXT_BASE) text = sec;
+    }
+    if (!text || text->contents.len < 4) return;
+
+    Profile *p = &prog->profile;
+    p->len = text->contents.len / 4;
+    p->counts = malloc(p->len * sizeof(u64));
+    RARSJS_CHECK_OOM(p->counts);
+    memset(p->counts, 0, p->len * sizeof(u64));
+}
+
+export void profile_disable(Program *prog) {
+    Profile *p = &prog->profile;
+    free(p->counts);
+    p->counts = NULL;
+    p->len = 0;
+}
+
+u64 profile_total(const Program *prog) {
+    const Profile *p = &prog->profile;
+    u64 total = 0;
+    for (u32 i = 0; i < p->len; i++) {
+        total += p->counts[i];
+    }
+    return total;
+}
+
+// Instructions are emitted in source order, so the ones from the same line
+// (like the expansion of a pseudoinstruction) are next to each other
+RARSJS_ARRAY(ProfileEntry) profile_by_line(const Program *prog) {
+    const Profile *p = &prog->profile;
+    const RARSJS_ARRAY(u32) *lines = &prog->as.text_by_linenum;
+    RARSJS_ARRAY(ProfileEntry) ret = RARSJS_ARRAY_NEW(ProfileEntry);
+    u32 len = p->len;
+    if (len > RARSJS_ARRAY_LEN(lines)) len = RARSJS_ARRAY_LEN(lines);
+
+    for (u32 i = 0; i < len; i++) {
+        if (!p->counts[i]) continue;
+
+        u32 line = *RARSJS_ARRAY_GET(lines, i);
+        size_t n = RARSJS_ARRAY_LEN(&ret);
+        if (n && RARSJS_ARRAY_GET(&ret, n - 1)->key == line) {
+            RARSJS_ARRAY_GET(&ret, n - 1)->count += p->counts[i];
+        } else {
+            *RARSJS_ARRAY_PUSH(&ret) = (ProfileEntry){line, p->counts[i]};
+        }
+    }
+
+    return ret;
+}
+
+// Each instruction is attributed to the closest label before it, like in
+// the callsan backtrace
+RARSJS_ARRAY(ProfileEntry) profile_by_label(Program *prog) {
+    const Profile *p = &prog->profile;
+    RARSJS_ARRAY(ProfileEntry) ret = RARSJS_ARRAY_NEW(ProfileEntry);
+
+    for (u32 i = 0; i < p->len; i++) {
+        if (!p->counts[i]) continue;
+
+        LabelData *label;
+        u32 off;
+        if (!pc_to_label_r(prog, TEXT_BASE + i * 4, &label, &off)) continue;
+
+        u32 key = label - prog->as.labels.buf;
+        size_t n = RARSJS_ARRAY_LEN(&ret);
+        if (n && RARSJS_ARRAY_GET(&ret, n - 1)->key == key) {
+            RARSJS_ARRAY_GET(&ret, n - 1)->count += p->counts[i];
+        } else {
+            *RARSJS_ARRAY_PUSH(&ret) = (ProfileEntry){key, p->counts[i]};
+        }
+    }
+
+    return ret;
+}
+
+// Call counting only does work on calls and returns: the instructions in
+// between are attributed in bulk using the hart's instret
+
+static u32 profile_func(Profile *p, u32 pc) {
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->funcs); i++) {
+        if (RARSJS_ARRAY_GET(&p->funcs, i)->pc == pc) return i;
+    }
+
+    *RARSJS_ARRAY_PUSH(&p->funcs) = (ProfileFunc){.pc = pc};
+    return RARSJS_ARRAY_LEN(&p->funcs) - 1;
+}
+
+static u32 profile_child(Profile *p, u32 parent, u32 pc) {
+    ProfileNode *pn = RARSJS_ARRAY_GET(&p->nodes, parent);
+    for (u32 i = pn->first_child; i;
+         i = RARSJS_ARRAY_GET(&p->nodes, i)->next_sibling) {
+        ProfileNode *n = RARSJS_ARRAY_GET(&p->nodes, i);
+        if (RARSJS_ARRAY_GET(&p->funcs, n->func)->pc == pc) return i;
+    }
+
+    u32 func = profile_func(p, pc);
+    u32 idx = RARSJS_ARRAY_LEN(&p->nodes);
+    // the push may move the array, so pn can't be used after it
+    u32 sibling = pn->first_child;
+    *RARSJS_ARRAY_PUSH(&p->nodes) =
+        (ProfileNode){.func = func, .parent = parent, .next_sibling = sibling};
+    RARSJS_ARRAY_GET(&p->nodes, parent)->first_child = idx;
+    return idx;
+}
+
+// Gives the instructions executed since the last call or return to the
+// function on top of the stack
+static void profile_attribute(Profile *p, u64 instret) {
+    size_t depth = RARSJS_ARRAY_LEN(&p->stack);
+    ProfileNode *n =
+        RARSJS_ARRAY_GET(&p->nodes, *RARSJS_ARRAY_GET(&p->stack, depth - 1));
+    u64 delta = instret - p->last_instret;
+    n->self += delta;
+    RARSJS_ARRAY_GET(&p->funcs, n->func)->exclusive += delta;
+    p->last_instret = instret;
+}
+
+static void profile_push(Profile *p, u32 node, u64 instret) {
+    ProfileFunc *f =
+        RARSJS_ARRAY_GET(&p->funcs, RARSJS_ARRAY_GET(&p->nodes, node)->func);
+    u32 depth = RARSJS_ARRAY_LEN(&p->stack);
+
+    f->calls++;
+    if (depth > f->max_depth) f->max_depth = depth;
+    if (f->active++ == 0) f->entered_at = instret;
+    *RARSJS_ARRAY_PUSH(&p->stack) = node;
+}
+
+static void profile_pop(Profile *p, u64 instret) {
+    u32 node = *RARSJS_ARRAY_POP(&p->stack);
+    ProfileFunc *f =
+        RARSJS_ARRAY_GET(&p->funcs, RARSJS_ARRAY_GET(&p->nodes, node)->func);
+    if (--f->active == 0) f->inclusive += instret - f->entered_at;
+}
+
+// Starts a new call graph rooted at the current pc
+void profile_calls_enable(Program *prog) {
+    profile_calls_disable(prog);
+    Profile *p = &prog->profile;
+    Machine *m = &prog->machine;
+    p->calls = true;
+    p->last_instret = m->instret;
+
+    *RARSJS_ARRAY_PUSH(&p->nodes) = (ProfileNode){.func = profile_func(p, m->pc)};
+    profile_push(p, 0, m->instret);
+}
+
+void profile_calls_disable(Program *prog) {
+    Profile *p = &prog->profile;
+    p->calls = false;
+    RARSJS_ARRAY_FREE(&p->funcs);
+    RARSJS_ARRAY_FREE(&p->nodes);
+    RARSJS_ARRAY_FREE(&p->stack);
+}
+
+void profile_calls_enter(Profile *p, u32 pc, u64 instret) {
+    profile_attribute(p, instret);
+    u32 top = *RARSJS_ARRAY_GET(&p->stack, RARSJS_ARRAY_LEN(&p->stack) - 1);
+    profile_push(p, profile_child(p, top, pc), instret);
+}
+
+void profile_calls_leave(Profile *p, u64 instret) {
+    // a ret from the entry point itself isn't a return from a call
+    if (RARSJS_ARRAY_LEN(&p->stack) < 2) return;
+    profile_attribute(p, instret);
+    profile_pop(p, instret);
+}
+
+// Stops recording, treating the functions still running as returned, so
+// that the counts can be read
+void profile_calls_finish(Program *prog) {
+    Profile *p = &prog->profile;
+    u64 instret = prog->machine.instret;
+    if (!p->calls) return;
+    profile_attribute(p, instret);
+    while (!RARSJS_ARRAY_IS_EMPTY(&p->stack)) {
+        profile_pop(p, instret);
+    }
+    p->calls = false;
+}
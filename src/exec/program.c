@@ -0,0 +1,110 @@
+#include "rarsjs/program.h"
+
+export Program g_program_default = {
+    .machine.prog = &g_program_default,
+    .smp = {.len = 1, .harts = {&g_program_default.machine}},
+    .timetravel.next = UINT64_MAX,
+    .dirty.smp = &g_program_default.smp,
+};
+
+#ifdef __wasm__
+// Where JS finds the parts of the default program it reads directly
+export Machine *const g_program_machine = &g_program_default.machine;
+export u32 *const g_program_error_line = &g_program_default.as.error_line;
+export const char **const g_program_error = &g_program_default.as.error;
+export RARSJS_ARRAY(u32) *const g_program_text_by_linenum =
+    &g_program_default.as.text_by_linenum;
+export u64 *const g_program_console_out_total =
+    &g_program_default.console.out_total;
+export u64 **const g_program_profile_counts = &g_program_default.profile.counts;
+export u32 *const g_program_profile_len = &g_program_default.profile.len;
+export u32 *const g_program_dirty_generation =
+    &g_program_default.dirty.generation;
+
+// The default machine's fields
+export u32 *const g_machine_regs = g_program_default.machine.regs;
+export u32 *const g_machine_pc = &g_program_default.machine.pc;
+export bool *const g_machine_exited = &g_program_default.machine.exited;
+export u64 *const g_machine_instret = &g_program_default.machine.instret;
+export u32 *const g_machine_mem_written_len =
+    &g_program_default.machine.mem_written_len;
+export u32 *const g_machine_mem_written_addr =
+    &g_program_default.machine.mem_written_addr;
+export u32 *const g_machine_reg_written =
+    &g_program_default.machine.reg_written;
+export Error *const g_machine_runtime_error_type =
+    &g_program_default.machine.runtime_error_type;
+export u32 *const g_machine_runtime_error_params =
+    g_program_default.machine.runtime_error_params;
+export RARSJS_ARRAY(ShadowStackEnt) *const g_machine_shadow_stack =
+    &g_program_default.machine.shadow_stack;
+export u8 *const g_machine_callsan_stack_written_by =
+    g_program_default.machine.callsan_stack_written_by;
+#endif
+
+// An empty program, which can be assembled into or loaded and run like the
+// default one
+void program_init(Program *p) {
+    *p = (Program){
+        .machine.prog = p,
+        .smp = {.len = 1, .harts = {&p->machine}},
+        .timetravel.next = UINT64_MAX,
+        .dirty.smp = &p->smp,
+    };
+}
+
+// Copies the memory, devices and hart 0 of src into dst, which must be
+// empty, so that dst can run on from where src is without touching it.
+// Symbols, the other harts and the models are left out
+void program_copy(Program *dst, const Program *src) {
+    const Assembler *as = &src->as;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&as->sections); i++) {
+        const Section *sec = *RARSJS_ARRAY_GET(&as->sections, i);
+        Section *copy = malloc(sizeof(Section));
+        RARSJS_CHECK_OOM(copy);
+        *copy = *sec;
+        copy->relocations = RARSJS_ARRAY_NEW(Relocation);
+        copy->snapshot.baseline = NULL;
+        memset(copy->dirty_pages, 0, sizeof(copy->dirty_pages));
+
+        size_t len = sec->contents.len;
+        copy->contents.buf = malloc(len ? len : 1);
+        RARSJS_CHECK_OOM(copy->contents.buf);
+        if (len) memcpy(copy->contents.buf, sec->contents.buf, len);
+        copy->contents.cap = len;
+        *RARSJS_ARRAY_PUSH(&dst->as.sections) = copy;
+
+        if (sec == as->text) dst->as.text = copy;
+        if (sec == as->data) dst->as.data = copy;
+        if (sec == as->stack) dst->as.stack = copy;
+        if (sec == as->kernel_text) dst->as.kernel_text = copy;
+        if (sec == as->kernel_data) dst->as.kernel_data = copy;
+        if (sec == as->mmio) dst->as.mmio = copy;
+    }
+
+    dst->machine = src->machine;
+    dst->machine.prog = dst;
+    dst->machine.shadow_stack = RARSJS_ARRAY_NEW(ShadowStackEnt);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&src->machine.shadow_stack); i++) {
+        *RARSJS_ARRAY_PUSH(&dst->machine.shadow_stack) =
+            *RARSJS_ARRAY_GET(&src->machine.shadow_stack, i);
+    }
+
+    dst->dev = src->dev;
+    dst->console.out_total = src->console.out_total;
+}
+
+// Frees everything p holds, leaving it empty
+void program_free(Program *p) {
+    smp_disable(p);
+    breakpoint_reset(p);
+    timetravel_disable(p);
+    snapshot_reset(p);
+    profile_disable(p);
+    profile_calls_disable(p);
+    cache_disable(p);
+    bpred_disable(p);
+    dev_reset(p);
+    free_runtime(p);
+    program_init(p);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+typedef enum BpredKind {
+    BPRED_BTFN = 0,  // static: backward taken, forward not taken
+    BPRED_1BIT = 1,
+    BPRED_2BIT = 2,
+    BPRED_GSHARE = 3,
+} BpredKind;
+
+typedef struct BpredConfig {
+    BpredKind kind;
+    u32 table_bits;    // log2 of the number of counters
+    u32 history_bits;  // global history length for gshare
+    u32 ras_size;      // return address stack entries, 0 to disable
+} BpredConfig;
+
+typedef struct BpredStats {
+    u64 branches;
+    u64 mispredicts;
+} BpredStats;
+
+typedef struct Bpred {
+    bool enabled;
+    BpredConfig config;
+
+    u8 *counters;  // 1 << table_bits
+    u32 history;
+    u32 *ras;      // circular, the oldest entries get overwritten
+    u32 ras_top;
+    u32 ras_len;
+
+    BpredStats branches;
+    BpredStats returns;
+    BpredStats *by_pc;  // conditional branches, indexed by (pc - TEXT_BASE) / 4
+    u32 by_pc_len;
+} Bpred;
+
+// Used by the next bpred_enable
+extern export BpredConfig g_bpred_config;
+
+const char *bpred_enable(Program *p);
+void bpred_disable(Program *p);
+void bpred_predict_branch(Bpred *b, u32 pc, bool backward, bool taken);
+void bpred_predict_call(Bpred *b, u32 ret_addr);
+void bpred_predict_ret(Bpred *b, u32 target);
+
+// Conditional branches, and the jumps that push or pop the return stack
+static inline void bpred_branch(Bpred *b, u32 pc, i32 offset, bool taken) {
+    if (b->enabled) bpred_predict_branch(b, pc, offset < 0, taken);
+}
+
+static inline void bpred_call(Bpred *b, u32 ret_addr) {
+    if (b->enabled) bpred_predict_call(b, ret_addr);
+}
+
+static inline void bpred_ret(Bpred *b, u32 target) {
+    if (b->enabled) bpred_predict_ret(b, target);
+}
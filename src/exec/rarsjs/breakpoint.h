@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+// Breakpoints in the text section, one bit per instruction indexed by
+// (pc - TEXT_BASE) / 4. bits is allocated by the first breakpoint set after
+// the program is assembled or loaded
+typedef struct Breakpoints {
+    u8 *bits;
+    u32 len;    // instructions covered by bits
+    u32 count;  // breakpoints set, checked before looking at bits
+    bool hit;   // the last emulate_n stopped on a breakpoint
+
+    // where each source line starts in the text: the instruction indices of
+    // line l are line_pcs[line_start[l]] up to line_pcs[line_start[l + 1]]
+    u32 *line_start;
+    u32 *line_pcs;
+    u32 lines;  // entries of line_start, minus one
+} Breakpoints;
+
+bool breakpoint_set(Program *p, u32 pc, bool on);
+u32 breakpoint_set_line(Program *p, u32 line, bool on);
+void breakpoint_clear_all(Program *p);
+void breakpoint_reset(Program *p);
+bool breakpoint_hit(Program *p);
+
+// Whether the instruction at pc has a breakpoint
+static inline bool breakpoint_at(const Breakpoints *b, u32 pc) {
+    if (!b->count) return false;
+    u32 off = pc - TEXT_BASE;
+    u32 idx = off / 4;
+    return !(off & 3) && idx < b->len && (b->bits[idx / 8] >> (idx % 8) & 1);
+}
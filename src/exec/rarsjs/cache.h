@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+typedef enum CachePolicy {
+    CACHE_LRU = 0,
+    CACHE_FIFO = 1,
+    CACHE_RANDOM = 2,
+} CachePolicy;
+
+typedef struct CacheConfig {
+    u32 size;  // bytes, all sizes must be powers of two
+    u32 line;  // bytes
+    u32 ways;
+    CachePolicy policy;
+    bool write_back;      // otherwise write-through
+    bool write_allocate;  // otherwise stores that miss bypass the cache
+} CacheConfig;
+
+typedef struct CacheStats {
+    u64 accesses;
+    u64 misses;
+    u64 evictions;
+    u64 mem_writes;  // write-backs of dirty lines, or write-through stores
+} CacheStats;
+
+typedef struct Cache {
+    CacheConfig config;
+    u32 sets;
+    u32 line_shift;
+
+    // way w of set s is at s * ways + w
+    u32 *tags;
+    u64 *valid;  // bitsets
+    u64 *dirty;
+    u64 *stamp;  // last use for LRU, fill time for FIFO
+    u64 clock;
+    u32 rng;
+
+    CacheStats stats;
+    CacheStats *by_section;  // parallel to the program's sections
+    CacheStats *by_pc;       // indexed by (pc - TEXT_BASE) / 4
+    u32 by_pc_len;
+} Cache;
+
+// L1I and L1D
+typedef struct Caches {
+    bool enabled;
+    Cache icache;
+    Cache dcache;
+} Caches;
+
+// Used by the next cache_enable
+extern export CacheConfig g_icache_config;
+extern export CacheConfig g_dcache_config;
+
+const char *cache_config_check(const CacheConfig *config);
+const char *cache_enable(Program *p);
+void cache_disable(Program *p);
+void cache_access(Cache *c, const RARSJS_ARRAY(SectionPtr) *sections,
+                  u32 addr, u32 len, bool write, u32 pc);
+
+// Instruction fetches go to L1I, loads and stores to L1D. sections are the
+// ones of the program, for the per-section counters
+static inline void cache_fetch(Caches *c,
+                               const RARSJS_ARRAY(SectionPtr) *sections,
+                               u32 pc) {
+    if (c->enabled) cache_access(&c->icache, sections, pc, 4, false, pc);
+}
+
+static inline void cache_data(Caches *c,
+                              const RARSJS_ARRAY(SectionPtr) *sections,
+                              u32 addr, u32 len, bool write, u32 pc) {
+    if (c->enabled) cache_access(&c->dcache, sections, addr, len, write, pc);
+}
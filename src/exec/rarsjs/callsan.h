@@ -22,14 +22,12 @@ typedef struct {
 
 RARSJS_ARRAY_TYPE(ShadowStackEnt);
 
-void callsan_init();
-void callsan_store(int reg);
-void callsan_call();
-bool callsan_ret();
-bool callsan_can_load(int reg);
-void callsan_report_store(u32 addr, u32 size, int reg);
-bool callsan_check_load(u32 addr, u32 size);
+typedef struct Machine Machine;
 
-extern u32 g_reg_bitmap;
-extern RARSJS_ARRAY(ShadowStackEnt) g_shadow_stack;
-extern u8 g_callsan_stack_written_by[];
+void callsan_init(Machine *m);
+void callsan_store(Machine *m, int reg);
+void callsan_call(Machine *m);
+bool callsan_ret(Machine *m);
+bool callsan_can_load(Machine *m, int reg);
+void callsan_report_store(Machine *m, u32 addr, u32 size, int reg);
+bool callsan_check_load(Machine *m, u32 addr, u32 size);
@@ -14,10 +14,11 @@ void *malloc(size_t size);
 void free(void *ptr);
 extern void panic();
 extern void emu_exit();
-extern void putchar(uint8_t);
+extern void flush_output(const uint8_t *buf, uint32_t len);
 size_t strlen(const char *str);
 int memcmp(const void *s1, const void *s2, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
 void *memset(void *dest, int c, size_t n);
 extern void shadowstack_push();
 extern void shadowstack_pop();
@@ -35,7 +36,6 @@ static inline void shadowstack_pop() {}
 #include <stdlib.h>
 #include <string.h>
 
-#define emu_exit() g_exited = true
 #endif
 
 #define TEXT_BASE 0x00400000
@@ -62,6 +62,14 @@ static inline void shadowstack_pop() {}
 #define CSR_MSTATUS 0x300
 #define CSR_MIE 0x304
 #define CSR_MIP 0x344
+#define CSR_MHARTID 0xF14
+// Read-only user counters, computed on read, +0x80 for the upper halves
+#define _CSR_CYCLE 0xC00
+#define _CSR_TIME 0xC01
+#define _CSR_INSTRET 0xC02
+#define _CSR_CYCLEH 0xC80
+#define _CSR_TIMEH 0xC81
+#define _CSR_INSTRETH 0xC82
 
 #define STATUS_SIE (1u<<1)
 #define STATUS_SPIE (1u<<5)
@@ -72,7 +80,11 @@ static inline void shadowstack_pop() {}
 RARSJS_ARRAY_TYPE(u8);
 RARSJS_ARRAY_TYPE(u32);
 
+// See program.h
+typedef struct Program Program;
+
 typedef struct Parser {
+    Program *prog;  // the program being assembled into
     const char *input;
     size_t pos;
     size_t size;
@@ -98,6 +110,9 @@ typedef struct {
 
 RARSJS_ARRAY_TYPE(Relocation);
 
+// The readers of the dirty page bits, see dirty.h
+typedef enum { DIRTY_VIEW, DIRTY_SNAPSHOT, DIRTY_CONSUMERS } DirtyConsumer;
+
 // It would be preferable not to use dedicated pointer types like SectionPtr,
 // since it is more idiomatic. However, the C preprocessor is limited in this
 // regard, and this allows the existance of dedicated array types
@@ -112,6 +127,11 @@ typedef struct Section {
     struct {
         size_t shidx;
     } elf;
+    // Only set up for writable sections once a snapshot exists
+    struct {
+        u8 *baseline;
+    } snapshot;
+    u64 *dirty_pages[DIRTY_CONSUMERS];  // see dirty.h
     bool read;
     bool write;
     bool execute;
@@ -128,7 +148,8 @@ typedef struct LabelData {
 
 typedef const char *DeferredInsnCb(Parser *p, const char *opcode,
                                    size_t opcode_len);
-typedef const char *DeferredInsnReloc(const char *sym, size_t sym_len);
+typedef const char *DeferredInsnReloc(Parser *p, const char *sym,
+                                      size_t sym_len);
 
 typedef struct DeferredInsn {
     Parser p;
@@ -161,7 +182,8 @@ typedef enum Error : u32 {
     ERROR_CALLSAN_RET_EMPTY = 9,
     ERROR_CALLSAN_LOAD_STACK = 10,
     ERROR_PROTECTION = 11,
-    ERROR_DOUBLE = 12
+    ERROR_DOUBLE = 12,
+    ERROR_INPUT = 13,  // the read int syscall found no number
 } Error;
 
 RARSJS_ARRAY_TYPE(SectionPtr);
@@ -171,34 +193,54 @@ RARSJS_ARRAY_TYPE(Extern);
 RARSJS_ARRAY_TYPE(DeferredInsn);
 RARSJS_ARRAY_TYPE(char);
 
-extern export Section *g_text;
-extern export Section *g_data;
-extern export Section *g_stack;
-extern export Section *g_kernel_data;
-extern export Section *g_kernel_text;
-extern export Section *g_mmio;
+// Indices of labels sorted by address, for looking up the label before a
+// pc. MMIO labels are left out, since they name registers rather than code
+typedef struct LabelIndex {
+    u32 *order;
+    size_t len;
+    bool built;
+} LabelIndex;
 
-extern RARSJS_ARRAY(SectionPtr) g_sections;
-extern RARSJS_ARRAY(LabelData) g_labels;
-extern RARSJS_ARRAY(Global) g_globals;
-extern RARSJS_ARRAY(Extern) g_externs;
-extern export RARSJS_ARRAY(u32) g_text_by_linenum;
+// What the assembler (or the ELF loader) produced: the sections, which are
+// also the guest's memory, and the symbols in them. Part of a Program (see
+// program.h)
+typedef struct Assembler {
+    RARSJS_ARRAY(SectionPtr) sections;
+    Section *text;
+    Section *data;
+    Section *stack;
+    Section *kernel_text;
+    Section *kernel_data;
+    Section *mmio;
+
+    RARSJS_ARRAY(LabelData) labels;
+    RARSJS_ARRAY(Global) globals;
+    RARSJS_ARRAY(Extern) externs;
+    RARSJS_ARRAY(u32) text_by_linenum;
+    LabelIndex label_index;
+
+    // only used while assembling
+    RARSJS_ARRAY(DeferredInsn) deferred_insn;
+    Section *section;
+    bool in_fixup;
+    bool allow_externs;
 
-extern export u32 g_error_line;
-extern export const char *g_error;
+    u32 error_line;
+    const char *error;
+} Assembler;
 
 extern const char *const REGISTER_NAMES[];
 extern const char *const CSR_NAMES[];
 
-void assemble(const char *str, size_t len, bool allow_externs);
-void emulate();
-bool resolve_symbol(const char *sym, size_t sym_len, bool global, u32 *addr,
-                    Section **sec);
-void prepare_runtime_sections();
-void prepare_aux_sections();
-void free_runtime();
-u32 LOAD(u32 addr, int size, bool *err);
-bool pc_to_label_r(u32 pc, LabelData **ret, u32 *off);
+void assemble(Program *prog, const char *str, size_t len, bool allow_externs);
+bool resolve_symbol(Program *prog, const char *sym, size_t sym_len, bool global,
+                    u32 *addr, Section **sec);
+void prepare_runtime_sections(Program *prog);
+void prepare_aux_sections(Program *prog);
+void free_runtime(Program *prog);
+void label_index_build(Program *prog);
+void label_index_free(Program *prog);
+bool pc_to_label_r(Program *prog, u32 pc, LabelData **ret, u32 *off);
 
 enum Reg {
     REG_ZERO = 0,
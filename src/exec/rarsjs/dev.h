@@ -9,6 +9,16 @@
 // DEVICE INFO
 
 #define DMA_CNTL_DO 1
+#define DMA_CNTL_ASYNC (1 << 1)
+#define DMA_CNTL_INTERRUPT (1 << 2)
+
+#define DMA_STATUS_BUSY 1
+#define DMA_STATUS_DONE (1 << 1)
+#define DMA_STATUS_ERROR (1 << 2)
+
+// Modelled latency of an asynchronous transfer, in retired instructions
+#define DMA_SETUP_LATENCY 16
+#define DMA_BYTES_PER_TICK 4
 
 #define POWER_CNTL_SHUTDOWN 1
 #define POWER_CNTL_RESTART (1 << 1)
@@ -26,7 +36,8 @@
 #define DMA0_LEN (DMA0_BASE + 16)
 #define DMA0_TRANS_SIZE (DMA0_BASE + 20)
 #define DMA0_CNTL (DMA0_BASE + 24)
-#define DMA0_END (DMA0_BASE + 28)
+#define DMA0_STATUS (DMA0_BASE + 28)
+#define DMA0_END (DMA0_BASE + 32)
 
 #define DMA1_BASE (MMIO_BASE + MMIO_DEVICE_RSV)
 #define DMA1_DST_ADDR DMA1_BASE
@@ -36,7 +47,8 @@
 #define DMA1_LEN (DMA1_BASE + 16)
 #define DMA1_TRANS_SIZE (DMA1_BASE + 20)
 #define DMA1_CNTL (DMA1_BASE + 24)
-#define DMA1_END (DMA1_BASE + 28)
+#define DMA1_STATUS (DMA1_BASE + 28)
+#define DMA1_END (DMA1_BASE + 32)
 
 #define DMA2_BASE (MMIO_BASE + MMIO_DEVICE_RSV * 2)
 #define DMA2_DST_ADDR DMA2_BASE
@@ -46,7 +58,8 @@
 #define DMA2_LEN (DMA2_BASE + 16)
 #define DMA2_TRANS_SIZE (DMA2_BASE + 20)
 #define DMA2_CNTL (DMA2_BASE + 24)
-#define DMA2_END (DMA2_BASE + 28)
+#define DMA2_STATUS (DMA2_BASE + 28)
+#define DMA2_END (DMA2_BASE + 32)
 
 #define DMA3_BASE (MMIO_BASE + MMIO_DEVICE_RSV * 3)
 #define DMA3_DST_ADDR DMA3_BASE
@@ -56,7 +69,8 @@
 #define DMA3_LEN (DMA3_BASE + 16)
 #define DMA3_TRANS_SIZE (DMA3_BASE + 20)
 #define DMA3_CNTL (DMA3_BASE + 24)
-#define DMA3_END (DMA3_BASE + 28)
+#define DMA3_STATUS (DMA3_BASE + 28)
+#define DMA3_END (DMA3_BASE + 32)
 
 #define POWER0_BASE (MMIO_BASE + MMIO_DEVICE_RSV * 4)
 #define POWER0_CNTL POWER0_BASE
@@ -70,9 +84,99 @@
 #define CONSOLE0_CNTL (CONSOLE0_BASE + 10)
 #define CONSOLE0_END (CONSOLE0_BASE + 14)
 
+#define CONSOLE_OUT_BUF_LEN 4096
+
 #define RIC0_BASE (MMIO_BASE + MMIO_DEVICE_RSV * 6)
 #define RIC0_DEVADDR RIC0_BASE
-#define RIC0_END (RIC0_BASE + 4)
-
-bool mmio_read(u32 mmio_addr, int size, u32 *ret);
-bool mmio_write(u32 mmio_addr, int size, u32 value);
+#define RIC0_IPI (RIC0_BASE + 4)
+#define RIC0_END (RIC0_BASE + 8)
+
+#define MMIO_NUM_DEVICES 7
+#define DMA_NUM 4
+
+typedef struct {
+    u32 dst_addr;
+    u32 src_addr;
+    u32 dst_inc;
+    u32 src_inc;
+    u32 len;
+    u32 trans_size;
+    u32 cntl;
+    u32 status;
+} PACKED DMAControllerRegisters;
+
+// An asynchronous transfer that has been started but not yet completed.
+// The registers are latched when the transfer starts, so the guest is free to
+// reprogram the controller while it is in flight, and so is the privilege of
+// the hart that started it, which the copy is checked against
+typedef struct {
+    DMAControllerRegisters regs;
+    u32 devaddr;
+    u32 ticks_left;
+    int privilege;
+    bool active;
+} DMATransfer;
+
+typedef struct Devices {
+    u8 buffers[MMIO_NUM_DEVICES][MMIO_DEVICE_RSV];
+    DMATransfer dma_transfers[DMA_NUM];
+    // Number of device events waiting for dev_tick (in-flight DMA
+    // transfers). Devices are only clocked while there are some
+    u32 pending;
+} Devices;
+
+#ifndef __wasm__
+typedef void (*ConsoleSink)(const u8 *buf, u32 len);
+#endif
+
+typedef struct Console {
+    // Guest output is staged here and handed to the host in bulk (see
+    // console_flush), instead of crossing into the host for every character
+    u8 out_buf[CONSOLE_OUT_BUF_LEN];
+    u32 out_len;
+    // Total number of bytes the guest has written, muted or not. Snapshots
+    // save it, so that after going back in time the host knows how much of
+    // the output it has already received is still valid
+    u64 out_total;
+    bool out_muted;
+
+    // Host input for the guest, read up to in_pos
+    // In WASM, JS pushes the whole input before running
+    // (console_input_reserve), so an empty queue means the input is over. The
+    // CLI instead refills it from a host file (usually stdin) whenever the
+    // guest runs out of input
+    RARSJS_ARRAY(u8) in;
+    size_t in_pos;
+    // Set once the current batch has been signalled, so that the guest gets
+    // one interrupt per batch instead of one per byte
+    bool in_signalled;
+
+#ifndef __wasm__
+    ConsoleSink out_sink;
+    FILE *in_file;
+#endif
+} Console;
+
+typedef struct Machine Machine;
+typedef struct Program Program;
+
+bool mmio_read(Machine *m, u32 mmio_addr, int size, u32 *ret);
+bool mmio_write(Machine *m, u32 mmio_addr, int size, u32 value);
+void dev_reset(Program *p);
+void dev_tick(Machine *m);
+size_t dev_state_size(void);
+void dev_save(Program *p, void *out);
+void dev_load(Program *p, const void *in);
+void console_putchar(Program *p, u8 c);
+void console_flush(Program *p);
+void console_set_muted(Program *p, bool muted);
+u8 *console_input_reserve(Program *p, u32 len);
+void console_input_push(Program *p, const u8 *buf, u32 len);
+void console_input_poll(Program *p);
+int console_getchar(Program *p);
+int console_peekchar(Program *p);
+
+#ifndef __wasm__
+void console_input_set_file(Program *p, FILE *file);
+void console_output_set_sink(Program *p, ConsoleSink sink);
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+// Which pages of guest memory were written, as a bit per page of a section
+// for each DirtyConsumer. The bits are set by every write (stores, syscalls,
+// DMA and snapshot restores) and stay set until the consumer clears them, so
+// that the memory view and snapshots each see the pages written since they
+// last looked, from a single tracker
+// A consumer's bits for a section exist once it watches the section, or, for
+// the memory view, from the first write after it started following memory
+// The generation is bumped whenever a clean page becomes dirty for some
+// consumer, so that one can tell with a single load whether there is anything
+// new at all
+#define DIRTY_PAGE_SHIFT 10
+#define DIRTY_PAGE_SIZE (1u << DIRTY_PAGE_SHIFT)
+
+typedef struct {
+    Section *sec;
+    u32 page;
+} DirtyPage;
+
+RARSJS_ARRAY_TYPE(DirtyPage);
+
+typedef struct Program Program;
+typedef struct Smp Smp;
+
+typedef struct Dirty {
+    u32 generation;
+    // consumers whose bits are allocated by the first write to any section
+    u32 lazy;
+    // pages in the order they became dirty for DIRTY_SNAPSHOT, so that
+    // snapshots are O(dirty pages) rather than O(memory)
+    RARSJS_ARRAY(DirtyPage) snapshot_pages;
+    // of the same program, locked to update the above from several threads
+    Smp *smp;
+} Dirty;
+
+void dirty_mark_range(Dirty *d, Section *sec, u32 off, u32 len);
+void dirty_watch(Dirty *d, Section *sec, DirtyConsumer c);
+bool dirty_is_set(const Section *sec, DirtyConsumer c, u32 page);
+void dirty_clear(Program *p, DirtyConsumer c);
+bool dirty_window_take(Program *p, u32 addr, u32 len);
+void dirty_free(Section *sec);
+
+// Whether the write to page of sec is already known to every consumer
+static inline bool dirty_page_known(const Dirty *d, const Section *sec,
+                                    u32 page) {
+    for (int c = 0; c < DIRTY_CONSUMERS; c++) {
+        u64 *bits = __atomic_load_n(&sec->dirty_pages[c], __ATOMIC_ACQUIRE);
+        if (bits ? !(bits[page / 64] >> (page % 64) & 1) : d->lazy >> c & 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Marks the pages of [addr, addr + len) of sec, returning early when the
+// write falls in a page that is already dirty for every consumer
+static inline void dirty_mark(Dirty *d, Section *sec, u32 addr, u32 len) {
+    u32 off = addr - sec->base;
+    u32 page = off >> DIRTY_PAGE_SHIFT;
+    if ((off + len - 1) >> DIRTY_PAGE_SHIFT == page &&
+        dirty_page_known(d, sec, page)) {
+        return;
+    }
+    dirty_mark_range(d, sec, off, len);
+}
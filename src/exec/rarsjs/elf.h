@@ -2685,8 +2685,10 @@ typedef struct {
     REadElfRelaSection *relas;
 } ReadElfResult;
 
+typedef struct Program Program;
+
 bool elf_read(u8 *elf_contents, size_t elf_contents_len, ReadElfResult *out,
               char **error);
-bool elf_emit_exec(void **out, size_t *len, char **error);
-bool elf_emit_obj(void **out, size_t *len, char **error);
-bool elf_load(u8 *elf_contents, size_t elf_len, char **error);
+bool elf_emit_exec(Program *prog, void **out, size_t *len, char **error);
+bool elf_emit_obj(Program *prog, void **out, size_t *len, char **error);
+bool elf_load(Program *prog, u8 *elf_contents, size_t elf_len, char **error);
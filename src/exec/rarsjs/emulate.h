@@ -1,5 +1,6 @@
 #pragma once
 
+#include "callsan.h"
 #include "core.h"
 
 #define PRIV_MACHINE 3
@@ -34,21 +35,68 @@
 #define CAUSE_SUPERVISOR_EXTERNAL (CAUSE_INTERRUPT | 9)
 #define CAUSE_MACHINE_EXTERNAL (CAUSE_INTERRUPT | 11)
 
-extern export u32 g_regs[32];
-extern export u32 g_csr[4096];
-extern export u32 g_pc;
+typedef struct Program Program;
 
-extern export u32 g_runtime_error_params[2];
-extern export Error g_runtime_error_type;
+// The state of one hart, which the emulator takes explicitly so that several
+// of them can exist at once. Memory, devices and everything else the harts
+// share belong to the Program they point at
+typedef struct Machine {
+    Program *prog;
+    u32 regs[32];
+    u32 csr[4096];
+    u32 pc;
+    int privilege;
+    u32 hartid;
+    // top of this hart's STACK_LEN bytes of stack
+    u32 stack_top;
 
-extern export bool g_exited;
-extern export int g_exit_code;
+    // Set by LR.W. SC.W succeeds if the word still holds the value that was
+    // loaded, since any other hart may have written it in the meantime
+    bool reserved;
+    u32 reserved_addr;
+    u32 reserved_val;
 
-void emulator_enter_kernel(void);
-void emulator_leave_kernel(void);
-u32 LOAD(u32 addr, int size, bool *err);
-void STORE(u32 addr, u32 val, int size, bool *err);
-void emulator_deliver_interrupt(u32 cause);
-void emulator_init(void);
-void emulator_interrupt_set_pending(u32 intno);
-void emulator_interrupt_clear_pending(u32 intno);
\ No newline at end of file
+    // Cleared by the emulator once it finds no interrupt to take, set by
+    // whatever may make one pending (see emulator_interrupt_recheck), so that
+    // instructions only have to test this
+    bool irq_maybe_pending;
+
+    bool exited;
+    int exit_code;
+    // Number of instructions executed (including a faulting one) since init
+    u64 instret;
+
+    // What the last emulated instruction wrote, 0 if nothing
+    u32 mem_written_len;
+    u32 mem_written_addr;
+    u32 reg_written;
+
+    Error runtime_error_type;
+    u32 runtime_error_params[2];
+
+    // callsan
+    u32 reg_bitmap;
+    RARSJS_ARRAY(ShadowStackEnt) shadow_stack;
+    u8 callsan_stack_written_by[STACK_LEN / 4];
+} Machine;
+
+void machine_init(Machine *m);
+void emulate(Machine *m);
+u32 emulate_n(Machine *m, u32 n);
+u32 emulate_step_over(Machine *m, u32 n);
+u32 emulate_step_out(Machine *m, u32 n);
+u32 emulate_resume(Machine *m, u32 n, u32 depth);
+void emulator_enter_kernel(Machine *m);
+void emulator_leave_kernel(Machine *m);
+Section *emulator_get_section(Program *p, u32 addr);
+u8 *emulator_get_addr(Program *p, u32 addr, int size, Section **out_sec);
+u8 *emulator_resolve_range(Machine *m, u32 addr, u32 len, bool write);
+u32 LOAD(Machine *m, u32 addr, int size, bool *err);
+void STORE(Machine *m, u32 addr, u32 val, int size, bool *err);
+void emu_read_window(Program *p, u32 addr, u32 len, u8 *out, u8 *valid);
+void emulator_deliver_interrupt(Machine *m, u32 cause);
+void emulator_init(Program *p);
+void emulator_exit(Machine *m);
+void emulator_interrupt_set_pending(Machine *m, u32 intno);
+void emulator_interrupt_clear_pending(Machine *m, u32 intno);
+void emulator_interrupt_recheck(Machine *m);
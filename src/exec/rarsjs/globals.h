@@ -0,0 +1,56 @@
+#pragma once
+
+#include "program.h"
+
+// The default program under the names its parts had as globals, for the
+// front ends (cli.c and the tests). The rest of the code takes the Program
+// explicitly
+#define g_sections (g_program_default.as.sections)
+#define g_text (g_program_default.as.text)
+#define g_data (g_program_default.as.data)
+#define g_stack (g_program_default.as.stack)
+#define g_kernel_text (g_program_default.as.kernel_text)
+#define g_kernel_data (g_program_default.as.kernel_data)
+#define g_mmio (g_program_default.as.mmio)
+#define g_labels (g_program_default.as.labels)
+#define g_globals (g_program_default.as.globals)
+#define g_externs (g_program_default.as.externs)
+#define g_text_by_linenum (g_program_default.as.text_by_linenum)
+#define g_error_line (g_program_default.as.error_line)
+#define g_error (g_program_default.as.error)
+
+#define g_machine (g_program_default.machine)
+#define g_regs (g_machine.regs)
+#define g_csr (g_machine.csr)
+#define g_pc (g_machine.pc)
+#define g_exited (g_machine.exited)
+#define g_exit_code (g_machine.exit_code)
+#define g_instret (g_machine.instret)
+#define g_mem_written_len (g_machine.mem_written_len)
+#define g_mem_written_addr (g_machine.mem_written_addr)
+#define g_reg_written (g_machine.reg_written)
+#define g_runtime_error_type (g_machine.runtime_error_type)
+#define g_runtime_error_params (g_machine.runtime_error_params)
+#define g_reg_bitmap (g_machine.reg_bitmap)
+#define g_shadow_stack (g_machine.shadow_stack)
+#define g_callsan_stack_written_by (g_machine.callsan_stack_written_by)
+
+#define g_smp (g_program_default.smp)
+#define g_console_out_buf (g_program_default.console.out_buf)
+#define g_console_out_len (g_program_default.console.out_len)
+#define g_console_out_total (g_program_default.console.out_total)
+#define g_breakpoints (g_program_default.breakpoints)
+#define g_timetravel_next (g_program_default.timetravel.next)
+#define g_dirty_generation (g_program_default.dirty.generation)
+#define g_dirty_snapshot_pages (g_program_default.dirty.snapshot_pages)
+#define g_profile_counts (g_program_default.profile.counts)
+#define g_profile_len (g_program_default.profile.len)
+#define g_profile_calls (g_program_default.profile.calls)
+#define g_profile_funcs (g_program_default.profile.funcs)
+#define g_profile_nodes (g_program_default.profile.nodes)
+#define g_timing (g_program_default.timing)
+#define g_cache_enabled (g_program_default.cache.enabled)
+#define g_icache (g_program_default.cache.icache)
+#define g_dcache (g_program_default.cache.dcache)
+#define g_bpred (g_program_default.bpred)
+#define g_trace (g_program_default.trace)
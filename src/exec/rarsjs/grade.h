@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "core.h"
+
+typedef enum GradeStatus {
+    GRADE_PASS = 0,
+    GRADE_WRONG = 1,    // the output differs from the expected one
+    GRADE_ERROR = 2,    // runtime error
+    GRADE_LIMIT = 3,    // ran out of instructions
+    GRADE_TIMEOUT = 4,  // ran out of time
+    GRADE_CRASH = 5,    // the case could not be run
+} GradeStatus;
+
+typedef struct GradeCase {
+    char *name;
+    char *input;     // NULL for no input
+    char *expected;
+} GradeCase;
+
+RARSJS_ARRAY_TYPE(GradeCase);
+
+typedef struct GradeResult {
+    GradeStatus status;
+    Error error;
+    int exit_code;
+    u64 instructions;
+    u64 ms;
+    u64 mismatch_at;  // offset of the first wrong output byte
+} GradeResult;
+
+typedef struct GradeConfig {
+    u64 max_instructions;  // 0 for no limit
+    u32 max_ms;            // 0 for no limit
+    u32 jobs;              // 0 for one per CPU
+} GradeConfig;
+
+bool grade_load_cases(const char *path, RARSJS_ARRAY(GradeCase) *out,
+                      char **error);
+void grade_free_cases(RARSJS_ARRAY(GradeCase) *cases);
+void grade_run(const Program *p, const GradeCase *cases, size_t len,
+               const GradeConfig *config, GradeResult *results);
+void grade_report(FILE *out, const GradeCase *cases,
+                  const GradeResult *results, size_t len, bool json);
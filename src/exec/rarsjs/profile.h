@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+// Instructions executed by the profiled part of the program, grouped by
+// source line (key is the line number) or by label (key is its index in
+// the labels)
+typedef struct ProfileEntry {
+    u32 key;
+    u64 count;
+} ProfileEntry;
+
+RARSJS_ARRAY_TYPE(ProfileEntry);
+
+// A function, identified by the address it was called at
+typedef struct ProfileFunc {
+    u32 pc;
+    u64 calls;
+    u64 inclusive;  // instructions from entry to return, outermost call only
+    u64 exclusive;  // instructions in the function body itself
+    u32 max_depth;  // deepest call stack it was on, the entry point is 0
+
+    u32 active;  // calls not returned from yet
+    u64 entered_at;
+} ProfileFunc;
+
+// A node of the calling context tree: one per distinct call stack
+typedef struct ProfileNode {
+    u32 func;  // index in funcs
+    u32 parent;
+    u32 first_child;  // 0 if none, as the root is never a child
+    u32 next_sibling;
+    u64 self;
+} ProfileNode;
+
+RARSJS_ARRAY_TYPE(ProfileFunc);
+RARSJS_ARRAY_TYPE(ProfileNode);
+
+typedef struct Profile {
+    // Execution count of each instruction in the text section, indexed by
+    // (pc - TEXT_BASE) / 4. NULL while profiling is disabled
+    u64 *counts;
+    u32 len;
+
+    bool calls;
+    RARSJS_ARRAY(ProfileFunc) funcs;
+    RARSJS_ARRAY(ProfileNode) nodes;
+    // nodes of the functions currently being executed, the entry point first
+    RARSJS_ARRAY(u32) stack;
+    // instructions up to here are already attributed to some node
+    u64 last_instret;
+} Profile;
+
+void profile_enable(Program *prog);
+void profile_disable(Program *prog);
+u64 profile_total(const Program *prog);
+RARSJS_ARRAY(ProfileEntry) profile_by_line(const Program *prog);
+RARSJS_ARRAY(ProfileEntry) profile_by_label(Program *prog);
+
+void profile_calls_enable(Program *prog);
+void profile_calls_disable(Program *prog);
+void profile_calls_finish(Program *prog);
+void profile_calls_enter(Profile *p, u32 pc, u64 instret);
+void profile_calls_leave(Profile *p, u64 instret);
+
+// Counts one execution of the instruction at pc
+static inline void profile_count(Profile *p, u32 pc) {
+    if (p->counts) {
+        u32 idx = (pc - TEXT_BASE) / 4;
+        if (idx < p->len) p->counts[idx]++;
+    }
+}
+
+// Called by the emulator after a jump that links ra, and on ret, with the
+// instret of the hart making it
+static inline void profile_call(Profile *p, u32 target, u64 instret) {
+    if (p->calls) profile_calls_enter(p, target, instret);
+}
+
+static inline void profile_ret(Profile *p, u64 instret) {
+    if (p->calls) profile_calls_leave(p, instret);
+}
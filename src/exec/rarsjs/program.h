@@ -0,0 +1,44 @@
+#pragma once
+
+#include "bpred.h"
+#include "breakpoint.h"
+#include "cache.h"
+#include "core.h"
+#include "dev.h"
+#include "dirty.h"
+#include "emulate.h"
+#include "profile.h"
+#include "smp.h"
+#include "snapshot.h"
+#include "timetravel.h"
+#include "timing.h"
+#include "trace.h"
+
+// Everything that belongs to one loaded program: its memory and symbols, its
+// harts and devices, and the state of the optional models. Harts point at
+// their Program, and the emulator reaches all of this through the hart it
+// runs; everything else takes the Program explicitly, so that several
+// programs can run at once on different threads
+typedef struct Program {
+    Assembler as;
+    Machine machine;  // hart 0, smp has the others
+    Smp smp;
+    Devices dev;
+    Console console;
+    Breakpoints breakpoints;
+    Timetravel timetravel;
+    SnapshotTracking snapshot;
+    Dirty dirty;
+    Profile profile;
+    Timing timing;
+    Caches cache;
+    Bpred bpred;
+    Trace trace;
+} Program;
+
+// The program of the CLI and the web UI
+extern export Program g_program_default;
+
+void program_init(Program *p);
+void program_copy(Program *dst, const Program *src);
+void program_free(Program *p);
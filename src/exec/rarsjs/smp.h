@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+#ifndef __wasm__
+#include <pthread.h>
+#endif
+
+#define SMP_MAX_HARTS 8
+#define SMP_DEFAULT_QUANTUM 1000
+
+typedef struct Machine Machine;
+
+typedef enum SmpMode {
+    SMP_LOCKSTEP = 0,  // harts take turns on one host thread, deterministic
+    SMP_FREE = 1,      // one host thread per hart, for throughput
+} SmpMode;
+
+typedef struct SmpConfig {
+    u32 harts;
+    SmpMode mode;
+    u32 quantum;  // instructions a hart runs before the next one gets a turn
+} SmpConfig;
+
+// Hart 0 is always the machine of the Program, the others share its memory
+// and devices
+typedef struct Smp {
+    u32 len;
+    Machine *harts[SMP_MAX_HARTS];
+    SmpConfig config;
+    // set while harts run on their own threads
+    bool threaded;
+#ifndef __wasm__
+    // Serializes what harts share besides memory (devices, console,
+    // syscalls) while threaded. Recursive, since syscalls can reach MMIO
+    // through LOAD/STORE
+    pthread_mutex_t lock;
+#endif
+    // for the harts of a threaded run to tell each other to stop
+    bool stop;
+    Machine *fault;
+} Smp;
+
+extern SmpConfig g_smp_config;
+
+const char *smp_enable(Program *p);
+void smp_disable(Program *p);
+Machine *smp_run(Program *p);
+
+static inline Machine *smp_hart(const Smp *smp, u32 hartid) {
+    return hartid < smp->len ? smp->harts[hartid] : NULL;
+}
+
+#ifndef __wasm__
+static inline void smp_lock(Smp *smp) {
+    if (smp->threaded) pthread_mutex_lock(&smp->lock);
+}
+
+static inline void smp_unlock(Smp *smp) {
+    if (smp->threaded) pthread_mutex_unlock(&smp->lock);
+}
+#else
+static inline void smp_lock(Smp *smp) {}
+static inline void smp_unlock(Smp *smp) {}
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+typedef struct Snapshot Snapshot;
+typedef struct Program Program;
+
+// Whether the pages written since the baseline are being tracked, see
+// snapshot.c
+typedef struct SnapshotTracking {
+    bool tracking;
+    // Bumped whenever the emulator is reinitialized, since the sections that
+    // older snapshots refer to no longer exist
+    u32 epoch;
+} SnapshotTracking;
+
+Snapshot *snapshot_create(Program *p);
+bool snapshot_restore(Program *p, const Snapshot *snap);
+size_t snapshot_size(const Snapshot *snap);
+void snapshot_free(Snapshot *snap);
+void snapshot_reset(Program *p);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+#include "snapshot.h"
+
+typedef struct {
+    u64 instret;
+    Snapshot *snap;
+    size_t size;
+} Checkpoint;
+
+RARSJS_ARRAY_TYPE(Checkpoint);
+
+typedef struct Timetravel {
+    RARSJS_ARRAY(Checkpoint) checkpoints;
+    u64 interval;
+    size_t budget;
+    size_t used;
+    // instret at which the next checkpoint is due, UINT64_MAX while disabled
+    u64 next;
+} Timetravel;
+
+bool timetravel_enable(Program *p, u32 interval, u32 budget);
+void timetravel_disable(Program *p);
+void timetravel_checkpoint(Program *p);
+bool timetravel_seek(Program *p, u64 target);
+bool timetravel_reverse_step(Program *p);
+bool timetravel_reverse_continue(Program *p);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+// Cycles to fill the classic IF/ID/EX/MEM/WB pipeline
+#define TIMING_PIPELINE_FILL 4
+// Bubble between a load and an instruction using its result
+#define TIMING_LOAD_USE_STALL 1
+
+// Default latencies, in cycles
+#define TIMING_DEFAULT_MUL 3
+#define TIMING_DEFAULT_DIV 20
+#define TIMING_DEFAULT_LOAD 1
+#define TIMING_DEFAULT_BRANCH 2
+#define TIMING_DEFAULT_CSR 3
+
+typedef struct TimingConfig {
+    u32 mul;     // cycles in EX for a multiplication
+    u32 div;     // cycles in EX for a division or remainder
+    u32 load;    // cycles in MEM for a load
+    u32 branch;  // cycles flushed by a taken branch, jump or trap
+    u32 csr;     // cycles for a CSR access or other system instruction
+} TimingConfig;
+
+typedef struct Timing {
+    bool enabled;
+
+    u64 cycles;
+    u64 instructions;
+    u64 load_use_stalls;
+    u64 branch_stalls;
+    u64 unit_stalls;  // multi-cycle EX and MEM
+
+    // the instruction being executed, and the register the last one loaded
+    u32 inst_pc;
+    u32 inst;
+    u32 load_rd;
+} Timing;
+
+extern export TimingConfig g_timing_config;
+
+void timing_enable(Program *p);
+void timing_disable(Program *p);
+void timing_retire(Timing *t, u32 next_pc);
+
+// The instruction is noted at fetch, its cycles are counted once it retires,
+// knowing where it sent the pc
+static inline void timing_fetch(Timing *t, u32 pc, u32 inst) {
+    if (t->enabled) {
+        t->inst_pc = pc;
+        t->inst = inst;
+    }
+}
+
+static inline void timing_account(Timing *t, u32 next_pc) {
+    if (t->enabled) timing_retire(t, next_pc);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "core.h"
+
+#define TRACE_MAGIC "RJTR"
+#define TRACE_VERSION 1
+
+// Flags byte that starts every record
+#define TRACE_PC_JUMP 1  // pc isn't the previous one + 4
+#define TRACE_REG 2      // a register was written
+#define TRACE_MEM 4      // guest memory was written
+#define TRACE_ERROR 8    // the instruction raised a runtime error
+
+typedef struct TraceRecord {
+    u32 pc;
+    u32 reg_val;
+    u32 mem_addr;
+    u32 mem_val;
+    u8 reg;      // 0 if no register was written
+    u8 mem_len;  // 0 if no memory was written
+    u8 error;
+} TraceRecord;
+
+// Running state of the delta encoding, mirrored by the decoder
+typedef struct TraceCodec {
+    u32 pc;
+    u32 regs[32];
+    u32 mem_addr;
+} TraceCodec;
+
+typedef struct Trace {
+    bool enabled;
+    u32 inst_pc;
+
+    u64 start;  // instret of the first record
+    TraceCodec codec;
+    u8 *buf;
+    u32 buf_len;
+
+    // ring mode: the last ring_size records, encoded when the trace ends
+    TraceRecord *ring;
+    u32 ring_size;
+    u32 ring_next;
+    u64 ring_len;
+
+#ifndef __wasm__
+    FILE *out;
+    bool failed;
+#endif
+} Trace;
+
+typedef struct Machine Machine;
+
+void trace_record(Trace *t, Machine *m);
+#ifndef __wasm__
+void trace_start(Program *p, FILE *out, u32 ring_size);
+bool trace_finish(Program *p);
+bool trace_decode(FILE *in, FILE *out, char **error);
+#endif
+
+// The pc is noted at fetch, the record is written once the instruction retires
+static inline void trace_fetch(Trace *t, u32 pc) {
+    if (t->enabled) t->inst_pc = pc;
+}
+
+static inline void trace_retire(Trace *t, Machine *m) {
+    if (t->enabled) trace_record(t, m);
+}
@@ -12,6 +12,7 @@ void *malloc(size_t size);
 void free(void *ptr);
 extern void panic();
 void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
 void *memset(void *dest, int c, size_t n);
 
 #define RARSJS_CHECK_OOM(ptr) \
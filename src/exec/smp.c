@@ -0,0 +1,153 @@
+#include "rarsjs/smp.h"
+
+#include "rarsjs/dev.h"
+#include "rarsjs/dirty.h"
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// All harts start at the entry point with the same state, except for their
+// hart id (read through mhartid) and their stack, which sits right below the
+// one of the previous hart. A hart that exits stops on its own, and the whole
+// machine stops when hart 0 does or when any hart raises a runtime error
+
+SmpConfig g_smp_config = {.harts = 1, .quantum = SMP_DEFAULT_QUANTUM};
+
+// Makes room for a STACK_LEN stack per hart, keeping hart 0's on top
+static void smp_grow_stack(Program *p, u32 harts) {
+    Section *stack = p->as.stack;
+    u32 len = harts * STACK_LEN;
+    u8 *buf = malloc(len);
+    RARSJS_CHECK_OOM(buf);
+    memset(buf, 0xAB, len - STACK_LEN);
+    memcpy(buf + len - STACK_LEN,
+           stack->contents.buf + stack->contents.len - STACK_LEN, STACK_LEN);
+
+    free(stack->contents.buf);
+    stack->contents = (RARSJS_ARRAY(u8)){.buf = buf, .len = len, .cap = len};
+    stack->base = STACK_TOP - len;
+    dirty_free(stack);
+    dirty_mark_range(&p->dirty, stack, 0, len);
+}
+
+#define SMP_STR(x) #x
+#define SMP_XSTR(x) SMP_STR(x)
+
+// Adds the harts of g_smp_config to the loaded program, which must not have
+// started running yet. Returns an error message, or NULL
+const char *smp_enable(Program *p) {
+    smp_disable(p);
+    if (g_smp_config.harts < 1 || g_smp_config.harts > SMP_MAX_HARTS) {
+        return "the number of harts must be between 1 and " SMP_XSTR(
+            SMP_MAX_HARTS);
+    }
+    if (!g_smp_config.quantum) return "the quantum must be at least 1";
+#ifdef __wasm__
+    if (g_smp_config.mode == SMP_FREE) return "free-running harts need threads";
+#endif
+
+    smp_grow_stack(p, g_smp_config.harts);
+    for (u32 i = 1; i < g_smp_config.harts; i++) {
+        Machine *h = malloc(sizeof(Machine));
+        RARSJS_CHECK_OOM(h);
+        *h = p->machine;
+        h->hartid = i;
+        h->stack_top = STACK_TOP - i * STACK_LEN;
+        h->regs[REG_SP] = h->stack_top;
+        h->shadow_stack = RARSJS_ARRAY_NEW(ShadowStackEnt);
+        p->smp.harts[i] = h;
+    }
+
+    p->smp.len = g_smp_config.harts;
+    p->smp.config = g_smp_config;
+    return NULL;
+}
+
+// Drops every hart but the program's own machine
+void smp_disable(Program *p) {
+    Smp *smp = &p->smp;
+    for (u32 i = 1; i < smp->len; i++) {
+        RARSJS_ARRAY_FREE(&smp->harts[i]->shadow_stack);
+        free(smp->harts[i]);
+        smp->harts[i] = NULL;
+    }
+    smp->len = 1;
+}
+
+static Machine *smp_run_lockstep(Program *p) {
+    while (!p->machine.exited) {
+        for (u32 i = 0; i < p->smp.len && !p->machine.exited; i++) {
+            Machine *h = p->smp.harts[i];
+            if (h->exited) continue;
+            emulate_n(h, p->smp.config.quantum);
+            if (h->runtime_error_type != ERROR_NONE) return h;
+        }
+    }
+    return NULL;
+}
+
+#ifndef __wasm__
+static void *smp_thread(void *arg) {
+    Machine *m = arg;
+    Smp *smp = &m->prog->smp;
+    while (!m->exited && !__atomic_load_n(&smp->stop, __ATOMIC_RELAXED)) {
+        for (u32 i = 0; i < smp->config.quantum && !m->exited; i++) {
+            emulate(m);
+            if (m->runtime_error_type == ERROR_NONE) continue;
+
+            Machine *none = NULL;
+            __atomic_compare_exchange_n(&smp->fault, &none, m, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            __atomic_store_n(&smp->stop, true, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    if (m == &m->prog->machine) {
+        __atomic_store_n(&smp->stop, true, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static Machine *smp_run_threads(Program *p) {
+    Smp *smp = &p->smp;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&smp->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    smp->stop = false;
+    smp->fault = NULL;
+    console_input_poll(p);
+    smp->threaded = true;
+
+    pthread_t threads[SMP_MAX_HARTS];
+    u32 started = 0;
+    while (started < smp->len &&
+           !pthread_create(&threads[started], NULL, smp_thread,
+                           smp->harts[started])) {
+        started++;
+    }
+    if (started < smp->len) {
+        __atomic_store_n(&smp->stop, true, __ATOMIC_RELAXED);
+    }
+    for (u32 i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    smp->threaded = false;
+    pthread_mutex_destroy(&smp->lock);
+    console_flush(p);
+
+    // without enough threads, the harts go on taking turns
+    if (started < smp->len && !smp->fault) return smp_run_lockstep(p);
+    return smp->fault;
+}
+#endif
+
+// Runs every hart until the machine stops, returns the hart that raised a
+// runtime error, or NULL
+Machine *smp_run(Program *p) {
+#ifndef __wasm__
+    if (p->smp.config.mode == SMP_FREE) return smp_run_threads(p);
+#endif
+    return smp_run_lockstep(p);
+}
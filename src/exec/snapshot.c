@@ -0,0 +1,205 @@
+#include "rarsjs/snapshot.h"
+
+#include "rarsjs/callsan.h"
+#include "rarsjs/dev.h"
+#include "rarsjs/dirty.h"
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// Memory is saved relative to a baseline: the contents of every writable
+// section when the first snapshot was taken. From then on, the pages written
+// since the baseline are tracked as DIRTY_SNAPSHOT pages, and a snapshot only
+// stores those pages.
+// Restoring puts back the baseline for the pages that are dirty now, and the
+// saved contents for the pages that were dirty then, so both creating and
+// restoring are O(dirty pages) rather than O(memory)
+
+// CSRs that the emulator actually implements
+static const u32 SNAPSHOT_CSRS[] = {CSR_MSTATUS,  CSR_MIE,  CSR_MIP,   CSR_STVEC,
+                                    CSR_SSCRATCH, CSR_SEPC, CSR_SCAUSE};
+
+#define SNAPSHOT_NUM_CSRS (sizeof(SNAPSHOT_CSRS) / sizeof(*SNAPSHOT_CSRS))
+
+struct Snapshot {
+    u32 epoch;
+
+    u64 instret;
+    u32 regs[32];
+    u32 pc;
+    u32 csrs[SNAPSHOT_NUM_CSRS];
+    int privilege;
+    bool exited;
+    int exit_code;
+
+    u32 reg_bitmap;
+    RARSJS_ARRAY(ShadowStackEnt) shadow_stack;
+    u8 callsan_stack_written_by[STACK_LEN / 4];
+
+    u8 *dev_state;
+
+    size_t num_pages;
+    DirtyPage *pages;
+    u8 *page_data;  // num_pages * DIRTY_PAGE_SIZE
+};
+
+static u32 page_len(Section *sec, u32 page) {
+    u32 off = page << DIRTY_PAGE_SHIFT;
+    u32 len = sec->contents.len - off;
+    return len < DIRTY_PAGE_SIZE ? len : DIRTY_PAGE_SIZE;
+}
+
+static bool snapshot_tracked(Section *sec) {
+    return sec->write && sec->base != MMIO_BASE && sec->contents.len;
+}
+
+static void snapshot_start_tracking(Program *p) {
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&p->as.sections); i++) {
+        Section *sec = *RARSJS_ARRAY_GET(&p->as.sections, i);
+        if (!snapshot_tracked(sec)) {
+            continue;
+        }
+
+        dirty_watch(&p->dirty, sec, DIRTY_SNAPSHOT);
+        free(sec->snapshot.baseline);
+        sec->snapshot.baseline = malloc(sec->contents.len);
+        RARSJS_CHECK_OOM(sec->snapshot.baseline);
+        memcpy(sec->snapshot.baseline, sec->contents.buf, sec->contents.len);
+    }
+
+    p->dirty.snapshot_pages.len = 0;
+    p->snapshot.tracking = true;
+}
+
+// Forgets the baseline and all dirty pages; existing snapshots can no longer
+// be restored. The sections themselves are freed by free_runtime
+void snapshot_reset(Program *p) {
+    RARSJS_ARRAY_FREE(&p->dirty.snapshot_pages);
+    p->snapshot.tracking = false;
+    p->snapshot.epoch++;
+}
+
+// Saves hart 0 of p, along with memory and devices
+export Snapshot *snapshot_create(Program *p) {
+    if (!p->snapshot.tracking) {
+        snapshot_start_tracking(p);
+    }
+
+    Snapshot *snap = malloc(sizeof(*snap));
+    RARSJS_CHECK_OOM(snap);
+
+    Machine *m = &p->machine;
+    snap->epoch = p->snapshot.epoch;
+    snap->instret = m->instret;
+    memcpy(snap->regs, m->regs, sizeof(m->regs));
+    snap->pc = m->pc;
+    for (size_t i = 0; i < SNAPSHOT_NUM_CSRS; i++) {
+        snap->csrs[i] = m->csr[SNAPSHOT_CSRS[i]];
+    }
+    snap->privilege = m->privilege;
+    snap->exited = m->exited;
+    snap->exit_code = m->exit_code;
+
+    snap->reg_bitmap = m->reg_bitmap;
+    snap->shadow_stack = RARSJS_ARRAY_NEW(ShadowStackEnt);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&m->shadow_stack); i++) {
+        *RARSJS_ARRAY_PUSH(&snap->shadow_stack) =
+            *RARSJS_ARRAY_GET(&m->shadow_stack, i);
+    }
+    memcpy(snap->callsan_stack_written_by, m->callsan_stack_written_by,
+           sizeof(snap->callsan_stack_written_by));
+
+    snap->dev_state = malloc(dev_state_size());
+    RARSJS_CHECK_OOM(snap->dev_state);
+    dev_save(p, snap->dev_state);
+
+    RARSJS_ARRAY(DirtyPage) *pages = &p->dirty.snapshot_pages;
+    snap->num_pages = RARSJS_ARRAY_LEN(pages);
+    snap->pages = NULL;
+    snap->page_data = NULL;
+    if (snap->num_pages) {
+        snap->pages = malloc(snap->num_pages * sizeof(DirtyPage));
+        RARSJS_CHECK_OOM(snap->pages);
+        snap->page_data = malloc(snap->num_pages * DIRTY_PAGE_SIZE);
+        RARSJS_CHECK_OOM(snap->page_data);
+    }
+
+    for (size_t i = 0; i < snap->num_pages; i++) {
+        DirtyPage *page = RARSJS_ARRAY_GET(pages, i);
+        snap->pages[i] = *page;
+        memcpy(snap->page_data + i * DIRTY_PAGE_SIZE,
+               page->sec->contents.buf + (page->page << DIRTY_PAGE_SHIFT),
+               page_len(page->sec, page->page));
+    }
+
+    return snap;
+}
+
+// Returns false if the emulator was reinitialized since snap was taken
+export bool snapshot_restore(Program *p, const Snapshot *snap) {
+    if (snap->epoch != p->snapshot.epoch) {
+        return false;
+    }
+
+    // pages written since the baseline go back to it...
+    RARSJS_ARRAY(DirtyPage) *pages = &p->dirty.snapshot_pages;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(pages); i++) {
+        DirtyPage *page = RARSJS_ARRAY_GET(pages, i);
+        u32 off = page->page << DIRTY_PAGE_SHIFT;
+        u32 len = page_len(page->sec, page->page);
+        memcpy(page->sec->contents.buf + off,
+               page->sec->snapshot.baseline + off, len);
+        dirty_mark_range(&p->dirty, page->sec, off, len);
+    }
+    dirty_clear(p, DIRTY_SNAPSHOT);
+
+    // ...and those written before the snapshot get their saved contents
+    for (size_t i = 0; i < snap->num_pages; i++) {
+        const DirtyPage *page = &snap->pages[i];
+        u32 off = page->page << DIRTY_PAGE_SHIFT;
+        u32 len = page_len(page->sec, page->page);
+        memcpy(page->sec->contents.buf + off,
+               snap->page_data + i * DIRTY_PAGE_SIZE, len);
+        dirty_mark_range(&p->dirty, page->sec, off, len);
+    }
+
+    Machine *m = &p->machine;
+    m->instret = snap->instret;
+    memcpy(m->regs, snap->regs, sizeof(m->regs));
+    m->pc = snap->pc;
+    for (size_t i = 0; i < SNAPSHOT_NUM_CSRS; i++) {
+        m->csr[SNAPSHOT_CSRS[i]] = snap->csrs[i];
+    }
+    emulator_interrupt_recheck(m);
+    m->privilege = snap->privilege;
+    m->reserved = false;
+    m->exited = snap->exited;
+    m->exit_code = snap->exit_code;
+    m->runtime_error_type = ERROR_NONE;
+
+    m->reg_bitmap = snap->reg_bitmap;
+    m->shadow_stack.len = 0;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&snap->shadow_stack); i++) {
+        *RARSJS_ARRAY_PUSH(&m->shadow_stack) =
+            *RARSJS_ARRAY_GET(&snap->shadow_stack, i);
+    }
+    memcpy(m->callsan_stack_written_by, snap->callsan_stack_written_by,
+           sizeof(snap->callsan_stack_written_by));
+
+    dev_load(p, snap->dev_state);
+    return true;
+}
+
+// Host memory held by snap, for callers that keep many of them around
+size_t snapshot_size(const Snapshot *snap) {
+    return sizeof(*snap) + dev_state_size() +
+           RARSJS_ARRAY_LEN(&snap->shadow_stack) * sizeof(ShadowStackEnt) +
+           snap->num_pages * (sizeof(DirtyPage) + DIRTY_PAGE_SIZE);
+}
+
+export void snapshot_free(Snapshot *snap) {
+    RARSJS_ARRAY_FREE(&snap->shadow_stack);
+    free(snap->dev_state);
+    free(snap->pages);
+    free(snap->page_data);
+    free(snap);
+}
@@ -0,0 +1,173 @@
+#include "rarsjs/timetravel.h"
+
+#include "rarsjs/breakpoint.h"
+#include "rarsjs/dev.h"
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+#include "rarsjs/snapshot.h"
+
+// Going back in time restores the closest earlier checkpoint and replays
+// forward from it. Execution is deterministic (console input is kept after
+// being read, and devices are part of the snapshot), so the replay reaches
+// exactly the same state, with the output muted since the host already has it
+// Checkpoints are snapshots taken every interval instructions.
+// When they exceed the memory budget, every other one is dropped and the
+// interval doubles, so a long run keeps a bounded, progressively sparser
+// history instead of losing its beginning
+// The optional models (profiler, timing, caches, branch predictor, trace) are
+// not part of the snapshots and replays skip their hooks, so going back would
+// leave them out of step with the machine (rdcycle would change, for one).
+// Time travel is refused while any of them is enabled instead
+
+static bool timetravel_models_off(Program *p) {
+    return !p->profile.counts && !p->profile.calls && !p->timing.enabled &&
+           !p->cache.enabled && !p->bpred.enabled && !p->trace.enabled;
+}
+
+static void timetravel_drop(Timetravel *tt, size_t from) {
+    for (size_t i = from; i < RARSJS_ARRAY_LEN(&tt->checkpoints); i++) {
+        Checkpoint *cp = RARSJS_ARRAY_GET(&tt->checkpoints, i);
+        tt->used -= cp->size;
+        snapshot_free(cp->snap);
+    }
+
+    if (from < RARSJS_ARRAY_LEN(&tt->checkpoints)) {
+        tt->checkpoints.len = from;
+    }
+}
+
+// Keeps the first checkpoint and every other one after it
+static void timetravel_thin(Timetravel *tt) {
+    size_t kept = 1;
+    for (size_t i = 1; i < RARSJS_ARRAY_LEN(&tt->checkpoints); i++) {
+        Checkpoint *cp = RARSJS_ARRAY_GET(&tt->checkpoints, i);
+        if (i % 2 == 0) {
+            *RARSJS_ARRAY_GET(&tt->checkpoints, kept++) = *cp;
+        } else {
+            tt->used -= cp->size;
+            snapshot_free(cp->snap);
+        }
+    }
+
+    tt->checkpoints.len = kept;
+    tt->interval *= 2;
+}
+
+void timetravel_checkpoint(Program *p) {
+    Timetravel *tt = &p->timetravel;
+    Snapshot *snap = snapshot_create(p);
+    size_t size = snapshot_size(snap);
+    u64 instret = p->machine.instret;
+    *RARSJS_ARRAY_PUSH(&tt->checkpoints) = (Checkpoint){instret, snap, size};
+    tt->used += size;
+    tt->next = instret + tt->interval;
+
+    while (tt->used > tt->budget && RARSJS_ARRAY_LEN(&tt->checkpoints) > 2) {
+        timetravel_thin(tt);
+    }
+}
+
+// Starts recording from the current instruction, with a checkpoint every
+// interval instructions and at most budget bytes of checkpoints
+// Returns false, recording nothing, while a model is enabled
+export bool timetravel_enable(Program *p, u32 interval, u32 budget) {
+    timetravel_disable(p);
+    if (!timetravel_models_off(p)) return false;
+    Timetravel *tt = &p->timetravel;
+    tt->interval = interval ? interval : 1;
+    tt->budget = budget;
+    timetravel_checkpoint(p);
+    return true;
+}
+
+export void timetravel_disable(Program *p) {
+    Timetravel *tt = &p->timetravel;
+    timetravel_drop(tt, 0);
+    RARSJS_ARRAY_FREE(&tt->checkpoints);
+    tt->used = 0;
+    tt->next = UINT64_MAX;
+}
+
+// Runs (muted) until the instret of hart 0 reaches target
+// If last_bp is given, it gets the last instret at which the pc was on a
+// breakpoint, or UINT64_MAX
+static void timetravel_replay(Program *p, u64 target, bool checkpoint,
+                              u64 *last_bp) {
+    Machine *m = &p->machine;
+    console_set_muted(p, true);
+    while (m->instret < target && !m->exited) {
+        if (last_bp && breakpoint_at(&p->breakpoints, m->pc)) {
+            *last_bp = m->instret;
+        }
+        if (checkpoint && m->instret >= p->timetravel.next) {
+            timetravel_checkpoint(p);
+        }
+        emulate(m);
+        if (m->runtime_error_type != ERROR_NONE) break;
+    }
+    console_set_muted(p, false);
+}
+
+// Index of the last checkpoint at or before instret, or -1
+static i64 timetravel_find(const Timetravel *tt, u64 instret) {
+    for (size_t i = RARSJS_ARRAY_LEN(&tt->checkpoints); i-- > 0;) {
+        if (RARSJS_ARRAY_GET(&tt->checkpoints, i)->instret <= instret) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool timetravel_restore(Program *p, size_t idx) {
+    // everything emitted so far must reach the host before the console's
+    // out_total goes back, so that it can tell which part of it to discard
+    console_flush(p);
+    Checkpoint *cp = RARSJS_ARRAY_GET(&p->timetravel.checkpoints, idx);
+    return snapshot_restore(p, cp->snap);
+}
+
+// Brings the machine back to how it was after target instructions
+// Fails if a model was enabled since recording started
+export bool timetravel_seek(Program *p, u64 target) {
+    if (target > p->machine.instret || !timetravel_models_off(p)) return false;
+
+    Timetravel *tt = &p->timetravel;
+    i64 idx = timetravel_find(tt, target);
+    if (idx < 0 || !timetravel_restore(p, idx)) return false;
+
+    // running forward again recreates later checkpoints as needed
+    timetravel_drop(tt, idx + 1);
+    tt->next = RARSJS_ARRAY_GET(&tt->checkpoints, idx)->instret + tt->interval;
+
+    timetravel_replay(p, target, true, NULL);
+    return true;
+}
+
+export bool timetravel_reverse_step(Program *p) {
+    u64 instret = p->machine.instret;
+    return instret > 0 && timetravel_seek(p, instret - 1);
+}
+
+// Goes back to the last time the pc was on a breakpoint,
+// or to the oldest checkpoint if there is none. Returns whether one was found
+export bool timetravel_reverse_continue(Program *p) {
+    if (!timetravel_models_off(p)) return false;
+    Timetravel *tt = &p->timetravel;
+    u64 end = p->machine.instret;
+    for (i64 idx = timetravel_find(tt, end ? end - 1 : 0); idx >= 0; idx--) {
+        u64 start = RARSJS_ARRAY_GET(&tt->checkpoints, idx)->instret;
+        if (start >= end || !timetravel_restore(p, idx)) continue;
+
+        u64 found = UINT64_MAX;
+        timetravel_replay(p, end, false, &found);
+        if (found != UINT64_MAX) {
+            return timetravel_seek(p, found);
+        }
+        end = start;
+    }
+
+    if (!RARSJS_ARRAY_IS_EMPTY(&tt->checkpoints)) {
+        timetravel_seek(p, RARSJS_ARRAY_GET(&tt->checkpoints, 0)->instret);
+    }
+    return false;
+}
@@ -0,0 +1,92 @@
+#include "rarsjs/timing.h"
+
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// Models an in-order 5-stage pipeline with full forwarding: every
+// instruction takes one cycle, plus
+//  - the extra cycles of multi-cycle units (MUL/DIV in EX, loads in MEM,
+//    CSR accesses), during which the whole pipeline waits
+//  - a bubble when an instruction needs the result of the load right
+//    before it, which is only available after MEM
+//  - the instructions flushed when the pc is redirected, as branches are
+//    predicted not taken
+
+export TimingConfig g_timing_config = {
+    .mul = TIMING_DEFAULT_MUL,
+    .div = TIMING_DEFAULT_DIV,
+    .load = TIMING_DEFAULT_LOAD,
+    .branch = TIMING_DEFAULT_BRANCH,
+    .csr = TIMING_DEFAULT_CSR,
+};
+
+// Resets the counters and starts accounting from the next instruction
+export void timing_enable(Program *p) {
+    p->timing = (Timing){.enabled = true, .cycles = TIMING_PIPELINE_FILL};
+}
+
+export void timing_disable(Program *p) { p->timing.enabled = false; }
+
+static bool reads_rs1(u32 opcode, u32 funct3) {
+    switch (opcode) {
+        case 0b0110111:  // LUI
+        case 0b0010111:  // AUIPC
+        case 0b1101111:  // JAL
+            return false;
+        case 0b1110011:  // SYSTEM, the CSR*I forms take an immediate
+            return funct3 && !(funct3 & 0b100);
+        default:
+            return true;
+    }
+}
+
+static bool reads_rs2(u32 opcode) {
+    return opcode == 0b0110011 ||  // R-type
+           opcode == 0b0101111 ||  // AMOs
+           opcode == 0b0100011 ||  // stores
+           opcode == 0b1100011;    // branches
+}
+
+static u64 extra(u32 latency) { return latency > 1 ? latency - 1 : 0; }
+
+// Accounts for the instruction that was just executed
+void timing_retire(Timing *t, u32 next_pc) {
+    u32 inst = t->inst;
+    u32 opcode = inst & 0x7f;
+    u32 rd = (inst >> 7) & 0x1f;
+    u32 funct3 = (inst >> 12) & 0b111;
+    u32 rs1 = (inst >> 15) & 0x1f;
+    u32 rs2 = (inst >> 20) & 0x1f;
+    u32 funct7 = inst >> 25;
+
+    u64 cycles = 1;
+
+    if (t->load_rd &&
+        ((reads_rs1(opcode, funct3) && rs1 == t->load_rd) ||
+         (reads_rs2(opcode) && rs2 == t->load_rd))) {
+        cycles += TIMING_LOAD_USE_STALL;
+        t->load_use_stalls += TIMING_LOAD_USE_STALL;
+    }
+    t->load_rd = 0;
+
+    u64 unit = 0;
+    if (opcode == 0b0110011 && funct7 == 1) {
+        unit = extra(funct3 < 4 ? g_timing_config.mul : g_timing_config.div);
+    } else if (opcode == 0b0000011 || opcode == 0b0101111) {
+        unit = extra(g_timing_config.load);
+        t->load_rd = rd;
+    } else if (opcode == 0b1110011) {
+        unit = extra(g_timing_config.csr);
+    }
+    cycles += unit;
+    t->unit_stalls += unit;
+
+    // covers taken branches, jumps and traps alike
+    if (next_pc != t->inst_pc + 4) {
+        cycles += g_timing_config.branch;
+        t->branch_stalls += g_timing_config.branch;
+    }
+
+    t->cycles += cycles;
+    t->instructions++;
+}
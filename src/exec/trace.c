@@ -0,0 +1,258 @@
+#include "rarsjs/trace.h"
+
+#include "rarsjs/emulate.h"
+#include "rarsjs/program.h"
+
+// A trace is a header (magic, version, instret of the first record as a
+// little endian u64) followed by one record per retired instruction:
+//   flags byte
+//   TRACE_PC_JUMP: pc - (previous pc + 4)
+//   TRACE_REG:     register byte, value - previous value of that register
+//   TRACE_MEM:     address - previous written address, length byte, value
+//   TRACE_ERROR:   error type byte
+// Numbers are LEB128 varints, signed ones zigzag encoded, so a straight-line
+// instruction writing a register usually takes 3 bytes. Only the last store
+// of an instruction is recorded, which matters for syscalls
+
+#define TRACE_BUF_SIZE (64 * 1024)
+#define TRACE_MAX_RECORD 24
+
+static u32 zigzag(u32 n) { return (n << 1) ^ (u32)((i32)n >> 31); }
+static u32 unzigzag(u32 n) { return (n >> 1) ^ -(n & 1); }
+
+static u32 put_varint(u8 *p, u32 n) {
+    u32 len = 0;
+    while (n >= 0x80) {
+        p[len++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    p[len++] = n;
+    return len;
+}
+
+// Encodes rec after the ones already seen by codec, returns its length
+static u32 trace_encode(TraceCodec *codec, const TraceRecord *rec, u8 *p) {
+    u32 len = 1;
+    u8 flags = 0;
+
+    if (rec->pc != codec->pc + 4) {
+        flags |= TRACE_PC_JUMP;
+        len += put_varint(p + len, zigzag(rec->pc - (codec->pc + 4)));
+    }
+    codec->pc = rec->pc;
+
+    if (rec->reg) {
+        flags |= TRACE_REG;
+        p[len++] = rec->reg;
+        len += put_varint(p + len, zigzag(rec->reg_val - codec->regs[rec->reg]));
+        codec->regs[rec->reg] = rec->reg_val;
+    }
+
+    if (rec->mem_len) {
+        flags |= TRACE_MEM;
+        len += put_varint(p + len, zigzag(rec->mem_addr - codec->mem_addr));
+        p[len++] = rec->mem_len;
+        len += put_varint(p + len, rec->mem_val);
+        codec->mem_addr = rec->mem_addr;
+    }
+
+    if (rec->error) {
+        flags |= TRACE_ERROR;
+        p[len++] = rec->error;
+    }
+
+    p[0] = flags;
+    return len;
+}
+
+#ifndef __wasm__
+static void trace_flush(Trace *t) {
+    if (t->buf_len && fwrite(t->buf, 1, t->buf_len, t->out) != t->buf_len) {
+        t->failed = true;
+    }
+    t->buf_len = 0;
+}
+
+static void trace_emit(Trace *t, const TraceRecord *rec) {
+    if (t->buf_len + TRACE_MAX_RECORD > TRACE_BUF_SIZE) trace_flush(t);
+    t->buf_len += trace_encode(&t->codec, rec, t->buf + t->buf_len);
+}
+
+static void trace_header(Trace *t, u64 start) {
+    u8 *p = t->buf + t->buf_len;
+    memcpy(p, TRACE_MAGIC, 4);
+    p[4] = TRACE_VERSION;
+    for (int i = 0; i < 8; i++) p[5 + i] = start >> (i * 8);
+    t->buf_len += 13;
+}
+
+// Records every instruction retired from now on into out, which must stay
+// open until trace_finish. With a nonzero ring_size, only the last ring_size
+// instructions are kept in memory and written out at the end, which is
+// cheap enough to leave on to see what led to a crash
+void trace_start(Program *p, FILE *out, u32 ring_size) {
+    Trace *t = &p->trace;
+    *t = (Trace){0};
+    t->out = out;
+    t->start = p->machine.instret + 1;
+    // the first pc is encoded relative to 0
+    t->codec.pc = -4u;
+    t->buf = malloc(TRACE_BUF_SIZE);
+    RARSJS_CHECK_OOM(t->buf);
+
+    if (ring_size) {
+        t->ring = malloc(ring_size * sizeof(TraceRecord));
+        RARSJS_CHECK_OOM(t->ring);
+        t->ring_size = ring_size;
+    } else {
+        trace_header(t, t->start);
+    }
+
+    t->enabled = true;
+}
+
+// Writes out whatever is still buffered, returns false on a write error
+bool trace_finish(Program *p) {
+    Trace *t = &p->trace;
+    if (!t->buf) return true;
+
+    if (t->ring) {
+        u64 kept = t->ring_len < t->ring_size ? t->ring_len : t->ring_size;
+        u32 first = kept < t->ring_size ? 0 : t->ring_next;
+        trace_header(t, t->start + t->ring_len - kept);
+        for (u64 i = 0; i < kept; i++) {
+            trace_emit(t, &t->ring[(first + i) % t->ring_size]);
+        }
+    }
+
+    trace_flush(t);
+    bool ok = !t->failed && fflush(t->out) == 0;
+    free(t->buf);
+    free(t->ring);
+    *t = (Trace){0};
+    return ok;
+}
+#endif
+
+// Called after every emulated instruction of m, including a faulting one
+void trace_record(Trace *t, Machine *m) {
+    TraceRecord rec = {0};
+    rec.error = m->runtime_error_type;
+    // the pc of a failed fetch was never seen by trace_fetch
+    rec.pc = rec.error == ERROR_FETCH ? m->pc : t->inst_pc;
+
+    if (m->reg_written) {
+        rec.reg = m->reg_written;
+        rec.reg_val = m->regs[m->reg_written];
+    }
+
+    Section *sec;
+    if (m->mem_written_len && rec.error == ERROR_NONE) {
+        u8 *mem = emulator_get_addr(m->prog, m->mem_written_addr,
+                                    m->mem_written_len, &sec);
+        rec.mem_addr = m->mem_written_addr;
+        rec.mem_len = m->mem_written_len;
+        // MMIO has no backing memory, its registers are recorded as 0
+        if (mem && sec->base != MMIO_BASE) {
+            for (u32 i = 0; i < m->mem_written_len; i++) {
+                rec.mem_val |= (u32)mem[i] << (i * 8);
+            }
+        }
+    }
+
+#ifndef __wasm__
+    if (t->ring) {
+        t->ring[t->ring_next] = rec;
+        t->ring_next = (t->ring_next + 1) % t->ring_size;
+        t->ring_len++;
+    } else {
+        trace_emit(t, &rec);
+    }
+#endif
+}
+
+#ifndef __wasm__
+static bool get_varint(FILE *in, u32 *out) {
+    u32 n = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = getc(in);
+        if (c == EOF) return false;
+        n |= (u32)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *out = n;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_byte(FILE *in, u8 *out) {
+    int c = getc(in);
+    *out = c;
+    return c != EOF;
+}
+
+// Prints one line per record of the trace in
+bool trace_decode(FILE *in, FILE *out, char **error) {
+    u8 header[13];
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, TRACE_MAGIC, 4) != 0) {
+        *error = "not a trace file";
+        return false;
+    }
+    if (header[4] != TRACE_VERSION) {
+        *error = "unsupported trace version";
+        return false;
+    }
+
+    u64 instret = 0;
+    for (int i = 0; i < 8; i++) instret |= (u64)header[5 + i] << (i * 8);
+
+    TraceCodec codec = {.pc = -4u};
+    int c;
+    while ((c = getc(in)) != EOF) {
+        u8 flags = c;
+        u32 n;
+
+        if (flags & TRACE_PC_JUMP) {
+            if (!get_varint(in, &n)) goto truncated;
+            codec.pc += 4 + unzigzag(n);
+        } else {
+            codec.pc += 4;
+        }
+        fprintf(out, "%llu 0x%08x", (unsigned long long)instret++, codec.pc);
+
+        if (flags & TRACE_REG) {
+            u8 reg;
+            if (!get_byte(in, &reg) || reg >= 32 || !get_varint(in, &n)) {
+                goto truncated;
+            }
+            codec.regs[reg] += unzigzag(n);
+            fprintf(out, " %s=0x%08x", REGISTER_NAMES[reg], codec.regs[reg]);
+        }
+
+        if (flags & TRACE_MEM) {
+            u8 len;
+            u32 val;
+            if (!get_varint(in, &n) || !get_byte(in, &len) ||
+                !get_varint(in, &val)) {
+                goto truncated;
+            }
+            codec.mem_addr += unzigzag(n);
+            fprintf(out, " [0x%08x]:%u=0x%x", codec.mem_addr, len, val);
+        }
+
+        if (flags & TRACE_ERROR) {
+            u8 err;
+            if (!get_byte(in, &err)) goto truncated;
+            fprintf(out, " error %u", err);
+        }
+        fputc('\n', out);
+    }
+    return true;
+
+truncated:
+    *error = "truncated trace";
+    return false;
+}
+#endif
@@ -2,12 +2,28 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include "../exec/rarsjs/emulate.h"
 #include "../exec/rarsjs/core.h"
+#include "../exec/rarsjs/bpred.h"
+#include "../exec/rarsjs/breakpoint.h"
+#include "../exec/rarsjs/cache.h"
+#include "../exec/rarsjs/dev.h"
+#include "../exec/rarsjs/dirty.h"
+#include "../exec/rarsjs/elf.h"
+#include "../exec/rarsjs/globals.h"
+#include "../exec/rarsjs/grade.h"
+#include "../exec/rarsjs/snapshot.h"
+#include "../exec/rarsjs/profile.h"
+#include "../exec/rarsjs/program.h"
+#include "../exec/rarsjs/smp.h"
+#include "../exec/rarsjs/timetravel.h"
+#include "../exec/rarsjs/timing.h"
+#include "../exec/rarsjs/trace.h"
 
 void setUp(void) {}
 void tearDown(void) {
-    free_runtime();
+    free_runtime(&g_program_default);
 }
 
 // need this wrapper because TEST_ASSERT_EQUAL_STRING_LEN doesn't check that the length matches
@@ -133,7 +149,7 @@ void test_parse_quoted_str_invalid_escape(void) {
 }
 
 void assemble_line(const char *line) {
-    assemble(line, strlen(line), false);
+    assemble(&g_program_default, line, strlen(line), false);
 }
 
 void test_unknown_opcode(void) {
@@ -204,7 +220,7 @@ void test_sw_newline(void) {
 void test_addi_oob(void) {
     assemble_line("addi x1, x2, 2048");
     TEST_ASSERT_EQUAL_STRING(g_error, "Out of bounds imm");
-    free_runtime();
+    free_runtime(&g_program_default);
 
     assemble_line("addi x1, x2, -2049");
     TEST_ASSERT_EQUAL_STRING(g_error, "Out of bounds imm");
@@ -237,14 +253,14 @@ void test_parse_directives_nums() {
     TEST_ASSERT_EQUAL_INT(g_data->contents.len, 4);
     memcpy(&word, g_data->contents.buf, 4);
     TEST_ASSERT_EQUAL_INT(word, 5);
-    free_runtime();
+    free_runtime(&g_program_default);
 
     u16 half; 
     assemble_line(".DATA\nvar: .HALF 5");
     TEST_ASSERT_EQUAL_INT(g_data->contents.len, 2);
     memcpy(&half, g_data->contents.buf, 2);
     TEST_ASSERT_EQUAL_INT(half, 5);
-    free_runtime();
+    free_runtime(&g_program_default);
 
     u8 byte;
     assemble_line(".data\nvar: .byte 5");
@@ -261,30 +277,30 @@ void test_parse_directives_nums_invalid() {
 void test_parse_directives_nums_oob() {
     assemble_line(".data\nvar: .half 0x10000");
     TEST_ASSERT_EQUAL_STRING(g_error, "Out of bounds half");
-    free_runtime();
+    free_runtime(&g_program_default);
 
     assemble_line(".data\nvar: .half -32769");
     TEST_ASSERT_EQUAL_STRING(g_error, "Out of bounds half");
-    free_runtime();
+    free_runtime(&g_program_default);
 
     assemble_line(".data\nvar: .byte 0x100");
     TEST_ASSERT_EQUAL_STRING(g_error, "Out of bounds byte");
-    free_runtime();
+    free_runtime(&g_program_default);
 
     assemble_line(".data\nvar: .byte -129");
     TEST_ASSERT_EQUAL_STRING(g_error, "Out of bounds byte");
-    free_runtime();
+    free_runtime(&g_program_default);
 }
 
 void test_parse_directives_str() {
     assemble_line(".data\nstr: .ASCII \"hi\", \"hi\"");
     TEST_ASSERT_EQUAL_STR("hihi", g_data->contents.buf, g_data->contents.len);
-    free_runtime();
+    free_runtime(&g_program_default);
 
     assemble_line(".data\nstr: .string \"hi\"");
     TEST_ASSERT_EQUAL_INT(g_data->contents.len, 3);
     TEST_ASSERT_EQUAL_CHAR_ARRAY("hi\0", g_data->contents.buf, g_data->contents.len);
-    free_runtime();
+    free_runtime(&g_program_default);
 }
 
 void test_parse_multiple_definitions() {
@@ -301,7 +317,7 @@ void test_resolve_text_symbol_found(void) {
     assemble_line("mylabel: addi a0, a0, 0");
     u32 addr;
     Section *sec;
-    bool found = resolve_symbol("mylabel", strlen("mylabel"), false, &addr, &sec);
+    bool found = resolve_symbol(&g_program_default, "mylabel", strlen("mylabel"), false, &addr, &sec);
     TEST_ASSERT_TRUE(found);
     TEST_ASSERT_EQUAL(sec, g_text);
     TEST_ASSERT_TRUE(addr >= g_text->base && addr < g_text->limit);
@@ -311,7 +327,7 @@ void test_resolve_data_symbol_found(void) {
     assemble_line(".data\nmylabel: .word 1234");
     u32 addr;
     Section *sec;
-    bool found = resolve_symbol("mylabel", strlen("mylabel"), false, &addr, &sec);
+    bool found = resolve_symbol(&g_program_default, "mylabel", strlen("mylabel"), false, &addr, &sec);
     TEST_ASSERT_TRUE(found);
     TEST_ASSERT_EQUAL(sec, g_data);
     TEST_ASSERT_TRUE(addr >= g_data->base && addr < g_data->limit);
@@ -321,7 +337,7 @@ void test_pc_to_label_r2(void) {
     assemble_line("label: add x0, x0, x0");
     LabelData *ret = NULL;
     u32 off = 0;
-    bool result = pc_to_label_r(g_text->base, &ret, &off);
+    bool result = pc_to_label_r(&g_program_default, g_text->base, &ret, &off);
     TEST_ASSERT_TRUE(result);
     TEST_ASSERT_EQUAL_STR("label", ret->txt, ret->len);
 }
@@ -330,14 +346,35 @@ void test_pc_to_label_r_no_label(void) {
     assemble_line("add x0, x0, x0");
     LabelData *ret = NULL;
     u32 off = 0;
-    bool result = pc_to_label_r(0xdeadbeef, &ret, &off);
+    bool result = pc_to_label_r(&g_program_default, 0xdeadbeef, &ret, &off);
     TEST_ASSERT_FALSE(result);
 }
 
+void test_pc_to_label_r_index(void) {
+    assemble_line("first:\nsecond: add x0, x0, x0\nadd x0, x0, x0\nthird: add x0, x0, x0\n.data\nvar: .word 1");
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    LabelData *ret = NULL;
+    u32 off = 0;
+
+    // labels at the same address resolve to the first one
+    TEST_ASSERT_TRUE(pc_to_label_r(&g_program_default, g_text->base + 4, &ret, &off));
+    TEST_ASSERT_EQUAL_STR("first", ret->txt, ret->len);
+    TEST_ASSERT_EQUAL(4, off);
+    TEST_ASSERT_TRUE(pc_to_label_r(&g_program_default, g_text->base + 8, &ret, &off));
+    TEST_ASSERT_EQUAL_STR("third", ret->txt, ret->len);
+    TEST_ASSERT_EQUAL(0, off);
+    TEST_ASSERT_TRUE(pc_to_label_r(&g_program_default, g_data->base, &ret, &off));
+    TEST_ASSERT_EQUAL_STR("var", ret->txt, ret->len);
+
+    // a label from a lower section doesn't name pcs outside it
+    TEST_ASSERT_FALSE(pc_to_label_r(&g_program_default, MMIO_BASE, &ret, &off));
+    TEST_ASSERT_FALSE(pc_to_label_r(&g_program_default, STACK_TOP + 4, &ret, &off));
+}
+
 void test_fixup(void) {
     assemble_line("j exit\nexit:");
     bool err;
-    TEST_ASSERT_EQUAL_INT(LOAD(g_text->base, 4, &err), 0x0040006f);
+    TEST_ASSERT_EQUAL_INT(LOAD(&g_machine, g_text->base, 4, &err), 0x0040006f);
     TEST_ASSERT_FALSE(err);
 }
 
@@ -345,7 +382,7 @@ void test_backtrack(void) {
     assemble_line("j .exit\n.exit:");
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
     bool err;
-    TEST_ASSERT_EQUAL_INT(LOAD(g_text->base, 4, &err), 0x0040006f);
+    TEST_ASSERT_EQUAL_INT(LOAD(&g_machine, g_text->base, 4, &err), 0x0040006f);
     TEST_ASSERT_FALSE(err);
 }
 
@@ -385,17 +422,17 @@ addi x0, x0, 3 \n\
 
 void build_and_run(const char* txt) {
     u32 addr;
-    assemble(txt, strlen(txt), false);
+    assemble(&g_program_default, txt, strlen(txt), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
-    if (resolve_symbol("_start", strlen("_start"), true, &addr, NULL)) g_pc = addr;
+    if (resolve_symbol(&g_program_default, "_start", strlen("_start"), true, &addr, NULL)) g_pc = addr;
     while (!g_exited) {
-        emulate();
+        emulate(&g_machine);
         if (g_runtime_error_type != ERROR_NONE) break;
     }
 }
 void check_pc_at_label(const char* label) {
     u32 addr;
-    TEST_ASSERT_TRUE(resolve_symbol(label, strlen(label), false, &addr, NULL));
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, label, strlen(label), false, &addr, NULL));
     TEST_ASSERT_EQUAL(g_pc, addr);
 }
 void test_runtime_exit() {
@@ -539,33 +576,33 @@ _start:\n\
 void test_load_store_api(void) {
     assemble_line(".data\nvar: .word 0");
     bool err = false;
-    STORE(g_data->base, 0xDEADBEEFu, 4, &err);
+    STORE(&g_machine, g_data->base, 0xDEADBEEFu, 4, &err);
     TEST_ASSERT_FALSE(err);
-    u32 val = LOAD(g_data->base, 4, &err);
+    u32 val = LOAD(&g_machine, g_data->base, 4, &err);
     TEST_ASSERT_FALSE(err);
     TEST_ASSERT_EQUAL_UINT32(0xDEADBEEFu, val);
 }
 
 void test_kernel_memory_protection(void) {
     const char* prog = ".section .kernel_data\nvar: .word 0xCAFEBABE";
-    assemble(prog, strlen(prog), false);
+    assemble(&g_program_default, prog, strlen(prog), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
 
     bool err = false;
     // user mode should not be able to read supervisor memory
-    u32 val = LOAD(g_kernel_data->base, 4, &err);
+    u32 val = LOAD(&g_machine, g_kernel_data->base, 4, &err);
     TEST_ASSERT_TRUE(err);
 
     // but kernel mode should
-    emulator_enter_kernel();
+    emulator_enter_kernel(&g_machine);
     err = false;
-    val = LOAD(g_kernel_data->base, 4, &err);
+    val = LOAD(&g_machine, g_kernel_data->base, 4, &err);
     TEST_ASSERT_FALSE(err);
     TEST_ASSERT_EQUAL_UINT32(0xCAFEBABEu, val);
 }
 
 void step() {
-    emulate();
+    emulate(&g_machine);
     TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
 }
 
@@ -577,7 +614,7 @@ handler: addi x0, x0, 0\n\
 .globl _start\n\
 _start: ecall\n\
 ";
-    assemble(prog, strlen(prog), false);
+    assemble(&g_program_default, prog, strlen(prog), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
     TEST_ASSERT_TRUE(g_kernel_text->contents.len > 0);
     TEST_ASSERT_TRUE(g_text->contents.len > 0);
@@ -586,30 +623,57 @@ _start: ecall\n\
     g_csr[CSR_STVEC] = g_kernel_text->base;
 
     u32 addr;
-    TEST_ASSERT_TRUE(resolve_symbol("_start", strlen("_start"), true, &addr, NULL));
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "_start", strlen("_start"), true, &addr, NULL));
     g_pc = addr;
 
-    emulator_leave_kernel();
-    emulate(); // one single instruction
+    emulator_leave_kernel(&g_machine);
+    emulate(&g_machine); // one single instruction
     TEST_ASSERT_EQUAL(g_pc, g_csr[CSR_STVEC]);
     TEST_ASSERT_EQUAL(addr, g_csr[CSR_SEPC]);
 }
 
 void test_emulator_interrupt_set_pending(void) {
     const char *prog = "addi x0, x0, 0";
-    assemble(prog, strlen(prog), false);
+    assemble(&g_program_default, prog, strlen(prog), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
 
     g_csr[CSR_MIP] = 0;
     g_csr[CSR_STVEC] = 0xAABB00;
-    emulator_interrupt_set_pending(CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
+    emulator_interrupt_set_pending(&g_machine, CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
     TEST_ASSERT_TRUE(g_csr[CSR_MIP] & (1u << (CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT)));
-    emulate();
+    emulate(&g_machine);
     TEST_ASSERT_EQUAL_UINT32(g_pc, g_csr[CSR_STVEC]);
     TEST_ASSERT_EQUAL_UINT32(g_text->base, g_csr[CSR_SEPC]);
     TEST_ASSERT_EQUAL_UINT32(CAUSE_SUPERVISOR_TIMER, g_csr[CSR_SCAUSE]);
 }
 
+void test_interrupt_pending_flag(void) {
+    const char *prog = "addi x0, x0, 0\naddi x0, x0, 0\naddi x0, x0, 0";
+    assemble(&g_program_default, prog, strlen(prog), false);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    g_csr[CSR_STVEC] = 0xAABB00;
+
+    // nothing pending, so the first instruction clears the flag
+    TEST_ASSERT_TRUE(g_machine.irq_maybe_pending);
+    emulate(&g_machine);
+    TEST_ASSERT_FALSE(g_machine.irq_maybe_pending);
+
+    // pending but masked: looked at once, then left alone
+    g_csr[CSR_MSTATUS] &= ~STATUS_SIE;
+    emulator_interrupt_set_pending(&g_machine, CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
+    TEST_ASSERT_TRUE(g_machine.irq_maybe_pending);
+    emulate(&g_machine);
+    TEST_ASSERT_FALSE(g_machine.irq_maybe_pending);
+    TEST_ASSERT_EQUAL_UINT32(g_text->base + 8, g_pc);
+
+    // enabling interrupts behind the emulator's back needs a recheck
+    g_csr[CSR_MSTATUS] |= STATUS_SIE;
+    emulator_interrupt_recheck(&g_machine);
+    emulate(&g_machine);
+    TEST_ASSERT_EQUAL_UINT32(0xAABB00, g_pc);
+    TEST_ASSERT_EQUAL_UINT32(CAUSE_SUPERVISOR_TIMER, g_csr[CSR_SCAUSE]);
+}
+
 void test_sret_returns_to_sepc(void) {
     assemble_line(
         ".section .kernel_text\n"
@@ -619,10 +683,10 @@ void test_sret_returns_to_sepc(void) {
         );
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
     u32 addr;
-    TEST_ASSERT_TRUE(resolve_symbol("return_target", strlen("return_target"), false, &addr, NULL));
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "return_target", strlen("return_target"), false, &addr, NULL));
     g_csr[CSR_SEPC] = addr;
     g_pc = g_kernel_text->base;
-    emulator_enter_kernel();
+    emulator_enter_kernel(&g_machine);
     step();
     TEST_ASSERT_EQUAL(g_pc, g_csr[CSR_SEPC]);
 }
@@ -656,15 +720,15 @@ vector_handlers:\n\
 .globl _start\n\
 _start: addi x0, x0, 0\n\
 ";
-    assemble(prog, strlen(prog), false);
+    assemble(&g_program_default, prog, strlen(prog), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
 
     u32 vector_handlers;
-    TEST_ASSERT_TRUE(resolve_symbol("vector_handlers", strlen("vector_handlers"), false, &vector_handlers, NULL));
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "vector_handlers", strlen("vector_handlers"), false, &vector_handlers, NULL));
     
     g_csr[CSR_STVEC] = vector_handlers | 1;
     
-    emulator_interrupt_set_pending(CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
+    emulator_interrupt_set_pending(&g_machine, CAUSE_SUPERVISOR_TIMER & ~CAUSE_INTERRUPT);
     step();
     
     // delivers interrupt and executes one instruction
@@ -678,9 +742,9 @@ void test_sstatus_write_mask(void) {
     li t0, -1\n\
     csrrw zero, sstatus, t0\n\
 ";
-    assemble(prog, strlen(prog), false);
+    assemble(&g_program_default, prog, strlen(prog), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
-    emulator_enter_kernel();
+    emulator_enter_kernel(&g_machine);
     g_pc = g_kernel_text->base;
     step();
     step();
@@ -698,7 +762,7 @@ void test_sstatus_bit_manipulation(void) {
     assemble_line(prog);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
     g_pc = g_kernel_text->base;
-    emulator_enter_kernel();
+    emulator_enter_kernel(&g_machine);
     step();
     step();
     step();
@@ -717,7 +781,7 @@ void test_sstatus_ecall(void) {
     assemble_line(prog);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
     g_pc = g_kernel_text->base;
-    emulator_enter_kernel();
+    emulator_enter_kernel(&g_machine);
     step();
     step();
     step();
@@ -744,24 +808,24 @@ sw_irq_handle:                \n\
 .globl _start\n\
 _start: ecall\n\
 ";
-    assemble(prog, strlen(prog), false);
+    assemble(&g_program_default, prog, strlen(prog), false);
     TEST_ASSERT_EQUAL_STRING(g_error, NULL);
     
     u32 handler_addr;
-    TEST_ASSERT_TRUE(resolve_symbol("handler", strlen("handler"), false, &handler_addr, NULL));
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "handler", strlen("handler"), false, &handler_addr, NULL));
     g_csr[CSR_STVEC] = handler_addr;
     
     u32 start_addr;
-    TEST_ASSERT_TRUE(resolve_symbol("_start", strlen("_start"), true, &start_addr, NULL));
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "_start", strlen("_start"), true, &start_addr, NULL));
     g_pc = start_addr;
     
-    emulator_leave_kernel();
+    emulator_leave_kernel(&g_machine);
 
     step(); // ecall
     TEST_ASSERT_EQUAL(handler_addr, g_pc);
     TEST_ASSERT_EQUAL(CAUSE_U_ECALL, g_csr[CSR_SCAUSE]);
     TEST_ASSERT_FALSE(g_csr[CSR_MSTATUS] & STATUS_SIE);
-    emulator_interrupt_set_pending(CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
+    emulator_interrupt_set_pending(&g_machine, CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
     step(); // ecall.csrrw
     step(); // ecall.addi
     step(); // ecall.bne
@@ -777,4 +841,1413 @@ _start: ecall\n\
     step(); // ecall.sret
     // PC is generally advanced by the handler, but it's not necessary in this test
     TEST_ASSERT_EQUAL(start_addr, g_pc);
-}
\ No newline at end of file
+}
+// -- device tests
+
+#define DMA_TEST_PROLOGUE "\
+.data                       \n\
+src: .word 1, 2, 3, 4       \n\
+dst: .word 0, 0, 0, 0       \n\
+.section .kernel_text       \n\
+.globl _kernel_start        \n\
+_kernel_start:              \n\
+    csrrci zero, sstatus, 2 \n\
+    la t0, _DMA0_BASE       \n\
+    la t1, dst              \n\
+    sw t1, 0(t0)            \n\
+    la t1, src              \n\
+    sw t1, 4(t0)            \n\
+"
+
+#define DMA_TEST_EPILOGUE "\
+    la t0, _POWER0_CNTL     \n\
+    li t1, 1                \n\
+    sb t1, 0(t0)            \n\
+"
+
+static u32 load_label_word(const char *label, u32 off) {
+    u32 addr;
+    bool err;
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, label, strlen(label), false, &addr, NULL));
+    u32 val = LOAD(&g_machine, addr + off, 4, &err);
+    TEST_ASSERT_FALSE(err);
+    return val;
+}
+
+void test_dma_bulk_copy(void) {
+    build_and_run(DMA_TEST_PROLOGUE "\
+    li t1, 4                \n\
+    sw t1, 8(t0)            \n\
+    sw t1, 12(t0)           \n\
+    sw t1, 20(t0)           \n\
+    li t1, 16               \n\
+    sw t1, 16(t0)           \n\
+    li t1, 1                \n\
+    sw t1, 24(t0)           \n\
+    lw s1, 28(t0)           \n\
+" DMA_TEST_EPILOGUE);
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    for (u32 i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i + 1, load_label_word("dst", i * 4));
+    }
+    TEST_ASSERT_EQUAL_UINT32(DMA_STATUS_DONE, g_regs[REG_S1]);
+}
+
+void test_dma_strided_copy(void) {
+    build_and_run(DMA_TEST_PROLOGUE "\
+    li t1, 4                \n\
+    sw t1, 8(t0)            \n\
+    sw t1, 20(t0)           \n\
+    li t1, 8                \n\
+    sw t1, 12(t0)           \n\
+    sw t1, 16(t0)           \n\
+    li t1, 1                \n\
+    sw t1, 24(t0)           \n\
+" DMA_TEST_EPILOGUE);
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    TEST_ASSERT_EQUAL_UINT32(1, load_label_word("dst", 0));
+    TEST_ASSERT_EQUAL_UINT32(3, load_label_word("dst", 4));
+    TEST_ASSERT_EQUAL_UINT32(0, load_label_word("dst", 8));
+}
+
+void test_dma_async_interrupt(void) {
+    build_and_run(DMA_TEST_PROLOGUE "\
+    li t1, 4                \n\
+    sw t1, 8(t0)            \n\
+    sw t1, 12(t0)           \n\
+    sw t1, 20(t0)           \n\
+    li t1, 16               \n\
+    sw t1, 16(t0)           \n\
+    li t1, 7                \n\
+    sw t1, 24(t0)           \n\
+    lw s1, 28(t0)           \n\
+    la t1, dst              \n\
+    lw s2, 0(t1)            \n\
+wait:                       \n\
+    lw t1, 28(t0)           \n\
+    andi t1, t1, 2          \n\
+    beqz t1, wait           \n\
+" DMA_TEST_EPILOGUE);
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    // the transfer is still in flight right after being started
+    TEST_ASSERT_EQUAL_UINT32(DMA_STATUS_BUSY, g_regs[REG_S1]);
+    TEST_ASSERT_EQUAL_UINT32(0, g_regs[REG_S2]);
+    TEST_ASSERT_EQUAL_UINT32(4, load_label_word("dst", 12));
+    TEST_ASSERT_TRUE(g_csr[CSR_MIP] &
+                     (1u << (CAUSE_SUPERVISOR_EXTERNAL & ~CAUSE_INTERRUPT)));
+    bool err;
+    TEST_ASSERT_EQUAL_UINT32(DMA0_BASE, LOAD(&g_machine, RIC0_DEVADDR, 4, &err));
+}
+
+void test_console_output_buffered(void) {
+    assemble_line("li a0, 'x'\nli a7, 11\necall\nli a0, 'y'\necall");
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    emulate(&g_machine);
+    emulate(&g_machine);
+    emulate(&g_machine);
+    TEST_ASSERT_EQUAL_UINT32(1, g_console_out_len);
+    TEST_ASSERT_EQUAL('x', g_console_out_buf[0]);
+    // a batch flushes whatever is left at its end
+    TEST_ASSERT_EQUAL_UINT32(2, emulate_n(&g_machine, 2));
+    TEST_ASSERT_EQUAL_UINT32(0, g_console_out_len);
+}
+
+static void run_with_input(const char *txt, const char *input) {
+    u32 addr;
+    assemble(&g_program_default, txt, strlen(txt), false);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    console_input_push(&g_program_default, (const u8 *)input, strlen(input));
+    if (resolve_symbol(&g_program_default, "_start", strlen("_start"), true, &addr, NULL)) g_pc = addr;
+    while (!g_exited) {
+        emulate(&g_machine);
+        if (g_runtime_error_type != ERROR_NONE) break;
+    }
+}
+
+void test_console_read_syscalls(void) {
+    run_with_input("\
+.data                       \n\
+buf: .word 0, 0, 0, 0       \n\
+.text                       \n\
+    li a7, 5                \n\
+    ecall                   \n\
+    mv s1, a0               \n\
+    la a0, buf              \n\
+    li a1, 16               \n\
+    li a7, 8                \n\
+    ecall                   \n\
+    li a7, 12               \n\
+    ecall                   \n\
+    mv s2, a0               \n\
+    ecall                   \n\
+    mv s3, a0               \n\
+    ecall                   \n\
+    mv s4, a0               \n\
+    li a7, 93               \n\
+    ecall                   \n\
+", "  -42 \nhello\nxy");
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    TEST_ASSERT_EQUAL_INT32(-42, (i32)g_regs[REG_S1]);
+    TEST_ASSERT_EQUAL_UINT32('l' << 24 | 'l' << 16 | 'e' << 8 | 'h',
+                             load_label_word("buf", 0));
+    TEST_ASSERT_EQUAL_UINT32('\n' << 8 | 'o', load_label_word("buf", 4));
+    TEST_ASSERT_EQUAL_UINT32('x', g_regs[REG_S2]);
+    TEST_ASSERT_EQUAL_UINT32('y', g_regs[REG_S3]);
+    TEST_ASSERT_EQUAL_INT32(-1, (i32)g_regs[REG_S4]);
+}
+
+void test_console_read_errors(void) {
+    // read int without a number in the input
+    run_with_input("li a7, 5\necall\nli a7, 93\necall", "abc\n");
+    TEST_ASSERT_EQUAL(ERROR_INPUT, g_runtime_error_type);
+    free_runtime(&g_program_default);
+
+    // read string into the read-only text section
+    run_with_input("\
+    li a0, 0x00400000       \n\
+    li a1, 16               \n\
+    li a7, 8                \n\
+    ecall                   \n\
+", "hello\n");
+    TEST_ASSERT_EQUAL(ERROR_STORE, g_runtime_error_type);
+    TEST_ASSERT_EQUAL_UINT32(TEXT_BASE, g_runtime_error_params[0]);
+}
+
+void test_console_in_mmio(void) {
+    run_with_input("\
+.section .kernel_text       \n\
+.globl _kernel_start        \n\
+_kernel_start:              \n\
+    csrrci zero, sstatus, 2 \n\
+    la t0, _CONSOLE0_BASE   \n\
+    lw s1, 2(t0)            \n\
+    li t1, 2                \n\
+    sw t1, 6(t0)            \n\
+    li t1, 1                \n\
+    sw t1, 10(t0)           \n\
+    lbu s2, 0(t0)           \n\
+    lbu s3, 0(t0)           \n\
+    lbu s4, 0(t0)           \n\
+    lbu s5, 0(t0)           \n\
+    li t1, 2                \n\
+    sw t1, 10(t0)           \n\
+    lbu s6, 0(t0)           \n\
+", "abc");
+    // a blocking read at the end of the input can never complete
+    TEST_ASSERT_EQUAL(ERROR_LOAD, g_runtime_error_type);
+    TEST_ASSERT_EQUAL_UINT32(3, g_regs[REG_S1]);
+    TEST_ASSERT_EQUAL_UINT32('a', g_regs[REG_S2]);
+    TEST_ASSERT_EQUAL_UINT32('b', g_regs[REG_S3]);
+    TEST_ASSERT_EQUAL_UINT32('c', g_regs[REG_S4]);
+    TEST_ASSERT_EQUAL_UINT32(0, g_regs[REG_S5]);
+    // enabling the interrupt with a full batch queued raises it right away
+    TEST_ASSERT_TRUE(g_csr[CSR_MIP] &
+                     (1u << (CAUSE_SUPERVISOR_EXTERNAL & ~CAUSE_INTERRUPT)));
+    bool err;
+    TEST_ASSERT_EQUAL_UINT32(CONSOLE0_BASE, LOAD(&g_machine, RIC0_DEVADDR, 4, &err));
+}
+
+static void run_to_label(const char *label) {
+    u32 addr;
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, label, strlen(label), false, &addr, NULL));
+    while (g_pc != addr && !g_exited) {
+        emulate(&g_machine);
+        TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    }
+}
+
+// An asynchronous transfer started by the kernel still completes after the
+// hart has gone back to user mode
+void test_dma_async_keeps_privilege(void) {
+    assemble_line("\
+.data                       \n\
+src: .word 1, 2, 3, 4       \n\
+.section .kernel_data       \n\
+dst: .word 0, 0, 0, 0       \n\
+.section .kernel_text       \n\
+.globl _kernel_start        \n\
+_kernel_start:              \n\
+    la t0, _DMA0_BASE       \n\
+    la t1, dst              \n\
+    sw t1, 0(t0)            \n\
+    la t1, src              \n\
+    sw t1, 4(t0)            \n\
+    li t1, 4                \n\
+    sw t1, 8(t0)            \n\
+    sw t1, 12(t0)           \n\
+    sw t1, 20(t0)           \n\
+    li t1, 16               \n\
+    sw t1, 16(t0)           \n\
+    li t1, 3                \n\
+    sw t1, 24(t0)           \n\
+started:                    \n\
+    addi zero, zero, 0      \n\
+");
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    run_to_label("started");
+
+    g_machine.privilege = PRIV_USER;
+    for (u32 i = 0; i < DMA_SETUP_LATENCY + 16 / DMA_BYTES_PER_TICK; i++) {
+        dev_tick(&g_machine);
+    }
+    g_machine.privilege = PRIV_SUPERVISOR;
+
+    bool err;
+    TEST_ASSERT_EQUAL_UINT32(DMA_STATUS_DONE,
+                             LOAD(&g_machine, DMA0_BASE + 28, 4, &err));
+    for (u32 i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i + 1, load_label_word("dst", i * 4));
+    }
+}
+
+#define SNAPSHOT_TEST_PROGRAM "\
+.data                       \n\
+arr: .word 0, 0, 0, 0       \n\
+.text                       \n\
+    la t0, arr              \n\
+    li t1, 1                \n\
+    sw t1, 0(t0)            \n\
+first:                      \n\
+    li t1, 2                \n\
+    sw t1, 4(t0)            \n\
+    addi sp, sp, -4         \n\
+    sw t1, 0(sp)            \n\
+second:                     \n\
+    li a7, 93               \n\
+    ecall                   \n\
+"
+
+void test_snapshot_restore(void) {
+    assemble_line(SNAPSHOT_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+
+    run_to_label("first");
+    Snapshot *first = snapshot_create(&g_program_default);
+    run_to_label("second");
+    TEST_ASSERT_EQUAL_UINT32(2, load_label_word("arr", 4));
+    u32 sp = g_regs[REG_SP];
+    emulate(&g_machine);
+    emulate(&g_machine);
+    TEST_ASSERT_TRUE(g_exited);
+    Snapshot *end = snapshot_create(&g_program_default);
+
+    TEST_ASSERT_TRUE(snapshot_restore(&g_program_default, first));
+    TEST_ASSERT_FALSE(g_exited);
+    check_pc_at_label("first");
+    TEST_ASSERT_EQUAL_UINT32(1, load_label_word("arr", 0));
+    TEST_ASSERT_EQUAL_UINT32(0, load_label_word("arr", 4));
+    TEST_ASSERT_EQUAL_UINT32(sp + 4, g_regs[REG_SP]);
+    bool err;
+    TEST_ASSERT_EQUAL_UINT32(0xABABABAB, LOAD(&g_machine, sp, 4, &err));
+
+    // restoring a later snapshot after an earlier one
+    TEST_ASSERT_TRUE(snapshot_restore(&g_program_default, end));
+    TEST_ASSERT_TRUE(g_exited);
+    TEST_ASSERT_EQUAL_UINT32(2, load_label_word("arr", 4));
+    TEST_ASSERT_EQUAL_UINT32(2, LOAD(&g_machine, sp, 4, &err));
+
+    // the sections a snapshot refers to are gone after reassembling
+    free_runtime(&g_program_default);
+    assemble_line(SNAPSHOT_TEST_PROGRAM);
+    TEST_ASSERT_FALSE(snapshot_restore(&g_program_default, first));
+
+    snapshot_free(first);
+    snapshot_free(end);
+}
+
+#define TIMETRAVEL_TEST_PROGRAM "\
+.data                       \n\
+counter: .word 0            \n\
+.text                       \n\
+    la t0, counter          \n\
+loop:                       \n\
+    lw t1, 0(t0)            \n\
+    addi t1, t1, 1          \n\
+    sw t1, 0(t0)            \n\
+mark:                       \n\
+    j loop                  \n\
+"
+
+void test_timetravel_seek(void) {
+    assemble_line(TIMETRAVEL_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    // small enough that the checkpoints have to be thinned out
+    timetravel_enable(&g_program_default, 16, 16 * 1024);
+
+    emulate_n(&g_machine, 500);
+    u32 counter = load_label_word("counter", 0);
+    u32 pc = g_pc;
+    u32 t1 = g_regs[REG_T1];
+    emulate_n(&g_machine, 500);
+    TEST_ASSERT_EQUAL_UINT32(1000, g_instret);
+    u32 final_counter = load_label_word("counter", 0);
+
+    TEST_ASSERT_TRUE(timetravel_seek(&g_program_default, 500));
+    TEST_ASSERT_EQUAL_UINT32(500, g_instret);
+    TEST_ASSERT_EQUAL_UINT32(counter, load_label_word("counter", 0));
+    TEST_ASSERT_EQUAL_UINT32(pc, g_pc);
+    TEST_ASSERT_EQUAL_UINT32(t1, g_regs[REG_T1]);
+    TEST_ASSERT_FALSE(timetravel_seek(&g_program_default, 501));
+
+    TEST_ASSERT_TRUE(timetravel_reverse_step(&g_program_default));
+    TEST_ASSERT_EQUAL_UINT32(499, g_instret);
+
+    u32 mark;
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "mark", 4, false, &mark, NULL));
+    TEST_ASSERT_TRUE(breakpoint_set(&g_program_default, mark, true));
+    TEST_ASSERT_TRUE(timetravel_reverse_continue(&g_program_default));
+    check_pc_at_label("mark");
+    TEST_ASSERT_TRUE(g_instret < 499 && g_instret >= 495);
+    // the store right before mark has happened, once per iteration
+    TEST_ASSERT_EQUAL_UINT32((g_instret - 1) / 4, load_label_word("counter", 0));
+
+    // running forward again after going back gives the same result
+    breakpoint_clear_all(&g_program_default);
+    emulate_n(&g_machine, 1000 - g_instret);
+    TEST_ASSERT_EQUAL_UINT32(final_counter, load_label_word("counter", 0));
+    timetravel_disable(&g_program_default);
+}
+
+// The checkpoints don't hold the models, so going back is refused while one
+// is enabled, whether before recording starts or after
+void test_timetravel_refused_with_models(void) {
+    assemble_line(TIMETRAVEL_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+
+    timing_enable(&g_program_default);
+    TEST_ASSERT_FALSE(timetravel_enable(&g_program_default, 16, 16 * 1024));
+    TEST_ASSERT_EQUAL(0, RARSJS_ARRAY_LEN(&g_program_default.timetravel.checkpoints));
+    timing_disable(&g_program_default);
+
+    TEST_ASSERT_TRUE(timetravel_enable(&g_program_default, 16, 16 * 1024));
+    emulate_n(&g_machine, 100);
+    timing_enable(&g_program_default);
+    emulate_n(&g_machine, 100);
+    u64 cycles = g_timing.cycles;
+    TEST_ASSERT_FALSE(timetravel_reverse_step(&g_program_default));
+    TEST_ASSERT_FALSE(timetravel_reverse_continue(&g_program_default));
+    TEST_ASSERT_EQUAL(200, g_instret);
+    TEST_ASSERT_EQUAL(cycles, g_timing.cycles);
+    timing_disable(&g_program_default);
+    timetravel_disable(&g_program_default);
+}
+
+#define PROFILE_TEST_PROGRAM "\
+main:                       \n\
+    li t0, 10               \n\
+loop:                       \n\
+    addi t0, t0, -1         \n\
+    bnez t0, loop           \n\
+done:                       \n\
+    li a7, 93               \n\
+    ecall                   \n\
+"
+
+void test_profile_counts(void) {
+    assemble_line(PROFILE_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    profile_enable(&g_program_default);
+    emulate_n(&g_machine, 1000);
+    TEST_ASSERT_TRUE(g_exited);
+
+    TEST_ASSERT_EQUAL_UINT32(5, g_profile_len);
+    TEST_ASSERT_EQUAL(1, g_profile_counts[0]);
+    TEST_ASSERT_EQUAL(10, g_profile_counts[1]);
+    TEST_ASSERT_EQUAL(10, g_profile_counts[2]);
+    TEST_ASSERT_EQUAL(1 + 20 + 2, profile_total(&g_program_default));
+
+    RARSJS_ARRAY(ProfileEntry) lines = profile_by_line(&g_program_default);
+    TEST_ASSERT_EQUAL(5, RARSJS_ARRAY_LEN(&lines));
+    TEST_ASSERT_EQUAL(4, RARSJS_ARRAY_GET(&lines, 1)->key);
+    TEST_ASSERT_EQUAL(10, RARSJS_ARRAY_GET(&lines, 1)->count);
+    RARSJS_ARRAY_FREE(&lines);
+
+    RARSJS_ARRAY(ProfileEntry) labels = profile_by_label(&g_program_default);
+    TEST_ASSERT_EQUAL(3, RARSJS_ARRAY_LEN(&labels));
+    LabelData *loop = RARSJS_ARRAY_GET(&g_labels, RARSJS_ARRAY_GET(&labels, 1)->key);
+    TEST_ASSERT_EQUAL_STR("loop", loop->txt, loop->len);
+    TEST_ASSERT_EQUAL(20, RARSJS_ARRAY_GET(&labels, 1)->count);
+    RARSJS_ARRAY_FREE(&labels);
+
+    // reassembling turns profiling off
+    assemble_line(PROFILE_TEST_PROGRAM);
+    TEST_ASSERT_NULL(g_profile_counts);
+    emulate_n(&g_machine, 1000);
+    TEST_ASSERT_EQUAL(0, profile_total(&g_program_default));
+}
+
+#define FIB_TEST_PROGRAM "\
+main:                       \n\
+    li a0, 10               \n\
+    jal fib                 \n\
+    li a7, 93               \n\
+    ecall                   \n\
+fib:                        \n\
+    li t0, 2                \n\
+    blt a0, t0, base        \n\
+    addi sp, sp, -16        \n\
+    sw ra, 12(sp)           \n\
+    sw s0, 8(sp)            \n\
+    mv s0, a0               \n\
+    addi a0, a0, -1         \n\
+    jal fib                 \n\
+    mv t1, a0               \n\
+    addi a0, s0, -2         \n\
+    sw t1, 4(sp)            \n\
+    jal fib                 \n\
+    lw t1, 4(sp)            \n\
+    add a0, a0, t1          \n\
+    lw s0, 8(sp)            \n\
+    lw ra, 12(sp)           \n\
+    addi sp, sp, 16         \n\
+base:                       \n\
+    ret                     \n\
+"
+
+void test_profile_calls(void) {
+    assemble_line(FIB_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    profile_calls_enable(&g_program_default);
+    emulate_n(&g_machine, 100000);
+    TEST_ASSERT_TRUE(g_exited);
+    TEST_ASSERT_EQUAL(55, g_regs[REG_A0]);
+    profile_calls_finish(&g_program_default);
+
+    TEST_ASSERT_EQUAL(2, RARSJS_ARRAY_LEN(&g_profile_funcs));
+    ProfileFunc *main = RARSJS_ARRAY_GET(&g_profile_funcs, 0);
+    ProfileFunc *fib = RARSJS_ARRAY_GET(&g_profile_funcs, 1);
+    TEST_ASSERT_EQUAL(1, main->calls);
+    TEST_ASSERT_EQUAL(g_instret, main->inclusive);
+    TEST_ASSERT_EQUAL(177, fib->calls);
+    TEST_ASSERT_EQUAL(10, fib->max_depth);
+    // recursive calls are only counted once in the inclusive count
+    TEST_ASSERT_EQUAL(fib->exclusive, fib->inclusive);
+    TEST_ASSERT_EQUAL(g_instret, main->exclusive + fib->exclusive);
+
+    // one node per depth of the recursion, below main
+    TEST_ASSERT_EQUAL(11, RARSJS_ARRAY_LEN(&g_profile_nodes));
+    u64 self = 0;
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_profile_nodes); i++) {
+        self += RARSJS_ARRAY_GET(&g_profile_nodes, i)->self;
+    }
+    TEST_ASSERT_EQUAL(g_instret, self);
+    profile_calls_disable(&g_program_default);
+}
+
+#define TIMING_TEST_PROGRAM "\
+.data                       \n\
+x: .word 7                  \n\
+.text                       \n\
+    la t0, x                \n\
+    lw t1, 0(t0)            \n\
+    addi t2, t1, 1          \n\
+    mul t3, t2, t2          \n\
+    div t4, t3, t2          \n\
+    beqz zero, skip         \n\
+    addi zero, zero, 0      \n\
+skip:                       \n\
+    li a7, 93               \n\
+    ecall                   \n\
+"
+
+void test_timing_model(void) {
+    assemble_line(TIMING_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    timing_enable(&g_program_default);
+    emulate_n(&g_machine, 7);
+    check_pc_at_label("skip");
+
+    TEST_ASSERT_EQUAL(7, g_timing.instructions);
+    TEST_ASSERT_EQUAL(TIMING_LOAD_USE_STALL, g_timing.load_use_stalls);
+    TEST_ASSERT_EQUAL(TIMING_DEFAULT_BRANCH, g_timing.branch_stalls);
+    TEST_ASSERT_EQUAL(TIMING_DEFAULT_MUL - 1 + TIMING_DEFAULT_DIV - 1,
+                      g_timing.unit_stalls);
+    TEST_ASSERT_EQUAL(TIMING_PIPELINE_FILL + 7 + g_timing.load_use_stalls +
+                          g_timing.branch_stalls + g_timing.unit_stalls,
+                      g_timing.cycles);
+
+    // a slower memory makes every load wait, and disabling stops counting
+    assemble_line(TIMING_TEST_PROGRAM);
+    g_timing_config.load = 3;
+    timing_enable(&g_program_default);
+    emulate_n(&g_machine, 3);
+    TEST_ASSERT_EQUAL(2, g_timing.unit_stalls);
+    timing_disable(&g_program_default);
+    emulate_n(&g_machine, 4);
+    TEST_ASSERT_EQUAL(3, g_timing.instructions);
+    g_timing_config.load = TIMING_DEFAULT_LOAD;
+}
+
+// a, b and c map to the same set of a 2-way cache with 16 byte lines
+static void cache_abca(CachePolicy policy, bool write_back) {
+    free_runtime(&g_program_default);
+    assemble_line(".data\narr: .word 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0\n");
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    CacheConfig saved = g_dcache_config;
+    g_dcache_config = (CacheConfig){.size = 64, .line = 16, .ways = 2,
+                                    .policy = policy, .write_back = write_back,
+                                    .write_allocate = true};
+    TEST_ASSERT_NULL(cache_enable(&g_program_default));
+    g_dcache_config = saved;
+
+    u32 a = DATA_BASE, b = DATA_BASE + 32, c = DATA_BASE + 64;
+    cache_access(&g_dcache, &g_sections, a, 4, true, TEXT_BASE);
+    cache_access(&g_dcache, &g_sections, b, 4, false, TEXT_BASE);
+    cache_access(&g_dcache, &g_sections, a + 4, 4, false, TEXT_BASE);
+    cache_access(&g_dcache, &g_sections, c, 4, false, TEXT_BASE);
+    cache_access(&g_dcache, &g_sections, a + 8, 4, false, TEXT_BASE);
+}
+
+void test_cache_replacement(void) {
+    // LRU evicts b, which was used least recently
+    cache_abca(CACHE_LRU, true);
+    TEST_ASSERT_EQUAL(5, g_dcache.stats.accesses);
+    TEST_ASSERT_EQUAL(3, g_dcache.stats.misses);
+    TEST_ASSERT_EQUAL(1, g_dcache.stats.evictions);
+    TEST_ASSERT_EQUAL(0, g_dcache.stats.mem_writes);
+
+    // FIFO evicts a, which was filled first, and writes it back
+    cache_abca(CACHE_FIFO, true);
+    TEST_ASSERT_EQUAL(4, g_dcache.stats.misses);
+    TEST_ASSERT_EQUAL(2, g_dcache.stats.evictions);
+    TEST_ASSERT_EQUAL(1, g_dcache.stats.mem_writes);
+
+    // write-through stores go to memory right away
+    cache_abca(CACHE_LRU, false);
+    TEST_ASSERT_EQUAL(1, g_dcache.stats.mem_writes);
+    for (size_t i = 0; i < RARSJS_ARRAY_LEN(&g_sections); i++) {
+        if (*RARSJS_ARRAY_GET(&g_sections, i) == g_data) {
+            TEST_ASSERT_EQUAL(5, g_dcache.by_section[i].accesses);
+        }
+    }
+
+    g_dcache_config.size = 48;
+    TEST_ASSERT_NOT_NULL(cache_enable(&g_program_default));
+    g_dcache_config.size = 4096;
+}
+
+void test_cache_program(void) {
+    assemble_line(".data\nx: .word 1, 2\n.text\n    la t0, x\n    lw t1, 0(t0)\n    lw t2, 4(t0)\n    sw t2, 0(t0)\n");
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    TEST_ASSERT_NULL(cache_enable(&g_program_default));
+    emulate_n(&g_machine, 5);
+    TEST_ASSERT_EQUAL(5, g_icache.stats.accesses);
+    TEST_ASSERT_EQUAL(1, g_icache.stats.misses);
+    TEST_ASSERT_EQUAL(3, g_dcache.stats.accesses);
+    TEST_ASSERT_EQUAL(1, g_dcache.stats.misses);
+    // the miss is attributed to the first load, after la's two instructions
+    TEST_ASSERT_EQUAL(1, g_dcache.by_pc[2].misses);
+    cache_disable(&g_program_default);
+}
+
+static u64 bpred_mispredicts(const char *program, BpredKind kind) {
+    free_runtime(&g_program_default);
+    assemble_line(program);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    BpredConfig saved = g_bpred_config;
+    g_bpred_config.kind = kind;
+    TEST_ASSERT_NULL(bpred_enable(&g_program_default));
+    g_bpred_config = saved;
+    emulate_n(&g_machine, 100000);
+    TEST_ASSERT_TRUE(g_exited);
+    return g_bpred.branches.mispredicts;
+}
+
+void test_bpred_loop(void) {
+    // the backward branch of the loop is taken 9 times out of 10
+    TEST_ASSERT_EQUAL(1, bpred_mispredicts(PROFILE_TEST_PROGRAM, BPRED_BTFN));
+    TEST_ASSERT_EQUAL(10, g_bpred.branches.branches);
+    TEST_ASSERT_EQUAL(10, g_bpred.by_pc[2].branches);
+    TEST_ASSERT_EQUAL(2, bpred_mispredicts(PROFILE_TEST_PROGRAM, BPRED_1BIT));
+    TEST_ASSERT_EQUAL(2, bpred_mispredicts(PROFILE_TEST_PROGRAM, BPRED_2BIT));
+    TEST_ASSERT_EQUAL(0, g_bpred.returns.branches);
+}
+
+void test_bpred_return_stack(void) {
+    // fib(10) recurses 10 deep, 2 more than the stack holds
+    bpred_mispredicts(FIB_TEST_PROGRAM, BPRED_GSHARE);
+    TEST_ASSERT_EQUAL(177, g_bpred.branches.branches);
+    TEST_ASSERT_EQUAL(177, g_bpred.returns.branches);
+    TEST_ASSERT_EQUAL(2, g_bpred.returns.mispredicts);
+
+    g_bpred_config.ras_size = 16;
+    bpred_mispredicts(FIB_TEST_PROGRAM, BPRED_GSHARE);
+    TEST_ASSERT_EQUAL(0, g_bpred.returns.mispredicts);
+    g_bpred_config.ras_size = 0;
+    bpred_mispredicts(FIB_TEST_PROGRAM, BPRED_GSHARE);
+    TEST_ASSERT_EQUAL(177, g_bpred.returns.mispredicts);
+    g_bpred_config.ras_size = 8;
+    bpred_disable(&g_program_default);
+}
+
+void test_counter_csrs(void) {
+    build_and_run("\
+    rdinstret s1            \n\
+    li t0, 5                \n\
+loop:                       \n\
+    addi t0, t0, -1         \n\
+    bnez t0, loop           \n\
+    rdinstret s2            \n\
+    rdcycle s3              \n\
+    rdtime s4               \n\
+    rdinstreth s5           \n\
+    csrrs s7, cycleh, zero  \n\
+    rdinstret s8            \n\
+    li a7, 93               \n\
+    ecall                   \n\
+");
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    TEST_ASSERT_EQUAL(0, g_regs[REG_S1]);
+    TEST_ASSERT_EQUAL(12, g_regs[REG_S2]);
+    TEST_ASSERT_EQUAL(13, g_regs[REG_S3]);
+    TEST_ASSERT_EQUAL(14, g_regs[REG_S4]);
+    TEST_ASSERT_EQUAL(0, g_regs[REG_S5]);
+    TEST_ASSERT_EQUAL(0, g_regs[REG_S7]);
+    TEST_ASSERT_EQUAL(17, g_regs[REG_S8]);
+
+    // the counters are read-only
+    free_runtime(&g_program_default);
+    build_and_run("li t1, 1\ncsrrw t0, instret, t1\n");
+    TEST_ASSERT_EQUAL(ERROR_UNHANDLED_INSN, g_runtime_error_type);
+    TEST_ASSERT_EQUAL(TEXT_BASE + 4, g_runtime_error_params[0]);
+    TEST_ASSERT_EQUAL(0, g_regs[REG_T0]);
+
+    // supervisor CSRs can't be accessed from user mode
+    free_runtime(&g_program_default);
+    build_and_run("csrrs t0, sstatus, zero\n");
+    TEST_ASSERT_EQUAL(ERROR_PROTECTION, g_runtime_error_type);
+    TEST_ASSERT_EQUAL(0, g_regs[REG_T0]);
+}
+
+static const char *TRACE_TEST_PROGRAM = "\
+.data                   \n\
+buf: .word 0            \n\
+.text                   \n\
+    li t0, 3            \n\
+    lui t1, 0x10000     \n\
+loop:                   \n\
+    sw t0, 0(t1)        \n\
+    addi t0, t0, -1     \n\
+    bnez t0, loop       \n\
+    lw t2, 0(zero)      \n\
+";
+
+// Runs TRACE_TEST_PROGRAM under the tracer and returns the decoded trace
+static char *trace_decoded(u32 ring_size) {
+    static char text[1024];
+    free_runtime(&g_program_default);
+    assemble(&g_program_default, TRACE_TEST_PROGRAM, strlen(TRACE_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+
+    FILE *bin = tmpfile();
+    FILE *out = tmpfile();
+    trace_start(&g_program_default, bin, ring_size);
+    emulate_n(&g_machine, 1000);
+    TEST_ASSERT_EQUAL(ERROR_LOAD, g_runtime_error_type);
+    TEST_ASSERT_TRUE(trace_finish(&g_program_default));
+    TEST_ASSERT_FALSE(g_trace.enabled);
+
+    char *error = NULL;
+    rewind(bin);
+    TEST_ASSERT_TRUE(trace_decode(bin, out, &error));
+    rewind(out);
+    size_t len = fread(text, 1, sizeof(text) - 1, out);
+    text[len] = 0;
+    fclose(bin);
+    fclose(out);
+    return text;
+}
+
+void test_trace_roundtrip(void) {
+    TEST_ASSERT_EQUAL_STRING(trace_decoded(0), "\
+1 0x00400000 t0=0x00000003\n\
+2 0x00400004 t1=0x10000000\n\
+3 0x00400008 [0x10000000]:4=0x3\n\
+4 0x0040000c t0=0x00000002\n\
+5 0x00400010\n\
+6 0x00400008 [0x10000000]:4=0x2\n\
+7 0x0040000c t0=0x00000001\n\
+8 0x00400010\n\
+9 0x00400008 [0x10000000]:4=0x1\n\
+10 0x0040000c t0=0x00000000\n\
+11 0x00400010\n\
+12 0x00400014 error 2\n");
+
+    // only the instructions that led to the crash are kept
+    TEST_ASSERT_EQUAL_STRING(trace_decoded(3), "\
+10 0x0040000c t0=0x00000000\n\
+11 0x00400010\n\
+12 0x00400014 error 2\n");
+}
+
+static char g_sink_buf[64];
+static u32 g_sink_len;
+
+static void test_sink(const u8 *buf, u32 len) {
+    memcpy(g_sink_buf + g_sink_len, buf, len);
+    g_sink_len += len;
+}
+
+void test_console_output_sink(void) {
+    g_sink_len = 0;
+    console_output_set_sink(&g_program_default, test_sink);
+    build_and_run("\
+    li a0, 42           \n\
+    li a7, 1            \n\
+    ecall               \n\
+    li a0, 10           \n\
+    li a7, 11           \n\
+    ecall               \n\
+    li a7, 93           \n\
+    ecall               \n\
+");
+    console_flush(&g_program_default);
+    console_output_set_sink(&g_program_default, NULL);
+    TEST_ASSERT_EQUAL(3, g_sink_len);
+    TEST_ASSERT_EQUAL_STRING_LEN("42\n", g_sink_buf, 3);
+}
+
+// Every hart leaves its id + 1 and its sp in its slot, and hart 0 waits for
+// the others before exiting
+static const char *SMP_TEST_PROGRAM = "\
+.data                           \n\
+done: .word 0, 0, 0, 0          \n\
+sps: .word 0, 0, 0, 0           \n\
+.text                           \n\
+    csrrs t0, mhartid, zero     \n\
+    slli t1, t0, 2              \n\
+    la t2, sps                  \n\
+    add t2, t2, t1              \n\
+    sw sp, 0(t2)                \n\
+    la t2, done                 \n\
+    add t2, t2, t1              \n\
+    addi t3, t0, 1              \n\
+    sw t3, 0(t2)                \n\
+    bnez t0, park               \n\
+    la t2, done                 \n\
+wait:                           \n\
+    lw t3, 4(t2)                \n\
+    beqz t3, wait               \n\
+    lw t3, 8(t2)                \n\
+    beqz t3, wait               \n\
+    lw t3, 12(t2)               \n\
+    beqz t3, wait               \n\
+park:                           \n\
+    li a7, 10                   \n\
+    ecall                       \n\
+";
+
+static void smp_run_test_program(SmpMode mode) {
+    assemble(&g_program_default, SMP_TEST_PROGRAM, strlen(SMP_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+
+    g_smp_config = (SmpConfig){.harts = 4, .mode = mode, .quantum = 7};
+    TEST_ASSERT_NULL(smp_enable(&g_program_default));
+    TEST_ASSERT_NULL(smp_run(&g_program_default));
+    g_smp_config = (SmpConfig){.harts = 1, .quantum = SMP_DEFAULT_QUANTUM};
+
+    TEST_ASSERT_TRUE(g_exited);
+    for (u32 i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL(i + 1, load_label_word("done", i * 4));
+        TEST_ASSERT_EQUAL(STACK_TOP - i * STACK_LEN,
+                          load_label_word("sps", i * 4));
+    }
+}
+
+void test_smp_lockstep(void) {
+    smp_run_test_program(SMP_LOCKSTEP);
+    // taking turns is deterministic
+    u64 instret = g_smp.harts[1]->instret;
+    free_runtime(&g_program_default);
+    smp_run_test_program(SMP_LOCKSTEP);
+    TEST_ASSERT_EQUAL(instret, g_smp.harts[1]->instret);
+}
+
+void test_smp_free(void) { smp_run_test_program(SMP_FREE); }
+
+void test_smp_ipi(void) {
+    build_and_run("li a7, 10\necall");
+    g_smp_config.harts = 2;
+    TEST_ASSERT_NULL(smp_enable(&g_program_default));
+    g_smp_config.harts = 1;
+
+    u32 ssip = 1u << (CAUSE_SUPERVISOR_SOFTWARE & ~CAUSE_INTERRUPT);
+    TEST_ASSERT_TRUE(mmio_write(&g_machine, RIC0_IPI - MMIO_BASE, 4, 1));
+    TEST_ASSERT_EQUAL(ssip, g_smp.harts[1]->csr[CSR_MIP] & ssip);
+    TEST_ASSERT_EQUAL(0, g_machine.csr[CSR_MIP] & ssip);
+    // there is no hart 2
+    TEST_ASSERT_FALSE(mmio_write(&g_machine, RIC0_IPI - MMIO_BASE, 4, 2));
+}
+
+void test_amo_encoding(void) {
+    assemble_line("lr.w t0, (a0)\nsc.w t1, a1, 0(a0)\namoadd.w t2, a2, (a0)\n"
+                  "amomaxu.w zero, a3, (a0)\nfence\nfence r, w\nfence.i\n");
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    static const u32 expected[] = {0x100522AF, 0x18B5232F, 0x00C523AF,
+                                   0xE0D5202F, 0x0FF0000F, 0x0210000F,
+                                   0x0000100F};
+    for (u32 i = 0; i < sizeof(expected) / sizeof(*expected); i++) {
+        bool err;
+        TEST_ASSERT_EQUAL_HEX32(expected[i],
+                                LOAD(&g_machine, TEXT_BASE + i * 4, 4, &err));
+    }
+    free_runtime(&g_program_default);
+
+    assemble_line("amoadd.w t2, a2, 4(a0)");
+    TEST_ASSERT_EQUAL_STRING("Offset must be 0", g_error);
+    free_runtime(&g_program_default);
+    assemble_line("fence rx, w");
+    TEST_ASSERT_EQUAL_STRING("Invalid predecessor set", g_error);
+}
+
+void test_amo(void) {
+    build_and_run("\
+    .data                   \n\
+x:  .word 5                 \n\
+    .text                   \n\
+    la a0, x                \n\
+    li a1, -3               \n\
+    amoadd.w s1, a1, (a0)   \n\
+    amomin.w s2, a1, (a0)   \n\
+    li a1, 7                \n\
+    amomaxu.w s3, a1, (a0)  \n\
+    amoswap.w s4, a1, (a0)  \n\
+    amoor.w s5, zero, (a0)  \n\
+    sc.w s6, a1, (a0)       \n\
+    lr.w s7, (a0)           \n\
+    li a1, 9                \n\
+    sc.w s8, a1, (a0)       \n\
+    sc.w s9, a1, (a0)       \n\
+    fence                   \n\
+    lw s10, 0(a0)           \n\
+    li a7, 10               \n\
+    ecall                   \n\
+");
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+    TEST_ASSERT_EQUAL(5, g_regs[REG_S1]);
+    TEST_ASSERT_EQUAL(2, g_regs[REG_S2]);
+    TEST_ASSERT_EQUAL((u32)-3, g_regs[REG_S3]);  // maxu keeps 0xFFFFFFFD
+    TEST_ASSERT_EQUAL((u32)-3, g_regs[REG_S4]);
+    TEST_ASSERT_EQUAL(7, g_regs[REG_S5]);
+    TEST_ASSERT_EQUAL(1, g_regs[REG_S6]);  // no reservation
+    TEST_ASSERT_EQUAL(7, g_regs[REG_S7]);
+    TEST_ASSERT_EQUAL(0, g_regs[REG_S8]);
+    TEST_ASSERT_EQUAL(1, g_regs[REG_S9]);  // the reservation is used up
+    TEST_ASSERT_EQUAL(9, g_regs[REG_S10]);
+    free_runtime(&g_program_default);
+
+    // AMOs need an aligned word
+    build_and_run(".data\nx: .word 0, 0\n.text\nla a0, x\naddi a0, a0, 2\n"
+                  "amoadd.w zero, zero, (a0)\n");
+    TEST_ASSERT_EQUAL(ERROR_STORE, g_runtime_error_type);
+    TEST_ASSERT_EQUAL(DATA_BASE + 2, g_runtime_error_params[0]);
+}
+
+// Every hart adds 1 to count 1000 times with INC, then hart 0 waits for all
+// of them to be done
+#define SMP_COUNT_PROGRAM(INC) "\
+.data                           \n\
+count: .word 0                  \n\
+done: .word 0                   \n\
+.text                           \n\
+    li t0, 1000                 \n\
+    la t1, count                \n\
+    li t4, 1                    \n\
+loop:                           \n\
+" INC "                         \n\
+    addi t0, t0, -1             \n\
+    bnez t0, loop               \n\
+    la t2, done                 \n\
+    amoadd.w zero, t4, (t2)     \n\
+    csrrs t3, mhartid, zero     \n\
+    bnez t3, park               \n\
+    li t5, 4                    \n\
+wait:                           \n\
+    lw t3, 0(t2)                \n\
+    bne t3, t5, wait            \n\
+park:                           \n\
+    li a7, 10                   \n\
+    ecall                       \n\
+"
+
+static u32 smp_count(const char *src, SmpMode mode) {
+    assemble(&g_program_default, src, strlen(src), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    g_smp_config = (SmpConfig){.harts = 4, .mode = mode, .quantum = 7};
+    TEST_ASSERT_NULL(smp_enable(&g_program_default));
+    TEST_ASSERT_NULL(smp_run(&g_program_default));
+    g_smp_config = (SmpConfig){.harts = 1, .quantum = SMP_DEFAULT_QUANTUM};
+    u32 count = load_label_word("count", 0);
+    free_runtime(&g_program_default);
+    return count;
+}
+
+void test_smp_atomics(void) {
+    const char *racy = SMP_COUNT_PROGRAM("lw t2, 0(t1)\naddi t2, t2, 1\n"
+                                         "sw t2, 0(t1)");
+    const char *amo = SMP_COUNT_PROGRAM("amoadd.w zero, t4, (t1)");
+    const char *lrsc = SMP_COUNT_PROGRAM("retry:\nlr.w t2, (t1)\n"
+                                         "addi t2, t2, 1\nsc.w t3, t2, (t1)\n"
+                                         "bnez t3, retry");
+
+    // harts switching between the load and the store lose increments
+    TEST_ASSERT_LESS_THAN(4000, smp_count(racy, SMP_LOCKSTEP));
+    TEST_ASSERT_EQUAL(4000, smp_count(amo, SMP_LOCKSTEP));
+    TEST_ASSERT_EQUAL(4000, smp_count(lrsc, SMP_LOCKSTEP));
+    TEST_ASSERT_EQUAL(4000, smp_count(amo, SMP_FREE));
+    TEST_ASSERT_EQUAL(4000, smp_count(lrsc, SMP_FREE));
+}
+
+#define BREAKPOINT_TEST_PROGRAM "\
+    li t0, 3                \n\
+loop:                       \n\
+    la t1, loop             \n\
+    addi t0, t0, -1         \n\
+    bnez t0, loop           \n\
+    li a7, 93               \n\
+    ecall                   \n\
+"
+
+void test_breakpoints(void) {
+    assemble(&g_program_default, BREAKPOINT_TEST_PROGRAM, strlen(BREAKPOINT_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+
+    // la is two instructions, but its line stops only before the first one
+    TEST_ASSERT_EQUAL(1, breakpoint_set_line(&g_program_default, 3, true));
+    TEST_ASSERT_EQUAL(0, breakpoint_set_line(&g_program_default, 100, true));
+    TEST_ASSERT_FALSE(breakpoint_set(&g_program_default, TEXT_BASE + 2, true));
+
+    u32 loop;
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "loop", 4, false, &loop, NULL));
+    for (int i = 0; i < 3; i++) {
+        emulate_n(&g_machine, 1000);
+        TEST_ASSERT_TRUE(g_breakpoints.hit);
+        TEST_ASSERT_EQUAL_UINT32(loop, g_pc);
+    }
+
+    // resuming from the breakpoint runs past it
+    breakpoint_set_line(&g_program_default, 3, false);
+    TEST_ASSERT_TRUE(breakpoint_set(&g_program_default, loop + 8, true));
+    breakpoint_set(&g_program_default, loop + 8, false);
+    emulate_n(&g_machine, 1000);
+    TEST_ASSERT_FALSE(g_breakpoints.hit);
+    TEST_ASSERT_TRUE(g_exited);
+    TEST_ASSERT_EQUAL(0, g_breakpoints.count);
+}
+
+#define STEP_TEST_PROGRAM "\
+main:                       \n\
+    li a0, 1000             \n\
+    jal count               \n\
+after:                      \n\
+    li a7, 93               \n\
+    ecall                   \n\
+count:                      \n\
+    addi a0, a0, -1         \n\
+    bnez a0, count          \n\
+    ret                     \n\
+"
+
+void test_step_over_and_out(void) {
+    assemble(&g_program_default, STEP_TEST_PROGRAM, strlen(STEP_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+
+    // a plain instruction is a single step
+    TEST_ASSERT_EQUAL(1, emulate_step_over(&g_machine, 100000));
+    // a call runs until it returns
+    TEST_ASSERT_EQUAL(2002, emulate_step_over(&g_machine, 100000));
+    check_pc_at_label("after");
+    TEST_ASSERT_EQUAL(0, g_regs[REG_A0]);
+
+    // a breakpoint in the callee stops it
+    free_runtime(&g_program_default);
+    assemble(&g_program_default, STEP_TEST_PROGRAM, strlen(STEP_TEST_PROGRAM), false);
+    u32 count;
+    TEST_ASSERT_TRUE(resolve_symbol(&g_program_default, "count", 5, false, &count, NULL));
+    TEST_ASSERT_TRUE(breakpoint_set(&g_program_default, count + 4, true));
+    emulate_step_over(&g_machine, 1);
+    emulate_step_over(&g_machine, 100000);
+    TEST_ASSERT_TRUE(g_breakpoints.hit);
+    TEST_ASSERT_EQUAL_UINT32(count + 4, g_pc);
+    breakpoint_clear_all(&g_program_default);
+
+    // from inside the callee, step out returns to the caller
+    TEST_ASSERT_EQUAL(2000, emulate_step_out(&g_machine, 100000));
+    check_pc_at_label("after");
+
+    // the budget is respected
+    free_runtime(&g_program_default);
+    assemble(&g_program_default, STEP_TEST_PROGRAM, strlen(STEP_TEST_PROGRAM), false);
+    emulate_step_over(&g_machine, 1);
+    TEST_ASSERT_EQUAL(10, emulate_step_over(&g_machine, 10));
+    TEST_ASSERT_EQUAL_UINT32(count + 4, g_pc);
+
+    // a resumed batch stops on a breakpoint right away, and otherwise goes
+    // on down to the depth the step started from
+    TEST_ASSERT_TRUE(breakpoint_set(&g_program_default, count + 4, true));
+    TEST_ASSERT_EQUAL(0, emulate_resume(&g_machine, 100000, 1));
+    TEST_ASSERT_TRUE(g_breakpoints.hit);
+    breakpoint_clear_all(&g_program_default);
+    TEST_ASSERT_EQUAL(1992, emulate_resume(&g_machine, 100000, 1));
+    check_pc_at_label("after");
+}
+
+#define WINDOW_TEST_PROGRAM "\
+    .data                   \n\
+x:  .word 0x11223344        \n\
+    .text                   \n\
+main:                       \n\
+    la t0, x                \n\
+    li t1, 5                \n\
+    sw t1, 0(t0)            \n\
+    li a7, 93               \n\
+    ecall                   \n\
+"
+
+void test_read_window(void) {
+    assemble(&g_program_default, WINDOW_TEST_PROGRAM, strlen(WINDOW_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+
+    // the window starts in the gap below .data
+    u8 out[8], valid[1];
+    emu_read_window(&g_program_default, DATA_BASE - 4, 8, out, valid);
+    TEST_ASSERT_EQUAL(0xF0, valid[0]);
+    TEST_ASSERT_EQUAL(0, out[0]);
+    TEST_ASSERT_EQUAL(0x44, out[4]);
+    TEST_ASSERT_EQUAL(0x11, out[7]);
+
+    emulate_n(&g_machine, 4);
+    emu_read_window(&g_program_default, DATA_BASE, 4, out, valid);
+    TEST_ASSERT_EQUAL(0x0F, valid[0]);
+    TEST_ASSERT_EQUAL(5, out[0]);
+    TEST_ASSERT_EQUAL(0, out[3]);
+}
+
+void test_dirty_pages(void) {
+    assemble(&g_program_default, WINDOW_TEST_PROGRAM, strlen(WINDOW_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    Section *data = emulator_get_section(&g_program_default, DATA_BASE);
+
+    // the view's bits are kept once it first asks
+    dirty_window_take(&g_program_default, DATA_BASE, 4);
+
+    // only the first write to a clean page is news
+    u32 generation = g_dirty_generation;
+    emulate_n(&g_machine, 3);
+    TEST_ASSERT_EQUAL(generation, g_dirty_generation);
+    emulate_n(&g_machine, 1);
+    TEST_ASSERT_EQUAL(generation + 1, g_dirty_generation);
+    TEST_ASSERT_TRUE(dirty_is_set(data, DIRTY_VIEW, 0));
+    TEST_ASSERT_FALSE(dirty_is_set(data, DIRTY_VIEW, 1));
+    bool err;
+    STORE(&g_machine, DATA_BASE + 4, 0, 4, &err);
+    TEST_ASSERT_EQUAL(generation + 1, g_dirty_generation);
+
+    // a window only takes the bits of the pages it covers
+    u32 top = STACK_TOP - DIRTY_PAGE_SIZE, below = top - DIRTY_PAGE_SIZE;
+    STORE(&g_machine, top, 0, 4, &err);
+    STORE(&g_machine, below, 0, 4, &err);
+    TEST_ASSERT_FALSE(dirty_window_take(&g_program_default, below - DIRTY_PAGE_SIZE, 4));
+    TEST_ASSERT_TRUE(dirty_window_take(&g_program_default, top, 4));
+    TEST_ASSERT_FALSE(dirty_window_take(&g_program_default, top, 4));
+    TEST_ASSERT_TRUE(dirty_is_set(g_stack, DIRTY_VIEW,
+                                  (below - g_stack->base) / DIRTY_PAGE_SIZE));
+    TEST_ASSERT_TRUE(dirty_window_take(&g_program_default, below + 8, DIRTY_PAGE_SIZE));
+    TEST_ASSERT_FALSE(dirty_window_take(&g_program_default, below, 2 * DIRTY_PAGE_SIZE));
+    TEST_ASSERT_TRUE(dirty_window_take(&g_program_default, DATA_BASE, 4));
+    STORE(&g_machine, DATA_BASE, 0, 4, &err);
+    TEST_ASSERT_EQUAL(generation + 4, g_dirty_generation);
+
+    // snapshots track the same writes with their own bits
+    dirty_clear(&g_program_default, DIRTY_VIEW);
+    Snapshot *snap = snapshot_create(&g_program_default);
+    TEST_ASSERT_FALSE(dirty_is_set(data, DIRTY_SNAPSHOT, 0));
+    STORE(&g_machine, STACK_TOP - 4, 0, 4, &err);
+    u32 stack_page = (STACK_LEN - 4) / DIRTY_PAGE_SIZE;
+    TEST_ASSERT_TRUE(dirty_is_set(g_stack, DIRTY_SNAPSHOT, stack_page));
+    TEST_ASSERT_EQUAL(1, RARSJS_ARRAY_LEN(&g_dirty_snapshot_pages));
+
+    // restoring one rewrites the pages written since
+    dirty_clear(&g_program_default, DIRTY_VIEW);
+    TEST_ASSERT_TRUE(snapshot_restore(&g_program_default, snap));
+    TEST_ASSERT_TRUE(dirty_is_set(g_stack, DIRTY_VIEW, stack_page));
+    TEST_ASSERT_FALSE(dirty_is_set(g_stack, DIRTY_SNAPSHOT, stack_page));
+    TEST_ASSERT_FALSE(dirty_is_set(data, DIRTY_VIEW, 0));
+    TEST_ASSERT_EQUAL(0, RARSJS_ARRAY_LEN(&g_dirty_snapshot_pages));
+    snapshot_free(snap);
+}
+
+void test_elf_debug_info(void) {
+    const char *src = ".globl _start\n_start:\njal ra, func\n\n"
+                      "li a0, 0x12345678\nfunc:\njalr x0, 0(ra)\n";
+    assemble(&g_program_default, src, strlen(src), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    u32 n = RARSJS_ARRAY_LEN(&g_text_by_linenum);
+    u32 *lines = malloc(n * sizeof(u32));
+    memcpy(lines, g_text_by_linenum.buf, n * sizeof(u32));
+
+    void *elf = NULL;
+    size_t len = 0;
+    char *error = NULL;
+    TEST_ASSERT_TRUE(elf_emit_exec(&g_program_default, &elf, &len, &error));
+    free_runtime(&g_program_default);
+    TEST_ASSERT_TRUE(elf_load(&g_program_default, elf, len, &error));
+
+    TEST_ASSERT_EQUAL(n, RARSJS_ARRAY_LEN(&g_text_by_linenum));
+    for (size_t i = 0; i < n; i++) {
+        TEST_ASSERT_EQUAL(lines[i], *RARSJS_ARRAY_GET(&g_text_by_linenum, i));
+    }
+    // li expands to two instructions on the same line
+    TEST_ASSERT_EQUAL(lines[1], lines[2]);
+
+    LabelData *label = NULL;
+    u32 off = 0;
+    TEST_ASSERT_TRUE(pc_to_label_r(&g_program_default, TEXT_BASE + 8, &label, &off));
+    TEST_ASSERT_EQUAL_STR("_start", label->txt, label->len);
+    TEST_ASSERT_EQUAL(8, off);
+    TEST_ASSERT_TRUE(pc_to_label_r(&g_program_default, TEXT_BASE + 12, &label, &off));
+    TEST_ASSERT_EQUAL_STR("func", label->txt, label->len);
+    TEST_ASSERT_EQUAL(0, off);
+
+    free_runtime(&g_program_default);
+    free(lines);
+    free(elf);
+}
+
+// Symbols come locals first, and a malformed symbol or line table only
+// leaves the program without its debug info
+void test_elf_bad_debug_info(void) {
+    const char *src = ".globl _start\n.globl func\n_start:\njal ra, func\n"
+                      "li a7, 10\necall\nlocal:\nfunc:\njalr x0, 0(ra)\n";
+    assemble(&g_program_default, src, strlen(src), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+
+    u8 *elf = NULL;
+    size_t len = 0;
+    char *error = NULL;
+    TEST_ASSERT_TRUE(elf_emit_exec(&g_program_default, (void **)&elf, &len, &error));
+    free_runtime(&g_program_default);
+
+    ElfHeader *ehdr = (ElfHeader *)elf;
+    ElfSectionHeader *shdrs = (ElfSectionHeader *)(elf + ehdr->shdrs_off);
+    bool corrupted_lines = false;
+    for (u32 i = 0; i < ehdr->shent_num; i++) {
+        ElfSectionHeader *sh = &shdrs[i];
+        if (sh->type == SHT_SYMTAB) {
+            ElfSymtabEntry *syms = (ElfSymtabEntry *)(elf + sh->off);
+            u32 n = sh->mem_sz / sizeof(ElfSymtabEntry);
+            TEST_ASSERT_EQUAL(2, n - sh->info);  // _start and func
+            for (u32 j = 1; j < n; j++) {
+                TEST_ASSERT_EQUAL(j < sh->info ? STB_LOCAL : STB_GLOBAL,
+                                  ELF32_ST_BIND(syms[j].info));
+            }
+            sh->off = len;
+        } else if (sh->type == SHT_PROGBITS && !(sh->flags & SHF_ALLOC)) {
+            u32 count = UINT32_MAX;
+            memcpy(elf + sh->off + 4, &count, sizeof(count));
+            corrupted_lines = true;
+        }
+    }
+    TEST_ASSERT_TRUE(corrupted_lines);
+
+    TEST_ASSERT_TRUE(elf_load(&g_program_default, elf, len, &error));
+    TEST_ASSERT_NULL(error);
+    TEST_ASSERT_EQUAL(0, RARSJS_ARRAY_LEN(&g_labels));
+    TEST_ASSERT_EQUAL(0, RARSJS_ARRAY_LEN(&g_text_by_linenum));
+    emulate_n(&g_machine, 100);
+    TEST_ASSERT_TRUE(g_exited);
+    TEST_ASSERT_EQUAL(ERROR_NONE, g_runtime_error_type);
+
+    free_runtime(&g_program_default);
+    free(elf);
+}
+
+// A second program can be assembled and run to completion while the default
+// one is stopped halfway, without either seeing the other's state
+void test_program_independent(void) {
+    assemble_line(SNAPSHOT_TEST_PROGRAM);
+    TEST_ASSERT_EQUAL_STRING(g_error, NULL);
+    run_to_label("first");
+    u32 pc = g_pc;
+    u64 instret = g_instret;
+    TEST_ASSERT_TRUE(breakpoint_set(&g_program_default, pc, true));
+
+    Program other;
+    program_init(&other);
+    const char *txt = "li t0, 5\nli a7, 93\necall";
+    assemble(&other, txt, strlen(txt), false);
+    TEST_ASSERT_NULL(other.as.error);
+    while (!other.machine.exited) {
+        emulate(&other.machine);
+        if (other.machine.runtime_error_type != ERROR_NONE) break;
+    }
+    TEST_ASSERT_TRUE(other.machine.exited);
+    TEST_ASSERT_EQUAL_UINT32(5, other.machine.regs[REG_T0]);
+    TEST_ASSERT_FALSE(breakpoint_at(&other.breakpoints, TEXT_BASE));
+
+    TEST_ASSERT_FALSE(g_exited);
+    TEST_ASSERT_EQUAL_UINT32(pc, g_pc);
+    TEST_ASSERT_EQUAL(instret, g_instret);
+    TEST_ASSERT_TRUE(breakpoint_at(&g_breakpoints, pc));
+    TEST_ASSERT_EQUAL_UINT32(1, load_label_word("arr", 0));
+    run_to_label("second");
+    TEST_ASSERT_EQUAL_UINT32(2, load_label_word("arr", 4));
+
+    program_free(&other);
+    breakpoint_reset(&g_program_default);
+}
+
+// Cases live in a fresh directory under /tmp, removed by grade_dir_free
+static char g_grade_dir[64];
+
+static void grade_dir_new(void) {
+    strcpy(g_grade_dir, "/tmp/rarsjs_grade_XXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(g_grade_dir));
+}
+
+static void grade_write(const char *name, const char *contents) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", g_grade_dir, name);
+    FILE *f = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs(contents, f);
+    fclose(f);
+}
+
+static void grade_dir_free(const char *const *names, size_t len) {
+    char path[128];
+    for (size_t i = 0; i < len; i++) {
+        snprintf(path, sizeof(path), "%s/%s", g_grade_dir, names[i]);
+        unlink(path);
+    }
+    rmdir(g_grade_dir);
+}
+
+void test_grade_load_cases_dir(void) {
+    static const char *const FILES[] = {"b.out", "a.out", "a.in", "c.txt"};
+    grade_dir_new();
+    for (size_t i = 0; i < 4; i++) grade_write(FILES[i], "1\n");
+
+    RARSJS_ARRAY(GradeCase) cases = RARSJS_ARRAY_NEW(GradeCase);
+    char *error = NULL;
+    TEST_ASSERT_TRUE(grade_load_cases(g_grade_dir, &cases, &error));
+    TEST_ASSERT_EQUAL(2, cases.len);
+
+    char path[128];
+    GradeCase *a = RARSJS_ARRAY_GET(&cases, 0);
+    TEST_ASSERT_EQUAL_STRING("a", a->name);
+    snprintf(path, sizeof(path), "%s/a.in", g_grade_dir);
+    TEST_ASSERT_EQUAL_STRING(path, a->input);
+    snprintf(path, sizeof(path), "%s/a.out", g_grade_dir);
+    TEST_ASSERT_EQUAL_STRING(path, a->expected);
+
+    GradeCase *b = RARSJS_ARRAY_GET(&cases, 1);
+    TEST_ASSERT_EQUAL_STRING("b", b->name);
+    TEST_ASSERT_NULL(b->input);
+
+    grade_free_cases(&cases);
+    grade_dir_free(FILES, 4);
+}
+
+void test_grade_load_cases_manifest(void) {
+    static const char *const FILES[] = {"cases", "x.in", "x.out", "y.out",
+                                        "bad"};
+    grade_dir_new();
+    grade_write("x.in", "1\n");
+    grade_write("x.out", "1");
+    grade_write("y.out", "2");
+
+    // relative paths are relative to the manifest, absolute ones aren't
+    char manifest[256];
+    snprintf(manifest, sizeof(manifest),
+             "# comment\n\nx.in x.out\n- %s/y.out\n", g_grade_dir);
+    grade_write("cases", manifest);
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/cases", g_grade_dir);
+    RARSJS_ARRAY(GradeCase) cases = RARSJS_ARRAY_NEW(GradeCase);
+    char *error = NULL;
+    TEST_ASSERT_TRUE(grade_load_cases(path, &cases, &error));
+    TEST_ASSERT_EQUAL(2, cases.len);
+
+    GradeCase *x = RARSJS_ARRAY_GET(&cases, 0);
+    snprintf(path, sizeof(path), "%s/x.in", g_grade_dir);
+    TEST_ASSERT_EQUAL_STRING(path, x->input);
+    snprintf(path, sizeof(path), "%s/x.out", g_grade_dir);
+    TEST_ASSERT_EQUAL_STRING(path, x->expected);
+
+    GradeCase *y = RARSJS_ARRAY_GET(&cases, 1);
+    TEST_ASSERT_NULL(y->input);
+    snprintf(path, sizeof(path), "%s/y.out", g_grade_dir);
+    TEST_ASSERT_EQUAL_STRING(path, y->expected);
+    grade_free_cases(&cases);
+
+    // a missing expected output is an error now rather than a crash later
+    grade_write("bad", "x.in missing.out\n");
+    snprintf(path, sizeof(path), "%s/bad", g_grade_dir);
+    TEST_ASSERT_FALSE(grade_load_cases(path, &cases, &error));
+    TEST_ASSERT_NOT_NULL(error);
+    grade_free_cases(&cases);
+
+    grade_dir_free(FILES, 5);
+}
+
+// Prints the number it reads, spins forever on 1 and faults on 2
+#define GRADE_TEST_PROGRAM "\
+    li a7, 5            \n\
+    ecall               \n\
+    li t0, 1            \n\
+    beq a0, t0, spin    \n\
+    li t0, 2            \n\
+    beq a0, t0, crash   \n\
+    li a7, 1            \n\
+    ecall               \n\
+    li a7, 93           \n\
+    ecall               \n\
+spin:                   \n\
+    j spin              \n\
+crash:                  \n\
+    lw t1, 0(zero)      \n\
+"
+
+void test_grade_run(void) {
+    static const char *const FILES[] = {"pass.in", "pass.out", "wrong.in",
+                                        "wrong.out", "limit.in", "limit.out",
+                                        "error.in", "error.out"};
+    grade_dir_new();
+    grade_write("pass.in", "5\n");
+    grade_write("pass.out", "5");
+    grade_write("wrong.in", "7\n");
+    grade_write("wrong.out", "8");
+    grade_write("limit.in", "1\n");
+    grade_write("limit.out", "");
+    grade_write("error.in", "2\n");
+    grade_write("error.out", "");
+
+    RARSJS_ARRAY(GradeCase) cases = RARSJS_ARRAY_NEW(GradeCase);
+    char *error = NULL;
+    TEST_ASSERT_TRUE(grade_load_cases(g_grade_dir, &cases, &error));
+    TEST_ASSERT_EQUAL(4, cases.len);
+
+    assemble(&g_program_default, GRADE_TEST_PROGRAM, strlen(GRADE_TEST_PROGRAM), false);
+    TEST_ASSERT_EQUAL_STRING(NULL, g_error);
+    GradeConfig config = {.max_instructions = 10000, .jobs = 2};
+    GradeResult results[4];
+    grade_run(&g_program_default, cases.buf, cases.len, &config, results);
+
+    // the cases are sorted by name: error, limit, pass, wrong
+    TEST_ASSERT_EQUAL(GRADE_ERROR, results[0].status);
+    TEST_ASSERT_EQUAL(ERROR_LOAD, results[0].error);
+    TEST_ASSERT_EQUAL(GRADE_LIMIT, results[1].status);
+    TEST_ASSERT_EQUAL(10000, results[1].instructions);
+    TEST_ASSERT_EQUAL(GRADE_PASS, results[2].status);
+    TEST_ASSERT_EQUAL(GRADE_WRONG, results[3].status);
+    TEST_ASSERT_EQUAL(0, results[3].mismatch_at);
+
+    // the cases ran on copies, the program itself is where it was
+    TEST_ASSERT_EQUAL(0, g_instret);
+    TEST_ASSERT_EQUAL(TEXT_BASE, g_pc);
+
+    grade_free_cases(&cases);
+    grade_dir_free(FILES, 8);
+}
@@ -13,6 +13,7 @@ import { Compartment, EditorState, Transaction } from "@codemirror/state";
 
 import { lineHighlightEffect, lineHighlightState } from "./LineHighlight";
 import { breakpointGutter } from "./Breakpoint";
+import { heatmapEffect, heatmapGutter } from "./Heatmap";
 import { createAsmLinter } from "./AssemblerErrors";
 import { defaultKeymap, indentWithTab } from "@codemirror/commands"
 
@@ -23,7 +24,7 @@ import { RegisterTable } from "./RegisterTable";
 import { MemoryView } from "./MemoryView";
 import { PaneResize } from "./PaneResize";
 import { githubLight, githubDark, Theme, Colors, githubHighlightStyle } from './GithubTheme'
-import { AsmErrState, continueStep, DebugState, ErrorState, fetchTestcases, getCurrentLine, IdleState, initialRegs, nextStep, quitDebug, RunningState, runNormal, runTestSuite, setWasmRuntime, singleStep, startStep, startStepTestSuite, StoppedState, testData, TestSuiteState, TestSuiteTableEntry, TEXT_BASE, wasmInterface, wasmRuntime, wasmTestsuite, wasmTestsuiteIdx } from "./EmulatorState";
+import { AsmErrState, canReverse, continueStep, DebugState, ErrorState, fetchTestcases, getCurrentLine, IdleState, initialRegs, nextStep, quitDebug, stepOut, reverseContinue, reverseStep, RunningState, runNormal, runTestSuite, setWasmRuntime, showHeatmap, singleStep, startStep, startStepTestSuite, stopRun, StoppedState, testData, TestSuiteState, TestSuiteTableEntry, TEXT_BASE, toggleHeatmap, wasmInterface, wasmRuntime, wasmTestsuite, wasmTestsuiteIdx } from "./EmulatorState";
 import { highlightTree } from "@lezer/highlight";
 
 let parserWithMetadata = parser.configure({
@@ -196,7 +197,11 @@ window.addEventListener('keydown', (event) => {
 	// FIXME: this is deprecated but i'm not sure what is the correct successor
 	const prefix = isMac ? (event.ctrlKey && event.shiftKey) : (event.ctrlKey && event.altKey);
 
-	if (wasmRuntime.status == "debug" && prefix && event.key.toUpperCase() == 'S') {
+	if (wasmRuntime.status == "running" && prefix && event.key.toUpperCase() == 'X') {
+		event.preventDefault();
+		stopRun();
+	}
+	else if (wasmRuntime.status == "debug" && prefix && event.key.toUpperCase() == 'S') {
 		event.preventDefault();
 		singleStep(wasmRuntime, setWasmRuntime);
 	}
@@ -204,10 +209,22 @@ window.addEventListener('keydown', (event) => {
 		event.preventDefault();
 		nextStep(wasmRuntime, setWasmRuntime);
 	}
+	else if (wasmRuntime.status == "debug" && prefix && event.key.toUpperCase() == 'O') {
+		event.preventDefault();
+		stepOut(wasmRuntime, setWasmRuntime);
+	}
 	else if (wasmRuntime.status == "debug" && prefix && event.key.toUpperCase() == 'C') {
 		event.preventDefault();
 		continueStep(wasmRuntime, setWasmRuntime);
 	}
+	else if (canReverse(wasmRuntime) && prefix && event.key.toUpperCase() == 'B') {
+		event.preventDefault();
+		reverseStep(wasmRuntime, setWasmRuntime);
+	}
+	else if (canReverse(wasmRuntime) && prefix && event.key.toUpperCase() == 'V') {
+		event.preventDefault();
+		reverseContinue(wasmRuntime, setWasmRuntime);
+	}
 	else if (wasmRuntime.status == "debug" && prefix && event.key.toUpperCase() == 'X') {
 		event.preventDefault();
 		quitDebug(wasmRuntime, setWasmRuntime);
@@ -238,6 +255,23 @@ const Navbar: Component = () => {
 						<h1 class="text-xl font-bold theme-fg">rars.js</h1>
 					</div>
 					<div class="flex-shrink-0 mx-auto"></div>
+					{/* the bundled icon font is a subset, so mirror existing glyphs */}
+					<Show when={canReverse(wasmRuntime)}>
+						<button
+							on:click={() => reverseContinue(wasmRuntime, setWasmRuntime)}
+							class="cursor-pointer flex-0-shrink flex material-symbols-outlined -scale-x-100 theme-fg theme-bg-hover theme-bg-active"
+							title={`Reverse continue (${prefixStr}-V)`}
+						>
+							resume
+						</button>
+						<button
+							on:click={() => reverseStep(wasmRuntime, setWasmRuntime)}
+							class="cursor-pointer flex-0-shrink flex material-symbols-outlined -scale-x-100 theme-fg theme-bg-hover theme-bg-active"
+							title={`Step back (${prefixStr}-B)`}
+						>
+							step_over
+						</button>
+					</Show>
 					<Show when={wasmRuntime.status == "debug" ? wasmRuntime : null}>{debugRuntime => <>
 						<button
 							on:click={() => singleStep(debugRuntime(), setWasmRuntime)}
@@ -253,6 +287,13 @@ const Navbar: Component = () => {
 						>
 							step_over
 						</button>
+						<button
+							on:click={() => stepOut(debugRuntime(), setWasmRuntime)}
+							class="cursor-pointer flex-0-shrink flex material-symbols-outlined -scale-y-100 theme-fg theme-bg-hover theme-bg-active"
+							title={`Step out (${prefixStr}-O)`}
+						>
+							step_into
+						</button>
 						<button
 							on:click={() => continueStep(debugRuntime(), setWasmRuntime)}
 							class="cursor-pointer flex-0-shrink flex material-symbols-outlined theme-fg theme-bg-hover theme-bg-active"
@@ -270,6 +311,26 @@ const Navbar: Component = () => {
 						<div class="cursor-pointer flex-shrink-0 mx-auto"></div></>
 					}
 					</Show>
+					<Show when={wasmRuntime.status == "running"}>
+						<button
+							on:click={() => stopRun()}
+							class="cursor-pointer flex-0-shrink flex material-symbols-outlined theme-fg theme-bg-hover theme-bg-active"
+							title={`Stop (${prefixStr}-X)`}
+						>
+							stop
+						</button>
+						<div class="cursor-pointer flex-shrink-0 mx-auto"></div>
+					</Show>
+					<Show when={!testsuiteName}>
+						<button
+							on:click={toggleHeatmap}
+							class="cursor-pointer flex-0-shrink flex px-2 text-sm theme-fg theme-bg-hover theme-bg-active"
+							classList={{ "font-semibold": showHeatmap() }}
+							title="Show how many times each line ran (runs get slower)"
+						>
+							Heatmap
+						</button>
+					</Show>
 					<button
 						on:click={doChangeTheme}
 						class="cursor-pointer flex-0-shrink flex material-symbols-outlined theme-fg theme-bg-hover theme-bg-active"
@@ -405,6 +466,17 @@ const Editor: Component = () => {
 			effects: lineHighlightEffect.of(lineno), // disable the line highlight, as line numbering starts from 1 
 		});
 	})
+	// show where a finished run spent its time; only runNormal profiles, and
+	// only while the heat map is on
+	createComputed(() => {
+		wasmRuntime.version; // rerun after every run, even if the status stays the same
+		const finished = wasmRuntime.status == "stopped" || wasmRuntime.status == "error";
+		const shown = finished && showHeatmap();
+		if (!view) return;
+		view.dispatch({
+			effects: heatmapEffect.of(shown ? wasmInterface.getLineProfile() : null),
+		});
+	})
 
 	onMount(async () => {
 		await fetchTestcases();
@@ -421,6 +493,7 @@ const Editor: Component = () => {
 				new LanguageSupport(riscvLanguage, [dummyIndent]),
 				lintCompartment.of(createAsmLinter()),
 				breakpointGutter, // must be first so it's the first gutter
+				heatmapGutter,
 				basicSetup,
 				theme,
 				EditorView.editorAttributes.of({ style: "font-size: 1.4em" }),
@@ -467,10 +540,10 @@ const TestSuiteViewer = (table: TestSuiteTableEntry[], currentDebuggingEntry: nu
 						const errorType = testcase.runErr ? "crashed" : "mismatched";
 						return (
 							<tr
-								class={`  border-b theme-border ${passed ? 'theme-testsuccess' : 'theme-testfail'}`}
+								class={`  border-b theme-border ${testcase.pending ? '' : passed ? 'theme-testsuccess' : 'theme-testfail'}`}
 							>
 								<td class="px-2">
-									{passed ?
+									{testcase.pending ? <span class="text-sm">running</span> : passed ?
 										<div class="flex flex-col">
 											<span class="text-sm">success</span>
 											<button class="text-left text-sm hover:font-semibold " on:click={() => startStepTestSuite(wasmRuntime, setWasmRuntime, index)}>
@@ -632,7 +705,7 @@ const App: Component = () => {
 								writeAddr={wasmInterface.memWrittenAddr ? wasmInterface.memWrittenAddr[0] : 0}
 								writeLen={wasmInterface.memWrittenLen ? wasmInterface.memWrittenLen[0] : 0}
 								sp={wasmInterface.regsArr ? wasmInterface.regsArr[2 - 1] : 0}
-								load={wasmInterface.emu_load}
+								read={(addr, len) => wasmInterface.readWindow(addr, len)}
 							/>}
 						</PaneResize>}
 						{() => (<div
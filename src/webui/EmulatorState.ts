@@ -1,38 +1,16 @@
 import { createStore } from "solid-js/store";
-import { WasmInterface } from "./RiscV";
+import { convertNumber, type MemoryWindow, STACK_LEN, STACK_TOP, TEXT_BASE, WasmInterface, windowLoad } from "./RiscV";
+import type { Progress } from "./RunLoop";
 import { testsuiteName, view } from "./App";
 import { forceLinting } from "@codemirror/lint";
 import { breakpointState } from "./Breakpoint";
 import { createSignal } from "solid-js";
+import { TestPool } from "./TestPool";
 
-export function toUnsigned(x: number): number {
-	return x >>> 0;
-}
-
-export const TEXT_BASE = 0x00400000;
-export const TEXT_END = 0x10000000;
-export const DATA_BASE = 0x10000000;
-export const STACK_TOP = 0x7FFFF000;
-export const STACK_LEN = 4096;
-export const DATA_END = 0x70000000;
-
-export function convertNumber(x: number, decimal: boolean): string {
-	let ptr = false;
-	if (decimal) {
-		if (x >= TEXT_BASE && x <= TEXT_END) ptr = true;
-		else if (x >= STACK_TOP - STACK_LEN && x <= STACK_TOP) ptr = true;
-		else if (x >= DATA_BASE && x <= DATA_END) ptr = true;
-		if (ptr) return "0x" + (toUnsigned(x).toString(16).padStart(8, "0"));
-		else return toUnsigned(x).toString();
-	} else {
-		return toUnsigned(x).toString(16).padStart(8, "0");
-	}
-}
+export { convertNumber, DATA_BASE, DATA_END, STACK_LEN, STACK_TOP, TEXT_BASE, TEXT_END, toUnsigned } from "./RiscV";
 
 export type ShadowEntry = { name: string; args: number[]; sp: number };
 
-export let breakpoints = new Set();
-
 let globalVersion = 1;
 
 export type IdleState = {
@@ -86,7 +64,9 @@ export type TestSuiteTableEntry = {
 	input: string,
 	userOutput: string
 	output: string,
-	runErr: boolean
+	runErr: boolean,
+	// not run yet
+	pending?: boolean
 };
 
 export type TestSuiteState = {
@@ -107,7 +87,8 @@ export type RuntimeState =
 export type TestData = {
 	assignment: string,
 	testPrefix: string,
-	testcases: { input: string, output: string }[]
+	// stdin is fed to the console instead of being assembled with the program
+	testcases: { input: string, stdin?: string, output: string }[]
 };
 
 export let testData: TestData | null;
@@ -118,18 +99,22 @@ export let [wasmRuntime, setWasmRuntime] = createStore<RuntimeState>({ status: "
 export const wasmInterface = new WasmInterface();
 export let latestAsm = { text: "" };
 
-// TODO: cleanup
+// The heat map counts every instruction that runs, so runs only profile
+// while it is switched on
+export let [showHeatmap, setShowHeatmap] = createSignal<boolean>(localStorage.getItem("heatmap") == "on");
+
+export function toggleHeatmap(): void {
+	setShowHeatmap(!showHeatmap());
+	localStorage.setItem("heatmap", showHeatmap() ? "on" : "off");
+}
+
+// the core maps the lines to instructions and stops on them by itself
 function setBreakpoints(): void {
-	breakpoints = new Set();
+	const lines: number[] = [];
 	view.state.field(breakpointState).between(0, view.state.doc.length, (from) => {
-		const line = view.state.doc.lineAt(from);
-		const lineNum = line.number;
-		for (let i = 0; i < 65536; i++) {
-			if (wasmInterface.textByLinenum[i] == lineNum) {
-				breakpoints.add(TEXT_BASE + i * 4);
-			}
-		}
+		lines.push(view.state.doc.lineAt(from).number);
 	});
+	wasmInterface.setBreakpointLines(lines);
 }
 
 function buildShadowStack() {
@@ -194,12 +179,37 @@ export async function buildAsm(_runtime: RuntimeState, setRuntime): Promise<void
 	latestAsm.text = asm;
 }
 
+// shows how far a program that runs for a while has got
+function showProgress(setRuntime) {
+	return (progress: Progress) => setRuntime({
+		status: "running",
+		consoleText: wasmInterface.textBuffer,
+		pc: progress.pc,
+		regs: progress.regs,
+	});
+}
+
+function appendStatusLine(line: string) {
+	const needsNewline =
+		wasmInterface.textBuffer.length &&
+		wasmInterface.textBuffer[wasmInterface.textBuffer.length - 1] != "\n";
+
+	wasmInterface.textBuffer += needsNewline ? "\n" + line : line;
+}
+
+export function stopRun(): void {
+	wasmInterface.stop();
+	testPool?.stop();
+}
+
 export async function runNormal(_runtime: RuntimeState, setRuntime): Promise<void> {
+	if (wasmInterface.busy) return;
 	await buildAsm(_runtime, setRuntime);
 	if (_runtime.status == "asmerr") {
 		forceLinting(view);
 		return;
 	}
+	if (showHeatmap()) wasmInterface.enableProfile();
 
 	setRuntime({
 		status: "running",
@@ -208,20 +218,19 @@ export async function runNormal(_runtime: RuntimeState, setRuntime): Promise<voi
 		regs: [...wasmInterface.regsArr?.slice(0, 31) ?? initialRegs],
 	});
 
-	// run loop
-	while (true) {
-		wasmInterface.run();
-		if (wasmInterface.successfulExecution || wasmInterface.hasError) break;
-	}
+	await wasmInterface.runToEnd(showProgress(setRuntime));
 	if (wasmInterface.successfulExecution) {
-		const needsNewline =
-			wasmInterface.textBuffer.length &&
-			wasmInterface.textBuffer[wasmInterface.textBuffer.length - 1] != "\n";
-
-		wasmInterface.textBuffer +=
-			needsNewline
-				? "\nExecuted successfully."
-				: "Executed successfully.";
+		appendStatusLine("Executed successfully.");
+	} else if (wasmInterface.stopped && !wasmInterface.hasError) {
+		appendStatusLine("Stopped.");
+		setRuntime({
+			status: "stopped",
+			consoleText: wasmInterface.textBuffer,
+			pc: wasmInterface.pc[0],
+			regs: [...wasmInterface.regsArr.slice(0, 31)],
+			version: globalVersion++
+		});
+		return;
 	}
 	updateReactiveState(setRuntime);
 }
@@ -249,43 +258,50 @@ export async function buildWithTestcase(_runtime: RuntimeState, setRuntime, suff
 export let [wasmTestsuite, setTestsuite] = createSignal<TestSuiteTableEntry[]>([]);
 export let [wasmTestsuiteIdx, setTestsuiteIdx] = createSignal<number>(-1);
 
+let testPool: TestPool | null = null;
+
 export async function runTestSuite(_runtime: RuntimeState, setRuntime): Promise<void> {
-	if (testData == null) return;
+	if (testData == null || testData.testcases.length == 0) return;
+	if (wasmInterface.busy || testPool?.busy) return;
 	let testcases = testData.testcases;
 	let testPrefix = testData.testPrefix;
-	let outputTable = [];
-	for (let i = 0; i < testcases.length; i++) {
-		console.log("running test case", i);
-		await buildWithTestcase(_runtime, setRuntime, testPrefix + testcases[i].input);
-		if (_runtime.status == "asmerr") {
-			forceLinting(view);
-			return;
-		}
+	// errors in the user's code show up in the editor, as when running it
+	await buildWithTestcase(_runtime, setRuntime, testPrefix + testcases[0].input);
+	if (_runtime.status == "asmerr") {
+		forceLinting(view);
+		return;
+	}
+	const asm = latestAsm.text;
 
-		setRuntime({
-			status: "running",
-			consoleText: "",
-			pc: wasmInterface.pc?.[0] ?? TEXT_BASE,
-			regs: [...wasmInterface.regsArr?.slice(0, 31) ?? initialRegs],
-		});
+	setRuntime({
+		status: "running",
+		consoleText: "",
+		pc: TEXT_BASE,
+		regs: initialRegs,
+	});
 
-		// run loop
-		while (true) {
-			wasmInterface.run();
-			if (wasmInterface.successfulExecution || wasmInterface.hasError) break;
-		}
-		if (wasmInterface.successfulExecution && _runtime.status == "running") {
-			outputTable.push({ ...testcases[i], runErr: false, userOutput: wasmInterface.textBuffer.trim() });
-		} else {
-			outputTable.push({ ...testcases[i], runErr: true, userOutput: wasmInterface.textBuffer.trim() });
-		}
-	}
+	// results fill the table as the cases finish, in whatever order
+	let outputTable: TestSuiteTableEntry[] = testcases.map((testcase) =>
+		({ ...testcase, runErr: false, userOutput: "", pending: true }));
 	setTestsuite(outputTable);
+	testPool ??= new TestPool(wasmInterface.module);
+	await testPool.run(
+		testcases.map((testcase) => ({ source: asm + testPrefix + testcase.input, stdin: testcase.stdin ?? "" })),
+		(index, result) => {
+			outputTable = [...outputTable];
+			outputTable[index] = { ...testcases[index], runErr: !result.ok, userOutput: result.output };
+			setTestsuite(outputTable);
+		});
+
+	// the cases skipped by stopping count as failed
+	setTestsuite(outputTable.map((entry) => entry.pending ? { ...entry, runErr: true, pending: false } : entry));
+	setRuntime({ status: "testsuite", table: wasmTestsuite(), version: globalVersion++ });
 }
 
 
 
 export async function startStep(_runtime: RuntimeState, setRuntime): Promise<void> {
+	if (wasmInterface.busy) return;
 	console.log(_runtime);
 	await buildAsm(_runtime, setRuntime);
 	if (_runtime.status == "asmerr") {
@@ -293,6 +309,7 @@ export async function startStep(_runtime: RuntimeState, setRuntime): Promise<voi
 		return;
 	}
 	console.log("hereS");
+	wasmInterface.enableTimeTravel();
 
 	setRuntime({
 		status: "debug",
@@ -305,6 +322,7 @@ export async function startStep(_runtime: RuntimeState, setRuntime): Promise<voi
 
 
 export async function startStepTestSuite(_runtime: RuntimeState, setRuntime, index): Promise<void> {
+	if (wasmInterface.busy || testPool?.busy) return;
 	setTestsuiteIdx(index);
 	if (testData == null) return;
 	let testcases = testData.testcases;
@@ -318,6 +336,8 @@ export async function startStepTestSuite(_runtime: RuntimeState, setRuntime, ind
 		forceLinting(view);
 		return;
 	}
+	wasmInterface.setInput(testcases[index].stdin ?? "");
+	wasmInterface.enableTimeTravel();
 	console.log("hereS");
 
 	setRuntime({
@@ -342,55 +362,65 @@ export async function startStepTestSuite(_runtime: RuntimeState, setRuntime, ind
 
 
 export function singleStep(_runtime: DebugState, setRuntime): void {
+	if (wasmInterface.busy) return;
 	setBreakpoints();
 	wasmInterface.run();
 	updateReactiveState(setRuntime);
 }
 
-let temporaryBreakpoint: number | null = null;
-let savedSp = 0;
-
-export function continueStep(_runtime: DebugState, setRuntime): void {
+// a stopped run goes back to debugging from wherever it got to
+export async function continueStep(_runtime: DebugState, setRuntime): Promise<void> {
+	if (wasmInterface.busy) return;
 	setBreakpoints();
-	while (true) {
-		wasmInterface.run();
-		if (temporaryBreakpoint === wasmInterface.pc[0] && savedSp === wasmInterface.regsArr[2 - 1]) {
-			temporaryBreakpoint = null;
-			break;
-		}
-		if (breakpoints.has(wasmInterface.pc[0])) break;
-		if (wasmInterface.successfulExecution || wasmInterface.hasError) break;
-	}
+	await wasmInterface.runToEnd(showProgress(setRuntime));
+	finishStep(setRuntime);
+}
+
+function finishStep(setRuntime): void {
+	// debugging was quit while the program ran
+	if (wasmInterface.stopped && wasmRuntime.status == "idle") return;
 	if (wasmInterface.successfulExecution) {
-		const needsNewline =
-			wasmInterface.textBuffer.length &&
-			wasmInterface.textBuffer[wasmInterface.textBuffer.length - 1] != "\n";
-
-		wasmInterface.textBuffer +=
-			needsNewline
-				? "\nExecuted successfully."
-				: "Executed successfully.";
+		appendStatusLine("Executed successfully.");
 	}
 	updateReactiveState(setRuntime);
 }
 
-export function nextStep(_runtime: DebugState, setRuntime): void {
-	const inst = wasmInterface.emu_load(wasmInterface.pc[0], 4);
-	const opcode = inst & 127;
-	const funct3 = (inst >> 12) & 7;
-	const rd = (inst >> 7) & 31;
-	const isJal = opcode === 0x6f;
-	const isJalr = opcode === 0x67 && funct3 === 0;
-	if ((isJal || isJalr) && rd === 1) {
-		temporaryBreakpoint = wasmInterface.pc[0] + 4;
-		savedSp = wasmInterface.regsArr[2 - 1];
-		continueStep(_runtime, setRuntime);
-	} else {
-		singleStep(_runtime, setRuntime);
-	}
+// calls are run to their return by the core, stopping on breakpoints
+export async function nextStep(_runtime: DebugState, setRuntime): Promise<void> {
+	if (wasmInterface.busy) return;
+	setBreakpoints();
+	await wasmInterface.stepOver(showProgress(setRuntime));
+	finishStep(setRuntime);
+}
+
+export async function stepOut(_runtime: DebugState, setRuntime): Promise<void> {
+	if (wasmInterface.busy) return;
+	setBreakpoints();
+	await wasmInterface.stepOut(showProgress(setRuntime));
+	finishStep(setRuntime);
+}
+
+// going back works from a finished or crashed program too
+export function canReverse(_runtime: RuntimeState): boolean {
+	return wasmInterface.timeTravelEnabled &&
+		(_runtime.status == "debug" || _runtime.status == "error" || _runtime.status == "stopped");
+}
+
+export function reverseStep(_runtime: RuntimeState, setRuntime): void {
+	if (wasmInterface.busy) return;
+	wasmInterface.reverseStep();
+	updateReactiveState(setRuntime);
+}
+
+export function reverseContinue(_runtime: RuntimeState, setRuntime): void {
+	if (wasmInterface.busy) return;
+	setBreakpoints();
+	wasmInterface.reverseContinue();
+	updateReactiveState(setRuntime);
 }
 
 export function quitDebug(_runtime: DebugState, setRuntime): void {
+	wasmInterface.stop();
 	setRuntime({ status: "idle", version: globalVersion++ });
 }
 
@@ -402,13 +432,18 @@ export function getCurrentLine(_runtime: DebugState | ErrorState): number {
 	return 0;
 }
 
+// how much of the memory below STACK_TOP the memory view shows
+export const STACK_WINDOW = 65536;
+
 export type ShadowStackAugmentedEnt = {
 	name: string,
 	elems: { addr: string, isAnimated: boolean, text: string }[]
 }
 
 // TODO: cleanup and make type safe
-export function shadowStackAugmented(shadowStack: ShadowEntry[], load, writeAddr, writeLen): ShadowStackAugmentedEnt[] {
+export function shadowStackAugmented(shadowStack: ShadowEntry[], read: (addr: number, len: number) => MemoryWindow, writeAddr, writeLen): ShadowStackAugmentedEnt[] {
+	// the same window as the stack tab of the memory view
+	const stack = read(STACK_TOP - STACK_WINDOW, STACK_WINDOW);
 	let allInfo = new Array(shadowStack.length);
 	for (let i = 0; i < shadowStack.length; i++) {
 		let ent = shadowStack[i];
@@ -416,9 +451,9 @@ export function shadowStackAugmented(shadowStack: ShadowEntry[], load, writeAddr
 		let elemCnt = (ent.sp - startSp) / 4;
 		let elems = new Array(elemCnt);
 		for (let j = 0, ptr = ent.sp - 4; j < elemCnt; j++, ptr -= 4) {
-			let text = load ? convertNumber(load(ptr, 4), true) : "0";
+			let text = convertNumber(windowLoad(stack, ptr, 4) ?? 0, true);
 			if (wasmInterface.callsanWrittenBy) {
-				let off = (ptr - (0x7FFFF000 - 4096)) / 4;
+				let off = (ptr - (STACK_TOP - STACK_LEN)) / 4;
 				let regidx = wasmInterface.callsanWrittenBy[off];
 				if (regidx == 0xff) text = "??";
 				else if (regidx != 0) text += " (" + wasmInterface.getRegisterName(regidx) + ")";
@@ -0,0 +1,58 @@
+import type { WasmExports } from "./RiscV";
+import {
+  CONTROL_STOP,
+  runBatches,
+  type WorkerMessage,
+  type WorkerRequest,
+} from "./RunLoop";
+
+// Runs programs off the main thread, with its own instance of the module over
+// the memory shared with the page: the page builds the program and reads the
+// machine state as usual, the worker only runs it. The two never execute WASM
+// at the same time, since they also share the C stack
+
+let ready: Promise<WasmExports>;
+let memory: WebAssembly.Memory;
+let control: Int32Array;
+
+function post(msg: WorkerMessage, transfer: Transferable[] = []) {
+  (self as unknown as Worker).postMessage(msg, transfer);
+}
+
+async function init(module: WebAssembly.Module): Promise<WasmExports> {
+  const instance = await WebAssembly.instantiate(module, {
+    env: {
+      memory,
+      flush_output: (ptr: number, len: number) => {
+        const bytes = new Uint8Array(memory.buffer, ptr, len).slice();
+        post({ type: "output", bytes }, [bytes.buffer]);
+      },
+      // the page finds out from the machine state once the run is over
+      emu_exit: () => {},
+      panic: () => post({ type: "panic" }),
+      gettime64: () => BigInt(new Date().getTime() * 10 * 1000),
+    },
+  });
+  return instance.exports as unknown as WasmExports;
+}
+
+self.onmessage = async (event: MessageEvent<WorkerRequest>) => {
+  const req = event.data;
+  if (req.type == "init") {
+    memory = req.memory;
+    control = req.control;
+    ready = init(req.module);
+    return;
+  }
+
+  const exports = await ready;
+  const result = await runBatches(
+    exports,
+    memory,
+    req.kind,
+    req.budget,
+    () => Atomics.load(control, CONTROL_STOP) != 0,
+    (progress) => post({ type: "progress", progress }),
+  );
+  post({ type: "done", result });
+};
@@ -0,0 +1,68 @@
+import { RangeSet, RangeSetBuilder, StateEffect, StateField } from "@codemirror/state";
+
+import { EditorView, gutter, GutterMarker } from "@codemirror/view";
+
+class HeatMarker extends GutterMarker {
+  constructor(
+    readonly count: number,
+    readonly heat: number,
+  ) {
+    super();
+  }
+
+  eq(other: HeatMarker) {
+    return this.count == other.count && this.heat == other.heat;
+  }
+
+  toDOM() {
+    const bar = document.createElement("div");
+    bar.style.height = "100%";
+    bar.style.width = "0.4em";
+    bar.style.opacity = String(0.15 + 0.85 * this.heat);
+    bar.classList = "cm-heatmap-marker";
+    bar.title = `executed ${this.count} times`;
+    return bar;
+  }
+}
+
+// Instructions executed per line number, or null to clear the gutter
+export const heatmapEffect = StateEffect.define<Map<number, number> | null>();
+
+export const heatmapState = StateField.define<RangeSet<GutterMarker>>({
+  create() {
+    return RangeSet.empty;
+  },
+  update(set, transaction) {
+    set = set.map(transaction.changes);
+    for (let e of transaction.effects) {
+      if (e.is(heatmapEffect)) {
+        const builder = new RangeSetBuilder<GutterMarker>();
+        if (e.value) {
+          // log scale, so that a hot loop doesn't hide everything else
+          const max = Math.log1p(Math.max(...e.value.values()));
+          const doc = transaction.state.doc;
+          for (const [line, count] of [...e.value].sort((a, b) => a[0] - b[0])) {
+            if (line < 1 || line > doc.lines) continue;
+            const heat = max > 0 ? Math.log1p(count) / max : 0;
+            builder.add(doc.line(line).from, doc.line(line).from, new HeatMarker(count, heat));
+          }
+        }
+        set = builder.finish();
+      }
+    }
+    return set;
+  },
+});
+
+export const heatmapGutter = [
+  heatmapState,
+  gutter({
+    class: "cm-heatmap-gutter",
+    markers: (v) => v.state.field(heatmapState),
+  }),
+  EditorView.baseTheme({
+    ".cm-heatmap-marker": {
+      backgroundColor: "orangered",
+    },
+  }),
+];
@@ -1,10 +1,11 @@
 import { createVirtualizer } from "@tanstack/solid-virtual";
 import { Component, createSignal, onMount, createEffect, For, Show } from "solid-js";
 import { TabSelector } from "./TabSelector";
-import { DATA_BASE, shadowStackAugmented, ShadowStackAugmentedEnt, STACK_LEN, STACK_TOP, TEXT_BASE, wasmRuntime } from "./EmulatorState";
+import { DATA_BASE, shadowStackAugmented, ShadowStackAugmentedEnt, STACK_LEN, STACK_TOP, STACK_WINDOW, TEXT_BASE, wasmRuntime } from "./EmulatorState";
+import type { MemoryWindow } from "./RiscV";
 const ROW_HEIGHT: number = 24;
 
-export const MemoryView: Component<{ version: () => any, writeAddr: number, writeLen: number, sp: number, load: (addr: number, pow: number) => number | null }> = (props) => {
+export const MemoryView: Component<{ version: () => any, writeAddr: number, writeLen: number, sp: number, read: (addr: number, len: number) => MemoryWindow }> = (props) => {
     let parentRef: HTMLDivElement | undefined;
     let dummyChunk: HTMLDivElement | undefined;
     const [containerWidth, setContainerWidth] = createSignal<number>(0);
@@ -64,7 +65,7 @@ export const MemoryView: Component<{ version: () => any, writeAddr: number, writ
     const getStartAddr = () => {
         if (activeTab() == ".text") return TEXT_BASE;
         else if (activeTab() == ".data") return DATA_BASE;
-        else if (activeTab() == "stack") return STACK_TOP - 65536; // TODO: runtime stack size detection
+        else if (activeTab() == "stack") return STACK_TOP - STACK_WINDOW; // TODO: runtime stack size detection
         return 0;
     }
     // FIXME: selecting data should not also select the address column
@@ -76,7 +77,7 @@ export const MemoryView: Component<{ version: () => any, writeAddr: number, writ
                 <Show when={activeTab() == "frames"}>
                     <ShadowStack
                         shadowStackAugmented={(wasmRuntime.status == "debug" || wasmRuntime.status == "error")
-                            ? shadowStackAugmented(wasmRuntime.shadowStack, props.load, props.writeAddr, props.writeLen) : []}
+                            ? shadowStackAugmented(wasmRuntime.shadowStack, props.read, props.writeAddr, props.writeLen) : []}
                         version={props.version} />
                 </Show>
                 <Show when={activeTab() != "frames"}>
@@ -92,6 +93,8 @@ export const MemoryView: Component<{ version: () => any, writeAddr: number, writ
                                     {(() => {
                                         props.version();
                                         let start = getStartAddr();
+                                        // every row reads the same window, only once per change
+                                        let mem = props.read(start, 65536);
                                         let chunks = chunksPerLine() - 1;
                                         let idx = virtRow.index;
                                         if (chunksPerLine() < 2) chunks = 1;
@@ -107,7 +110,9 @@ export const MemoryView: Component<{ version: () => any, writeAddr: number, writ
                                                 if (grayedOut) style = "theme-fg2";
                                                 if (ptr >= props.sp && ptr < props.sp + 4) style = "frame-highlight";
                                                 if (isAnimated) style = "animate-fade-highlight";
-                                                let text = props.load ? props.load(ptr, 1).toString(16).padStart(2, "0") : "00";
+                                                let off = ptr - start;
+                                                if (!(mem.valid[off >> 3] & (1 << (off & 7)))) style += " theme-fg2";
+                                                let text = mem.bytes[off].toString(16).padStart(2, "0");
                                                 if (j == 3) style += " mr-[1ch]";
                                                 components[i * 4 + j] = <a class={style}>{text}</a>;
                                             }
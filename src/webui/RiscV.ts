@@ -1,39 +1,149 @@
-import { convertNumber } from "./EmulatorState";
+import {
+  CONTROL_LEN,
+  CONTROL_STOP,
+  type Progress,
+  type RunKind,
+  type RunResult,
+  runBatches,
+  type WorkerMessage,
+  type WorkerRequest,
+} from "./RunLoop";
 import wasmUrl from "./main.wasm?url";
+import sharedWasmUrl from "./main-shared.wasm?url";
 
-interface WasmExports {
-  emulate(): void;
-  assemble: (offset: number, len: number, allow_externs: boolean) => void;
-  pc_to_label: (pc: number) => void;
-  emu_load: (addr: number, size: number) => number;
+export interface WasmExports {
+  emulate(machine: number): void;
+  emulate_n(machine: number, n: number): number;
+  emulate_step_over(machine: number, n: number): number;
+  emulate_step_out(machine: number, n: number): number;
+  emulate_resume(machine: number, n: number, depth: number): number;
+  console_input_reserve(program: number, len: number): number;
+  timetravel_enable(program: number, interval: number, budget: number): boolean;
+  timetravel_reverse_step(program: number): number;
+  timetravel_reverse_continue(program: number): number;
+  breakpoint_set_line(program: number, line: number, on: boolean): number;
+  breakpoint_clear_all(program: number): void;
+  breakpoint_hit(program: number): boolean;
+  profile_enable(program: number): void;
+  assemble: (
+    program: number,
+    offset: number,
+    len: number,
+    allow_externs: boolean,
+  ) => void;
+  pc_to_label: (program: number, pc: number) => void;
+  emu_read_window(
+    program: number,
+    addr: number,
+    len: number,
+    out: number,
+    valid: number,
+  ): void;
+  malloc(size: number): number;
+  dirty_window_take(program: number, addr: number, len: number): boolean;
   __heap_base: number;
-  g_regs: number;
   g_heap_size: number;
-  g_mem_written_addr: number;
-  g_mem_written_len: number;
-  g_reg_written: number;
-  g_pc: number;
-  g_text_by_linenum: number;
-  g_error: number;
-  g_error_line: number;
+  g_program_default: number;
+  g_program_text_by_linenum: number;
+  g_program_error: number;
+  g_program_error_line: number;
   g_runtime_error_pc: number;
-  g_runtime_error_params: number;
-  g_runtime_error_type: number;
   g_pc_to_label_txt: number;
   g_pc_to_label_len: number;
-  g_shadow_stack: number;
-  g_callsan_stack_written_by: number;
+  g_program_machine: number;
+  g_machine_regs: number;
+  g_machine_pc: number;
+  g_machine_exited: number;
+  g_machine_instret: number;
+  g_machine_mem_written_len: number;
+  g_machine_mem_written_addr: number;
+  g_machine_reg_written: number;
+  g_machine_runtime_error_type: number;
+  g_machine_runtime_error_params: number;
+  g_machine_shadow_stack: number;
+  g_machine_callsan_stack_written_by: number;
+  g_program_console_out_total: number;
+  g_program_profile_counts: number;
+  g_program_profile_len: number;
+  g_program_dirty_generation: number;
 }
 
-const INSTRUCTION_LIMIT: number = 100 * 1000;
+// A copy of some guest memory, with a bit per byte (LSB first) telling
+// whether it could be read
+export type MemoryWindow = {
+  addr: number;
+  bytes: Uint8Array;
+  valid: Uint8Array;
+};
+
+// Little-endian value in the window, or null if any of it couldn't be read
+export function windowLoad(
+  window: MemoryWindow,
+  addr: number,
+  size: number,
+): number | null {
+  const off = addr - window.addr;
+  if (off < 0 || off + size > window.bytes.length) return null;
+  let val = 0;
+  for (let i = size - 1; i >= 0; i--) {
+    if (!(window.valid[(off + i) >> 3] & (1 << ((off + i) & 7)))) return null;
+    val = val * 256 + window.bytes[off + i];
+  }
+  return val;
+}
+
+export function toUnsigned(x: number): number {
+  return x >>> 0;
+}
+
+// guest memory layout, as in core.h
+export const TEXT_BASE = 0x00400000;
+export const TEXT_END = 0x10000000;
+export const DATA_BASE = 0x10000000;
+export const STACK_TOP = 0x7FFFF000;
+export const STACK_LEN = 4096;
+export const DATA_END = 0x70000000;
+
+export function convertNumber(x: number, decimal: boolean): string {
+  let ptr = false;
+  if (decimal) {
+    if (x >= TEXT_BASE && x <= TEXT_END) ptr = true;
+    else if (x >= STACK_TOP - STACK_LEN && x <= STACK_TOP) ptr = true;
+    else if (x >= DATA_BASE && x <= DATA_END) ptr = true;
+    if (ptr) return "0x" + (toUnsigned(x).toString(16).padStart(8, "0"));
+    else return toUnsigned(x).toString();
+  } else {
+    return toUnsigned(x).toString(16).padStart(8, "0");
+  }
+}
+
+const INSTRUCTION_LIMIT: number = 100 * 1000 * 1000;
+// checkpoint every TIMETRAVEL_INTERVAL instructions while debugging, using at
+// most TIMETRAVEL_BUDGET bytes (older ones get sparser past that)
+const TIMETRAVEL_INTERVAL: number = 4096;
+const TIMETRAVEL_BUDGET: number = 32 * 1024 * 1024;
+// the shared variant of the module is linked with --max-memory=1GiB
+const SHARED_MAX_PAGES: number = 16384;
 
 export class WasmInterface {
   private memory: WebAssembly.Memory;
+  // memory can only be shared with a worker on cross-origin isolated pages
+  private shared: boolean;
+  private worker?: Worker;
+  private control?: Int32Array;
+  private stopRequested: boolean = false;
+  private workerProgress?: (progress: Progress) => void;
+  private workerDone?: (result: RunResult) => void;
   private wasmInstance?: WebAssembly.Instance;
+  public module?: WebAssembly.Module;
   private exports?: WasmExports;
   private loadedPromise?: Promise<void>;
   private originalMemory?: Uint8Array;
   public textBuffer: string = "";
+  private outputDecoder: TextDecoder = new TextDecoder("utf8");
+  // raw output, kept while time travel is enabled so that it can be cut back
+  // to what had been printed at the instruction we go back to
+  private outputChunks: Uint8Array[] | null = null;
   public successfulExecution: boolean;
   public regsArr?: Uint32Array;
   public memWrittenLen?: Uint32Array;
@@ -46,15 +156,32 @@ export class WasmInterface {
   public runtimeErrorType?: Uint32Array;
   public hasError: boolean = false;
   public instructions: number;
+  // set while a program runs asynchronously, when nothing else may call into
+  // the module: the worker and the page share its stack
+  public busy: boolean = false;
+  // whether the last run was cut short by stop()
+  public stopped: boolean = false;
   public shadowStackPtr?: Uint32Array;
   public shadowStack?: Uint32Array;
   public shadowStackLen?: Uint32Array;
   public callsanWrittenBy?: Uint8Array;
 
-  public emu_load: (addr: number, size: number) => number;
+  // the last window read, reused until guest memory changes
+  private window?: MemoryWindow & { version: number; build: number };
+  private windowScratch?: { ptr: number; len: number; build: number };
+  private builds: number = 0;
 
-  constructor() {
-    this.memory = new WebAssembly.Memory({ initial: 7 });
+  // Without useWorker, programs always run on the calling thread, as they do
+  // in the workers of the test pool
+  constructor(private useWorker: boolean = true) {
+    this.shared = globalThis.crossOriginIsolated === true;
+    this.memory = this.shared
+      ? new WebAssembly.Memory({
+          initial: 7,
+          maximum: SHARED_MAX_PAGES,
+          shared: true,
+        })
+      : new WebAssembly.Memory({ initial: 7 });
   }
 
   createU8(off: number) {
@@ -64,30 +191,38 @@ export class WasmInterface {
     return new Uint32Array(this.memory.buffer, off);
   }
 
-  async loadModule(): Promise<void> {
+  // Instantiates module, or the variant this page can use if not given
+  async loadModule(module?: WebAssembly.Module): Promise<void> {
     if (this.loadedPromise) return this.loadedPromise;
     this.loadedPromise = (async () => {
-      const res = await fetch(wasmUrl);
-      const buffer = await res.arrayBuffer();
-      const { instance } = await WebAssembly.instantiate(buffer, {
+      if (!module) {
+        const res = await fetch(this.shared ? sharedWasmUrl : wasmUrl);
+        module = await WebAssembly.compile(await res.arrayBuffer());
+      }
+      this.module = module;
+      const instance = await WebAssembly.instantiate(module, {
         env: {
           memory: this.memory,
-          putchar: (n: number) => {
-            this.textBuffer += String.fromCharCode(n);
+          flush_output: (ptr: number, len: number) => {
+            // TextDecoder doesn't take views of shared memory
+            this.appendOutput(
+              new Uint8Array(this.memory.buffer, ptr, len).slice(),
+            );
           },
           emu_exit: () => {
             console.log("EXIT");
             this.successfulExecution = true;
           },
           panic: () => {
-            alert("wasm panic");
+            if (typeof alert === "function") alert("wasm panic");
+            else console.error("wasm panic");
           },
           gettime64: () => BigInt(new Date().getTime() * 10 * 1000),
         },
       });
       this.wasmInstance = instance;
       this.exports = this.wasmInstance.exports as unknown as WasmExports;
-      this.emu_load = this.exports.emu_load;
+      if (this.shared && this.useWorker) this.startWorker(module);
       // Save a snapshot of the original memory to restore between builds.
       this.originalMemory = new Uint8Array(this.memory.buffer.slice(0));
       console.log("Wasm module loaded");
@@ -95,6 +230,44 @@ export class WasmInterface {
     return this.loadedPromise;
   }
 
+  private startWorker(module: WebAssembly.Module) {
+    this.control = new Int32Array(
+      new SharedArrayBuffer(CONTROL_LEN * Int32Array.BYTES_PER_ELEMENT),
+    );
+    this.worker = new Worker(new URL("./EmulatorWorker.ts", import.meta.url), {
+      type: "module",
+    });
+    this.worker.onmessage = (event: MessageEvent<WorkerMessage>) => {
+      const msg = event.data;
+      switch (msg.type) {
+        case "output":
+          this.appendOutput(msg.bytes);
+          break;
+        case "progress":
+          this.workerProgress?.(msg.progress);
+          break;
+        case "done":
+          this.workerDone?.(msg.result);
+          break;
+        case "panic":
+          alert("wasm panic");
+          break;
+      }
+    };
+    const init: WorkerRequest = {
+      type: "init",
+      module,
+      memory: this.memory,
+      control: this.control,
+    };
+    this.worker.postMessage(init);
+  }
+
+  private appendOutput(bytes: Uint8Array) {
+    this.outputChunks?.push(bytes);
+    this.textBuffer += this.outputDecoder.decode(bytes, { stream: true });
+  }
+
   async build(
     source: string,
   ): Promise<{ line: number; message: string } | null> {
@@ -106,6 +279,9 @@ export class WasmInterface {
     this.instructions = 0;
     this.hasError = false;
     this.textBuffer = "";
+    this.outputDecoder = new TextDecoder("utf8");
+    this.outputChunks = null;
+    this.builds++;
 
     this.createU8(0).set(this.originalMemory);
 
@@ -114,20 +290,6 @@ export class WasmInterface {
     const strLen = strBytes.length;
     const offset = this.exports.__heap_base;
 
-    this.memWrittenAddr = this.createU32(this.exports.g_mem_written_addr);
-    this.memWrittenLen = this.createU32(this.exports.g_mem_written_len);
-    this.regWritten = this.createU32(this.exports.g_reg_written);
-    this.pc = this.createU32(this.exports.g_pc);
-    this.regsArr = this.createU32(this.exports.g_regs + 4);
-    this.runtimeErrorParams = this.createU32(
-      this.exports.g_runtime_error_params,
-    );
-    this.runtimeErrorType = this.createU32(this.exports.g_runtime_error_type);
-    this.shadowStackLen = this.createU32(this.exports.g_shadow_stack);
-    this.shadowStackPtr = this.createU32(this.exports.g_shadow_stack + 8);
-    this.callsanWrittenBy = this.createU8(
-      this.exports.g_callsan_stack_written_by,
-    );
     if (offset + strLen > this.memory.buffer.byteLength) {
       const pages = Math.ceil(
         (offset + strLen - this.memory.buffer.byteLength) / 65536,
@@ -137,13 +299,15 @@ export class WasmInterface {
 
     this.createU8(offset).set(strBytes);
     this.createU32(this.exports.g_heap_size)[0] = (strLen + 7) & ~7; // align up to 8
-    this.exports.assemble(offset, strLen, false);
-    const textByLinenumPtr = this.createU32(this.exports.g_text_by_linenum)[2];
-    this.textByLinenum = this.createU32(textByLinenumPtr);
-    this.textByLinenumLen = this.createU32(this.exports.g_text_by_linenum);
+    this.exports.assemble(this.program, offset, strLen, false);
+    this.createViews();
 
-    const errorLine = this.createU32(this.exports.g_error_line)[0];
-    const errorPtr = this.createU32(this.exports.g_error)[0];
+    const errorLine = this.createU32(
+      this.machineField(this.exports.g_program_error_line),
+    )[0];
+    const errorPtr = this.createU32(
+      this.machineField(this.exports.g_program_error),
+    )[0];
     if (errorPtr) {
       const error = this.createU8(errorPtr);
       const errorLen = error.indexOf(0);
@@ -153,12 +317,232 @@ export class WasmInterface {
 
     return null;
   }
+
+  // Views are detached whenever the WASM memory grows, so they have to be
+  // recreated after anything that may allocate
+  private createViews() {
+    this.memWrittenAddr = this.createU32(
+      this.machineField(this.exports.g_machine_mem_written_addr),
+    );
+    this.memWrittenLen = this.createU32(
+      this.machineField(this.exports.g_machine_mem_written_len),
+    );
+    this.regWritten = this.createU32(
+      this.machineField(this.exports.g_machine_reg_written),
+    );
+    this.pc = this.createU32(this.machineField(this.exports.g_machine_pc));
+    this.regsArr = this.createU32(
+      this.machineField(this.exports.g_machine_regs) + 4,
+    );
+    this.runtimeErrorParams = this.createU32(
+      this.machineField(this.exports.g_machine_runtime_error_params),
+    );
+    this.runtimeErrorType = this.createU32(
+      this.machineField(this.exports.g_machine_runtime_error_type),
+    );
+    const shadowStack = this.machineField(this.exports.g_machine_shadow_stack);
+    this.shadowStackLen = this.createU32(shadowStack);
+    this.shadowStackPtr = this.createU32(shadowStack + 8);
+    this.callsanWrittenBy = this.createU8(
+      this.machineField(this.exports.g_machine_callsan_stack_written_by),
+    );
+    const textByLinenum = this.machineField(
+      this.exports.g_program_text_by_linenum,
+    );
+    this.textByLinenum = this.createU32(this.createU32(textByLinenum)[2]);
+    this.textByLinenumLen = this.createU32(textByLinenum);
+  }
+
+  // The default program's parts and its machine's fields are exported as
+  // pointers to them
+  private machineField(ptr: number): number {
+    return this.createU32(ptr)[0];
+  }
+
+  // The default program, which the exports that work on a program are given
+  private get program(): number {
+    return this.exports.g_program_default;
+  }
+
+  // Queues the guest's console input; call after build(), which resets it
+  setInput(input: string) {
+    const bytes = new TextEncoder().encode(input);
+    if (bytes.length == 0) return;
+    const ptr = this.exports.console_input_reserve(this.program, bytes.length);
+    this.createU8(ptr).set(bytes);
+    this.createViews();
+  }
+
+  // Reads len bytes of guest memory from addr in a single call, or none at
+  // all if none of the pages it covers was written since the last time
+  readWindow(addr: number, len: number): MemoryWindow {
+    const version = this.createU32(
+      this.machineField(this.exports.g_program_dirty_generation),
+    )[0];
+    const last = this.window;
+    const same =
+      last &&
+      last.addr == addr &&
+      last.bytes.length == len &&
+      last.build == this.builds;
+    if (same && last.version == version) {
+      return last;
+    }
+    // the module can't be called into while a program runs in the worker
+    if (this.busy) {
+      return same
+        ? last
+        : {
+            addr,
+            bytes: new Uint8Array(len),
+            valid: new Uint8Array((len + 7) >> 3),
+          };
+    }
+    // takes the bits of the window's pages even if it is read for other reasons
+    if (!this.exports.dirty_window_take(this.program, addr, len) && same) {
+      last.version = version;
+      return last;
+    }
+
+    // the heap only grows until the next build, so this stays ours until then
+    // (kept a multiple of 8, since malloc doesn't align)
+    const scratchLen = (len + ((len + 7) >> 3) + 7) & ~7;
+    let scratch = this.windowScratch;
+    if (!scratch || scratch.build != this.builds || scratch.len < scratchLen) {
+      scratch = {
+        ptr: this.exports.malloc(scratchLen),
+        len: scratchLen,
+        build: this.builds,
+      };
+      this.windowScratch = scratch;
+      this.createViews();
+    }
+
+    this.exports.emu_read_window(
+      this.program,
+      addr,
+      len,
+      scratch.ptr,
+      scratch.ptr + len,
+    );
+    this.window = {
+      addr,
+      bytes: this.createU8(scratch.ptr).slice(0, len),
+      valid: this.createU8(scratch.ptr + len).slice(0, (len + 7) >> 3),
+      version,
+      build: this.builds,
+    };
+    return this.window;
+  }
+
+  private readU64(off: number): number {
+    const words = this.createU32(off);
+    return words[0] + words[1] * 2 ** 32;
+  }
+
+  get timeTravelEnabled(): boolean {
+    return this.outputChunks !== null;
+  }
+
+  // Starts recording checkpoints, so that execution can go back from here,
+  // unless a model (like the profiler) is enabled
+  enableTimeTravel() {
+    this.outputChunks = [];
+    if (
+      !this.exports.timetravel_enable(
+        this.program,
+        TIMETRAVEL_INTERVAL,
+        TIMETRAVEL_BUDGET,
+      )
+    ) {
+      this.outputChunks = null;
+    }
+    this.createViews();
+  }
+
+  reverseStep() {
+    this.exports.timetravel_reverse_step(this.program);
+    this.afterTimeTravel();
+  }
+
+  // Replaces the breakpoints with the ones on these source lines
+  setBreakpointLines(lines: number[]) {
+    this.exports.breakpoint_clear_all(this.program);
+    for (const line of lines) {
+      this.exports.breakpoint_set_line(this.program, line, true);
+    }
+  }
+
+  // Whether the last run stopped before a breakpoint
+  get breakpointHit(): boolean {
+    return !!this.exports.breakpoint_hit(this.program);
+  }
+
+  // Goes back to the last time execution was on one of the breakpoints
+  reverseContinue() {
+    this.exports.timetravel_reverse_continue(this.program);
+    this.afterTimeTravel();
+  }
+
+  private afterTimeTravel() {
+    this.createViews();
+    this.successfulExecution = this.createU8(
+      this.machineField(this.exports.g_machine_exited),
+    )[0] != 0;
+    this.hasError = false;
+    this.instructions = this.readU64(
+      this.machineField(this.exports.g_machine_instret),
+    );
+
+    // drop the output printed after this point, along with any error message
+    let remaining = this.readU64(
+      this.machineField(this.exports.g_program_console_out_total),
+    );
+    const kept: Uint8Array[] = [];
+    for (const chunk of this.outputChunks) {
+      if (remaining == 0) break;
+      kept.push(chunk.subarray(0, Math.min(chunk.length, remaining)));
+      remaining -= kept[kept.length - 1].length;
+    }
+    this.outputChunks = kept;
+    this.outputDecoder = new TextDecoder("utf8");
+    this.textBuffer = kept
+      .map((chunk) => this.outputDecoder.decode(chunk, { stream: true }))
+      .join("");
+  }
+
+  // Counts how many times each instruction runs, until the next build
+  enableProfile() {
+    this.exports.profile_enable(this.program);
+    this.createViews();
+  }
+
+  // Instructions executed per source line, or null if profiling is off
+  getLineProfile(): Map<number, number> | null {
+    const countsPtr = this.createU32(
+      this.machineField(this.exports.g_program_profile_counts),
+    )[0];
+    if (!countsPtr) return null;
+    const len = this.createU32(
+      this.machineField(this.exports.g_program_profile_len),
+    )[0];
+    const counts = this.createU32(countsPtr);
+    const profile = new Map<number, number>();
+    for (let i = 0; i < len && i < this.textByLinenumLen[0]; i++) {
+      const count = counts[i * 2] + counts[i * 2 + 1] * 2 ** 32;
+      if (count == 0) continue;
+      const line = this.textByLinenum[i];
+      profile.set(line, (profile.get(line) ?? 0) + count);
+    }
+    return profile;
+  }
+
   getShadowStack(): Uint32Array {
     return this.createU32(this.shadowStackPtr[0]);
   }
 
   getStringFromPc(pc: number): string {
-    this.exports.pc_to_label(pc);
+    this.exports.pc_to_label(this.program, pc);
     const labelPtr = this.createU32(this.exports.g_pc_to_label_txt)[0];
     if (labelPtr) {
       const labelLen = this.createU32(this.exports.g_pc_to_label_len)[0];
@@ -206,9 +590,99 @@ export class WasmInterface {
     ];
     return regnames[idx];
   }
-  run(): void {
-    this.exports.emulate();
-    this.instructions++;
+  // runs up to maxInstructions, stopping early on exit, error or breakpoint
+  run(maxInstructions: number = 1): void {
+    const budget = this.budget(maxInstructions);
+    const machine = this.machineField(this.exports.g_program_machine);
+    this.finishRun(this.exports.emulate_n(machine, budget));
+  }
+
+  // The following run in the worker if there is one, and on this thread in
+  // slices otherwise, reporting the state of the program every so often
+  // Nothing else may call into the module until they are done
+
+  // runs until exit, error or breakpoint
+  runToEnd(onProgress?: (progress: Progress) => void): Promise<void> {
+    return this.execute("run", onProgress);
+  }
+
+  // runs the current instruction, or the whole call if it is one
+  stepOver(onProgress?: (progress: Progress) => void): Promise<void> {
+    return this.execute("stepOver", onProgress);
+  }
+
+  // runs until the current function returns
+  stepOut(onProgress?: (progress: Progress) => void): Promise<void> {
+    return this.execute("stepOut", onProgress);
+  }
+
+  // Asks the running program to stop after its current batch
+  stop() {
+    this.stopRequested = true;
+    if (this.control) Atomics.store(this.control, CONTROL_STOP, 1);
+  }
+
+  private budget(maxInstructions: number): number {
+    return Math.min(maxInstructions, INSTRUCTION_LIMIT + 1 - this.instructions);
+  }
+
+  private async execute(
+    kind: RunKind,
+    onProgress?: (progress: Progress) => void,
+  ): Promise<void> {
+    const budget = this.budget(INSTRUCTION_LIMIT);
+    this.stopRequested = false;
+    if (this.control) Atomics.store(this.control, CONTROL_STOP, 0);
+    this.busy = true;
+    let result: RunResult;
+    try {
+      result = this.worker
+        ? await this.runInWorker(kind, budget, onProgress)
+        : await runBatches(
+            this.exports,
+            this.memory,
+            kind,
+            budget,
+            () => this.stopRequested,
+            async (progress) => {
+              onProgress?.(progress);
+              // let the page handle its events, a stop request among them
+              await new Promise((resolve) => setTimeout(resolve));
+            },
+          );
+    } finally {
+      this.busy = false;
+    }
+
+    this.stopped = result.stopped;
+    // emu_exit was called in the worker, if at all
+    this.successfulExecution = this.createU8(
+      this.machineField(this.exports.g_machine_exited),
+    )[0] != 0;
+    this.finishRun(result.executed);
+  }
+
+  private runInWorker(
+    kind: RunKind,
+    budget: number,
+    onProgress?: (progress: Progress) => void,
+  ): Promise<RunResult> {
+    return new Promise((resolve) => {
+      this.workerProgress = onProgress;
+      this.workerDone = (result) => {
+        this.workerProgress = undefined;
+        this.workerDone = undefined;
+        resolve(result);
+      };
+      const req: WorkerRequest = { type: "run", kind, budget };
+      this.worker.postMessage(req);
+    });
+  }
+
+  private finishRun(executed: number): void {
+    this.instructions += executed;
+    // checkpoints allocate, which may have grown (and detached) the memory
+    if (this.pc.buffer !== this.memory.buffer) this.createViews();
     if (this.instructions > INSTRUCTION_LIMIT) {
       this.textBuffer += `ERROR: instruction limit ${INSTRUCTION_LIMIT} reached\n`;
       this.hasError = true;
@@ -263,6 +737,9 @@ export class WasmInterface {
           str = convertNumber(runtimeParam1, false);
           this.textBuffer += `CallSan: ${pcString}\nAttempted to read from stack address 0x${str}, which hasn't been written to in the current function.\n`;
           break;
+        case 13:
+          this.textBuffer += `ERROR: read int found no number in the input at ${pcString}\n`;
+          break;
         default:
           this.textBuffer += `ERROR${errorType}: ${pcString} ${this.runtimeErrorParams[0].toString(
             16,
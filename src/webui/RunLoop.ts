@@ -0,0 +1,104 @@
+import type { WasmExports } from "./RiscV";
+
+// The loop that runs a program for longer than a step. The worker runs it
+// over the memory it shares with the page, and the page runs it itself when
+// it isn't cross-origin isolated, so it can't share memory
+
+// instructions executed per WASM call
+export const RUN_BATCH: number = 65536;
+// how often the state of a running program is reported
+export const PROGRESS_INTERVAL_MS: number = 100;
+
+// slots of the Int32Array shared with the worker
+export const CONTROL_STOP = 0;
+export const CONTROL_LEN = 1;
+
+export type RunKind = "run" | "stepOver" | "stepOut";
+
+export type Progress = {
+  executed: number;
+  pc: number;
+  regs: number[];
+};
+
+export type RunResult = {
+  executed: number;
+  // whether the run was cut short by a stop request
+  stopped: boolean;
+};
+
+export type WorkerRequest =
+  | {
+      type: "init";
+      module: WebAssembly.Module;
+      memory: WebAssembly.Memory;
+      control: Int32Array;
+    }
+  | { type: "run"; kind: RunKind; budget: number };
+
+export type WorkerMessage =
+  | { type: "output"; bytes: Uint8Array }
+  | { type: "progress"; progress: Progress }
+  | { type: "done"; result: RunResult }
+  | { type: "panic" };
+
+function machineField(memory: WebAssembly.Memory, ptr: number): number {
+  return new Uint32Array(memory.buffer, ptr, 1)[0];
+}
+
+function snapshot(
+  exports: WasmExports,
+  memory: WebAssembly.Memory,
+  executed: number,
+): Progress {
+  const regs = machineField(memory, exports.g_machine_regs);
+  return {
+    executed,
+    pc: new Uint32Array(memory.buffer, machineField(memory, exports.g_machine_pc), 1)[0],
+    regs: [...new Uint32Array(memory.buffer, regs + 4, 31)],
+  };
+}
+
+// Runs up to budget instructions in batches, until the program exits or
+// faults, a breakpoint is hit, a step is complete or shouldStop() says so
+// onProgress gets a snapshot every PROGRESS_INTERVAL_MS, and is awaited
+export async function runBatches(
+  exports: WasmExports,
+  memory: WebAssembly.Memory,
+  kind: RunKind,
+  budget: number,
+  shouldStop: () => boolean,
+  onProgress: (progress: Progress) => void | Promise<void>,
+): Promise<RunResult> {
+  const machine = machineField(memory, exports.g_program_machine);
+  const shadowStack = machineField(memory, exports.g_machine_shadow_stack);
+  const calls = new Uint32Array(memory.buffer, shadowStack, 1)[0];
+  const depth = kind == "run" ? 0 : kind == "stepOver" ? calls + 1 : calls;
+  const start =
+    kind == "run"
+      ? exports.emulate_n
+      : kind == "stepOver"
+        ? exports.emulate_step_over
+        : exports.emulate_step_out;
+  const exited = machineField(memory, exports.g_machine_exited);
+  const errorType = machineField(memory, exports.g_machine_runtime_error_type);
+
+  let executed = 0;
+  let reported = performance.now();
+  while (executed < budget) {
+    if (shouldStop()) return { executed, stopped: true };
+    const n = Math.min(RUN_BATCH, budget - executed);
+    const ran =
+      executed == 0 ? start(machine, n) : exports.emulate_resume(machine, n, depth);
+    executed += ran;
+    // memory may have grown during the batch, so read through fresh views
+    if (ran < n || new Uint8Array(memory.buffer, exited, 1)[0]) break;
+    if (new Uint32Array(memory.buffer, errorType, 1)[0]) break;
+
+    if (performance.now() - reported >= PROGRESS_INTERVAL_MS) {
+      await onProgress(snapshot(exports, memory, executed));
+      reported = performance.now();
+    }
+  }
+  return { executed, stopped: false };
+}
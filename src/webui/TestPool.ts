@@ -0,0 +1,80 @@
+// Runs test cases on a pool of workers, one per hardware thread. Each worker
+// instantiates the module the page compiled with its own memory, so cases
+// share nothing and a suite takes about as long as its slowest case
+
+export type TestCase = {
+  source: string;
+  stdin: string;
+};
+
+export type TestResult = {
+  // whether the program exited, rather than failing or being stopped
+  ok: boolean;
+  output: string;
+};
+
+export type TestRequest =
+  | { type: "init"; module: WebAssembly.Module }
+  | ({ type: "run" } & TestCase)
+  | { type: "stop" };
+
+export class TestPool {
+  private workers: Worker[] = [];
+  private stopped: boolean = false;
+  public busy: boolean = false;
+
+  constructor(private module: WebAssembly.Module) {}
+
+  private spawn(): Worker {
+    const worker = new Worker(new URL("./TestWorker.ts", import.meta.url), {
+      type: "module",
+    });
+    const init: TestRequest = { type: "init", module: this.module };
+    worker.postMessage(init);
+    return worker;
+  }
+
+  // Runs every case, calling onResult as each one finishes
+  // Cases that hadn't started when stop() was called get no result
+  async run(
+    cases: TestCase[],
+    onResult: (index: number, result: TestResult) => void,
+  ): Promise<void> {
+    const size = Math.min(cases.length, navigator.hardwareConcurrency || 4);
+    while (this.workers.length < size) this.workers.push(this.spawn());
+    this.stopped = false;
+    this.busy = true;
+
+    let next = 0;
+    const drain = (worker: Worker) =>
+      new Promise<void>((resolve) => {
+        const dispatch = () => {
+          if (this.stopped || next >= cases.length) {
+            worker.onmessage = null;
+            resolve();
+            return;
+          }
+          const index = next++;
+          worker.onmessage = (event: MessageEvent<TestResult>) => {
+            onResult(index, event.data);
+            dispatch();
+          };
+          const req: TestRequest = { type: "run", ...cases[index] };
+          worker.postMessage(req);
+        };
+        dispatch();
+      });
+
+    try {
+      await Promise.all(this.workers.slice(0, size).map(drain));
+    } finally {
+      this.busy = false;
+    }
+  }
+
+  stop() {
+    this.stopped = true;
+    const req: TestRequest = { type: "stop" };
+    for (const worker of this.workers) worker.postMessage(req);
+  }
+}
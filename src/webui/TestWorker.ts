@@ -0,0 +1,33 @@
+import { WasmInterface } from "./RiscV";
+import type { TestRequest, TestResult } from "./TestPool";
+
+// Runs the cases the pool hands it one at a time, each assembled from scratch
+// since cases add their own code to the program
+
+const wasm = new WasmInterface(false);
+let ready: Promise<void>;
+
+self.onmessage = async (event: MessageEvent<TestRequest>) => {
+  const req = event.data;
+  if (req.type == "init") {
+    ready = wasm.loadModule(req.module);
+    return;
+  }
+  if (req.type == "stop") {
+    // only reaches a case while it runs, as that is when messages get through
+    wasm.stop();
+    return;
+  }
+
+  await ready;
+  let result: TestResult;
+  const err = await wasm.build(req.source);
+  if (err !== null) {
+    result = { ok: false, output: `Error on line ${err.line}: ${err.message}` };
+  } else {
+    wasm.setInput(req.stdin);
+    await wasm.runToEnd();
+    result = { ok: wasm.successfulExecution, output: wasm.textBuffer.trim() };
+  }
+  (self as unknown as Worker).postMessage(result);
+};
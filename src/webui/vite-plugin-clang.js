@@ -2,14 +2,26 @@ import { exec } from "child_process";
 import path from "path";
 import fs from "fs";
 
+// The shared variant runs in a worker over memory shared with the page, which
+// browsers only allow on cross-origin isolated pages. The others get main.wasm
+const SHARED_FLAGS =
+  "-matomics -mbulk-memory -Wl,--shared-memory -Wl,--max-memory=1073741824";
+
 function compile(outpath, optimize) {
+  if (!fs.existsSync(outpath)) {
+    fs.mkdirSync(outpath, { recursive: true });
+  }
   let opts = optimize ? "-flto -O3" : "";
+  return Promise.all([
+    compileVariant(`${outpath}/main.wasm`, opts),
+    compileVariant(`${outpath}/main-shared.wasm`, `${opts} ${SHARED_FLAGS}`),
+  ]);
+}
+
+function compileVariant(out, opts) {
   return new Promise((resolve, reject) => {
-    if (!fs.existsSync(outpath)) {
-      fs.mkdirSync(outpath, { recursive: true });
-    }
     exec(
-      `clang --target=wasm32 -flto -nostdlib -Wl,--export-all -Wl,--no-entry -Wl,--allow-undefined -Wl,--import-memory ${opts} -o ${outpath}/main.wasm src/exec/dev.c src/exec/core.c src/exec/emulate.c src/exec/callsan.c src/exec/wasm.c`,
+      `clang --target=wasm32 -flto -nostdlib -Wl,--export-all -Wl,--no-entry -Wl,--allow-undefined -Wl,--import-memory ${opts} -o ${out} src/exec/dev.c src/exec/core.c src/exec/emulate.c src/exec/callsan.c src/exec/snapshot.c src/exec/timetravel.c src/exec/profile.c src/exec/timing.c src/exec/cache.c src/exec/bpred.c src/exec/trace.c src/exec/smp.c src/exec/breakpoint.c src/exec/dirty.c src/exec/program.c src/exec/wasm.c`,
       (error, stdout, stderr) => {
         if (error) {
           reject(stderr);
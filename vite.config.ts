@@ -5,10 +5,20 @@ import {lezer} from "@lezer/generator/rollup";
 import tailwindcss from 'tailwindcss'
 import autoprefixer from 'autoprefixer'
 
+// lets the emulator share its memory with a worker, see RiscV.ts
+const crossOriginIsolation = {
+  'Cross-Origin-Opener-Policy': 'same-origin',
+  'Cross-Origin-Embedder-Policy': 'require-corp',
+};
+
 export default defineConfig({
   plugins: [solidPlugin(), clangPlugin(), lezer()],
   server: {
     port: 3000,
+    headers: crossOriginIsolation,
+  },
+  preview: {
+    headers: crossOriginIsolation,
   },
   optimizeDeps: {
     include: ["@lezer/generator"]